@@ -95,11 +95,16 @@ namespace Arena
                 pos_pre = Position{ align_pow_2(rep(current->pos), rep(align)) };
                 pos_post = extend(pos_pre, rep(size));
             }
-            // Now we figure out what the zero target is.
+            // Now we figure out what the zero target is.  Pages committed below come zeroed from the OS, but debug
+            // builds fill the whole unpoisoned region, so there all of it is zeroed again.
             uint64_t size_to_zero = 0;
             if (is_yes(zero))
             {
+#ifdef NDEBUG
                 size_to_zero = std::min(rep(current->os_cmt), rep(pos_post)) - rep(pos_pre);
+#else
+                size_to_zero = rep(size);
+#endif // NDEBUG
             }
 
             // Commit new pages if necessary.
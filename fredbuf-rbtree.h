@@ -1,6 +1,9 @@
 #pragma once
 
+#include <type_traits>
+
 #include "macros.h"
+#include "piece-rewrite.h"
 #include "types.h"
 
 // The concept for the RB tree is borrowed from
@@ -43,6 +46,8 @@ namespace PieceTree
     using Editor::Column;
 
     enum class LFCount : size_t { };
+    enum class CodePointCount : size_t { };
+    enum class Utf16Count : size_t { };
 
     struct BufferCursor
     {
@@ -54,6 +59,249 @@ namespace PieceTree
         bool operator==(const BufferCursor&) const = default;
     };
 
+    struct Piece;
+    struct BufferCollection;
+
+    // Piece summaries.  A summary is a monoid over the text of the tree: 'identity()' summarizes no text and must equal
+    // a value-initialized summary, 'combine(left, right)' summarizes 'left' followed by 'right' and
+    // 'of(buffers, piece)' summarizes the text of one piece.  Pieces cache their summary and the tree keeps the
+    // summary of every subtree as nodes are copied, so the summary of any prefix is a single descent (see 'seek').
+
+    // The number of code points, i.e. bytes which do not continue a UTF-8 sequence.
+    struct CodePointSummary
+    {
+        CodePointCount codepoints = { };
+
+        static CodePointSummary identity()
+        {
+            return { };
+        }
+
+        static CodePointSummary combine(const CodePointSummary& left, const CodePointSummary& right)
+        {
+            return { CodePointCount{ rep(left.codepoints) + rep(right.codepoints) } };
+        }
+
+        static CodePointSummary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // The number of UTF-16 code units.  Four byte UTF-8 sequences are a surrogate pair.
+    struct Utf16Summary
+    {
+        Utf16Count utf16_units = { };
+
+        static Utf16Summary identity()
+        {
+            return { };
+        }
+
+        static Utf16Summary combine(const Utf16Summary& left, const Utf16Summary& right)
+        {
+            return { Utf16Count{ rep(left.utf16_units) + rep(right.utf16_units) } };
+        }
+
+        static Utf16Summary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // Line lengths (in bytes, excluding the LF) at the edges of a span of text and the longest line lying entirely
+    // inside it.  A span without a LF has 'leading' and 'trailing' equal to its length.
+    struct LineExtent
+    {
+        Length leading = { };
+        Length trailing = { };
+        Length longest = { };
+        bool has_lf = false;
+
+        static LineExtent identity()
+        {
+            return { };
+        }
+
+        static LineExtent combine(const LineExtent& left, const LineExtent& right);
+        static LineExtent of(const BufferCollection* buffers, const Piece& piece);
+
+        // The longest line of the span, including the partial ones at its edges.
+        Length longest_line() const
+        {
+            auto edge = rep(leading) > rep(trailing) ? leading : trailing;
+            return rep(longest) > rep(edge) ? longest : edge;
+        }
+    };
+
+    // Bracket pairs tracked by 'BracketSummary'.  The opening and closing characters of a pair must differ.
+    constexpr size_t max_bracket_pairs = 4;
+
+    struct BracketPair
+    {
+        char open;
+        char close;
+    };
+
+    struct BracketPairs
+    {
+        BracketPair pairs[max_bracket_pairs];
+        uint64_t count;
+    };
+
+    // The nesting of one bracket pair over a span of text: 'delta' is the net change in depth and 'min' the lowest
+    // depth reached at any point of the span relative to its start (so never above 0).
+    struct BracketDepth
+    {
+        int32_t delta = 0;
+        int32_t min = 0;
+
+        static BracketDepth combine(const BracketDepth& left, const BracketDepth& right)
+        {
+            auto right_min = left.delta + right.min;
+            return { left.delta + right.delta, left.min < right_min ? left.min : right_min };
+        }
+    };
+
+    // Nesting of every bracket pair in the collection's 'bracket_pairs'.  Finding a matching bracket descends to the
+    // first span whose 'min' reaches the target depth instead of scanning the text in between.
+    struct BracketSummary
+    {
+        BracketDepth depths[max_bracket_pairs] = { };
+
+        static BracketSummary identity()
+        {
+            return { };
+        }
+
+        static BracketSummary combine(const BracketSummary& left, const BracketSummary& right)
+        {
+            BracketSummary result;
+            for (size_t i = 0; i < max_bracket_pairs; ++i)
+            {
+                result.depths[i] = BracketDepth::combine(left.depths[i], right.depths[i]);
+            }
+            return result;
+        }
+
+        static BracketSummary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // A polynomial rolling hash of the bytes, modulo 2^61 - 1.  'power_minus_one' is the base raised to the length of
+    // the text, minus one so that the empty text is the zero value.
+    struct HashSummary
+    {
+        uint64_t hash = 0;
+        uint64_t power_minus_one = 0;
+
+        static HashSummary identity()
+        {
+            return { };
+        }
+
+        static HashSummary combine(const HashSummary& left, const HashSummary& right);
+        static HashSummary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // Soft-wrapped rows at 'width' bytes per row, where an empty line still takes a row.  'head' is the text before
+    // the first LF and 'tail' the text after the last one (both the whole span without a LF), and 'rows' counts the
+    // rows of the complete lines between them.  Pieces summarized without a wrap index, and spans mixing widths, are
+    // 'stale', so a root summarized for another width is detected and rebuilt.
+    struct WrapSummary
+    {
+        static constexpr uint64_t stale = ~uint64_t{ 0 };
+
+        uint64_t width = 0;
+        Length head = { };
+        Length tail = { };
+        uint64_t rows = 0;
+        bool spans_lf = false;
+
+        static WrapSummary identity()
+        {
+            return { };
+        }
+
+        static WrapSummary combine(const WrapSummary& left, const WrapSummary& right);
+        static WrapSummary of(const BufferCollection* buffers, const Piece& piece);
+
+        static uint64_t line_rows(Length length, uint64_t width)
+        {
+            return rep(length) == 0 ? 1 : (rep(length) + width - 1) / width;
+        }
+
+        // The rows of every line ended by a LF of the span.
+        uint64_t complete_rows() const
+        {
+            return spans_lf ? rows + line_rows(head, width) : 0;
+        }
+    };
+
+    // Several summaries maintained together.  Each one is a base, so its members are reachable directly.
+    template <typename... Summaries>
+    struct SummaryList : Summaries...
+    {
+        static SummaryList identity()
+        {
+            return { Summaries::identity()... };
+        }
+
+        static SummaryList combine(const SummaryList& left, const SummaryList& right)
+        {
+            return { Summaries::combine(left, right)... };
+        }
+
+        static SummaryList of(const BufferCollection* buffers, const Piece& piece)
+        {
+            return { Summaries::of(buffers, piece)... };
+        }
+    };
+
+    // A summary the tree keeps when 'enabled'.
+    template <bool enabled, typename Summary>
+    struct SummaryOption { };
+
+    // The list of the summaries enabled among 'Options', in their order.
+    template <typename List, typename... Options>
+    struct SelectSummaries
+    {
+        using type = List;
+    };
+
+    template <typename... Chosen, bool enabled, typename Summary, typename... Options>
+    struct SelectSummaries<SummaryList<Chosen...>, SummaryOption<enabled, Summary>, Options...>
+    {
+        using type = typename SelectSummaries<std::conditional_t<enabled, SummaryList<Chosen..., Summary>, SummaryList<Chosen...>>, Options...>::type;
+    };
+
+    // The summaries kept by the tree, as selected in macros.h.  Length and line feeds are not part of it: every node
+    // keeps them in dedicated counters since all descents use them.  An empty list takes no space in pieces or nodes.
+    using TreeSummary = SelectSummaries<SummaryList<>,
+                                        SummaryOption<FRED_CODE_POINT_SUMMARY, CodePointSummary>,
+                                        SummaryOption<FRED_UTF16_SUMMARY, Utf16Summary>,
+                                        SummaryOption<FRED_LINE_EXTENT_SUMMARY, LineExtent>,
+                                        SummaryOption<FRED_BRACKET_SUMMARY, BracketSummary>,
+                                        SummaryOption<FRED_HASH_SUMMARY, HashSummary>,
+                                        SummaryOption<FRED_WRAP_SUMMARY, WrapSummary>>::type;
+
+    // Selects no summary: a seek projected onto it reads only the lengths and line feeds kept beside the summaries.
+    struct NoSummary
+    {
+        static NoSummary identity()
+        {
+            return { };
+        }
+
+        static NoSummary combine(const NoSummary&, const NoSummary&)
+        {
+            return { };
+        }
+    };
+
+    // The part of a tree summary a seek combines: one of its summaries, the whole list or none.
+    template <typename Part>
+    decltype(auto) project(const TreeSummary& summary)
+    {
+        if constexpr (std::is_base_of_v<Part, TreeSummary>)
+            return static_cast<const Part&>(summary);
+        else
+            return Part::identity();
+    }
+
     struct Piece
     {
         BufferIndex index = { }; // Index into a buffer in PieceTree.  This could be an immutable buffer or the mutable buffer.
@@ -61,6 +309,7 @@ namespace PieceTree
         BufferCursor last = { };
         Length length = { };
         LFCount newline_count = { };
+        FRED_NO_UNIQUE_ADDRESS TreeSummary summary = { };
     };
 
     using Offset = PieceTree::CharOffset;
@@ -68,6 +317,9 @@ namespace PieceTree
     struct NodeData
     {
         PieceTree::Piece piece;
+        // Covers the whole subtree rooted at this node.  Declared before the counters since an empty summary cannot
+        // share its address with the one in 'piece', and placed last it would pad every node.
+        FRED_NO_UNIQUE_ADDRESS PieceTree::TreeSummary subtree_summary = { };
 
         PieceTree::Length left_subtree_length = { };
         PieceTree::LFCount left_subtree_lf_count = { };
@@ -75,7 +327,7 @@ namespace PieceTree
 
     class RedBlackTree;
 
-    NodeData attribute(const NodeData& data, const RedBlackTree& left);
+    NodeData attribute(const NodeData& data, const RedBlackTree& left, const RedBlackTree& right);
 
     enum class Color
     {
@@ -97,6 +349,8 @@ namespace PieceTree
 
     struct RBNodeCounted;
     struct RBTreeBlock;
+    enum class LineStart : size_t;
+    using PieceRewrite = Editor::PieceRewrite<Piece, LineStart>;
 
     struct RBNodeBlock
     {
@@ -162,6 +416,21 @@ namespace PieceTree
         // Mutators.
         RedBlackTree insert(RBTreeBlock* blk, const NodeData& x, Offset at) const;
         RedBlackTree remove(RBTreeBlock* blk, Offset at) const;
+        // Replaces the piece of the node holding 'at' by 'x', copying only the path to it.
+        RedBlackTree replace(RBTreeBlock* blk, const NodeData& x, Offset at) const;
+        // Replaces the piece of the node holding 'at' by 'left' and inserts 'mid' and 'right' after it, in one descent.
+        RedBlackTree split_insert(RBTreeBlock* blk, const NodeData& left, const NodeData& mid, const NodeData& right, Offset at) const;
+        // Replaces the piece of the node holding 'at' by 'first' and inserts 'second' after it, in one descent.
+        RedBlackTree replace_pair(RBTreeBlock* blk, const NodeData& first, const NodeData& second, Offset at) const;
+        // Splits the tree into the pieces starting before 'at' and the rest, copying only the nodes along the split.
+        void split(RBTreeBlock* blk, Offset at, RedBlackTree* before, RedBlackTree* after) const;
+        // Joins trees whose pieces come in the order given, copying only the nodes along the seam.
+        static RedBlackTree join(RBTreeBlock* blk, const RedBlackTree& left, const NodeData& x, const RedBlackTree& right);
+        static RedBlackTree join(RBTreeBlock* blk, const RedBlackTree& left, const RedBlackTree& right);
+        // Copies the tree with 'rewrite' applied to every piece, sharing the subtrees it leaves alone.
+        RedBlackTree rewrite_pieces(RBTreeBlock* blk, PieceRewrite* rewrite) const;
+        // Builds a balanced tree holding 'count' pieces in order, bottom-up.
+        static RedBlackTree construct_from(RBTreeBlock* blk, const NodeData* pieces, size_t count);
 
         // Duplication.
         RedBlackTree dup() const;
@@ -174,6 +443,8 @@ namespace PieceTree
 
         RedBlackTree(const RBNodeCounted* node);
 
+        static RedBlackTree construct_range(RBTreeBlock* blk, const NodeData* pieces, size_t count, size_t depth, size_t black_depth);
+
         // Removal.
 #ifdef EXPERIMENTAL_REMOVE
         ColorTree rem(Offset at, Offset total) const;
@@ -191,6 +462,20 @@ namespace PieceTree
 
         // Insertion.
         RedBlackTree ins(RBTreeBlock* blk, const NodeData& x, Offset at, Offset total_offset) const;
+        RedBlackTree ins_pair(RBTreeBlock* blk, const NodeData& x1, const NodeData& x2, Offset at, Offset total_offset) const;
+        RedBlackTree split_ins(RBTreeBlock* blk, const NodeData& left, const NodeData& mid, const NodeData& right, Offset at, Offset total_offset) const;
+        RedBlackTree repl_pair(RBTreeBlock* blk, const NodeData& first, const NodeData& second, Offset at, Offset total_offset) const;
+
+        // Split and join.
+        // 'height' is the black height of the tree, and those of the two sides come back with them so that the joins
+        // along the split do not walk the spines again.
+        void split_at(RBTreeBlock* blk, Offset at, Offset total_offset, size_t height, RedBlackTree* before, size_t* before_height, RedBlackTree* after, size_t* after_height) const;
+        static size_t black_height(const RedBlackTree& tree);
+        static RedBlackTree join(RBTreeBlock* blk, const RedBlackTree& left, size_t left_height, const NodeData& x, const RedBlackTree& right, size_t right_height, size_t* height);
+        static RedBlackTree join_right(RBTreeBlock* blk, const RedBlackTree& left, const NodeData& x, const RedBlackTree& right, size_t left_height, size_t right_height);
+        static RedBlackTree join_left(RBTreeBlock* blk, const RedBlackTree& left, const NodeData& x, const RedBlackTree& right, size_t left_height, size_t right_height);
+        RedBlackTree repl(RBTreeBlock* blk, const NodeData& x, Offset at, Offset total_offset) const;
+        static RedBlackTree red_triple(RBTreeBlock* blk, const NodeData& a, const NodeData& b, const NodeData& c);
         static RedBlackTree balance(RBTreeBlock* blk, Color c, const RedBlackTree& lft, const NodeData& x, const RedBlackTree& rgt);
         bool doubled_left() const;
         bool doubled_right() const;
@@ -204,4 +489,61 @@ namespace PieceTree
     // Global queries.
     PieceTree::Length tree_length(const RedBlackTree& root);
     PieceTree::LFCount tree_lf_count(const RedBlackTree& root);
+    PieceTree::TreeSummary tree_summary(const RedBlackTree& root);
+
+    // The summary of the text before some position, projected onto 'Part'.
+    template <typename Part>
+    struct PrefixOf
+    {
+        Length length = { };
+        LFCount lf_count = { };
+        FRED_NO_UNIQUE_ADDRESS Part summary = { };
+    };
+
+    template <typename Part>
+    struct SeekResultOf
+    {
+        // The piece whose inclusion makes the predicate true, or null if no prefix does.
+        const NodeData* node = nullptr;
+        // Everything before 'node', or the whole tree when 'node' is null.
+        PrefixOf<Part> prefix;
+    };
+
+    using PrefixSummary = PrefixOf<TreeSummary>;
+    using SeekResult = SeekResultOf<TreeSummary>;
+
+    // Finds the first piece whose inclusion makes 'pred' true.  'pred' is given summaries of prefixes ending at piece
+    // boundaries and must be monotone: once it holds for a prefix, it holds for every longer one.  Only the 'Part' of
+    // the summaries the predicate and the caller read is combined, so a seek by length with 'NoSummary' costs what a
+    // plain descent does.
+    template <typename Part = TreeSummary, typename Pred>
+    SeekResultOf<Part> seek(const RedBlackTree& root, Pred pred)
+    {
+        SeekResultOf<Part> result;
+        const RBNodeCounted* node = root.root_ptr();
+        while (node != &null_node_inst)
+        {
+            const NodeData& data = node->payload.data;
+            PrefixOf<Part> left{ .length = result.prefix.length + data.left_subtree_length,
+                                 .lf_count = LFCount{ rep(result.prefix.lf_count) + rep(data.left_subtree_lf_count) },
+                                 .summary = Part::combine(result.prefix.summary, project<Part>(node->payload.left->payload.data.subtree_summary)) };
+            if (pred(left))
+            {
+                node = node->payload.left;
+                continue;
+            }
+            PrefixOf<Part> with_piece{ .length = left.length + data.piece.length,
+                                       .lf_count = LFCount{ rep(left.lf_count) + rep(data.piece.newline_count) },
+                                       .summary = Part::combine(left.summary, project<Part>(data.piece.summary)) };
+            if (pred(with_piece))
+            {
+                result.node = &data;
+                result.prefix = left;
+                return result;
+            }
+            result.prefix = with_piece;
+            node = node->payload.right;
+        }
+        return result;
+    }
 } // namespace PieceTree
\ No newline at end of file
@@ -1,12 +1,24 @@
 #include <stdio.h>
+#include <string.h>
 
 #include <cassert>
+#include <initializer_list>
 
 #include "arena.h"
 #include "fred-strings.h"
 
 #define COUNT_ALLOC
 
+// The tests cover every tree summary, while the timings measure the default tree, which keeps none.
+#ifndef TIMING_DATA
+#define FRED_CODE_POINT_SUMMARY 1
+#define FRED_UTF16_SUMMARY 1
+#define FRED_LINE_EXTENT_SUMMARY 1
+#define FRED_BRACKET_SUMMARY 1
+#define FRED_HASH_SUMMARY 1
+#define FRED_WRAP_SUMMARY 1
+#endif // TIMING_DATA
+
 #define USE_RATBUF 1
 
 #if USE_RATBUF
@@ -111,6 +123,53 @@ void assume_reverse_buffer(const PieceTree::Tree* tree, String8 forward_buf, Pie
     Arena::scratch_end(scratch);
 }
 
+void assume_chunks(const PieceTree::Tree* tree, String8View expected, int locus)
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    // Forward chunks concatenate to the buffer.
+    {
+        PieceTree::TreeWalker walker{ scratch.arena, tree };
+        uint64_t off = 0;
+        bool result = true;
+        for (String8View chunk = walker.next_chunk(); chunk.size != 0; chunk = walker.next_chunk())
+        {
+            if (off + chunk.size > expected.size or memcmp(expected.str + off, chunk.str, chunk.size) != 0)
+            {
+                result = false;
+                break;
+            }
+            off += chunk.size;
+        }
+        if (not result or off != expected.size or walker.remaining() != PieceTree::Length{ 0 } or not walker.exhausted())
+        {
+            fprintf(stderr, "forward chunks did not match expected value of '%.*s'. Line(%d)\n", int(expected.size), expected.str, locus);
+            assert(false);
+        }
+    }
+    // Reverse chunks concatenate to the buffer from the back.
+    if (expected.size != 0)
+    {
+        PieceTree::ReverseTreeWalker walker{ scratch.arena, tree, PieceTree::CharOffset{ expected.size - 1 } };
+        uint64_t end = expected.size;
+        bool result = true;
+        for (String8View chunk = walker.next_chunk(); chunk.size != 0; chunk = walker.next_chunk())
+        {
+            if (chunk.size > end or memcmp(expected.str + end - chunk.size, chunk.str, chunk.size) != 0)
+            {
+                result = false;
+                break;
+            }
+            end -= chunk.size;
+        }
+        if (not result or end != 0 or not walker.exhausted())
+        {
+            fprintf(stderr, "reverse chunks did not match expected value of '%.*s'. Line(%d)\n", int(expected.size), expected.str, locus);
+            assert(false);
+        }
+    }
+    Arena::scratch_end(scratch);
+}
+
 void assume_buffer(const PieceTree::Tree* tree, String8View expected, int locus = __builtin_LINE())
 {
     auto scratch = Arena::scratch_begin(Arena::no_conflicts);
@@ -133,6 +192,7 @@ void assume_buffer(const PieceTree::Tree* tree, String8View expected, int locus
     }
     assume_buffer_snapshots(tree, str8_mut(expected), start, locus);
     assume_reverse_buffer(tree, buf, start + retract(tree->length()), locus);
+    assume_chunks(tree, expected, locus);
     Arena::scratch_end(scratch);
 }
 
@@ -888,6 +948,128 @@ passages, and more recently with desktop publishing software like Aldus PageMake
     release_tree(tree);
     Arena::scratch_end(scratch);
 }
+
+void time_line_starts()
+{
+    Stopwatch sw;
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    // A single large immutable buffer with many short lines, so every lookup searches a huge piece.
+    String8 text = str8_cstr_alloc(scratch.arena, 64 * 1024 * 1024);
+    for EachIndex(i, text.size)
+    {
+        text.str[i] = i % 17 == 16 ? '\n' : 'a';
+    }
+    tree_builder_accept(arena, &builder, text);
+    Tree* tree = tree_builder_finish(&builder);
+
+    constexpr int timing_count = 10;
+    std::chrono::microseconds timing_data[timing_count];
+    uint64_t seed = 0x9E3779B97F4A7C15ull;
+    uint64_t sink = 0;
+    for EachIndex(i, timing_count)
+    {
+        sw.start();
+        for (int j = 0; j < 100000; ++j)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            sink += rep(tree->line_at(CharOffset{ (seed >> 16) % text.size }));
+        }
+        sw.stop();
+        timing_data[i] = sw.to_us();
+    }
+    // Aggregate and display.
+    printf("---------- Random line_at in a large buffer (%llu) ----------\n", static_cast<unsigned long long>(sink));
+    int64_t total_count = 0;
+    for EachIndex(i, timing_count)
+    {
+        printf("[%u] = %ldus\n", unsigned(i), long(timing_data[i].count()));
+        total_count += timing_data[i].count();
+    }
+    // Find mean.
+    double mean = static_cast<double>(total_count) / timing_count;
+    printf("Average: %.2fus\n", mean);
+
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void time_traversals()
+{
+    Stopwatch sw;
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    String8 text = str8_cstr_alloc(scratch.arena, 16 * 1024 * 1024);
+    for EachIndex(i, text.size)
+    {
+        text.str[i] = i % 61 == 60 ? '\n' : char('a' + i % 26);
+    }
+    tree_builder_accept(arena, &builder, text);
+    Tree* tree = tree_builder_finish(&builder);
+    // Scatter the document over many pieces so that traversals chase pointers rather than stream one buffer.
+    uint64_t seed = 0x2545F4914F6CDD1Dull;
+    for EachIndex(i, 200000)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        tree->insert(CharOffset{ (seed >> 16) % rep(tree->length()) }, str8_mut(str8_literal("xyz")), SuppressHistory::Yes);
+    }
+
+    constexpr int timing_count = 10;
+    std::chrono::microseconds timing_data[timing_count];
+    auto report = [&](const char* name)
+    {
+        // Aggregate and display.
+        printf("---------- %s ----------\n", name);
+        int64_t total_count = 0;
+        for EachIndex(i, timing_count)
+        {
+            printf("[%u] = %ldus\n", unsigned(i), long(timing_data[i].count()));
+            total_count += timing_data[i].count();
+        }
+        // Find mean.
+        double mean = static_cast<double>(total_count) / timing_count;
+        printf("Average: %.2fus\n", mean);
+    };
+    uint64_t sink = 0;
+
+    // Full document walk.
+    {
+        for EachIndex(i, timing_count)
+        {
+            sw.start();
+            TreeWalker walker{ scratch.arena, tree };
+            while (not walker.exhausted())
+            {
+                sink += walker.next();
+            }
+            sw.stop();
+            timing_data[i] = sw.to_us();
+        }
+        report("Full walk");
+    }
+
+    // Random access.
+    {
+        for EachIndex(i, timing_count)
+        {
+            sw.start();
+            for (int j = 0; j < 200000; ++j)
+            {
+                seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+                sink += tree->at(CharOffset{ (seed >> 16) % rep(tree->length()) });
+            }
+            sw.stop();
+            timing_data[i] = sw.to_us();
+        }
+        report("Random at");
+    }
+    printf("(%llu)\n", static_cast<unsigned long long>(sink));
+
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
 #endif // TIMING_DATA
 
 void test10()
@@ -1071,60 +1253,2121 @@ void test13()
 
 }
 
+void test14()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("Hello, World!\n")));
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("Goodbye, World!")));
+    Tree* tree = tree_builder_finish(&builder);
+
+    tree->insert(CharOffset{ 5 }, str8_mut(str8_literal(" there")));
+    tree->insert(CharOffset{ 0 }, str8_mut(str8_literal(">> ")));
+    tree->remove(CharOffset{ 25 }, Length{ 3 });
+    auto expected = str8_literal(">> Hello there, World!\nGoye, World!");
+    assume_buffer(tree, expected);
 
-int main()
+    // Scope the walkers so they release their roots before the tree.
+    {
+        // Every offset should produce a chunk which begins (or ends, for the reverse walker) at that offset.
+        TreeWalker walker{ scratch.arena, tree };
+        ReverseTreeWalker rwalker{ scratch.arena, tree, retract(CharOffset{ expected.size }) };
+        for EachIndex(i, expected.size)
+        {
+            String8View chunk = walker.chunk_at(CharOffset{ i });
+            assert(chunk.size != 0);
+            assert(i + chunk.size <= expected.size);
+            assert(memcmp(expected.str + i, chunk.str, chunk.size) == 0);
+            assert(walker.offset() == CharOffset{ i + chunk.size });
+
+            String8View rchunk = rwalker.chunk_at(CharOffset{ i });
+            assert(rchunk.size != 0);
+            assert(rchunk.size <= i + 1);
+            assert(memcmp(expected.str + i + 1 - rchunk.size, rchunk.str, rchunk.size) == 0);
+        }
+
+        // Mixing chunks with single characters.
+        walker.seek(CharOffset{ 0 });
+        char c = walker.next();
+        assert(c == '>');
+        String8View chunk = walker.next_chunk();
+        assert(chunk.size == 2);
+        c = walker.next();
+        assert(c == 'H');
+    }
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test15()
 {
-    // Setup the scratch arenas.
-    constexpr int arena_size = 3;
-    Arena::Arena* scratch_arenas[arena_size];
-    // Generally, you only need two arenas to handle all conflicts.
-    scratch_arenas[0] = Arena::alloc(Arena::default_params);
-    scratch_arenas[1] = Arena::alloc(Arena::default_params);
-    scratch_arenas[2] = Arena::alloc(Arena::default_params);
-    Arena::populate_scratch_arenas({ scratch_arenas, arena_size });
+#if not USE_RATBUF
+    // Walkers are arena-free and can be copied mid-walk.
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("0123456789")));
+    Tree* tree = tree_builder_finish(&builder);
 
-    test1();
-    printf("test1: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test2();
-    printf("test2: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test3();
-    printf("test3: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test4();
-    printf("test4: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test5();
-    printf("test5: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test6();
-    printf("test6: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test7();
-    printf("test7: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test8();
-    printf("test8: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test9();
-    printf("test9: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test10();
-    printf("test10: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test11();
-    printf("test11: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test12();
-    printf("test12: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
-    alloc_count=0;dealloc_count=0;
-    test13();
-    printf("test13: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    // Build a deep tree with many pieces.
+    for EachIndex(i, 2000)
+    {
+        char c = 'a' + (i % 26);
+        tree->insert(CharOffset{ (i * 7) % rep(tree->length()) }, str8(&c, 1));
+    }
+
+    {
+        TreeWalker walker{ tree };
+        uint64_t count = 0;
+        while (not walker.exhausted())
+        {
+            walker.next();
+            ++count;
+        }
+        assert(count == rep(tree->length()));
+
+        walker.seek(CharOffset{ 1000 });
+        TreeWalker copy = walker;
+        while (not walker.exhausted())
+        {
+            assert(walker.offset() == copy.offset());
+            char c = walker.next();
+            char copied = copy.next();
+            assert(c == copied);
+        }
+        assert(copy.exhausted());
+
+        ReverseTreeWalker rwalker{ tree, CharOffset{ 1000 } };
+        ReverseTreeWalker rcopy = rwalker;
+        rcopy = rwalker;
+        while (not rwalker.exhausted())
+        {
+            char c = rwalker.next();
+            char copied = rcopy.next();
+            assert(c == copied);
+        }
+        assert(rcopy.exhausted());
+    }
+    release_tree(tree);
+#endif // not USE_RATBUF
+}
+
+String8 buffer_contents(Arena::Arena* arena, const PieceTree::Tree* tree)
+{
+    String8List serial_lst{};
+    str8_serial_begin(arena, &serial_lst);
+    PieceTree::TreeWalker walker{ arena, tree };
+    for (String8View chunk = walker.next_chunk(); chunk.size != 0; chunk = walker.next_chunk())
+    {
+        str8_serial_push_str8(arena, &serial_lst, str8_mut(chunk));
+    }
+    return str8_serial_end(arena, serial_lst);
+}
+
+void test16()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("first line\nsecond line\n\nfourth\n")));
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("fifth line is a bit longer\nsixth")));
+    Tree* tree = tree_builder_finish(&builder);
+
+    uint64_t seed = 42;
+    auto rand_next = [&seed](uint64_t bound)
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return (seed >> 33) % bound;
+    };
+
+    {
+        TextCursor cursor{ tree };
+        for EachIndex(round, 400)
+        {
+            // Mutate every so often so the cursor has to notice the new root.
+            if (round % 8 == 0)
+            {
+                auto off = CharOffset{ rand_next(rep(tree->length()) + 1) };
+                if (round % 16 == 0)
+                    tree->insert(off, str8_mut(str8_literal("ab\ncd")));
+                else
+                    tree->insert(off, str8_mut(str8_literal("x")));
+            }
+            String8 text = buffer_contents(scratch.arena, tree);
+            // Compute the expected line and column of the cursor.
+            auto check = [&](CharOffset off)
+            {
+                assert(cursor.offset() == off);
+                uint64_t line = 1;
+                uint64_t line_first = 0;
+                for EachIndex(i, rep(off))
+                {
+                    if (text.str[i] == '\n')
+                    {
+                        ++line;
+                        line_first = i + 1;
+                    }
+                }
+                assert(cursor.line() == Line{ line });
+                assert(cursor.column() == Column{ rep(off) - line_first });
+                assert(cursor.current() == (rep(off) < text.size ? text.str[rep(off)] : '\0'));
+                assert(cursor.line() == tree->line_at(off) or rep(off) == text.size);
+            };
+            switch (rand_next(4))
+            {
+            case 0:
+            {
+                auto k = Length{ rand_next(6) };
+                auto expected = rep(cursor.offset()) + rep(k);
+                cursor.advance(k);
+                check(CharOffset{ expected < text.size ? expected : text.size });
+                break;
+            }
+            case 1:
+            {
+                auto k = Length{ rand_next(6) };
+                auto expected = rep(cursor.offset()) > rep(k) ? rep(cursor.offset()) - rep(k) : 0;
+                cursor.retreat(k);
+                check(CharOffset{ expected });
+                break;
+            }
+            case 2:
+            {
+                auto off = CharOffset{ rand_next(text.size + 1) };
+                cursor.seek(off);
+                check(off);
+                break;
+            }
+            case 3:
+            {
+                auto line = Line{ 1 + rand_next(rep(tree->line_count())) };
+                auto col = Column{ rand_next(8) };
+                auto range = tree->get_line_range(line);
+                auto expected = rep(range.first) + rep(col);
+                if (expected > rep(range.last))
+                    expected = rep(range.last);
+                assert(cursor.offset_at(line, col) == CharOffset{ expected });
+                check(CharOffset{ expected });
+                break;
+            }
+            }
+        }
+
+        // Line movement keeps the column where possible.
+        cursor.seek_line(Line{ 1 }, Column{ 3 });
+        cursor.advance_lines(Length{ 1 });
+        assert(cursor.line() == Line{ 2 });
+        assert(cursor.column() == Column{ 3 } or rep(tree->get_line_range(Line{ 2 }).last) < rep(cursor.offset()) + 1);
+        cursor.retreat_lines(Length{ 5 });
+        assert(cursor.line() == Line{ 1 });
+    }
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test17()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("The quick brown fox\njumps over\n")));
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("the lazy dog.")));
+    Tree* tree = tree_builder_finish(&builder);
+    for EachIndex(i, 20)
+    {
+        tree->insert(CharOffset{ (i * 5) % rep(tree->length()) }, str8_mut(str8_literal("<>")));
+    }
+    String8 text = buffer_contents(scratch.arena, tree);
+    auto* owning_snap = tree->owning_snap(scratch.arena);
+    {
+        auto ref_snap = tree->ref_snap();
+        char dst[256];
+        for EachIndex(first, text.size + 1)
+        {
+            for (uint64_t count = 0; first + count <= text.size + 2; count += 3)
+            {
+                auto expected = first + count <= text.size ? count : text.size - first;
+                String8 range = tree->get_range(scratch.arena, CharOffset{ first }, Length{ count });
+                assert(range.size == expected);
+                assert(expected == 0 or memcmp(range.str, text.str + first, expected) == 0);
+                Length copied = tree->copy_range(CharOffset{ first }, Length{ count }, dst);
+                assert(copied == Length{ expected });
+                assert(memcmp(dst, text.str + first, expected) == 0);
+
+                range = owning_snap->get_range(scratch.arena, CharOffset{ first }, Length{ count });
+                assert(range.size == expected);
+                assert(expected == 0 or memcmp(range.str, text.str + first, expected) == 0);
+                copied = ref_snap.copy_range(CharOffset{ first }, Length{ count }, dst);
+                assert(copied == Length{ expected });
+                assert(memcmp(dst, text.str + first, expected) == 0);
+            }
+        }
+        // The snapshots are unaffected by later edits.
+        tree->remove(CharOffset{ 0 }, Length{ 10 });
+        String8 range = ref_snap.get_range(scratch.arena, CharOffset{ 0 }, Length{ text.size });
+        assert(str8_match_exact(range, text));
+    }
+    release_owning_snap(owning_snap);
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test18()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("first\r\nsecond\nthi")));
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("rd\r")));
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("\n\n\r\nlast\r")));
+    Tree* tree = tree_builder_finish(&builder);
+    for EachIndex(i, 15)
+    {
+        tree->insert(CharOffset{ (i * 7) % rep(tree->length()) }, str8_mut(str8_literal(i % 3 == 0 ? "\r\n" : "ab")));
+    }
+    // Keep the final newline so the walker has to produce a trailing empty line.
+    tree->insert(CharOffset{ rep(tree->length()) }, str8_mut(str8_literal("\n")));
+    auto* owning_snap = tree->owning_snap(scratch.arena);
+    {
+        // Every line, from every starting line, in both modes.
+        for EachIndex(start, rep(tree->line_count()) + 1)
+        {
+            LineWalker walker{ scratch.arena, tree, StripCRLF::No, Line{ start } };
+            LineWalker crlf_walker{ scratch.arena, owning_snap, StripCRLF::Yes, Line{ start } };
+            Line line = start == 0 ? Line::Beginning : Line{ start };
+            while (not walker.exhausted())
+            {
+                assert(walker.line() == line);
+                String8 expected = tree->get_line_content(scratch.arena, line);
+                String8View view = walker.next();
+                assert(view.size == expected.size);
+                assert(memcmp(view.str, expected.str, view.size) == 0);
+
+                String8 expected_crlf;
+                IncompleteCRLF incomplete = owning_snap->get_line_content_crlf(scratch.arena, &expected_crlf, line);
+                assert(not crlf_walker.exhausted());
+                LineSlices slices = crlf_walker.next_slices();
+                assert(slices.length == Length{ expected_crlf.size });
+                // The final line has no LF, so the incomplete flag is not meaningful there.
+                if (rep(line) < rep(tree->line_count()))
+                {
+                    assert(slices.incomplete_crlf == incomplete);
+                }
+                uint64_t pos = 0;
+                for EachIndex(i, slices.count)
+                {
+                    assert(slices.slices[i].size != 0);
+                    assert(memcmp(slices.slices[i].str, expected_crlf.str + pos, slices.slices[i].size) == 0);
+                    pos += slices.slices[i].size;
+                }
+                line = extend(line);
+            }
+            assert(crlf_walker.exhausted());
+            assert(rep(line) == rep(tree->line_count()) + 1);
+        }
+        LineWalker past_end{ scratch.arena, tree, StripCRLF::No, Line{ rep(tree->line_count()) + 1 } };
+        assert(past_end.exhausted());
+    }
+    release_owning_snap(owning_snap);
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test19()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("short\n0123456789")));
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("abcdefghij\nend")));
+    Tree* tree = tree_builder_finish(&builder);
+    tree->insert(CharOffset{ 12 }, str8_mut(str8_literal("XY")));
+    // Line 2 is now "012345XY6789abcdefghij" spread across several pieces.
+    {
+        auto ref_snap = tree->ref_snap();
+        for EachIndex(line_index, rep(tree->line_count()))
+        {
+            Line line = Line{ line_index + 1 };
+            String8 full = tree->get_line_content(scratch.arena, line);
+            LineRange full_range = tree->get_line_range(line);
+            for EachIndex(first, full.size + 2)
+            {
+                for EachIndex(count, full.size + 2)
+                {
+                    auto expected_first = first < full.size ? first : full.size;
+                    auto expected_count = count < full.size - expected_first ? count : full.size - expected_first;
+                    String8 slice = tree->get_line_slice(scratch.arena, line, Column{ first }, Length{ count });
+                    assert(slice.size == expected_count);
+                    assert(expected_count == 0 or memcmp(slice.str, full.str + expected_first, expected_count) == 0);
+                    LineRange range = ref_snap.get_line_range_slice(line, Column{ first }, Length{ count });
+                    assert(range.first == full_range.first + Length{ expected_first });
+                    assert(range.last == range.first + Length{ expected_count });
+                }
+            }
+        }
+        assert(tree->get_line_slice(scratch.arena, Line{ 2 }, Column{ 3 }, Length{ 6 }).size == 6);
+        assert(str8_match_exact(tree->get_line_slice(scratch.arena, Line{ 2 }, Column{ 4 }, Length{ 4 }), str8_mut(str8_literal("45XY"))));
+    }
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test20()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    // Enough lines for the sampled line start index to be built, with lines of varying length.
+    String8 text = str8_cstr_alloc(scratch.arena, 40000);
+    for EachIndex(i, text.size)
+    {
+        text.str[i] = (i * 7919) % 23 == 0 ? '\n' : char('a' + i % 26);
+    }
+    tree_builder_accept(arena, &builder, text);
+    Tree* tree = tree_builder_finish(&builder);
+    auto check_lines = [&]
+    {
+        String8 contents = buffer_contents(scratch.arena, tree);
+        uint64_t lf_count = 0;
+        for EachIndex(i, contents.size)
+        {
+            if (i % 13 == 0)
+            {
+                assert(tree->line_at(CharOffset{ i }) == Line{ lf_count + 1 });
+            }
+            lf_count += contents.str[i] == '\n';
+        }
+    };
+    check_lines();
+    // Splitting the original piece locates positions through the index.
+    for EachIndex(i, 30)
+    {
+        tree->insert(CharOffset{ (i * 1237) % rep(tree->length()) }, str8_mut(str8_literal("x\ny")));
+        tree->remove(CharOffset{ (i * 3571) % rep(tree->length()) }, Length{ 5 });
+    }
+    check_lines();
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+#if FRED_CODE_POINT_SUMMARY
+void test21()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    // Mix 1, 2, 3 and 4 byte sequences so that pieces and index blocks split in the middle of code points.
+    const String8View glyphs[] = { str8_literal("a"), str8_literal("\xC3\xA9"), str8_literal("\xE2\x82\xAC"),
+                                   str8_literal("\xF0\x9F\x98\x80"), str8_literal("\n") };
+    String8List lst{};
+    str8_serial_begin(scratch.arena, &lst);
+    for EachIndex(i, 3000)
+    {
+        str8_serial_push_str8(scratch.arena, &lst, str8_mut(glyphs[(i * 7) % 11 % 5]));
+    }
+    tree_builder_accept(arena, &builder, str8_serial_end(scratch.arena, lst));
+    Tree* tree = tree_builder_finish(&builder);
+    auto check_code_points = [&]
+    {
+        String8 contents = buffer_contents(scratch.arena, tree);
+        uint64_t cp = 0;
+        uint64_t line_cp = 0;
+        uint64_t line = 1;
+        for EachIndex(i, contents.size + 1)
+        {
+            bool starts = i == contents.size or (static_cast<uint8_t>(contents.str[i]) & 0xC0) != 0x80;
+            if (i % 7 == 0)
+            {
+                assert(tree->offset_to_codepoint(CharOffset{ i }) == CodePointCount{ cp });
+                if (i != contents.size)
+                {
+                    assert(tree->codepoint_column(CharOffset{ i }) == CodePointCount{ line_cp });
+                }
+            }
+            if (starts)
+            {
+                assert(tree->codepoint_to_offset(CodePointCount{ cp }) == CharOffset{ i });
+                if (i == contents.size or contents.str[i] == '\n')
+                {
+                    // Columns past the end of the line clamp to the line end.
+                    assert(tree->codepoint_column_offset(Line{ line }, CodePointCount{ line_cp + 3 }) == CharOffset{ i });
+                }
+                assert(tree->codepoint_column_offset(Line{ line }, CodePointCount{ line_cp }) == CharOffset{ i });
+            }
+            if (i == contents.size)
+                break;
+            cp += starts;
+            line_cp += starts;
+            if (contents.str[i] == '\n')
+            {
+                ++line;
+                line_cp = 0;
+            }
+        }
+        assert(tree->codepoint_count() == CodePointCount{ cp });
+    };
+    check_code_points();
+    for EachIndex(i, 40)
+    {
+        auto cps = rep(tree->codepoint_count());
+        auto at = tree->codepoint_to_offset(CodePointCount{ (i * 1237) % cps });
+        tree->insert(at, str8_mut(glyphs[i % 5]));
+        tree->insert(at, str8_mut(str8_literal("x\xE2\x82\xAC\xC3\xA9")));
+        cps = rep(tree->codepoint_count());
+        auto first = tree->codepoint_to_offset(CodePointCount{ (i * 3571) % cps });
+        auto last = tree->codepoint_to_offset(CodePointCount{ (i * 3571) % cps + 4 });
+        tree->remove(first, distance(first, last));
+    }
+    check_code_points();
+    {
+        auto* snap = tree->owning_snap(scratch.arena);
+        CharOffset mid = tree->codepoint_to_offset(CodePointCount{ 1000 });
+        tree->insert(CharOffset{ 0 }, str8_mut(str8_literal("\xF0\x9F\x98\x80")));
+        assert(snap->codepoint_to_offset(CodePointCount{ 1000 }) == mid);
+        assert(snap->offset_to_codepoint(mid) == CodePointCount{ 1000 });
+        assert(tree->offset_to_codepoint(mid + Length{ 4 }) == CodePointCount{ 1001 });
+        release_owning_snap(snap);
+    }
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_CODE_POINT_SUMMARY && FRED_UTF16_SUMMARY
+void test22()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    const String8View glyphs[] = { str8_literal("a"), str8_literal("\xF0\x9F\x98\x80"), str8_literal("\xC3\xA9"),
+                                   str8_literal("\xE2\x82\xAC"), str8_literal("\n") };
+    String8List lst{};
+    str8_serial_begin(scratch.arena, &lst);
+    for EachIndex(i, 3000)
+    {
+        str8_serial_push_str8(scratch.arena, &lst, str8_mut(glyphs[(i * 5) % 13 % 5]));
+    }
+    tree_builder_accept(arena, &builder, str8_serial_end(scratch.arena, lst));
+    Tree* tree = tree_builder_finish(&builder);
+    auto check_positions = [&]
+    {
+        String8 contents = buffer_contents(scratch.arena, tree);
+        uint64_t line = 1;
+        uint64_t character = 0;
+        for EachIndex(i, contents.size + 1)
+        {
+            auto b = i == contents.size ? 0 : static_cast<uint8_t>(contents.str[i]);
+            if ((b & 0xC0) == 0x80)
+                continue;
+            Utf16Position pos{ .line = Line{ line }, .character = Utf16Count{ character } };
+            assert(tree->offset_to_utf16_position(CharOffset{ i }) == pos);
+            assert(tree->utf16_position_to_offset(pos) == CharOffset{ i });
+            if (b >= 0xF0)
+            {
+                // The second half of a surrogate pair maps back to the start of the pair.
+                pos.character = extend(pos.character);
+                assert(tree->utf16_position_to_offset(pos) == CharOffset{ i });
+            }
+            if (i == contents.size or b == '\n')
+            {
+                pos.character = extend(pos.character, 10);
+                assert(tree->utf16_position_to_offset(pos) == CharOffset{ i });
+            }
+            character += 1 + (b >= 0xF0);
+            if (b == '\n')
+            {
+                ++line;
+                character = 0;
+            }
+        }
+    };
+    check_positions();
+    for EachIndex(i, 40)
+    {
+        auto cps = rep(tree->codepoint_count());
+        auto at = tree->codepoint_to_offset(CodePointCount{ (i * 1237) % cps });
+        tree->insert(at, str8_mut(glyphs[i % 5]));
+        tree->insert(at, str8_mut(str8_literal("\xF0\x9F\x98\x80y\n")));
+        cps = rep(tree->codepoint_count());
+        auto first = tree->codepoint_to_offset(CodePointCount{ (i * 3571) % cps });
+        auto last = tree->codepoint_to_offset(CodePointCount{ (i * 3571) % cps + 3 });
+        tree->remove(first, distance(first, last));
+    }
+    check_positions();
+    {
+        auto* snap = tree->owning_snap(scratch.arena);
+        Utf16Position pos = tree->offset_to_utf16_position(tree->codepoint_to_offset(CodePointCount{ 1000 }));
+        CharOffset offset = tree->utf16_position_to_offset(pos);
+        tree->insert(CharOffset{ 0 }, str8_mut(str8_literal("\xF0\x9F\x98\x80")));
+        assert(snap->utf16_position_to_offset(pos) == offset);
+        assert(snap->offset_to_utf16_position(offset) == pos);
+        release_owning_snap(snap);
+    }
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+#endif // FRED_CODE_POINT_SUMMARY && FRED_UTF16_SUMMARY
+
+#if FRED_LINE_EXTENT_SUMMARY
+void test23()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    // Enough lines for the line length index to be built, with lengths which vary by line.
+    String8List lst{};
+    str8_serial_begin(scratch.arena, &lst);
+    for EachIndex(i, 2000)
+    {
+        for EachIndex(j, (i * 7919) % 97)
+        {
+            str8_serial_push_char(scratch.arena, &lst, char('a' + j % 26));
+        }
+        str8_serial_push_char(scratch.arena, &lst, '\n');
+    }
+    tree_builder_accept(arena, &builder, str8_serial_end(scratch.arena, lst));
+    Tree* tree = tree_builder_finish(&builder);
+    auto longest_line = [&]
+    {
+        String8 contents = buffer_contents(scratch.arena, tree);
+        uint64_t longest = 0;
+        uint64_t current = 0;
+        for EachIndex(i, contents.size)
+        {
+            current = contents.str[i] == '\n' ? 0 : current + 1;
+            longest = current > longest ? current : longest;
+        }
+        return Length{ longest };
+    };
+    assert(tree->max_line_length() == longest_line());
+    for EachIndex(i, 60)
+    {
+        auto length = rep(tree->length());
+        switch (i % 3)
+        {
+        case 0:
+            tree->insert(CharOffset{ (i * 1237) % length }, str8_mut(str8_literal("0123456789\n0123456789012345678901234567890123456789")));
+            break;
+        case 1:
+            tree->insert(CharOffset{ (i * 1237) % length }, str8_mut(str8_literal("\n")));
+            break;
+        case 2:
+            tree->remove(CharOffset{ (i * 3571) % length }, Length{ (i * 13) % 150 });
+            break;
+        }
+        assert(tree->max_line_length() == longest_line());
+    }
+    {
+        auto* snap = tree->owning_snap(scratch.arena);
+        auto longest = tree->max_line_length();
+        // The first line becomes the longest.
+        String8 filler = str8_cstr_alloc(scratch.arena, rep(longest) + 1);
+        memset(filler.str, 'z', filler.size);
+        tree->insert(CharOffset{ 0 }, filler);
+        assert(tree->max_line_length() == longest_line());
+        assert(rep(tree->max_line_length()) > rep(longest));
+        assert(snap->max_line_length() == longest);
+        release_owning_snap(snap);
+    }
+    // Removing every LF leaves a single line.
+    tree->remove(CharOffset{ 0 }, tree->length());
+    tree->insert(CharOffset{ 0 }, str8_mut(str8_literal("abc")));
+    assert(tree->max_line_length() == Length{ 3 });
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+#endif // FRED_LINE_EXTENT_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+void test24()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    // Deeply nested brackets spread over enough text for the bracket index to be built.
+    String8List lst{};
+    str8_serial_begin(scratch.arena, &lst);
+    uint64_t seed = 12345;
+    auto next = [&]
+    {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        return seed >> 33;
+    };
+    const char brackets[] = "([{)]}";
+    for EachIndex(i, 30000)
+    {
+        auto r = next() % 16;
+        str8_serial_push_char(scratch.arena, &lst, r < 6 ? brackets[r] : char('a' + r));
+    }
+    tree_builder_accept(arena, &builder, str8_serial_end(scratch.arena, lst));
+    Tree* tree = tree_builder_finish(&builder);
+    const CharRange ignored[] = { { CharOffset{ 1000 }, CharOffset{ 1100 } },
+                                    { CharOffset{ 5000 }, CharOffset{ 5300 } },
+                                    { CharOffset{ 12000 }, CharOffset{ 12010 } } };
+    auto is_ignored = [&](uint64_t offset, uint64_t count)
+    {
+        for EachIndex(i, count)
+        {
+            if (offset >= rep(ignored[i].first) and offset < rep(ignored[i].last))
+                return true;
+        }
+        return false;
+    };
+    // Scans the text directly.
+    auto expected_match = [&](String8 text, uint64_t offset, uint64_t count)
+    {
+        if (is_ignored(offset, count))
+            return CharOffset::Sentinel;
+        for EachIndex(pair, 3)
+        {
+            char open = brackets[pair];
+            char close = brackets[pair + 3];
+            int64_t depth = 0;
+            if (text.str[offset] == open)
+            {
+                for (uint64_t i = offset + 1; i < text.size; ++i)
+                {
+                    if (is_ignored(i, count))
+                        continue;
+                    depth += (text.str[i] == open) - (text.str[i] == close);
+                    if (depth < 0)
+                        return CharOffset{ i };
+                }
+                return CharOffset::Sentinel;
+            }
+            if (text.str[offset] == close)
+            {
+                for (uint64_t i = offset; i-- > 0;)
+                {
+                    if (is_ignored(i, count))
+                        continue;
+                    depth += (text.str[i] == close) - (text.str[i] == open);
+                    if (depth < 0)
+                        return CharOffset{ i };
+                }
+                return CharOffset::Sentinel;
+            }
+        }
+        return CharOffset::Sentinel;
+    };
+    auto expected_enclosing = [&](String8 text, uint64_t offset, uint64_t pair, uint64_t count)
+    {
+        int64_t depth = 0;
+        for (uint64_t i = offset; i-- > 0;)
+        {
+            if (is_ignored(i, count))
+                continue;
+            depth += (text.str[i] == brackets[pair + 3]) - (text.str[i] == brackets[pair]);
+            if (depth < 0)
+                return CharOffset{ i };
+        }
+        return CharOffset::Sentinel;
+    };
+    auto check = [&]
+    {
+        String8 text = buffer_contents(scratch.arena, tree);
+        for (uint64_t offset = 0; offset < text.size; offset += 37)
+        {
+            for EachIndex(count, 4)
+            {
+                assert(tree->match_bracket(CharOffset{ offset }, ignored, count) == expected_match(text, offset, count));
+                assert(tree->enclosing_bracket(CharOffset{ offset }, offset % 3, ignored, count) == expected_enclosing(text, offset, offset % 3, count));
+            }
+        }
+    };
+    check();
+    {
+        auto* snap = tree->owning_snap(scratch.arena);
+        String8 text = buffer_contents(scratch.arena, tree);
+        for EachIndex(i, 60)
+        {
+            auto length = rep(tree->length());
+            if (i % 2 == 0)
+            {
+                tree->insert(CharOffset{ (i * 7919) % length }, str8_mut(str8_literal("(({[x]}")));
+            }
+            else
+            {
+                tree->remove(CharOffset{ (i * 4111) % length }, Length{ (i * 31) % 300 });
+            }
+        }
+        check();
+        // The snapshot still sees the original text.
+        for (uint64_t offset = 0; offset < text.size; offset += 101)
+        {
+            assert(snap->match_bracket(CharOffset{ offset }) == expected_match(text, offset, 0));
+        }
+        release_owning_snap(snap);
+    }
+    // Typing enough into one piece for the mod buffer's index to grow past its first level.
+    for EachIndex(i, 1500)
+    {
+        tree->insert(CharOffset{ 2000 + i * 7 }, str8_mut(str8_literal(i % 3 == 0 ? "{(a[b)}" : "]x(y)z[")));
+    }
+    check();
+    assert(tree->match_bracket(CharOffset{ rep(tree->length()) }) == CharOffset::Sentinel);
+    assert(tree->enclosing_bracket(CharOffset{ 0 }, 0) == CharOffset::Sentinel);
+    assert(tree->enclosing_bracket(CharOffset{ 100 }, 3) == CharOffset::Sentinel);
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+#endif // FRED_BRACKET_SUMMARY
+
+#if FRED_HASH_SUMMARY
+void test25()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    // Every line repeats 50 lines later.
+    auto build = [&](uint64_t lines)
+    {
+        Arena::Arena* arena = Arena::alloc(Arena::default_params);
+        TreeBuilder builder = tree_builder_start(arena);
+        String8List lst{};
+        str8_serial_begin(scratch.arena, &lst);
+        for EachIndex(i, lines)
+        {
+            char line[32];
+            int size = snprintf(line, sizeof(line), "line %d\n", static_cast<int>(i % 50));
+            str8_serial_push_str8(scratch.arena, &lst, str8_copy(scratch.arena, String8{ .str = line, .size = static_cast<uint64_t>(size) }));
+            // Split the text over several buffers.
+            if (i % 700 == 699)
+            {
+                tree_builder_accept(arena, &builder, str8_serial_end(scratch.arena, lst));
+                lst = {};
+                str8_serial_begin(scratch.arena, &lst);
+            }
+        }
+        tree_builder_accept(arena, &builder, str8_serial_end(scratch.arena, lst));
+        return tree_builder_finish(&builder);
+    };
+    // The hash of some text, computed by a tree holding only that text.
+    auto hash_of = [&](String8 text)
+    {
+        Arena::Arena* arena = Arena::alloc(Arena::default_params);
+        TreeBuilder builder = tree_builder_start(arena);
+        tree_builder_accept(arena, &builder, text);
+        Tree* tree = tree_builder_finish(&builder);
+        auto result = tree->content_hash();
+        assert(tree->hash_range(CharOffset{ 0 }, tree->length()) == result);
+        release_tree(tree);
+        return result;
+    };
+    Tree* tree = build(2000);
+    auto check_ranges = [&]
+    {
+        auto length = rep(tree->length());
+        for EachIndex(i, 40)
+        {
+            CharOffset offset{ (i * 7919) % length };
+            Length count{ (i * 1031) % 3000 };
+            assert(tree->hash_range(offset, count) == hash_of(tree->get_range(scratch.arena, offset, count)));
+        }
+        assert(tree->content_hash() == hash_of(buffer_contents(scratch.arena, tree)));
+    };
+    check_ranges();
+    assert(tree->hash_line(Line{ 7 }) == tree->hash_line(Line{ 57 }));
+    assert(tree->hash_line(Line{ 7 }) != tree->hash_line(Line{ 8 }));
+    assert(tree->hash_line(Line{ 7 }) == hash_of(str8_mut(str8_literal("line 6"))));
+    assert(tree->hash_range(CharOffset{ 3 }, Length{ 0 }) == tree->hash_range(CharOffset{ 100 }, Length{ 0 }));
+    {
+        auto* snap = tree->owning_snap(scratch.arena);
+        auto before = tree->content_hash();
+        for EachIndex(i, 40)
+        {
+            auto length = rep(tree->length());
+            if (i % 2 == 0)
+            {
+                tree->insert(CharOffset{ (i * 4111) % length }, str8_mut(str8_literal("changed\nlines\n")));
+            }
+            else
+            {
+                tree->remove(CharOffset{ (i * 2909) % length }, Length{ (i * 17) % 200 });
+            }
+        }
+        check_ranges();
+        assert(tree->content_hash() != before);
+        assert(snap->content_hash() == before);
+        release_owning_snap(snap);
+    }
+    // Equal documents hash equal, however they were edited.
+    Tree* other = build(2000);
+    tree->remove(CharOffset{ 0 }, tree->length());
+    tree->insert(CharOffset{ 0 }, buffer_contents(scratch.arena, other));
+    assert(tree->content_hash() == other->content_hash());
+    assert(tree->hash_line(Line{ 1500 }) == other->hash_line(Line{ 1500 }));
+    release_tree(other);
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+#endif // FRED_HASH_SUMMARY
+
+#if FRED_WRAP_SUMMARY
+void test26()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    String8List lst{};
+    str8_serial_begin(scratch.arena, &lst);
+    for EachIndex(i, 800)
+    {
+        char line[160];
+        int size = static_cast<int>((i * 37) % 150);
+        memset(line, 'a' + static_cast<int>(i % 26), size);
+        line[size] = '\n';
+        str8_serial_push_str8(scratch.arena, &lst, str8_copy(scratch.arena, String8{ .str = line, .size = static_cast<uint64_t>(size + 1) }));
+    }
+    String8 text = str8_serial_end(scratch.arena, lst);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    // Split the text mid-line so that lines span pieces.
+    for (uint64_t first = 0; first < text.size; first += 997)
+    {
+        auto size = text.size - first < 997 ? text.size - first : 997;
+        tree_builder_accept(arena, &builder, str8_copy(arena, String8{ .str = text.str + first, .size = size }));
+    }
+    Tree* tree = tree_builder_finish(&builder);
+    // Rows of every line, wrapped by hand.
+    auto check = [&]
+    {
+        auto width = tree->wrap_width();
+        String8 content = buffer_contents(scratch.arena, tree);
+        uint64_t row = 0;
+        uint64_t line = 1;
+        uint64_t start = 0;
+        for (uint64_t i = 0; i <= content.size; ++i)
+        {
+            if (i < content.size and content.str[i] != '\n')
+                continue;
+            auto length = i - start;
+            auto rows = width == 0 or length == 0 ? 1 : (length + width - 1) / width;
+            for EachIndex(r, rows)
+            {
+                assert(tree->visual_row_start(row + r) == (LinePosition{ .line = Line{ line }, .column = Column{ r * width } }));
+            }
+            assert(tree->visual_row(Line{ line }, Column{ 0 }) == row);
+            assert(tree->visual_row(Line{ line }, Column{ length }) == row + rows - 1);
+            assert(tree->visual_row(Line{ line }, Column{ length + 500 }) == row + rows - 1);
+            row += rows;
+            line += 1;
+            start = i + 1;
+        }
+        assert(tree->visual_row_count() == row);
+        assert(tree->visual_row_start(row + 10) == tree->visual_row_start(row - 1));
+    };
+    check();
+    tree->set_wrap_width(13);
+    assert(tree->wrap_width() == 13);
+    check();
+    for EachIndex(i, 30)
+    {
+        auto length = rep(tree->length());
+        if (i % 3 != 2)
+        {
+            tree->insert(CharOffset{ (i * 4111) % length }, str8_mut(str8_literal("a soft wrapped insert\n\nwith a longer line than the wrap width")));
+        }
+        else
+        {
+            tree->remove(CharOffset{ (i * 2909) % length }, Length{ (i * 53) % 400 });
+        }
+        if (i % 10 == 0)
+        {
+            check();
+        }
+    }
+    check();
+    // Roots restored from the history were summarized for the previous width.
+    tree->set_wrap_width(40);
+    check();
+    for EachIndex(i, 5)
+    {
+        tree->try_undo(CharOffset{ });
+    }
+    check();
+    // As was a head, restored again after each change of width.
+    {
+        auto head = tree->head();
+        tree->insert(CharOffset{ 50 }, str8_mut(str8_literal("typed after the head\n")));
+        tree->set_wrap_width(17);
+        tree->snap_to(head);
+        check();
+        tree->set_wrap_width(40);
+        tree->snap_to(head);
+        check();
+        tree->snap_to(head);
+        check();
+    }
+    tree->set_wrap_width(0);
+    check();
+    tree->insert(CharOffset{ 100 }, str8_mut(str8_literal("inserted while not wrapping\n")));
+    tree->set_wrap_width(40);
+    check();
+    // Going back to an earlier width reuses its rows, which catch up with the lines typed since.
+    tree->insert(CharOffset{ 200 }, str8_mut(str8_literal("typed at width 40\nand one more line\n")));
+    tree->set_wrap_width(13);
+    check();
+    tree->set_wrap_width(40);
+    check();
+    tree->remove(CharOffset{ 0 }, tree->length());
+    check();
+    assert(tree->visual_row_count() == 1);
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+#endif // FRED_WRAP_SUMMARY
+
+void test27()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    String8List lst{};
+    str8_serial_begin(scratch.arena, &lst);
+    for EachIndex(i, 3000)
+    {
+        char line[32];
+        int size = snprintf(line, sizeof(line), "line %d\n", static_cast<int>(i));
+        str8_serial_push_str8(scratch.arena, &lst, str8_copy(scratch.arena, String8{ .str = line, .size = static_cast<uint64_t>(size) }));
+    }
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_serial_end(scratch.arena, lst));
+    Tree* tree = tree_builder_finish(&builder);
+    // Hides the lines of every collapsed fold by hand and walks the visible ones.
+    auto check = [&]
+    {
+        auto lines = rep(tree->line_count());
+        bool* hidden = Arena::push_array<bool>(scratch.arena, lines + 1);
+        for EachIndex(i, tree->fold_count())
+        {
+            Fold fold = tree->fold_at(i);
+            assert(rep(fold.header) < rep(fold.last) and rep(fold.last) <= lines);
+            assert(i == 0 or rep(tree->fold_at(i - 1).header) < rep(fold.header));
+            for (uint64_t l = rep(fold.header) + 1; fold.collapsed and l <= rep(fold.last); ++l)
+            {
+                hidden[l] = true;
+            }
+        }
+        uint64_t visible = 0;
+        for (uint64_t l = 1; l <= lines; ++l)
+        {
+            if (not hidden[l])
+            {
+                visible += 1;
+                assert(tree->visible_to_line(Line{ visible }) == Line{ l });
+            }
+            // A hidden line maps to the header before it.
+            assert(tree->line_to_visible(Line{ l }) == Line{ visible });
+        }
+        assert(rep(tree->visible_line_count()) == visible);
+        assert(tree->visible_to_line(Line{ visible + 5 }) == tree->visible_to_line(Line{ visible }));
+    };
+    check();
+    // Nested and overlapping folds, some of them expanded.
+    for (uint64_t h = 1; h < 2990; h += 10)
+    {
+        tree->add_fold(Line{ h }, Line{ h + 8 }, h % 20 == 1);
+        tree->add_fold(Line{ h + 2 }, Line{ h + 5 });
+    }
+    tree->add_fold(Line{ 50 }, Line{ 400 }, false);
+    tree->add_fold(Line{ 395 }, Line{ 420 });
+    tree->add_fold(Line{ 2990 }, Line{ 5000 });
+    assert(tree->fold_at(tree->fold_count() - 1).last == Line{ 3001 });
+    check();
+    tree->set_fold_collapsed(Line{ 50 }, true);
+    check();
+    tree->remove_fold(Line{ 395 });
+    tree->remove_fold(Line{ 2990 });
+    check();
+    // Edits outside the folds keep them on the same text.
+    auto header_text = [&](uint64_t index)
+    {
+        return tree->get_line_content(scratch.arena, tree->fold_at(index).header);
+    };
+    auto last_text = [&](uint64_t index)
+    {
+        return tree->get_line_content(scratch.arena, tree->fold_at(index).last);
+    };
+    auto fold_count = tree->fold_count();
+    String8* headers = Arena::push_array<String8>(scratch.arena, fold_count);
+    String8* lasts = Arena::push_array<String8>(scratch.arena, fold_count);
+    for EachIndex(i, fold_count)
+    {
+        headers[i] = header_text(i);
+        lasts[i] = last_text(i);
+    }
+    tree->insert(CharOffset{ 0 }, str8_mut(str8_literal("new\nlines\n")));
+    tree->insert(CharOffset{ rep(tree->length()) }, str8_mut(str8_literal("\nat the end\n")));
+    auto offset = rep(tree->get_line_range(Line{ 7 }).first) + 2;
+    tree->remove(CharOffset{ offset }, Length{ 3 });
+    assert(tree->fold_count() == fold_count);
+    for EachIndex(i, fold_count)
+    {
+        assert(str8_match_exact(header_text(i), headers[i]));
+        assert(str8_match_exact(last_text(i), lasts[i]));
+    }
+    check();
+    // Whole lines inserted at line starts back and forth through the document move the folds after them only.
+    for EachIndex(i, 50)
+    {
+        auto line = Line{ (i * 1237) % rep(tree->line_count()) + 1 };
+        tree->insert(tree->get_line_range(line).first, str8_mut(str8_literal("whole\nlines\n")));
+        if (i % 10 == 0)
+        {
+            check();
+        }
+    }
+    for EachIndex(i, fold_count)
+    {
+        assert(str8_match_exact(header_text(i), headers[i]));
+        assert(str8_match_exact(last_text(i), lasts[i]));
+    }
+    check();
+    // Removing lines inside a fold shrinks it.
+    auto before = tree->fold_at(0);
+    auto first = tree->get_line_range(extend(before.header)).first;
+    tree->remove(first, Length{ rep(tree->get_line_range(extend(before.header, 4)).first) - rep(first) });
+    assert(tree->fold_at(0).header == before.header);
+    assert(rep(tree->fold_at(0).last) == rep(before.last) - 3);
+    check();
+    for EachIndex(i, 30)
+    {
+        auto length = rep(tree->length());
+        if (i % 3 != 2)
+        {
+            tree->insert(CharOffset{ (i * 4111) % length }, str8_mut(str8_literal("a folded\ninsert\n")));
+        }
+        else
+        {
+            tree->remove(CharOffset{ (i * 2909) % length }, Length{ (i * 53) % 700 });
+        }
+        check();
+    }
+    // Folding or unfolding everything does not depend on the text.
+    tree->set_all_folds_collapsed(false);
+    assert(tree->visible_line_count() == tree->line_count());
+    check();
+    tree->set_all_folds_collapsed(true);
+    check();
+    while (tree->try_undo(CharOffset{ }).success)
+    {
+        check();
+    }
+    // The history brings the folds back to the text they were made on.
+    assert(tree->fold_count() == fold_count);
+    for EachIndex(i, fold_count)
+    {
+        assert(str8_match_exact(header_text(i), headers[i]));
+        assert(str8_match_exact(last_text(i), lasts[i]));
+    }
+    tree->try_redo(CharOffset{ });
+    tree->try_redo(CharOffset{ });
+    check();
+    tree->remove(CharOffset{ 0 }, tree->length());
+    assert(tree->fold_count() == 0);
+    check();
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test28()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("0123456789\n0123456789\n0123456789\n")));
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("abcdefghij\nabcdefghij\n")));
+    Tree* tree = tree_builder_finish(&builder);
+    // Split pieces in their middle, then keep typing after each split so the new piece is extended.
+    char expected[4096];
+    uint64_t size = 0;
+    {
+        String8 text = buffer_contents(scratch.arena, tree);
+        memcpy(expected, text.str, text.size);
+        size = text.size;
+    }
+    for EachIndex(i, 200)
+    {
+        auto offset = (i * 37) % size;
+        const char* typed = i % 3 == 0 ? "x\n" : "yz";
+        for EachIndex(k, 2)
+        {
+            tree->insert(CharOffset{ offset + k * 2 }, String8{ .str = const_cast<char*>(typed), .size = 2 });
+            memmove(expected + offset + k * 2 + 2, expected + offset + k * 2, size - offset - k * 2);
+            memcpy(expected + offset + k * 2, typed, 2);
+            size += 2;
+        }
+        if (i % 20 == 0)
+        {
+            String8 text = buffer_contents(scratch.arena, tree);
+            assert(text.size == size and memcmp(text.str, expected, size) == 0);
+        }
+    }
+    String8 text = buffer_contents(scratch.arena, tree);
+    assert(text.size == size and memcmp(text.str, expected, size) == 0);
+    assert(rep(tree->line_feed_count()) == 5 + 2 * 67);
+    while (tree->try_undo(CharOffset{ }).success)
+    {
+    }
+    assert(tree->length() == Length{ 55 });
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test29()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("Hello\nWorld\n")));
+    Tree* tree = tree_builder_finish(&builder);
+    // Typing a paragraph one character at a time in the middle of a piece splits it once, then extends one piece.
+    const char* paragraph = "The quick brown fox\njumps over the lazy dog.\n";
+    auto typed = strlen(paragraph);
+    for EachIndex(i, typed)
+    {
+        tree->insert(CharOffset{ 3 + i }, String8{ .str = const_cast<char*>(paragraph + i), .size = 1 });
+    }
+    assert(tree->piece_count() == 3);
+    String8 text = buffer_contents(scratch.arena, tree);
+    assert(str8_match_exact(str8_mut(str8_literal("HelThe quick brown fox\njumps over the lazy dog.\nlo\nWorld\n")), text));
+    assert(rep(tree->line_feed_count()) == 4);
+    assert(tree->line_at(CharOffset{ 25 }) == Line{ 2 });
+    // The whole run of typing is one undo step.
+    auto r = tree->try_undo(CharOffset{ });
+    assert(r.success);
+    text = buffer_contents(scratch.arena, tree);
+    assert(str8_match_exact(str8_mut(str8_literal("Hello\nWorld\n")), text));
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+// Builds two trees from the same chunks, repeated 'repeat' times, for tests running the same edits through two paths.
+void build_tree_pair(Tree* trees[2], std::initializer_list<const char*> chunks, uint64_t repeat = 1)
+{
+    for EachIndex(t, 2)
+    {
+        Arena::Arena* arena = Arena::alloc(Arena::default_params);
+        TreeBuilder builder = tree_builder_start(arena);
+        for EachIndex(r, repeat)
+        {
+            for (const char* chunk : chunks)
+            {
+                tree_builder_accept(arena, &builder, String8{ .str = const_cast<char*>(chunk), .size = strlen(chunk) });
+            }
+        }
+        trees[t] = tree_builder_finish(&builder);
+    }
+}
+
+// Undoes 'tree' and 'reference' in lock step to the beginning of their history and redoes them again, checking that
+// they read the same after every step.
+void assume_same_history(Tree* tree, Tree* reference, int locus = __builtin_LINE())
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    auto same = [&] {
+        if (not str8_match_exact(buffer_contents(scratch.arena, tree), buffer_contents(scratch.arena, reference)))
+        {
+            fprintf(stderr, "trees did not read the same through their history. Line(%d)\n", locus);
+            assert(false);
+        }
+    };
+    same();
+    while (reference->try_undo(CharOffset{ }).success)
+    {
+        auto r = tree->try_undo(CharOffset{ });
+        assert(r.success);
+        same();
+    }
+    auto r = tree->try_undo(CharOffset{ });
+    assert(not r.success);
+    while (reference->try_redo(CharOffset{ }).success)
+    {
+        r = tree->try_redo(CharOffset{ });
+        assert(r.success);
+        same();
+    }
+    r = tree->try_redo(CharOffset{ });
+    assert(not r.success);
+    Arena::scratch_end(scratch);
+}
+
+void test30()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Tree* trees[2];
+    build_tree_pair(trees, { "first line\nsecond line\nthird line\n" });
+    // The same edits through the typing cache and straight into the tree read the same and undo the same.
+    Tree* cached = trees[0];
+    Tree* direct = trees[1];
+    cached->set_typing_cache(true);
+    uint64_t cursor = 5;
+    for EachIndex(i, 600)
+    {
+        char typed[2] = { static_cast<char>('a' + i % 26), '\n' };
+        uint64_t size = i % 11 == 0 ? 2 : 1;
+        auto step = (i * 7919) % 13;
+        for (Tree* tree : trees)
+        {
+            if (step == 0)
+            {
+                tree->remove(CharOffset{ cursor - 1 }, Length{ 1 });
+            }
+            else if (step == 1)
+            {
+                tree->remove(CharOffset{ cursor - 1 }, Length{ 1 }, SuppressHistory::Yes);
+            }
+            else if (step == 2)
+            {
+                tree->insert(CharOffset{ cursor - 1 }, String8{ .str = typed, .size = size }, SuppressHistory::Yes);
+            }
+            else
+            {
+                tree->insert(CharOffset{ cursor }, String8{ .str = typed, .size = size });
+            }
+        }
+        if (step == 0 or step == 1)
+        {
+            cursor -= 1;
+        }
+        else
+        {
+            cursor += size;
+        }
+        if (i % 97 == 0)
+        {
+            // Jump elsewhere.
+            cursor = (cursor * 31) % rep(direct->length()) + 1;
+        }
+        assert(cached->length() == direct->length());
+        assert(cached->line_feed_count() == direct->line_feed_count());
+        assert(cached->at(CharOffset{ cursor - 1 }) == direct->at(CharOffset{ cursor - 1 }));
+        assert(cached->at(CharOffset{ cursor }) == direct->at(CharOffset{ cursor }));
+        if (i % 50 == 0)
+        {
+            // Other queries take the typed text into the tree first.
+            assert(str8_match_exact(buffer_contents(scratch.arena, cached), buffer_contents(scratch.arena, direct)));
+            assert(cached->get_line_content(scratch.arena, Line{ 2 }).size == direct->get_line_content(scratch.arena, Line{ 2 }).size);
+        }
+    }
+    cached->flush_typing();
+    auto* snap = cached->owning_snap(scratch.arena);
+    assert(snap->length() == direct->length());
+    assume_same_history(cached, direct);
+    release_tree(cached);
+    release_tree(direct);
+    Arena::scratch_end(scratch);
+}
+
+void test31()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Tree* trees[2];
+    build_tree_pair(trees, { "0123456789\nabcdefghij\nklmnopqrst\n" });
+    // The same edits with and without a compaction read, undo and redo the same.
+    Tree* compacted = trees[0];
+    Tree* plain = trees[1];
+    for (Tree* tree : trees)
+    {
+        tree->insert(CharOffset{ 5 }, str8_mut(str8_literal("hello\n")));
+        // Text which no root keeps.
+        tree->insert(CharOffset{ 0 }, str8_mut(str8_literal("JUNK")), SuppressHistory::Yes);
+        tree->remove(CharOffset{ 0 }, Length{ 4 }, SuppressHistory::Yes);
+        // Text only the dropped redo kept.
+        tree->insert(CharOffset{ 20 }, str8_mut(str8_literal("abc")));
+        tree->try_undo(CharOffset{ });
+        tree->insert(CharOffset{ 2 }, str8_mut(str8_literal("xyz")));
+    }
+    assert(compacted->mod_buffer_size() == Length{ 16 });
+    auto* snap = compacted->owning_snap(scratch.arena);
+    String8 before = buffer_contents(scratch.arena, compacted);
+
+    // Small steps with edits in between, held back while a reference snapshot is alive.
+    uint64_t steps = 0;
+    CompactionResult result{ };
+    {
+        auto ref = compacted->ref_snap();
+        for EachIndex(i, 20)
+        {
+            result = compacted->compact_mod_buffer(1);
+            assert(not result.done);
+            ++steps;
+        }
+    }
+    // A head does not hold it back.  The head is rewritten with the history, so snapping back to it after the
+    // compaction reads the same, and the text typed since is left to be reclaimed by the next one.
+    {
+        auto compacted_head = compacted->head();
+        auto plain_head = plain->head();
+        for (Tree* tree : trees)
+        {
+            tree->insert(CharOffset{ 0 }, str8_mut(str8_literal("HEAD")), SuppressHistory::Yes);
+        }
+        while (not (result = compacted->compact_mod_buffer(1)).done)
+        {
+            ++steps;
+        }
+        assert(result.reclaimed == Length{ 7 });
+        compacted->snap_to(compacted_head);
+        plain->snap_to(plain_head);
+        assert(str8_match_exact(buffer_contents(scratch.arena, compacted), buffer_contents(scratch.arena, plain)));
+    }
+    for (Tree* tree : trees)
+    {
+        tree->insert(CharOffset{ 0 }, str8_mut(str8_literal("!")));
+    }
+    while (not (result = compacted->compact_mod_buffer(1)).done)
+    {
+        ++steps;
+    }
+    assert(steps > 1);
+    assert(result.reclaimed == Length{ 4 });
+    assert(compacted->mod_buffer_size() == Length{ 10 });
+    assert(str8_match_exact(buffer_contents(scratch.arena, compacted), buffer_contents(scratch.arena, plain)));
+    assert(compacted->line_feed_count() == plain->line_feed_count());
+    assert(compacted->get_line_content(scratch.arena, Line{ 2 }).size == plain->get_line_content(scratch.arena, Line{ 2 }).size);
+
+    // The owning snapshot kept its copy.
+    {
+        TreeWalker walker{ scratch.arena, snap, CharOffset{ } };
+        String8List serial_lst{};
+        str8_serial_begin(scratch.arena, &serial_lst);
+        while (not walker.exhausted())
+        {
+            str8_serial_push_char(scratch.arena, &serial_lst, walker.next());
+        }
+        assert(str8_match_exact(before, str8_serial_end(scratch.arena, serial_lst)));
+    }
+    release_owning_snap(snap);
+
+    // Typing goes on after the moved text.
+    for (Tree* tree : trees)
+    {
+        tree->insert(CharOffset{ 1 }, str8_mut(str8_literal("?")));
+        tree->insert(CharOffset{ 2 }, str8_mut(str8_literal("\n")));
+    }
+    assume_same_history(compacted, plain);
+    // Nothing left to reclaim.
+    result = compacted->compact_mod_buffer(1000);
+    assert(result.done and result.reclaimed == Length{ 0 });
+    release_tree(compacted);
+    release_tree(plain);
+    Arena::scratch_end(scratch);
+}
+
+void test32()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Tree* trees[2];
+    build_tree_pair(trees, { "the quick brown fox\n" }, 20);
+#if FRED_WRAP_SUMMARY
+    for (Tree* tree : trees)
+    {
+        tree->set_wrap_width(7);
+    }
+#endif // FRED_WRAP_SUMMARY
+    // The same edits with and without defragmenting read, undo and redo the same.
+    Tree* defragmented = trees[0];
+    Tree* plain = trees[1];
+    for (Tree* tree : trees)
+    {
+        for EachIndex(i, 40)
+        {
+            // Splitting a piece and taking the split back leaves two contiguous pieces.
+            uint64_t offset = (i * 37) % rep(tree->length()) + 1;
+            tree->insert(CharOffset{ offset }, str8_mut(str8_literal("X")));
+            tree->remove(CharOffset{ offset }, Length{ 1 });
+            if (i % 4 == 0)
+            {
+                tree->insert(CharOffset{ (i * 53) % rep(tree->length()) }, str8_mut(str8_literal("ab\n")));
+            }
+        }
+    }
+    String8 before = buffer_contents(scratch.arena, defragmented);
+#if FRED_WRAP_SUMMARY
+    auto rows = defragmented->visual_row_count();
+#endif // FRED_WRAP_SUMMARY
+
+    auto joined = defragmented->defragment(DefragmentPolicy{ .copy_below = Length{ 0 } });
+    assert(joined.pieces_before == plain->piece_count());
+    assert(joined.pieces_after < joined.pieces_before);
+    assert(joined.pieces_after == defragmented->piece_count());
+    assert(joined.copied == Length{ 0 });
+    assert(str8_match_exact(before, buffer_contents(scratch.arena, defragmented)));
+
+    auto copied = defragmented->defragment(DefragmentPolicy{ .copy_below = Length{ 16 } });
+    assert(copied.pieces_before == joined.pieces_after);
+    assert(copied.pieces_after < copied.pieces_before);
+    assert(copied.copied != Length{ 0 });
+    assert(str8_match_exact(before, buffer_contents(scratch.arena, defragmented)));
+    assert(defragmented->line_feed_count() == plain->line_feed_count());
+#if FRED_WRAP_SUMMARY
+    assert(defragmented->visual_row_count() == rows);
+#endif // FRED_WRAP_SUMMARY
+    for EachIndex(i, rep(plain->line_count()))
+    {
+        auto line = Line{ i + 1 };
+        assert(str8_match_exact(defragmented->get_line_content(scratch.arena, line), plain->get_line_content(scratch.arena, line)));
+    }
+    assume_buffer_snapshots(defragmented, before, CharOffset{ }, __LINE__);
+
+    // Nothing is left to join.
+    auto again = defragmented->defragment(DefragmentPolicy{ .copy_below = Length{ 16 } });
+    assert(again.pieces_after == again.pieces_before);
+    assert(again.copied == Length{ 0 });
+
+    // Typing goes on as before and the history is untouched.
+    for (Tree* tree : trees)
+    {
+        tree->insert(CharOffset{ 3 }, str8_mut(str8_literal("typed")));
+        tree->insert(CharOffset{ 8 }, str8_mut(str8_literal("\n")));
+    }
+    assume_same_history(defragmented, plain);
+    release_tree(defragmented);
+    release_tree(plain);
+    Arena::scratch_end(scratch);
+}
+
+void test33()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("hello\nworld\n")));
+    Tree* tree = tree_builder_finish(&builder);
+
+    // A paste past the threshold becomes a buffer of its own.
+    constexpr uint64_t line_size = 16;
+    constexpr uint64_t line_total = large_insert_size / line_size + 1;
+    String8 paste{ .str = Arena::push_array_no_zero<char>(scratch.arena, line_total * line_size), .size = line_total * line_size };
+    for EachIndex(i, line_total)
+    {
+        snprintf(paste.str + i * line_size, line_size, "pasted %08zd", i);
+        paste.str[i * line_size + line_size - 1] = '\n';
+    }
+    tree->insert(CharOffset{ 6 }, paste);
+    assert(tree->mod_buffer_size() == Length{ 0 });
+    assert(tree->line_feed_count() == LFCount{ 2 + line_total });
+    assert(str8_match_exact(tree->get_line_content(scratch.arena, Line{ 2 + 1234 }), str8_mut(str8_literal("pasted 00001234"))));
+    // The copy left the caller's text alone.
+    paste.str[0] = '?';
+    assert(tree->at(CharOffset{ 6 }) == 'p');
+    paste.str[0] = 'p';
+
+    // Owned text is read in place.
+    static char owned_text[] = "owned\n";
+    tree->insert_owned(CharOffset{ 0 }, String8{ .str = owned_text, .size = sizeof(owned_text) - 1 });
+    assert(tree->mod_buffer_size() == Length{ 0 });
+
+    // Typing after the paste still goes to the mod buffer.
+    auto end = CharOffset{ 6 + 6 + paste.size };
+    tree->insert(end, str8_mut(str8_literal("typed")));
+    tree->insert(extend(end, 5), str8_mut(str8_literal("!")));
+    assert(tree->mod_buffer_size() == Length{ 6 });
+
+    String8List expected_lst{ };
+    str8_serial_begin(scratch.arena, &expected_lst);
+    str8_serial_push_str8(scratch.arena, &expected_lst, str8_mut(str8_literal("owned\nhello\n")));
+    str8_serial_push_str8(scratch.arena, &expected_lst, paste);
+    str8_serial_push_str8(scratch.arena, &expected_lst, str8_mut(str8_literal("typed!world\n")));
+    String8 expected = str8_serial_end(scratch.arena, expected_lst);
+    assert(str8_match_exact(buffer_contents(scratch.arena, tree), expected));
+    assume_buffer_snapshots(tree, expected, CharOffset{ }, __LINE__);
+    assert(tree->line_feed_count() == LFCount{ 3 + line_total });
+
+    // Each edit undoes on its own, back to the original text.
+    auto r = tree->try_undo(CharOffset{ });
+    assert(r.success);
+    assert(tree->length() == Length{ expected.size - 6 });
+    r = tree->try_undo(CharOffset{ });
+    assert(r.success);
+    assert(tree->at(CharOffset{ 6 }) == 'p' and tree->length() == Length{ 12 + paste.size });
+    r = tree->try_undo(CharOffset{ });
+    assert(r.success);
+    assert(str8_match_exact(buffer_contents(scratch.arena, tree), str8_mut(str8_literal("hello\nworld\n"))));
+    while (tree->try_redo(CharOffset{ }).success)
+    {
+    }
+    assert(str8_match_exact(buffer_contents(scratch.arena, tree), expected));
+
+    // Owned buffers are appended in place past the buffers a snapshot was taken with.
+    auto* snap = tree->owning_snap(scratch.arena);
+    static char owned_word[] = "w";
+    for EachIndex(i, 20)
+    {
+        tree->insert_owned(CharOffset{ 0 }, String8{ .str = owned_word, .size = 1 }, SuppressHistory::Yes);
+    }
+    assert(tree->length() == Length{ expected.size + 20 });
+    assert(str8_match_exact(tree->get_line_content(scratch.arena, Line{ 1 }), str8_mut(str8_literal("wwwwwwwwwwwwwwwwwwwwowned"))));
+    assert(str8_match_exact(snap->get_line_content(scratch.arena, Line{ 1 }), str8_mut(str8_literal("owned"))));
+    assert(str8_match_exact(snap->get_line_content(scratch.arena, Line{ 3 + 1234 }), str8_mut(str8_literal("pasted 00001234"))));
+    release_owning_snap(snap);
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test34()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Tree* trees[2];
+    build_tree_pair(trees, { "hello world\n", "the quick brown fox\njumps over\n" });
+    Tree* replaced = trees[0];
+    Tree* reference = trees[1];
+
+    replaced->replace(CharOffset{ 6 }, Length{ 5 }, str8_mut(str8_literal("there")));
+    assert(replaced->get_line_content(scratch.arena, Line{ 1 }).size == 11);
+    assert(replaced->at(CharOffset{ 6 }) == 't');
+    auto r = replaced->try_undo(CharOffset{ });
+    assert(r.success);
+    assert(replaced->at(CharOffset{ 6 }) == 'w');
+    r = replaced->try_undo(CharOffset{ });
+    assert(not r.success);
+    r = replaced->try_redo(CharOffset{ });
+    assert(r.success);
+    reference->remove(CharOffset{ 6 }, Length{ 5 });
+    reference->insert(CharOffset{ 6 }, str8_mut(str8_literal("there")), SuppressHistory::Yes);
+
+    // A replace reads and undoes like a remove followed by an insert recording no history.
+    const char* texts[] = { "a", "bc\n", "\n", "xyzzy", "lines\nand\nlines" };
+    for EachIndex(i, 300)
+    {
+        auto length = rep(reference->length());
+        uint64_t offset = (i * 7919) % (length + 1);
+        uint64_t count = (i * 31) % 9;
+        if (offset + count > length)
+        {
+            count = length - offset;
+        }
+        const char* text = texts[i % 5];
+        String8 txt{ .str = const_cast<char*>(text), .size = strlen(text) };
+        replaced->replace(CharOffset{ offset }, Length{ count }, txt);
+        if (count != 0)
+        {
+            reference->remove(CharOffset{ offset }, Length{ count });
+        }
+        reference->insert(CharOffset{ offset }, txt, count != 0 ? SuppressHistory::Yes : SuppressHistory::No);
+        assert(replaced->length() == reference->length());
+        assert(replaced->line_feed_count() == reference->line_feed_count());
+        if (i % 25 == 0)
+        {
+            assert(str8_match_exact(buffer_contents(scratch.arena, replaced), buffer_contents(scratch.arena, reference)));
+        }
+    }
+    assert(replaced->piece_count() <= reference->piece_count());
+    assume_same_history(replaced, reference);
+    release_tree(replaced);
+    release_tree(reference);
+    Arena::scratch_end(scratch);
+}
+
+// Checks a tree against a plain string edited the same way.
+void assume_model(const Tree* tree, const std::string& model, int locus = __builtin_LINE())
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    String8 buf = buffer_contents(scratch.arena, tree);
+    if (not str8_match_exact(buf, String8{ .str = const_cast<char*>(model.data()), .size = model.size() }))
+    {
+        fprintf(stderr, "buffer did not match the model. Line(%d)\n", locus);
+        assert(false);
+    }
+    size_t lf_count = 0;
+    for (char c : model)
+    {
+        lf_count += c == '\n';
+    }
+    assert(tree->line_feed_count() == LFCount{ lf_count });
+    Arena::scratch_end(scratch);
+}
+
+void test35()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("0123456789abcdef\n0123456789abcdef\n0123456789abcdef\n")));
+    Tree* tree = tree_builder_finish(&builder);
+    std::string model = "0123456789abcdef\n0123456789abcdef\n0123456789abcdef\n";
+
+    // Scattered inserts leave many pieces for the removals to span.
+    for EachIndex(i, 600)
+    {
+        char text[2] = { static_cast<char>('A' + i % 26), i % 7 == 0 ? '\n' : '-' };
+        uint64_t offset = (i * 7919) % (model.size() + 1);
+        tree->insert(CharOffset{ offset }, String8{ .str = text, .size = 2 });
+        model.insert(offset, text, 2);
+    }
+    assume_model(tree, model);
+    auto pieces = tree->piece_count();
+    assert(pieces > 600);
+
+    // Ranges in the middle, at either end, inside one piece and across many.
+    for EachIndex(i, 200)
+    {
+        uint64_t offset = (i * 104729) % model.size();
+        uint64_t count = i % 3 == 0 ? (i * 37) % 20 + 1 : 1 + (i % 3);
+        if (offset + count > model.size())
+        {
+            count = model.size() - offset;
+        }
+        tree->remove(CharOffset{ offset }, Length{ count });
+        model.erase(offset, count);
+        if (i % 20 == 0)
+        {
+            assume_model(tree, model);
+        }
+    }
+    assume_model(tree, model);
+
+    // The first half of the text goes in one edit, whatever the number of pieces.
+    auto half = model.size() / 2;
+    tree->remove(CharOffset{ }, Length{ half });
+    model.erase(0, half);
+    assume_model(tree, model);
+    assert(tree->piece_count() < pieces);
+    tree->remove(CharOffset{ 3 }, Length{ model.size() });
+    model.erase(3);
+    assume_model(tree, model);
+    while (tree->try_undo(CharOffset{ }).success)
+    {
+    }
+    assert(str8_match_exact(buffer_contents(scratch.arena, tree), str8_mut(str8_literal("0123456789abcdef\n0123456789abcdef\n0123456789abcdef\n"))));
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+void test36()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Arena::Arena* arena = Arena::alloc(Arena::default_params);
+    TreeBuilder builder = tree_builder_start(arena);
+    tree_builder_accept(arena, &builder, str8_mut(str8_literal("0123456789abcdef\n0123456789abcdef\n0123456789abcdef\n")));
+    Tree* tree = tree_builder_finish(&builder);
+    std::string model = "0123456789abcdef\n0123456789abcdef\n0123456789abcdef\n";
+
+    // Enough pieces for the cuts to reach through several levels of the tree.
+    for EachIndex(i, 400)
+    {
+        char text[3] = { static_cast<char>('A' + i % 26), static_cast<char>('a' + i % 26), i % 5 == 0 ? '\n' : '-' };
+        uint64_t offset = (i * 7919) % (model.size() + 1);
+        tree->insert(CharOffset{ offset }, String8{ .str = text, .size = 3 });
+        model.insert(offset, text, 3);
+    }
+    assume_model(tree, model);
+    std::string original = model;
+    auto mod_size = tree->mod_buffer_size();
+
+    // Spans of every size moved either way, cutting pieces anywhere.
+    uint64_t moves = 0;
+    for EachIndex(i, 200)
+    {
+        uint64_t from = (i * 104729) % model.size();
+        uint64_t count = i % 4 == 0 ? (i * 97) % 400 + 1 : (i * 13) % 9 + 1;
+        if (from + count > model.size())
+        {
+            count = model.size() - from;
+        }
+        uint64_t to = (i * 15485863) % (model.size() + 1);
+        tree->move_range(CharOffset{ from }, Length{ count }, CharOffset{ to });
+        if (to < from)
+        {
+            std::string span = model.substr(from, count);
+            model.erase(from, count);
+            model.insert(to, span);
+            ++moves;
+        }
+        else if (to > from + count)
+        {
+            std::string span = model.substr(from, count);
+            model.insert(to, span);
+            model.erase(from, count);
+            ++moves;
+        }
+        if (i % 20 == 0)
+        {
+            assume_model(tree, model);
+        }
+    }
+    assume_model(tree, model);
+    assert(moves > 100);
+    assert(tree->mod_buffer_size() == mod_size);
+
+    // Each move is one undo step.
+    for EachIndex(i, moves)
+    {
+        auto r = tree->try_undo(CharOffset{ });
+        assert(r.success);
+    }
+    model = original;
+    assume_model(tree, model);
+
+    // Folds move with their lines.
+    Arena::Arena* fold_arena = Arena::alloc(Arena::default_params);
+    builder = tree_builder_start(fold_arena);
+    tree_builder_accept(fold_arena, &builder, str8_mut(str8_literal("a\nb\nc\nd\ne\n")));
+    Tree* folded = tree_builder_finish(&builder);
+    folded->add_fold(Line{ 4 }, Line{ 5 });
+    folded->move_range(CharOffset{ 0 }, Length{ 2 }, CharOffset{ 6 });
+    assert(str8_match_exact(buffer_contents(scratch.arena, folded), str8_mut(str8_literal("b\nc\na\nd\ne\n"))));
+    assert(folded->fold_count() == 1);
+    assert(folded->fold_at(0).header == Line{ 4 } and folded->fold_at(0).last == Line{ 5 });
+    folded->move_range(CharOffset{ 0 }, Length{ 2 }, CharOffset{ 10 });
+    assert(str8_match_exact(buffer_contents(scratch.arena, folded), str8_mut(str8_literal("c\na\nd\ne\nb\n"))));
+    assert(folded->fold_count() == 1);
+    assert(folded->fold_at(0).header == Line{ 3 } and folded->fold_at(0).last == Line{ 4 });
+    release_tree(folded);
+    release_tree(tree);
+    Arena::scratch_end(scratch);
+}
+
+// Random edits, undo and moves with compaction and defragmentation in between, checked against a tree which only
+// edits and against a plain string.
+void test37()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    const char* texts[] = { "a", "bc\n", "\n", "xyzzy", "lines\nand\nlines", "0123456789" };
+    for (uint64_t seed = 1; seed <= 8; ++seed)
+    {
+        Tree* trees[2];
+        build_tree_pair(trees, { "the quick brown fox\n", "jumps over the lazy dog\n" }, 4);
+        Tree* tree = trees[0];
+        Tree* reference = trees[1];
+        String8 text = buffer_contents(scratch.arena, reference);
+        std::string model{ text.str, text.size };
+        uint64_t state = seed;
+        auto next = [&](uint64_t bound) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            return state % bound;
+        };
+        for EachIndex(i, 2000)
+        {
+            auto length = model.size();
+            uint64_t op = next(12);
+            if (op < 4)
+            {
+                const char* text = texts[next(sizeof texts / sizeof texts[0])];
+                uint64_t offset = next(length + 1);
+                for (Tree* t : trees)
+                {
+                    t->insert(CharOffset{ offset }, String8{ .str = const_cast<char*>(text), .size = strlen(text) });
+                }
+                model.insert(offset, text);
+            }
+            else if (op < 6 and length != 0)
+            {
+                uint64_t offset = next(length);
+                uint64_t count = 1 + next(length - offset < 12 ? length - offset : 12);
+                for (Tree* t : trees)
+                {
+                    t->remove(CharOffset{ offset }, Length{ count });
+                }
+                model.erase(offset, count);
+            }
+            else if (op == 6 and length != 0)
+            {
+                uint64_t from = next(length);
+                uint64_t count = 1 + next(length - from);
+                uint64_t to = next(length + 1);
+                for (Tree* t : trees)
+                {
+                    t->move_range(CharOffset{ from }, Length{ count }, CharOffset{ to });
+                }
+                if (to < from or to > from + count)
+                {
+                    std::string span = model.substr(from, count);
+                    model.erase(from, count);
+                    model.insert(to < from ? to : to - count, span);
+                }
+            }
+            else if (op == 7 or op == 8)
+            {
+                bool undo = op == 7;
+                auto r = undo ? reference->try_undo(CharOffset{ }) : reference->try_redo(CharOffset{ });
+                auto s = undo ? tree->try_undo(CharOffset{ }) : tree->try_redo(CharOffset{ });
+                assert(r.success == s.success);
+                text = buffer_contents(scratch.arena, reference);
+                model.assign(text.str, text.size);
+            }
+            else if (op == 9)
+            {
+                tree->defragment({ .copy_below = Length{ next(2) * 8 } });
+            }
+            else
+            {
+                // Steps small enough that a compaction spans several of the edits around it.
+                tree->compact_mod_buffer(1 + next(32));
+            }
+            assume_model(tree, model);
+        }
+        assume_model(reference, model);
+        while (not tree->compact_mod_buffer(UINT64_MAX).done)
+        {
+        }
+        assume_model(tree, model);
+        assume_same_history(tree, reference);
+        release_tree(tree);
+        release_tree(reference);
+    }
+    Arena::scratch_end(scratch);
+}
+
+void test38()
+{
+    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+    Tree* trees[2];
+    build_tree_pair(trees, { "first line\nsecond line\nthird line\n" });
+    // Every way of reading the tree sees the text still in the typing cache.
+    Tree* cached = trees[0];
+    Tree* direct = trees[1];
+    cached->set_typing_cache(true);
+    uint64_t cursor = 6;
+    auto type = [&]
+    {
+        auto mod_size = cached->mod_buffer_size();
+        for (Tree* tree : trees)
+        {
+            tree->insert(CharOffset{ cursor }, str8_mut(str8_literal("ab\n")));
+        }
+        cursor += 3;
+        assert(cached->mod_buffer_size() == mod_size);
+    };
+    auto same = [&]
+    {
+        String8 expected = buffer_contents(scratch.arena, direct);
+        type();
+        assert(str8_match_exact(buffer_contents(scratch.arena, cached), buffer_contents(scratch.arena, direct)));
+        assert(not str8_match_exact(buffer_contents(scratch.arena, cached), expected));
+    };
+
+    // Walkers.
+    same();
+    type();
+    {
+        String8 expected = buffer_contents(scratch.arena, direct);
+        ReverseTreeWalker rwalker{ scratch.arena, cached, retract(CharOffset{ expected.size }) };
+        for (uint64_t i = expected.size; i != 0; --i)
+        {
+            assert(rwalker.next() == expected.str[i - 1]);
+        }
+    }
+    type();
+    {
+        LineWalker walker{ scratch.arena, cached, StripCRLF::No, Line::Beginning };
+        for EachIndex(i, rep(direct->line_count()))
+        {
+            String8 expected = direct->get_line_content(scratch.arena, Line{ i + 1 });
+            String8View view = walker.next();
+            assert(view.size == expected.size);
+            assert(memcmp(view.str, expected.str, view.size) == 0);
+        }
+    }
+
+    // A cursor made before the typing.
+    {
+        TextCursor text_cursor{ cached, CharOffset{ cursor } };
+        type();
+        text_cursor.seek(CharOffset{ cursor });
+        assert(text_cursor.line() == direct->line_at(CharOffset{ cursor }));
+        assert(text_cursor.current() == direct->at(CharOffset{ cursor }));
+    }
+
+    // Snapshots.
+    type();
+    {
+        auto* snap = cached->owning_snap(scratch.arena);
+        assert(str8_match_exact(snap->get_range(scratch.arena, CharOffset{ }, direct->length()), buffer_contents(scratch.arena, direct)));
+        release_owning_snap(snap);
+    }
+    type();
+    {
+        auto ref = cached->ref_snap();
+        assert(str8_match_exact(ref.get_range(scratch.arena, CharOffset{ }, direct->length()), buffer_contents(scratch.arena, direct)));
+    }
+
+    // Queries.
+    type();
+    assert(str8_match_exact(cached->get_line_content(scratch.arena, Line{ 2 }), direct->get_line_content(scratch.arena, Line{ 2 })));
+    type();
+    assert(str8_match_exact(cached->get_range(scratch.arena, CharOffset{ 2 }, Length{ 20 }), direct->get_range(scratch.arena, CharOffset{ 2 }, Length{ 20 })));
+    type();
+    assert(cached->line_at(CharOffset{ cursor }) == direct->line_at(CharOffset{ cursor }));
+#if FRED_CODE_POINT_SUMMARY
+    type();
+    assert(cached->codepoint_count() == direct->codepoint_count());
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_LINE_EXTENT_SUMMARY
+    type();
+    assert(cached->max_line_length() == direct->max_line_length());
+#endif // FRED_LINE_EXTENT_SUMMARY
+#if FRED_HASH_SUMMARY
+    type();
+    assert(cached->hash_range(CharOffset{ }, cached->length()) == direct->hash_range(CharOffset{ }, direct->length()));
+#endif // FRED_HASH_SUMMARY
+
+    // A head holds the typed text, and snapping back to it drops what was typed since.
+    type();
+    {
+        auto head = cached->head();
+        auto direct_head = direct->head();
+        type();
+        cached->snap_to(head);
+        direct->snap_to(direct_head);
+        cursor -= 3;
+        same();
+    }
+
+    release_tree(cached);
+    release_tree(direct);
+    Arena::scratch_end(scratch);
+}
+
+int main()
+{
+    // Setup the scratch arenas.
+    constexpr int arena_size = 3;
+    Arena::Arena* scratch_arenas[arena_size];
+    // Generally, you only need two arenas to handle all conflicts.
+    scratch_arenas[0] = Arena::alloc(Arena::default_params);
+    scratch_arenas[1] = Arena::alloc(Arena::default_params);
+    scratch_arenas[2] = Arena::alloc(Arena::default_params);
+    Arena::populate_scratch_arenas({ scratch_arenas, arena_size });
+
+    test1();
+    printf("test1: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test2();
+    printf("test2: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test3();
+    printf("test3: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test4();
+    printf("test4: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test5();
+    printf("test5: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test6();
+    printf("test6: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test7();
+    printf("test7: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test8();
+    printf("test8: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test9();
+    printf("test9: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test10();
+    printf("test10: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test11();
+    printf("test11: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test12();
+    printf("test12: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test13();
+    printf("test13: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test14();
+    printf("test14: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test15();
+    printf("test15: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test16();
+    printf("test16: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test17();
+    printf("test17: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test18();
+    printf("test18: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test19();
+    printf("test19: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test20();
+    printf("test20: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+#if FRED_CODE_POINT_SUMMARY
+    test21();
+    printf("test21: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_CODE_POINT_SUMMARY && FRED_UTF16_SUMMARY
+    test22();
+    printf("test22: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+#endif // FRED_CODE_POINT_SUMMARY && FRED_UTF16_SUMMARY
+#if FRED_LINE_EXTENT_SUMMARY
+    test23();
+    printf("test23: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+#endif // FRED_LINE_EXTENT_SUMMARY
+#if FRED_BRACKET_SUMMARY
+    test24();
+    printf("test24: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_HASH_SUMMARY
+    test25();
+    printf("test25: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+#endif // FRED_HASH_SUMMARY
+#if FRED_WRAP_SUMMARY
+    test26();
+    printf("test26: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+#endif // FRED_WRAP_SUMMARY
+    test27();
+    printf("test27: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test28();
+    printf("test28: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test29();
+    printf("test29: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+    test30();
+    printf("test30: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test31();
+    printf("test31: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test32();
+    printf("test32: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test33();
+    printf("test33: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test34();
+    printf("test34: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test35();
+    printf("test35: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test36();
+    printf("test36: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test37();
+    printf("test37: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
+    alloc_count=0;dealloc_count=0;
+
+    test38();
+    printf("test38: allocs=%zd, deallocs=%zd\n", alloc_count, dealloc_count);
     alloc_count=0;dealloc_count=0;
 
 #ifdef TIMING_DATA
     time_buffer();
+    time_line_starts();
+    time_traversals();
 #endif // TIMING_DATA
 }
 
@@ -1,6 +1,9 @@
 #include "fredbuf.h"
 
 #include <cassert>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #include "enum-utils.h"
 #include "macros.h"
@@ -20,6 +23,26 @@ namespace PieceTree
         return LFCount{ rep(lhs) + rep(rhs) };
     }
 
+    constexpr CodePointCount operator+(CodePointCount lhs, CodePointCount rhs)
+    {
+        return CodePointCount{ rep(lhs) + rep(rhs) };
+    }
+
+    constexpr CodePointCount operator-(CodePointCount lhs, CodePointCount rhs)
+    {
+        return CodePointCount{ rep(lhs) - rep(rhs) };
+    }
+
+    constexpr Utf16Count operator+(Utf16Count lhs, Utf16Count rhs)
+    {
+        return Utf16Count{ rep(lhs) + rep(rhs) };
+    }
+
+    constexpr Utf16Count operator-(Utf16Count lhs, Utf16Count rhs)
+    {
+        return Utf16Count{ rep(lhs) - rep(rhs) };
+    }
+
     namespace
     {
         bool nil_node(const RBNodeCounted* node)
@@ -177,7 +200,7 @@ namespace PieceTree
                 const RedBlackTree& lft,
                 const NodeData& val,
                 const RedBlackTree& rgt)
-        : root_node(take_node_ref(make_node(blk, c, lft.root_node, attribute(val, lft), rgt.root_node)))
+        : root_node(take_node_ref(make_node(blk, c, lft.root_node, attribute(val, lft, rgt), rgt.root_node)))
     {
     }
 
@@ -196,6 +219,197 @@ namespace PieceTree
         return balance(blk, root_color(), left(), y, right().ins(blk, x, at, total_offset + y.left_subtree_length + y.piece.length));
     }
 
+    RedBlackTree RedBlackTree::replace(RBTreeBlock* blk, const NodeData& x, Offset at) const
+    {
+        return repl(blk, x, at, Offset{ 0 });
+    }
+
+    RedBlackTree RedBlackTree::split_insert(RBTreeBlock* blk, const NodeData& left, const NodeData& mid, const NodeData& right, Offset at) const
+    {
+        RedBlackTree t = split_ins(blk, left, mid, right, at, Offset{ 0 });
+        return RedBlackTree(blk, Color::Black, t.left(), t.root(), t.right());
+    }
+
+    RedBlackTree RedBlackTree::replace_pair(RBTreeBlock* blk, const NodeData& first, const NodeData& second, Offset at) const
+    {
+        RedBlackTree t = repl_pair(blk, first, second, at, Offset{ 0 });
+        return RedBlackTree(blk, Color::Black, t.left(), t.root(), t.right());
+    }
+
+    RedBlackTree RedBlackTree::repl(RBTreeBlock* blk, const NodeData& x, Offset at, Offset total_offset) const
+    {
+        assert(not is_empty());
+        // The shape of the tree does not change, so the path is copied with its colors.
+        const NodeData& y = root();
+        auto node_offset = total_offset + y.left_subtree_length;
+        if (at < node_offset)
+            return RedBlackTree(blk, root_color(), left().repl(blk, x, at, total_offset), y, right());
+        if (at < node_offset + y.piece.length)
+            return RedBlackTree(blk, root_color(), left(), x, right());
+        return RedBlackTree(blk, root_color(), left(), y, right().repl(blk, x, at, node_offset + y.piece.length));
+    }
+
+    // Inserting two nodes at once hangs a red pair where 'ins' would hang a single red node.  Below a black node the
+    // pair is a red node with a red child, which 'balance' already repairs.  A red node on the path is a leaf (its
+    // black height is 0), so it forms a red triple with the pair instead and its black parent rebalances that the same
+    // way it would a red node with a red child.
+    RedBlackTree RedBlackTree::red_triple(RBTreeBlock* blk, const NodeData& a, const NodeData& b, const NodeData& c)
+    {
+        return RedBlackTree(blk, Color::Red,
+                            RedBlackTree(blk, Color::Red, RedBlackTree(), a, RedBlackTree()),
+                            b,
+                            RedBlackTree(blk, Color::Red, RedBlackTree(), c, RedBlackTree()));
+    }
+
+    RedBlackTree RedBlackTree::ins_pair(RBTreeBlock* blk, const NodeData& x1, const NodeData& x2, Offset at, Offset total_offset) const
+    {
+        if (is_empty())
+            return RedBlackTree(blk, Color::Red, RedBlackTree(), x1, RedBlackTree(blk, Color::Red, RedBlackTree(), x2, RedBlackTree()));
+        const NodeData& y = root();
+        const bool go_left = at < total_offset + y.left_subtree_length + y.piece.length;
+        if (root_color() == Color::Red and (go_left ? left() : right()).is_empty())
+            return go_left ? red_triple(blk, x1, x2, y) : red_triple(blk, y, x1, x2);
+        if (go_left)
+            return balance(blk, root_color(), left().ins_pair(blk, x1, x2, at, total_offset), y, right());
+        return balance(blk, root_color(), left(), y, right().ins_pair(blk, x1, x2, at, total_offset + y.left_subtree_length + y.piece.length));
+    }
+
+    RedBlackTree RedBlackTree::split_ins(RBTreeBlock* blk, const NodeData& left_data, const NodeData& mid, const NodeData& right_data, Offset at, Offset total_offset) const
+    {
+        assert(not is_empty());
+        const NodeData& y = root();
+        auto node_offset = total_offset + y.left_subtree_length;
+        if (at < node_offset)
+            return balance(blk, root_color(), left().split_ins(blk, left_data, mid, right_data, at, total_offset), y, right());
+        if (not (at < node_offset + y.piece.length))
+            return balance(blk, root_color(), left(), y, right().split_ins(blk, left_data, mid, right_data, at, node_offset + y.piece.length));
+        // 'left_data' takes the place of the split piece and the other two become the first pieces of its right subtree.
+        if (root_color() == Color::Red and right().is_empty())
+            return red_triple(blk, left_data, mid, right_data);
+        return balance(blk, root_color(), left(), left_data, right().ins_pair(blk, mid, right_data, Offset{ 0 }, Offset{ 0 }));
+    }
+
+    RedBlackTree RedBlackTree::repl_pair(RBTreeBlock* blk, const NodeData& first, const NodeData& second, Offset at, Offset total_offset) const
+    {
+        assert(not is_empty());
+        const NodeData& y = root();
+        auto node_offset = total_offset + y.left_subtree_length;
+        if (at < node_offset)
+            return balance(blk, root_color(), left().repl_pair(blk, first, second, at, total_offset), y, right());
+        if (not (at < node_offset + y.piece.length))
+            return balance(blk, root_color(), left(), y, right().repl_pair(blk, first, second, at, node_offset + y.piece.length));
+        // 'first' takes the place of the piece and 'second' becomes the first piece of its right subtree, as a red node
+        // which the black node above repairs like any other insertion.
+        if (root_color() == Color::Red and right().is_empty())
+            return RedBlackTree(blk, Color::Red, left(), first, RedBlackTree(blk, Color::Red, RedBlackTree(), second, RedBlackTree()));
+        return balance(blk, root_color(), left(), first, right().ins(blk, second, Offset{ 0 }, Offset{ 0 }));
+    }
+
+    void RedBlackTree::split(RBTreeBlock* blk, Offset at, RedBlackTree* before, RedBlackTree* after) const
+    {
+        size_t before_height;
+        size_t after_height;
+        split_at(blk, at, Offset{ 0 }, black_height(*this), before, &before_height, after, &after_height);
+    }
+
+    void RedBlackTree::split_at(RBTreeBlock* blk, Offset at, Offset total_offset, size_t height, RedBlackTree* before, size_t* before_height, RedBlackTree* after, size_t* after_height) const
+    {
+        if (is_empty())
+        {
+            *before = RedBlackTree{ };
+            *after = RedBlackTree{ };
+            *before_height = 0;
+            *after_height = 0;
+            return;
+        }
+        // Each node on the path joins the side its piece falls on, so the joins along the way climb back up and their
+        // costs telescope to the height of the tree.
+        const NodeData& y = root();
+        auto node_offset = total_offset + y.left_subtree_length;
+        auto child_height = root_color() == Color::Black ? height - 1 : height;
+        RedBlackTree rest;
+        size_t rest_height;
+        if (at <= node_offset)
+        {
+            left().split_at(blk, at, total_offset, child_height, before, before_height, &rest, &rest_height);
+            *after = join(blk, rest, rest_height, y, right(), child_height, after_height);
+            return;
+        }
+        right().split_at(blk, at, node_offset + y.piece.length, child_height, &rest, &rest_height, after, after_height);
+        *before = join(blk, left(), child_height, y, rest, rest_height, before_height);
+    }
+
+    size_t RedBlackTree::black_height(const RedBlackTree& tree)
+    {
+        size_t height = 0;
+        for (const RBNodeCounted* node = tree.root_node; not nil_node(node); node = node->payload.left)
+        {
+            height += node->payload.color == Color::Black;
+        }
+        return height;
+    }
+
+    RedBlackTree RedBlackTree::join(RBTreeBlock* blk, const RedBlackTree& left, const NodeData& x, const RedBlackTree& right)
+    {
+        size_t height;
+        return join(blk, left, black_height(left), x, right, black_height(right), &height);
+    }
+
+    RedBlackTree RedBlackTree::join(RBTreeBlock* blk, const RedBlackTree& left, size_t left_height, const NodeData& x, const RedBlackTree& right, size_t right_height, size_t* height)
+    {
+        // Both sides join with black roots; the taller one is descended along its edge to a black node as high as the
+        // other side, where 'x' joins them as a red node and 'balance' repairs the path back up like an insertion.
+        // Painting a red root black adds one to the black height.
+        RedBlackTree lft = left.is_empty() or left.root_color() == Color::Black ? left.dup() : left.paint(blk, Color::Black);
+        RedBlackTree rgt = right.is_empty() or right.root_color() == Color::Black ? right.dup() : right.paint(blk, Color::Black);
+        left_height += not left.is_empty() and left.root_color() == Color::Red;
+        right_height += not right.is_empty() and right.root_color() == Color::Red;
+        if (left_height == right_height)
+        {
+            *height = left_height + 1;
+            return RedBlackTree(blk, Color::Black, lft, x, rgt);
+        }
+        RedBlackTree t = left_height > right_height ? join_right(blk, lft, x, rgt, left_height, right_height)
+                       : join_left(blk, lft, x, rgt, left_height, right_height);
+        *height = left_height > right_height ? left_height : right_height;
+        if (t.root_color() == Color::Black)
+            return t;
+        *height += 1;
+        return t.paint(blk, Color::Black);
+    }
+
+    RedBlackTree RedBlackTree::join(RBTreeBlock* blk, const RedBlackTree& left, const RedBlackTree& right)
+    {
+        if (left.is_empty())
+            return right.dup();
+        if (right.is_empty())
+            return left.dup();
+        // The first piece of 'right' joins the two.
+        const RBNodeCounted* first = right.root_node;
+        while (not nil_node(first->payload.left))
+        {
+            first = first->payload.left;
+        }
+        NodeData x = first->payload.data;
+        return join(blk, left, x, right.remove(blk, Offset{ 0 }));
+    }
+
+    RedBlackTree RedBlackTree::join_right(RBTreeBlock* blk, const RedBlackTree& left, const NodeData& x, const RedBlackTree& right, size_t left_height, size_t right_height)
+    {
+        if (left_height == right_height and (left.is_empty() or left.root_color() == Color::Black))
+            return RedBlackTree(blk, Color::Red, left, x, right);
+        auto child_height = left.root_color() == Color::Black ? left_height - 1 : left_height;
+        return balance(blk, left.root_color(), left.left(), left.root(), join_right(blk, left.right(), x, right, child_height, right_height));
+    }
+
+    RedBlackTree RedBlackTree::join_left(RBTreeBlock* blk, const RedBlackTree& left, const NodeData& x, const RedBlackTree& right, size_t left_height, size_t right_height)
+    {
+        if (left_height == right_height and (right.is_empty() or right.root_color() == Color::Black))
+            return RedBlackTree(blk, Color::Red, left, x, right);
+        auto child_height = right.root_color() == Color::Black ? right_height - 1 : right_height;
+        return balance(blk, right.root_color(), join_left(blk, left, x, right.left(), left_height, child_height), right.root(), right.right());
+    }
+
     RedBlackTree RedBlackTree::balance(RBTreeBlock* blk, Color c, const RedBlackTree& lft, const NodeData& x, const RedBlackTree& rgt)
     {
         if (c == Color::Black and lft.doubled_left())
@@ -261,6 +475,45 @@ namespace PieceTree
         return RedBlackTree(blk, c, left(), root(), right());
     }
 
+    RedBlackTree RedBlackTree::rewrite_pieces(RBTreeBlock* blk, PieceRewrite* rewrite) const
+    {
+        if (is_empty())
+            return RedBlackTree{ };
+        if (const void* copy = rewrite->copy_of(root_node))
+            return RedBlackTree(static_cast<const RBNodeCounted*>(copy));
+        RedBlackTree lft = left().rewrite_pieces(blk, rewrite);
+        RedBlackTree rgt = right().rewrite_pieces(blk, rewrite);
+        NodeData data = root();
+        bool changed = rewrite->apply(&data.piece);
+        RedBlackTree result = changed or lft.root_node != root_node->payload.left or rgt.root_node != root_node->payload.right
+                                ? RedBlackTree(blk, root_color(), lft, data, rgt)
+                                : dup();
+        rewrite->remember(root_node, result.root_node);
+        return result;
+    }
+
+    RedBlackTree RedBlackTree::construct_from(RBTreeBlock* blk, const NodeData* pieces, size_t count)
+    {
+        // The levels every path fills are black and the nodes below them red, so each path has the same number of
+        // black nodes and no red node has a child.
+        size_t black_depth = 0;
+        while ((size_t{ 2 } << black_depth) - 1 <= count)
+        {
+            ++black_depth;
+        }
+        return construct_range(blk, pieces, count, 0, black_depth);
+    }
+
+    RedBlackTree RedBlackTree::construct_range(RBTreeBlock* blk, const NodeData* pieces, size_t count, size_t depth, size_t black_depth)
+    {
+        if (count == 0)
+            return RedBlackTree{ };
+        size_t mid = (count - 1) / 2;
+        RedBlackTree lft = construct_range(blk, pieces, mid, depth + 1, black_depth);
+        RedBlackTree rgt = construct_range(blk, pieces + mid + 1, count - mid - 1, depth + 1, black_depth);
+        return RedBlackTree(blk, depth < black_depth ? Color::Black : Color::Red, lft, pieces[mid], rgt);
+    }
+
     PieceTree::Length tree_length(const RedBlackTree& root)
     {
         if (root.is_empty())
@@ -275,11 +528,34 @@ namespace PieceTree
         return root.root().left_subtree_lf_count + root.root().piece.newline_count + tree_lf_count(root.right());
     }
 
-    NodeData attribute(const NodeData& data, const RedBlackTree& left)
+    PieceTree::TreeSummary tree_summary(const RedBlackTree& root)
+    {
+        return root.root_ptr()->payload.data.subtree_summary;
+    }
+
+#if FRED_LINE_EXTENT_SUMMARY
+    LineExtent LineExtent::combine(const LineExtent& left, const LineExtent& right)
+    {
+        LineExtent result;
+        result.leading = left.has_lf ? left.leading : left.leading + right.leading;
+        result.trailing = right.has_lf ? right.trailing : left.trailing + right.trailing;
+        result.longest = rep(left.longest) < rep(right.longest) ? right.longest : left.longest;
+        // The line spanning the boundary is only complete when both sides end it with a LF.
+        if (left.has_lf and right.has_lf and rep(left.trailing + right.leading) > rep(result.longest))
+        {
+            result.longest = left.trailing + right.leading;
+        }
+        result.has_lf = left.has_lf or right.has_lf;
+        return result;
+    }
+#endif // FRED_LINE_EXTENT_SUMMARY
+
+    NodeData attribute(const NodeData& data, const RedBlackTree& left, const RedBlackTree& right)
     {
         auto new_data = data;
         new_data.left_subtree_length = tree_length(left);
         new_data.left_subtree_lf_count = tree_lf_count(left);
+        new_data.subtree_summary = TreeSummary::combine(TreeSummary::combine(tree_summary(left), data.piece.summary), tree_summary(right));
         return new_data;
     }
 
@@ -746,147 +1022,1166 @@ namespace PieceTree
             Arena::scratch_end(scratch);
         }
 
-        void compute_buffer_meta(BufferMeta* meta, const RedBlackTree& root)
-        {
-            meta->lf_count = tree_lf_count(root);
-            meta->total_content_length = tree_length(root);
-        }
+#if FRED_CODE_POINT_INDEX
+        constexpr uint64_t code_point_block_size = 256;
+#endif // FRED_CODE_POINT_INDEX
 
-        void append_mut_buf_start(BufferCollection* collection, LineStart start)
+#if FRED_CODE_POINT_SUMMARY
+        uint64_t count_code_points(const char* first, uint64_t size)
         {
-            LineStart* new_starts = Arena::push_array_no_zero_aligned<LineStart>(collection->mut_buf_starts_arena, 1, Arena::Alignment{ alignof(LineStart) });
-            LineStarts* starts = &collection->mod_buffer.line_starts;
-            assert(starts->starts + starts->count == new_starts);
-            new_starts[0] = start;
-            ++starts->count;
+            uint64_t count = 0;
+            for EachIndex(i, size)
+            {
+                // Every byte other than a continuation byte (10xxxxxx) begins a code point.
+                count += (static_cast<uint8_t>(first[i]) & 0xC0) != 0x80;
+            }
+            return count;
         }
+#endif // FRED_CODE_POINT_SUMMARY
 
-        void grow_mut_buf(BufferCollection* collection, uint64_t grow_by)
+#if FRED_UTF16_SUMMARY
+        uint64_t count_utf16_units(const char* first, uint64_t size)
         {
-            if (grow_by == 0)
-                return;
-            char* buf = Arena::push_array_no_zero_aligned<char>(collection->mut_buf_arena, grow_by, Arena::Alignment{ alignof(char) });
-            FRED_UNUSED(buf);
-            // When this buffer is created, it was originally designated a null-terminator slot at the beginning, so new buffers we
-            // allocate will need a null-terminator appended.
-            assert(collection->mod_buffer.buffer.str + collection->mod_buffer.buffer.size + 1 == buf);
-            // Note: We do not change the base of 'str', only its size.
-            collection->mod_buffer.buffer.size += grow_by;
-            // Append our null to the newly returned buffer piece.
-            collection->mod_buffer.buffer.str[collection->mod_buffer.buffer.size] = 0;
+            uint64_t count = 0;
+            for EachIndex(i, size)
+            {
+                auto b = static_cast<uint8_t>(first[i]);
+                // Four byte sequences (lead byte 11110xxx) are encoded as a surrogate pair.
+                count += ((b & 0xC0) != 0x80) + (b >= 0xF0);
+            }
+            return count;
         }
-    } // namespace [anon]
-
-    const CharBuffer* BufferCollection::buffer_at(BufferIndex index) const
-    {
-        if (index == BufferIndex::ModBuf)
-            return &mod_buffer;
-        return &orig_buffers.buffers[rep(index)];
-    }
+#endif // FRED_UTF16_SUMMARY
 
-    CharOffset BufferCollection::buffer_offset(BufferIndex index, const BufferCursor& cursor) const
-    {
-        LineStart* starts = buffer_at(index)->line_starts.starts;
-        return CharOffset{ rep(starts[rep(cursor.line)]) + rep(cursor.column) };
-    }
+#if FRED_HASH_SUMMARY
+        // Rolling hashes are computed modulo the Mersenne prime 2^61 - 1.
+        constexpr uint64_t hash_modulus = (uint64_t{ 1 } << 61) - 1;
+        constexpr uint64_t hash_base = 0x9E3779B97F4A7C15 % hash_modulus;
 
-    // Buffer collection management.
-    void dec_buffer_ref(BufferCollection* collection)
-    {
-        uint64_t count = os_atomic_u64_dec_eval(collection->orig_buffers.ref_count);
-        if (count == 0)
+        uint64_t hash_mul(uint64_t a, uint64_t b)
         {
-            // Note: The arena used to allocate nodes is the same one for the immutable buffers,
-            // so we do not need to release it.
-            Arena::release(collection->mut_buf_starts_arena);
-            Arena::release(collection->undo_redo_stack_arena);
-            Arena::release(collection->mut_buf_arena);
-            Arena::release(collection->immutable_buf_arena);
+#if defined(_MSC_VER)
+            uint64_t high;
+            uint64_t low = _umul128(a, b, &high);
+#else
+            auto product = static_cast<unsigned __int128>(a) * b;
+            auto low = static_cast<uint64_t>(product);
+            auto high = static_cast<uint64_t>(product >> 64);
+#endif
+            // 2^61 is 1 modulo the prime, so the bits above 61 fold back onto the low ones.
+            uint64_t result = (low & hash_modulus) + (low >> 61) + (high << 3);
+            result = (result & hash_modulus) + (result >> 61);
+            return result >= hash_modulus ? result - hash_modulus : result;
         }
-    }
 
-    BufferCollection take_buffer_ref(const BufferCollection* collection)
-    {
-        FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(collection->orig_buffers.ref_count));
-        return *collection;
-    }
+        uint64_t hash_add(uint64_t a, uint64_t b)
+        {
+            auto result = a + b;
+            return result >= hash_modulus ? result - hash_modulus : result;
+        }
 
-    Tree::Tree(BufferCollection buffers):
-        buffers{ buffers }
-    {
-        build_tree();
-    }
+        uint64_t hash_sub(uint64_t a, uint64_t b)
+        {
+            return a >= b ? a - b : a + hash_modulus - b;
+        }
 
-    void Tree::build_tree()
-    {
-        // First, take a reference to this immutable buffer set.
-        take_buffer_ref(&buffers);
-        // Note: The buffers were populated with valid array starts from the builder.
-        // In order to maintain the invariant of other buffers, the mod_buffer needs a single line-start of 0.
-        append_mut_buf_start(&buffers, {});
-        last_insert = { };
+        // 'hash_base' to the power 'n'.
+        uint64_t hash_power(uint64_t n)
+        {
+            uint64_t result = 1;
+            uint64_t square = hash_base;
+            for (; n != 0; n >>= 1)
+            {
+                if (n & 1)
+                {
+                    result = hash_mul(result, square);
+                }
+                square = hash_mul(square, square);
+            }
+            return result;
+        }
 
-        const auto buf_count = buffers.orig_buffers.count;
-        CharOffset offset = { };
-        for (size_t i = 0; i < buf_count; ++i)
+        // Extends 'hash' (of some text) by the bytes [first, first + size).
+        uint64_t hash_bytes(uint64_t hash, const char* first, uint64_t size)
         {
-            const CharBuffer* buf = &buffers.orig_buffers.buffers[i];
-            // Enforced by 'populate_line_starts'.
-            assert(buf->line_starts.count != 0);
-            // If this immutable buffer is empty, we can avoid creating a piece for it altogether.
-            if (buf->buffer.size == 0)
-                continue;
-            auto last_line = Line{ buf->line_starts.count - 1 };
-            // Create a new node that spans this buffer and retains an index to it.
-            // Insert the node into the balanced tree.
-            Piece piece {
-                .index = BufferIndex{ i },
-                .first = { .line = Line{ 0 }, .column = Column{ 0 } },
-                .last = { .line = last_line, .column = Column{ buf->buffer.size - rep(buf->line_starts.starts[rep(last_line)]) } },
-                .length = Length{ buf->buffer.size },
-                // Note: the number of newlines
-                .newline_count = LFCount{ rep(last_line) }
-            };
-            root = root.insert(buffers.rb_tree_blk, { piece }, offset);
-            offset = offset + piece.length;
+            for EachIndex(i, size)
+            {
+                // Offset by one so that leading NUL bytes still change the hash.
+                hash = hash_add(hash_mul(hash, hash_base), static_cast<uint8_t>(first[i]) + uint64_t{ 1 });
+            }
+            return hash;
         }
+#endif // FRED_HASH_SUMMARY
 
-        compute_buffer_meta();
-    }
+#if FRED_CODE_POINT_INDEX
+        // A copy of the first 'count' entries of 'blocks' in a new array of 'capacity' entries.
+        template <typename T>
+        T* grow_blocks(Arena::Arena* arena, const T* blocks, uint64_t count, uint64_t capacity)
+        {
+            T* result = Arena::push_array_no_zero<T>(arena, capacity);
+            if (count != 0)
+            {
+                memcpy(result, blocks, count * sizeof(T));
+            }
+            return result;
+        }
 
-    void Tree::internal_insert(CharOffset offset, String8 txt)
-    {
-        assert(txt.size != 0);
-        end_last_insert = extend(offset, txt.size);
-        ScopeGuard guard{ [&] {
-            compute_buffer_meta();
-#ifdef TEXTBUF_DEBUG
-            satisfies_rb_invariants(root);
-#endif // TEXTBUF_DEBUG
-        } };
-        if (root.is_empty())
+        // Extends 'index' to cover every block boundary of 'buf'.
+        void extend_code_point_index(Arena::Arena* arena, CodePointIndex* index, String8 buf)
         {
-            auto piece = build_piece(txt);
-            root = root.insert(buffers.rb_tree_blk, { piece }, CharOffset{ 0 });
-            return;
+            auto needed = buf.size / code_point_block_size + 1;
+            if (needed <= index->count)
+                return;
+            if (needed > index->capacity)
+            {
+                // The previous arrays are left intact since snapshots may still refer to them.
+                auto capacity = index->capacity * 2 < needed ? needed : index->capacity * 2;
+#if FRED_CODE_POINT_SUMMARY
+                index->blocks = grow_blocks(arena, index->blocks, index->count, capacity);
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+                index->utf16_blocks = grow_blocks(arena, index->utf16_blocks, index->count, capacity);
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+                index->hash_blocks = grow_blocks(arena, index->hash_blocks, index->count, capacity);
+#endif // FRED_HASH_SUMMARY
+                index->capacity = capacity;
+            }
+            if (index->count == 0)
+            {
+#if FRED_CODE_POINT_SUMMARY
+                index->blocks[0] = CodePointCount{ };
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+                index->utf16_blocks[0] = Utf16Count{ };
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+                index->hash_blocks[0] = 0;
+#endif // FRED_HASH_SUMMARY
+                index->count = 1;
+            }
+            for (uint64_t k = index->count; k < needed; ++k)
+            {
+                const char* block = buf.str + (k - 1) * code_point_block_size;
+#if FRED_CODE_POINT_SUMMARY
+                index->blocks[k] = extend(index->blocks[k - 1], count_code_points(block, code_point_block_size));
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+                index->utf16_blocks[k] = extend(index->utf16_blocks[k - 1], count_utf16_units(block, code_point_block_size));
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+                index->hash_blocks[k] = hash_bytes(index->hash_blocks[k - 1], block, code_point_block_size);
+#endif // FRED_HASH_SUMMARY
+            }
+            index->count = needed;
         }
+#endif // FRED_CODE_POINT_INDEX
 
-        auto result = node_at(&buffers, root.dup(), offset);
-        // If the offset is beyond the buffer, just select the last node.
-        if (result.node == nullptr)
+#if FRED_WRAP_SUMMARY
+        // Fills 'rows[k]' for lines k in [first, last) of 'buffer' from 'rows[first - 1]'.
+        void fill_wrap_rows(uint64_t* rows, uint64_t first, uint64_t last, const CharBuffer* buffer, uint64_t width)
         {
-            auto off = CharOffset{ 0 };
-            if (meta.total_content_length != Length{})
+            for (uint64_t k = first; k < last; ++k)
             {
-                off = off + retract(meta.total_content_length);
+                // Line k - 1 ends one byte before the start of line k.
+                auto length = rep(buffer->line_starts.starts[k]) - rep(buffer->line_starts.starts[k - 1]) - 1;
+                rows[k] = rows[k - 1] + WrapSummary::line_rows(Length{ length }, width);
             }
-            result = node_at(&buffers, root.dup(), off);
         }
 
-        // There are 3 cases:
-        // 1. We are inserting at the beginning of an existing node.
-        // 2. We are inserting at the end of an existing node.
-        // 3. We are inserting in the middle of the node.
+        // Extends the mod buffer rows of 'wrap' to the lines completed since the last call.
+        void extend_mod_wrap_rows(Arena::Arena* arena, WrapIndex* wrap, const CharBuffer* mod_buffer)
+        {
+            if (wrap == nullptr)
+                return;
+            auto needed = mod_buffer->line_starts.count;
+            if (needed <= wrap->mod_count)
+                return;
+            if (needed > wrap->mod_capacity)
+            {
+                // The previous array is left intact since snapshots may still refer to it.
+                auto capacity = wrap->mod_capacity * 2 < needed ? needed : wrap->mod_capacity * 2;
+                uint64_t* rows = Arena::push_array_no_zero<uint64_t>(arena, capacity);
+                if (wrap->mod_count != 0)
+                {
+                    memcpy(rows, wrap->mod_rows, wrap->mod_count * sizeof(uint64_t));
+                }
+                wrap->mod_rows = rows;
+                wrap->mod_capacity = capacity;
+            }
+            if (wrap->mod_count == 0)
+            {
+                wrap->mod_rows[0] = 0;
+                wrap->mod_count = 1;
+            }
+            fill_wrap_rows(wrap->mod_rows, wrap->mod_count, needed, mod_buffer, wrap->width);
+            wrap->mod_count = needed;
+        }
+
+        // Extends 'wrap' to the original buffers adopted and the mod buffer lines completed since it was last current.
+        void extend_wrap_rows(Arena::Arena* arena, WrapIndex* wrap, const BufferCollection* buffers)
+        {
+            auto count = buffers->orig_buffers.count;
+            if (count > wrap->capacity)
+            {
+                // The previous array is left intact since snapshots may still refer to it.
+                auto capacity = wrap->capacity * 2 < count ? count : wrap->capacity * 2;
+                uint64_t** rows = Arena::push_array_no_zero<uint64_t*>(arena, capacity);
+                if (wrap->count != 0)
+                {
+                    memcpy(rows, wrap->rows, wrap->count * sizeof(uint64_t*));
+                }
+                wrap->rows = rows;
+                wrap->capacity = capacity;
+            }
+            for (uint64_t i = wrap->count; i < count; ++i)
+            {
+                const CharBuffer* buffer = &buffers->orig_buffers.buffers[i];
+                wrap->rows[i] = Arena::push_array_no_zero<uint64_t>(arena, buffer->line_starts.count);
+                wrap->rows[i][0] = 0;
+                fill_wrap_rows(wrap->rows[i], 1, buffer->line_starts.count, buffer, wrap->width);
+            }
+            wrap->count = count;
+            extend_mod_wrap_rows(arena, wrap, &buffers->mod_buffer);
+        }
+
+        const uint64_t* wrap_rows(const WrapIndex* wrap, BufferIndex index)
+        {
+            return index == BufferIndex::ModBuf ? wrap->mod_rows : wrap->rows[rep(index)];
+        }
+#endif // FRED_WRAP_SUMMARY
+
+        // The line of mark 'mark' times two, plus one for a last line.
+        uint64_t mark_key(const FoldSet* set, uint64_t mark)
+        {
+            return set->marks[mark] + (mark < set->mark_gap ? 0 : 2 * set->shift);
+        }
+
+        uint64_t run_first_line(const FoldSet* set, uint64_t run)
+        {
+            return set->run_first[run] + (run < set->run_gap ? 0 : set->shift);
+        }
+
+        uint64_t run_header_line(const FoldSet* set, uint64_t run)
+        {
+            return set->run_header[run] + (run < set->run_gap ? 0 : set->shift);
+        }
+
+        Fold get_fold(const FoldSet* set, uint64_t index)
+        {
+            return { .header = Line{ mark_key(set, set->header_marks[index]) / 2 },
+                        .last = Line{ mark_key(set, set->last_marks[index]) / 2 },
+                        .collapsed = set->collapsed[index] };
+        }
+
+        // The first of the 'count' ascending values read through 'value' which is not below 'target'.
+        template <typename F>
+        uint64_t lower_bound_by(uint64_t count, uint64_t target, F value)
+        {
+            uint64_t first = 0;
+            while (count != 0)
+            {
+                auto half = count / 2;
+                if (value(first + half) < target)
+                {
+                    first += half + 1;
+                    count -= half + 1;
+                }
+                else
+                {
+                    count = half;
+                }
+            }
+            return first;
+        }
+
+        void rebuild_fold_runs(FoldSet* set)
+        {
+            uint64_t runs = 0;
+            uint64_t run_last = 0;
+            uint64_t hidden = 0;
+            for EachIndex(i, set->count)
+            {
+                if (not set->collapsed[i])
+                    continue;
+                const Fold fold = get_fold(set, i);
+                auto first = rep(fold.header) + 1;
+                // Folds nested in (or overlapping) the open run only extend it.
+                if (runs != 0 and first <= run_last + 1)
+                {
+                    run_last = rep(fold.last) > run_last ? rep(fold.last) : run_last;
+                    continue;
+                }
+                if (runs != 0)
+                {
+                    hidden += run_last - set->run_first[runs - 1] + 1;
+                }
+                set->run_first[runs] = first;
+                set->run_header[runs] = first - 1 - hidden;
+                set->hidden_before[runs] = hidden;
+                run_last = rep(fold.last);
+                ++runs;
+            }
+            if (runs != 0)
+            {
+                set->hidden_before[runs] = hidden + run_last - set->run_first[runs - 1] + 1;
+            }
+            set->run_count = runs;
+            set->run_gap = runs;
+        }
+
+        uint64_t hidden_lines(const FoldSet* set)
+        {
+            return set->run_count == 0 ? 0 : set->hidden_before[set->run_count];
+        }
+
+        // The index of the first fold whose header is not before 'header'.
+        uint64_t find_fold(const FoldSet* set, Line header)
+        {
+            return lower_bound_by(set->count, 2 * rep(header), [&](uint64_t i) { return mark_key(set, set->header_marks[i]); });
+        }
+
+        // Replaces the folds with 'folds', sorted by header, dropping those left without lines or sharing a header with
+        // the one before.  The set must have room for all of them.
+        void assign_folds(FoldSet* set, const Fold* folds, uint64_t count)
+        {
+            struct Mark
+            {
+                uint64_t key;
+                uint64_t fold;
+            };
+            Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+            Mark* marks = Arena::push_array_no_zero<Mark>(scratch.arena, 2 * count);
+            uint64_t kept = 0;
+            for EachIndex(i, count)
+            {
+                const Fold& fold = folds[i];
+                if (rep(fold.last) <= rep(fold.header) or (kept != 0 and marks[2 * kept - 2].key == 2 * rep(fold.header)))
+                    continue;
+                marks[2 * kept] = { .key = 2 * rep(fold.header), .fold = kept };
+                marks[2 * kept + 1] = { .key = 2 * rep(fold.last) + 1, .fold = kept };
+                set->collapsed[kept] = fold.collapsed;
+                ++kept;
+            }
+            std::sort(marks, marks + 2 * kept, [](const Mark& a, const Mark& b) { return a.key < b.key; });
+            for EachIndex(i, 2 * kept)
+            {
+                set->marks[i] = marks[i].key;
+                (marks[i].key % 2 == 0 ? set->header_marks : set->last_marks)[marks[i].fold] = i;
+            }
+            Arena::scratch_end(scratch);
+            set->count = kept;
+            set->mark_gap = 2 * kept;
+            set->shift = 0;
+            set->saved = nullptr;
+            rebuild_fold_runs(set);
+        }
+
+        // The folds in header order, as 'assign_folds' takes them.
+        Fold* copy_folds(Arena::Arena* arena, const FoldSet* set, uint64_t room)
+        {
+            Fold* folds = Arena::push_array_no_zero<Fold>(arena, room);
+            for EachIndex(i, set->count)
+            {
+                folds[i] = get_fold(set, i);
+            }
+            return folds;
+        }
+
+        void reserve_folds(FoldSet* set, uint64_t needed)
+        {
+            if (needed <= set->capacity)
+                return;
+            auto capacity = set->capacity * 2 < needed ? needed : set->capacity * 2;
+            if (set->arena == nullptr)
+            {
+                set->arena = Arena::alloc(Arena::default_params);
+            }
+            // The arena only holds the arrays, so they are set aside while it is cleared for the longer ones.
+            Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+            Fold* folds = copy_folds(scratch.arena, set, set->count);
+            Arena::clear(set->arena);
+            set->marks = Arena::push_array_no_zero<uint64_t>(set->arena, 2 * capacity);
+            set->header_marks = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->last_marks = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->collapsed = Arena::push_array_no_zero<bool>(set->arena, capacity);
+            // There is at most one run per fold.
+            set->run_first = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->run_header = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->hidden_before = Arena::push_array_no_zero<uint64_t>(set->arena, capacity + 1);
+            set->capacity = capacity;
+            auto saved = set->saved;
+            assign_folds(set, folds, set->count);
+            set->saved = saved;
+            Arena::scratch_end(scratch);
+        }
+
+        // Moves the gaps to 'mark_gap' and 'run_gap', storing the marks and runs crossing them at or before their place.
+        void move_fold_gaps(FoldSet* set, uint64_t mark_gap, uint64_t run_gap)
+        {
+            for (uint64_t i = mark_gap; i < set->mark_gap; ++i)
+            {
+                set->marks[i] -= 2 * set->shift;
+            }
+            for (uint64_t i = set->mark_gap; i < mark_gap; ++i)
+            {
+                set->marks[i] += 2 * set->shift;
+            }
+            for (uint64_t i = run_gap; i < set->run_gap; ++i)
+            {
+                set->run_first[i] -= set->shift;
+                set->run_header[i] -= set->shift;
+            }
+            for (uint64_t i = set->run_gap; i < run_gap; ++i)
+            {
+                set->run_first[i] += set->shift;
+                set->run_header[i] += set->shift;
+            }
+            set->mark_gap = mark_gap;
+            set->run_gap = run_gap;
+        }
+
+        // Moves the folds over an edit which replaced lines [first, first + removed] with 'inserted' + 1 lines.  Lines
+        // inside the removed ones collapse onto 'first' and a fold ending on the last edited line keeps all of it.  When
+        // 'first_moves' the edit began at the start of 'first', which moves down with the lines after it.
+        void edit_folds(FoldSet* set, Line first, uint64_t removed, uint64_t inserted, bool first_moves)
+        {
+            auto last = rep(first) + removed;
+            // The marks from 'boundary' on move by the lines the edit adds or removes and those from the line after
+            // 'first' up to it collapse onto 'first'.
+            auto boundary = 2 * last + (first_moves ? 0 : 1);
+            auto key_at = [&](uint64_t mark) { return mark_key(set, mark); };
+            auto moving = lower_bound_by(2 * set->count, boundary, key_at);
+            auto collapsing = lower_bound_by(2 * set->count, 2 * rep(first) + 2, key_at);
+            // Removing the lines of a fold which start on 'first' leaves it without lines.
+            auto emptied = false;
+            if (inserted == 0 and removed != 0)
+            {
+                auto at = find_fold(set, first);
+                emptied = at != set->count and get_fold(set, at).header == first and get_fold(set, at).last == Line{ last };
+            }
+            if (collapsing < moving or emptied)
+            {
+                auto move = [&](Line line, bool ends)
+                {
+                    if (rep(line) > last or ((ends or first_moves) and rep(line) == last))
+                        return Line{ rep(line) - removed + inserted };
+                    return rep(line) > rep(first) ? first : line;
+                };
+                Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+                Fold* folds = copy_folds(scratch.arena, set, set->count);
+                for EachIndex(i, set->count)
+                {
+                    folds[i].header = move(folds[i].header, false);
+                    folds[i].last = move(folds[i].last, true);
+                }
+                assign_folds(set, folds, set->count);
+                Arena::scratch_end(scratch);
+                return;
+            }
+            auto run = lower_bound_by(set->run_count, boundary, [&](uint64_t i) { return 2 * (run_first_line(set, i) - 1); });
+            // A collapsed fold reaching past the edit from before it grows or shrinks with it.
+            auto reaches = run != 0 and 2 * (run_first_line(set, run - 1) + set->hidden_before[run] - set->hidden_before[run - 1] - 1) + 1 >= boundary;
+            move_fold_gaps(set, moving, run);
+            set->shift += inserted - removed;
+            set->saved = nullptr;
+            if (reaches)
+            {
+                rebuild_fold_runs(set);
+            }
+        }
+
+        void drop_folds_past(FoldSet* set, Line last_line)
+        {
+            // The last mark is the greatest last line.
+            if (set->count == 0 or mark_key(set, 2 * set->count - 1) / 2 <= rep(last_line))
+                return;
+            Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+            Fold* folds = copy_folds(scratch.arena, set, set->count);
+            uint64_t count = 0;
+            for EachIndex(i, set->count)
+            {
+                if (rep(folds[i].last) <= rep(last_line))
+                {
+                    folds[count++] = folds[i];
+                }
+            }
+            assign_folds(set, folds, count);
+            Arena::scratch_end(scratch);
+        }
+
+        // The folds as they are now, copied only when they changed since the history last recorded them.
+        const FoldSnapshot* save_folds(Arena::Arena* arena, FoldSet* set)
+        {
+            if (set->count == 0)
+                return nullptr;
+            if (set->saved == nullptr)
+            {
+                FoldSnapshot* snapshot = Arena::push_array<FoldSnapshot>(arena, 1);
+                snapshot->folds = copy_folds(arena, set, set->count);
+                snapshot->count = set->count;
+                set->saved = snapshot;
+            }
+            return set->saved;
+        }
+
+        void restore_folds(FoldSet* set, const FoldSnapshot* snapshot)
+        {
+            if (snapshot == nullptr)
+            {
+                set->count = 0;
+                set->run_count = 0;
+                set->saved = nullptr;
+                return;
+            }
+            reserve_folds(set, snapshot->count);
+            assign_folds(set, snapshot->folds, snapshot->count);
+            set->saved = snapshot;
+        }
+
+#if FRED_CODE_POINT_SUMMARY
+        // The number of code points in the first 'offset' bytes of 'buffer'.
+        CodePointCount code_points_before(const CharBuffer* buffer, CharOffset offset)
+        {
+            auto block = rep(offset) / code_point_block_size;
+            auto block_start = block * code_point_block_size;
+            return extend(buffer->code_points.blocks[block], count_code_points(buffer->buffer.str + block_start, rep(offset) - block_start));
+        }
+
+        // Finds the offset in 'buffer' where code point 'codepoint' (counted from the start of the buffer) begins,
+        // without going past 'last'.
+        CharOffset code_point_offset(const CharBuffer* buffer, CodePointCount codepoint, CharOffset last)
+        {
+            const CodePointIndex& index = buffer->code_points;
+            // The last block boundary with at most 'codepoint' code points before it.
+            auto* past = branchless_lower_bound(index.blocks, index.blocks + index.count, extend(codepoint));
+            auto block = static_cast<uint64_t>(past - index.blocks) - 1;
+            auto seen = rep(index.blocks[block]);
+            auto offset = block * code_point_block_size;
+            for (; offset < rep(last); ++offset)
+            {
+                if ((static_cast<uint8_t>(buffer->buffer.str[offset]) & 0xC0) == 0x80)
+                    continue;
+                if (seen == rep(codepoint))
+                    break;
+                ++seen;
+            }
+            return CharOffset{ offset };
+        }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+        // The number of UTF-16 code units in the first 'offset' bytes of 'buffer'.
+        Utf16Count utf16_units_before(const CharBuffer* buffer, CharOffset offset)
+        {
+            auto block = rep(offset) / code_point_block_size;
+            auto block_start = block * code_point_block_size;
+            return extend(buffer->code_points.utf16_blocks[block], count_utf16_units(buffer->buffer.str + block_start, rep(offset) - block_start));
+        }
+
+        // Finds the offset in 'buffer' of the code point holding UTF-16 code unit 'units' (counted from the start of
+        // the buffer), without going past 'last'.
+        CharOffset utf16_unit_offset(const CharBuffer* buffer, Utf16Count units, CharOffset last)
+        {
+            const CodePointIndex& index = buffer->code_points;
+            auto* past = branchless_lower_bound(index.utf16_blocks, index.utf16_blocks + index.count, extend(units));
+            auto block = static_cast<uint64_t>(past - index.utf16_blocks) - 1;
+            auto seen = rep(index.utf16_blocks[block]);
+            auto offset = block * code_point_block_size;
+            for (; offset < rep(last); ++offset)
+            {
+                auto b = static_cast<uint8_t>(buffer->buffer.str[offset]);
+                if ((b & 0xC0) == 0x80)
+                    continue;
+                auto width = b >= 0xF0 ? 2 : 1;
+                if (seen + width > rep(units))
+                    break;
+                seen += width;
+            }
+            return CharOffset{ offset };
+        }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_HASH_SUMMARY
+        // The rolling hash of the first 'offset' bytes of 'buffer'.
+        uint64_t buffer_prefix_hash(const CharBuffer* buffer, uint64_t offset)
+        {
+            auto block = offset / code_point_block_size;
+            auto block_start = block * code_point_block_size;
+            return hash_bytes(buffer->code_points.hash_blocks[block], buffer->buffer.str + block_start, offset - block_start);
+        }
+
+        // The rolling hash of the bytes [first, last) of 'buffer'.
+        uint64_t buffer_hash(const CharBuffer* buffer, uint64_t first, uint64_t last)
+        {
+            auto before = hash_mul(buffer_prefix_hash(buffer, first), hash_power(last - first));
+            return hash_sub(buffer_prefix_hash(buffer, last), before);
+        }
+#endif // FRED_HASH_SUMMARY
+
+        // Line starts are sampled every 'line_start_sample_stride' entries so that a search over a large buffer
+        // touches a small top-level array followed by one contiguous block (256 bytes) of 'line_starts'.
+        constexpr uint64_t line_start_sample_stride = 32;
+        // Buffers with fewer lines than this are searched directly.
+        constexpr uint64_t line_start_sample_min_lines = line_start_sample_stride * 8;
+
+#if FRED_LINE_EXTENT_SUMMARY
+        // Maximum line lengths are grouped 32 lines (or 32 entries of the previous level) at a time.
+        constexpr uint64_t line_length_group = 32;
+
+        Length buffer_line_length(const CharBuffer* buffer, uint64_t line)
+        {
+            const LineStarts& starts = buffer->line_starts;
+            if (line + 1 == starts.count)
+                return Length{ buffer->buffer.size - rep(starts.starts[line]) };
+            // Exclude the LF.
+            return Length{ rep(starts.starts[line + 1]) - rep(starts.starts[line]) - 1 };
+        }
+
+        LineLengthIndex build_line_length_index(Arena::Arena* arena, const CharBuffer* buffer)
+        {
+            LineLengthIndex index{ };
+            if (buffer->line_starts.count < line_start_sample_min_lines)
+                return index;
+            uint64_t count = buffer->line_starts.count;
+            while (count > line_length_group and index.level_count < sizeof(index.levels) / sizeof(index.levels[0]))
+            {
+                auto level = index.level_count;
+                auto level_count = (count + line_length_group - 1) / line_length_group;
+                Length* entries = Arena::push_array<Length>(arena, level_count);
+                for EachIndex(i, count)
+                {
+                    auto value = level == 0 ? buffer_line_length(buffer, i) : index.levels[level - 1][i];
+                    Length* entry = &entries[i / line_length_group];
+                    *entry = rep(value) > rep(*entry) ? value : *entry;
+                }
+                index.levels[level] = entries;
+                index.counts[level] = level_count;
+                ++index.level_count;
+                count = level_count;
+            }
+            return index;
+        }
+
+        // The longest of the lines [first, last) of 'buffer'.
+        Length longest_buffer_line(const CharBuffer* buffer, uint64_t first, uint64_t last)
+        {
+            const LineLengthIndex& index = buffer->line_lengths;
+            size_t result = 0;
+            auto visit = [&](uint64_t level, uint64_t i)
+            {
+                auto length = rep(level == 0 ? buffer_line_length(buffer, i) : index.levels[level - 1][i]);
+                result = length > result ? length : result;
+            };
+            uint64_t level = 0;
+            while (first < last)
+            {
+                // Scan the unaligned ends of the range on this level and continue with the groups in between.
+                if (level == index.level_count or last - first < 2 * line_length_group)
+                {
+                    for (; first < last; ++first)
+                    {
+                        visit(level, first);
+                    }
+                    break;
+                }
+                for (; first % line_length_group != 0; ++first)
+                {
+                    visit(level, first);
+                }
+                for (; last % line_length_group != 0; --last)
+                {
+                    visit(level, last - 1);
+                }
+                first /= line_length_group;
+                last /= line_length_group;
+                ++level;
+            }
+            return Length{ result };
+        }
+#endif // FRED_LINE_EXTENT_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+        // Bracket nesting is indexed in blocks of 256 bytes, grouped 32 at a time on each following level.
+        constexpr uint64_t bracket_block_size = 256;
+        constexpr uint64_t bracket_group = 32;
+
+        constexpr BracketPairs default_bracket_pairs = { .pairs = { { '(', ')' }, { '[', ']' }, { '{', '}' } }, .count = 3 };
+
+        int32_t bracket_step(const BracketPair& pair, char c)
+        {
+            return (c == pair.open) - (c == pair.close);
+        }
+
+        BracketSummary scan_brackets(const BracketPairs& pairs, const char* first, uint64_t size)
+        {
+            BracketSummary result{ };
+            for EachIndex(i, size)
+            {
+                for EachIndex(p, pairs.count)
+                {
+                    BracketDepth& depth = result.depths[p];
+                    depth.delta += bracket_step(pairs.pairs[p], first[i]);
+                    depth.min = depth.delta < depth.min ? depth.delta : depth.min;
+                }
+            }
+            return result;
+        }
+
+        // Extends 'index' to cover every complete block of 'buf'.  Only the entries past the ones already indexed are
+        // computed, so appending to a buffer scans just the appended bytes.
+        void extend_bracket_index(Arena::Arena* arena, const BracketPairs& pairs, BracketIndex* index, String8 buf)
+        {
+            if (pairs.count == 0)
+                return;
+            uint64_t count = buf.size / bracket_block_size;
+            for (uint64_t level = 0; count != 0 and level < sizeof(index->levels) / sizeof(index->levels[0]); ++level)
+            {
+                auto have = level < index->level_count ? index->counts[level] : 0;
+                if (count > index->capacities[level])
+                {
+                    // The previous array is left intact since snapshots may still refer to it.
+                    auto capacity = index->capacities[level] * 2 < count ? count : index->capacities[level] * 2;
+                    BracketSummary* entries = Arena::push_array_no_zero<BracketSummary>(arena, capacity);
+                    if (have != 0)
+                    {
+                        memcpy(entries, index->levels[level], have * sizeof(BracketSummary));
+                    }
+                    index->levels[level] = entries;
+                    index->capacities[level] = capacity;
+                }
+                BracketSummary* entries = index->levels[level];
+                for (uint64_t i = have; i < count; ++i)
+                {
+                    if (level == 0)
+                    {
+                        entries[i] = scan_brackets(pairs, buf.str + i * bracket_block_size, bracket_block_size);
+                        continue;
+                    }
+                    entries[i] = BracketSummary{ };
+                    for EachIndex(j, bracket_group)
+                    {
+                        entries[i] = BracketSummary::combine(entries[i], index->levels[level - 1][i * bracket_group + j]);
+                    }
+                }
+                index->counts[level] = count;
+                index->level_count = level < index->level_count ? index->level_count : level + 1;
+                count /= bracket_group;
+            }
+        }
+
+        BracketIndex build_bracket_index(Arena::Arena* arena, const BracketPairs& pairs, String8 buf)
+        {
+            BracketIndex index{ };
+            if (buf.size / bracket_block_size >= bracket_group)
+            {
+                extend_bracket_index(arena, pairs, &index, buf);
+            }
+            return index;
+        }
+
+        // A copy of 'index' which stays valid after the indexed buffer is rewritten in place.
+        BracketIndex copy_bracket_index(Arena::Arena* arena, const BracketIndex& index)
+        {
+            BracketIndex result = index;
+            for EachIndex(level, index.level_count)
+            {
+                result.levels[level] = Arena::push_array_no_zero<BracketSummary>(arena, index.counts[level]);
+                memcpy(result.levels[level], index.levels[level], index.counts[level] * sizeof(BracketSummary));
+                result.capacities[level] = index.counts[level];
+            }
+            return result;
+        }
+
+        uint64_t bracket_span_size(uint64_t level)
+        {
+            uint64_t size = bracket_block_size;
+            for (; level != 0; --level)
+            {
+                size *= bracket_group;
+            }
+            return size;
+        }
+
+        // The number of index levels holding a span which starts at 'first' and ends by 'last'.
+        uint64_t bracket_levels_from(const BracketIndex& index, uint64_t first, uint64_t last)
+        {
+            uint64_t levels = 0;
+            uint64_t size = bracket_block_size;
+            while (levels < index.level_count and first % size == 0 and first + size <= last and first / size < index.counts[levels])
+            {
+                ++levels;
+                size *= bracket_group;
+            }
+            return levels;
+        }
+
+        // The number of index levels holding a span which ends at 'last' and starts at or after 'first'.
+        uint64_t bracket_levels_to(const BracketIndex& index, uint64_t first, uint64_t last)
+        {
+            uint64_t levels = 0;
+            uint64_t size = bracket_block_size;
+            while (levels < index.level_count and last % size == 0 and last - first >= size and last / size <= index.counts[levels])
+            {
+                ++levels;
+                size *= bracket_group;
+            }
+            return levels;
+        }
+
+        // Summarizes the bytes [first, last) of 'buffer'.
+        BracketSummary buffer_brackets(const BracketPairs& pairs, const CharBuffer* buffer, uint64_t first, uint64_t last)
+        {
+            const BracketIndex& index = buffer->brackets;
+            BracketSummary result{ };
+            while (first < last)
+            {
+                auto levels = bracket_levels_from(index, first, last);
+                if (levels != 0)
+                {
+                    auto size = bracket_span_size(levels - 1);
+                    result = BracketSummary::combine(result, index.levels[levels - 1][first / size]);
+                    first += size;
+                    continue;
+                }
+                auto next = (first / bracket_block_size + 1) * bracket_block_size;
+                next = next < last ? next : last;
+                result = BracketSummary::combine(result, scan_brackets(pairs, buffer->buffer.str + first, next - first));
+                first = next;
+            }
+            return result;
+        }
+
+        // Finds the first byte of [first, last) in 'buffer' after which the depth of bracket pair 'pair', which is
+        // '*depth' before 'first', is at most 'target'.  If there is none, '*depth' is advanced to 'last'.
+        CharOffset find_bracket_forward(const BracketPairs& pairs, uint64_t pair, const CharBuffer* buffer, uint64_t first, uint64_t last, int64_t* depth, int64_t target)
+        {
+            const BracketIndex& index = buffer->brackets;
+            while (first < last)
+            {
+                // Skip the largest indexed span which cannot hold the byte.
+                auto levels = bracket_levels_from(index, first, last);
+                bool skipped = false;
+                while (levels != 0 and not skipped)
+                {
+                    --levels;
+                    auto size = bracket_span_size(levels);
+                    const BracketDepth& span = index.levels[levels][first / size].depths[pair];
+                    if (*depth + span.min > target)
+                    {
+                        *depth += span.delta;
+                        first += size;
+                        skipped = true;
+                    }
+                }
+                if (skipped)
+                    continue;
+                *depth += bracket_step(pairs.pairs[pair], buffer->buffer.str[first]);
+                if (*depth <= target)
+                    return CharOffset{ first };
+                ++first;
+            }
+            return CharOffset::Sentinel;
+        }
+
+        // Finds the last byte of [first, last) in 'buffer' before which the depth of bracket pair 'pair', which is
+        // '*depth' at 'last', is at most 'target'.  If there is none, '*depth' is moved back to 'first'.
+        CharOffset find_bracket_backward(const BracketPairs& pairs, uint64_t pair, const CharBuffer* buffer, uint64_t first, uint64_t last, int64_t* depth, int64_t target)
+        {
+            const BracketIndex& index = buffer->brackets;
+            while (first < last)
+            {
+                auto levels = bracket_levels_to(index, first, last);
+                bool skipped = false;
+                while (levels != 0 and not skipped)
+                {
+                    --levels;
+                    auto size = bracket_span_size(levels);
+                    const BracketDepth& span = index.levels[levels][last / size - 1].depths[pair];
+                    if (*depth - span.delta + span.min > target)
+                    {
+                        *depth -= span.delta;
+                        last -= size;
+                        skipped = true;
+                    }
+                }
+                if (skipped)
+                    continue;
+                --last;
+                *depth -= bracket_step(pairs.pairs[pair], buffer->buffer.str[last]);
+                if (*depth <= target)
+                    return CharOffset{ last };
+            }
+            return CharOffset::Sentinel;
+        }
+
+        // Searches the bytes [first, last) of the document which lie in 'piece', starting at 'start', as above.
+        CharOffset piece_bracket_forward(const BufferCollection* buffers, const Piece& piece, uint64_t start, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
+        {
+            auto end = start + rep(piece.length);
+            first = first > start ? first : start;
+            last = last < end ? last : end;
+            if (first >= last)
+                return CharOffset::Sentinel;
+            const BracketDepth& span = piece.summary.depths[pair];
+            if (first == start and last == end and *depth + span.min > target)
+            {
+                *depth += span.delta;
+                return CharOffset::Sentinel;
+            }
+            auto base = rep(buffers->buffer_offset(piece.index, piece.first));
+            auto found = find_bracket_forward(buffers->bracket_pairs, pair, buffers->buffer_at(piece.index), base + first - start, base + last - start, depth, target);
+            if (found == CharOffset::Sentinel)
+                return found;
+            return CharOffset{ start + rep(found) - base };
+        }
+
+        CharOffset piece_bracket_backward(const BufferCollection* buffers, const Piece& piece, uint64_t start, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
+        {
+            auto end = start + rep(piece.length);
+            first = first > start ? first : start;
+            last = last < end ? last : end;
+            if (first >= last)
+                return CharOffset::Sentinel;
+            const BracketDepth& span = piece.summary.depths[pair];
+            if (first == start and last == end and *depth - span.delta + span.min > target)
+            {
+                *depth -= span.delta;
+                return CharOffset::Sentinel;
+            }
+            auto base = rep(buffers->buffer_offset(piece.index, piece.first));
+            auto found = find_bracket_backward(buffers->bracket_pairs, pair, buffers->buffer_at(piece.index), base + first - start, base + last - start, depth, target);
+            if (found == CharOffset::Sentinel)
+                return found;
+            return CharOffset{ start + rep(found) - base };
+        }
+#endif // FRED_BRACKET_SUMMARY
+
+        LineStarts sample_line_starts(Arena::Arena* arena, const LineStarts& starts)
+        {
+            LineStarts result{};
+            if (starts.count < line_start_sample_min_lines)
+                return result;
+            result.count = (starts.count + line_start_sample_stride - 1) / line_start_sample_stride;
+            result.starts = Arena::push_array_no_zero<LineStart>(arena, result.count);
+            for EachIndex(i, result.count)
+            {
+                result.starts[i] = starts.starts[i * line_start_sample_stride];
+            }
+            return result;
+        }
+
+        // Finds the line in [low, high] which contains 'offset' using the sampled index of 'buffer'.
+        size_t sampled_line_search(const CharBuffer* buffer, size_t low, size_t high, size_t offset)
+        {
+            const LineStarts& starts = buffer->line_starts;
+            const LineStarts& samples = buffer->line_start_samples;
+            // The first sample past 'offset' ends the block we are interested in.  Since 'starts[low] <= offset', the
+            // sample for 'low' is never past it.
+            auto* first_sample = samples.starts + low / line_start_sample_stride;
+            auto* last_sample = samples.starts + high / line_start_sample_stride + 1;
+            auto* past = branchless_lower_bound(first_sample + 1, last_sample, LineStart{ offset + 1 });
+            auto first = static_cast<size_t>(past - samples.starts - 1) * line_start_sample_stride;
+            auto last = first + line_start_sample_stride < starts.count ? first + line_start_sample_stride : starts.count;
+            // Counting rather than searching keeps the block scan branch-free so it can be vectorized.
+            size_t line = first;
+            for (size_t i = first + 1; i < last; ++i)
+            {
+                line += rep(starts.starts[i]) <= offset;
+            }
+            return line < high ? line : high;
+        }
+
+        void compute_buffer_meta(BufferMeta* meta, const RedBlackTree& root)
+        {
+            meta->lf_count = tree_lf_count(root);
+            meta->total_content_length = tree_length(root);
+            meta->summary = tree_summary(root);
+        }
+
+        void append_mut_buf_start(BufferCollection* collection, LineStart start)
+        {
+            LineStart* new_starts = Arena::push_array_no_zero_aligned<LineStart>(collection->mut_buf_starts_arena, 1, Arena::Alignment{ alignof(LineStart) });
+            LineStarts* starts = &collection->mod_buffer.line_starts;
+            assert(starts->starts + starts->count == new_starts);
+            new_starts[0] = start;
+            ++starts->count;
+        }
+
+        void grow_mut_buf(BufferCollection* collection, uint64_t grow_by)
+        {
+            if (grow_by == 0)
+                return;
+            char* buf = Arena::push_array_no_zero_aligned<char>(collection->mut_buf_arena, grow_by, Arena::Alignment{ alignof(char) });
+            FRED_UNUSED(buf);
+            // When this buffer is created, it was originally designated a null-terminator slot at the beginning, so new buffers we
+            // allocate will need a null-terminator appended.
+            assert(collection->mod_buffer.buffer.str + collection->mod_buffer.buffer.size + 1 == buf);
+            // Note: We do not change the base of 'str', only its size.
+            collection->mod_buffer.buffer.size += grow_by;
+            // Append our null to the newly returned buffer piece.
+            collection->mod_buffer.buffer.str[collection->mod_buffer.buffer.size] = 0;
+        }
+    } // namespace [anon]
+
+    const CharBuffer* BufferCollection::buffer_at(BufferIndex index) const
+    {
+        if (index == BufferIndex::ModBuf)
+            return &mod_buffer;
+        return &orig_buffers.buffers[rep(index)];
+    }
+
+    CharOffset BufferCollection::buffer_offset(BufferIndex index, const BufferCursor& cursor) const
+    {
+        LineStart* starts = buffer_at(index)->line_starts.starts;
+        return CharOffset{ rep(starts[rep(cursor.line)]) + rep(cursor.column) };
+    }
+
+    // Buffer collection management.
+    void dec_buffer_ref(BufferCollection* collection)
+    {
+        uint64_t count = os_atomic_u64_dec_eval(collection->orig_buffers.ref_count);
+        if (count == 0)
+        {
+            // Note: The arena used to allocate nodes is the same one for the immutable buffers,
+            // so we do not need to release it.
+            Arena::release(collection->mut_buf_starts_arena);
+            Arena::release(collection->undo_redo_stack_arena);
+            Arena::release(collection->mut_buf_arena);
+            Arena::release(collection->immutable_buf_arena);
+        }
+    }
+
+    BufferCollection take_buffer_ref(const BufferCollection* collection)
+    {
+        FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(collection->orig_buffers.ref_count));
+        return *collection;
+    }
+
+    namespace
+    {
+        // Reference snapshots read the mod buffer in place, so they hold a pin which compaction waits for.
+        BufferCollection pin_buffers(const BufferCollection* collection)
+        {
+            FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(collection->mod_buffer_pins));
+            return take_buffer_ref(collection);
+        }
+
+        void unpin_buffers(BufferCollection* collection)
+        {
+            FRED_UNUSED_RESULT(os_atomic_u64_dec_eval(collection->mod_buffer_pins));
+            dec_buffer_ref(collection);
+        }
+    } // namespace [anon]
+
+    Tree::Tree(BufferCollection buffers):
+        buffers{ buffers }
+    {
+        build_tree();
+    }
+
+    Tree::~Tree()
+    {
+        // A compaction in progress keeps the history it began with pinned.
+        if (compaction.arena != nullptr)
+        {
+            for EachIndex(i, compaction.pinned_count)
+            {
+                dec_node_ref(compaction.pinned[i]);
+            }
+            Arena::release(compaction.arena);
+        }
+        if (folds.arena != nullptr)
+        {
+            Arena::release(folds.arena);
+        }
+        for EachNode(entry, buffers.heads->first)
+        {
+            entry->~HeadEntry();
+        }
+    }
+
+    void Tree::build_tree()
+    {
+        // First, take a reference to this immutable buffer set.
+        take_buffer_ref(&buffers);
+        // Note: The buffers were populated with valid array starts from the builder.
+        // In order to maintain the invariant of other buffers, the mod_buffer needs a single line-start of 0.
+        append_mut_buf_start(&buffers, {});
+        last_insert = { };
+
+        const auto buf_count = buffers.orig_buffers.count;
+        CharOffset offset = { };
+        for (size_t i = 0; i < buf_count; ++i)
+        {
+            const CharBuffer* buf = &buffers.orig_buffers.buffers[i];
+            // Enforced by 'populate_line_starts'.
+            assert(buf->line_starts.count != 0);
+            // If this immutable buffer is empty, we can avoid creating a piece for it altogether.
+            if (buf->buffer.size == 0)
+                continue;
+            auto last_line = Line{ buf->line_starts.count - 1 };
+            // Create a new node that spans this buffer and retains an index to it.
+            // Insert the node into the balanced tree.
+            Piece piece {
+                .index = BufferIndex{ i },
+                .first = { .line = Line{ 0 }, .column = Column{ 0 } },
+                .last = { .line = last_line, .column = Column{ buf->buffer.size - rep(buf->line_starts.starts[rep(last_line)]) } },
+                .length = Length{ buf->buffer.size },
+                // Note: the number of newlines
+                .newline_count = LFCount{ rep(last_line) }
+            };
+            piece.summary = TreeSummary::of(&buffers, piece);
+            root = root.insert(buffers.rb_tree_blk, { piece }, offset);
+            offset = offset + piece.length;
+        }
+
+        compute_buffer_meta();
+    }
+
+    void Tree::internal_insert(CharOffset offset, String8 txt, AdoptBuffer adopt)
+    {
+        assert(txt.size != 0);
+        end_last_insert = extend(offset, txt.size);
+        // Adopted text is a buffer of its own, so it never extends the piece typed last.
+        auto make_piece = [&] { return is_yes(adopt) ? adopted_piece(txt) : build_piece(txt); };
+        ScopeGuard guard{ [&] {
+            // The folds move by the line feeds the edit adds, counted against 'meta' before it is updated.  The text
+            // before 'offset' is unchanged, so its line is found in the new tree.
+            if (folds.count != 0 and rep(tree_lf_count(root)) != rep(meta.lf_count))
+            {
+                bool line_moves = false;
+                auto fold_line = edit_line(offset, &line_moves);
+                edit_folds(&folds, fold_line, 0, rep(tree_lf_count(root)) - rep(meta.lf_count), line_moves);
+            }
+            compute_buffer_meta();
+#ifdef TEXTBUF_DEBUG
+            satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
+        } };
+        if (root.is_empty())
+        {
+            auto piece = make_piece();
+            root = root.insert(buffers.rb_tree_blk, { piece }, CharOffset{ 0 });
+            return;
+        }
+
+        auto result = node_at(&buffers, root.dup(), offset);
+        // If the offset is beyond the buffer, just select the last node.
+        if (result.node == nullptr)
+        {
+            auto off = CharOffset{ 0 };
+            if (meta.total_content_length != Length{})
+            {
+                off = off + retract(meta.total_content_length);
+            }
+            result = node_at(&buffers, root.dup(), off);
+        }
+
+        // There are 3 cases:
+        // 1. We are inserting at the beginning of an existing node.
+        // 2. We are inserting at the end of an existing node.
+        // 3. We are inserting in the middle of the node.
         auto [node, remainder, node_start_offset, line] = result;
         assert(node != nullptr);
         auto insert_pos = buffer_position(&buffers, node->piece, remainder);
@@ -904,15 +2199,16 @@ namespace PieceTree
             if (offset != CharOffset{})
             {
                 auto prev_node_result = node_at(&buffers, root.dup(), retract(offset));
-                if (prev_node_result.node->piece.index == BufferIndex::ModBuf
+                if (is_no(adopt)
+                    and prev_node_result.node->piece.index == BufferIndex::ModBuf
                     and prev_node_result.node->piece.last == last_insert)
                 {
-                    auto new_piece = build_piece(txt);
+                    auto new_piece = make_piece();
                     combine_pieces(prev_node_result, new_piece);
                     return;
                 }
             }
-            auto piece = build_piece(txt);
+            auto piece = make_piece();
             root = root.insert(buffers.rb_tree_blk, { piece }, offset);
             return;
         }
@@ -929,14 +2225,14 @@ namespace PieceTree
             // 2. Remove the old piece.
             // 3. Extend the old piece's length to the length of the newly created piece.
             // 4. Re-insert the new piece.
-            if (node->piece.index == BufferIndex::ModBuf and node->piece.last == last_insert)
+            if (is_no(adopt) and node->piece.index == BufferIndex::ModBuf and node->piece.last == last_insert)
             {
-                auto new_piece = build_piece(txt);
+                auto new_piece = make_piece();
                 combine_pieces(result, new_piece);
                 return;
             }
             // Insert the new piece at the end.
-            auto piece = build_piece(txt);
+            auto piece = make_piece();
             root = root.insert(buffers.rb_tree_blk, { piece }, offset);
             return;
         }
@@ -950,31 +2246,29 @@ namespace PieceTree
         new_piece_right.first = insert_pos;
         new_piece_right.length = new_len_right;
         new_piece_right.newline_count = line_feed_count(&buffers, node->piece.index, insert_pos, node->piece.last);
+        new_piece_right.summary = TreeSummary::of(&buffers, new_piece_right);
 
         // Remove the original node tail.
         auto new_piece_left = trim_piece_right(&buffers, node->piece, insert_pos);
 
-        auto new_piece = build_piece(txt);
-
-        // Remove the original node.
-        root = root.remove(buffers.rb_tree_blk, node_start_offset);
-
-        // Insert the left.
-        root = root.insert(buffers.rb_tree_blk, { new_piece_left }, node_start_offset);
+        auto new_piece = make_piece();
 
-        // Insert the new mid.
-        node_start_offset = node_start_offset + new_piece_left.length;
-        root = root.insert(buffers.rb_tree_blk, { new_piece }, node_start_offset);
-
-        // Insert remainder.
-        node_start_offset = node_start_offset + new_piece.length;
-        root = root.insert(buffers.rb_tree_blk, { new_piece_right }, node_start_offset);
+        // Replace the original node by the left and insert the new mid and the remainder after it.
+        root = root.split_insert(buffers.rb_tree_blk, { new_piece_left }, { new_piece }, { new_piece_right }, node_start_offset);
     }
 
     void Tree::internal_remove(CharOffset offset, Length count)
     {
         assert(rep(count) != 0 and not root.is_empty());
         ScopeGuard guard{ [&] {
+            // The folds move by the line feeds the edit removes, counted against 'meta' before it is updated.  The
+            // text before 'offset' is unchanged, so its line is found in the new tree.
+            if (folds.count != 0 and rep(tree_lf_count(root)) != rep(meta.lf_count))
+            {
+                bool starts_line = false;
+                auto fold_line = edit_line(offset, &starts_line);
+                edit_folds(&folds, fold_line, rep(meta.lf_count) - rep(tree_lf_count(root)), 0, false);
+            }
             compute_buffer_meta();
 #ifdef TEXTBUF_DEBUG
             satisfies_rb_invariants(root);
@@ -1030,40 +2324,145 @@ namespace PieceTree
             return;
         }
 
-        // Traverse nodes and delete all nodes within the offset range. First we will build the
-        // partial pieces for the nodes that will eventually make up this range.
-        // There are four cases here:
-        // 1. The entire first node is deleted as well as all of the last node.
-        // 2. Part of the first node is deleted and all of the last node.
-        // 3. Part of the first node is deleted and part of the last node.
-        // 4. The entire first node is deleted and part of the last node.
+        // The range spans pieces.  The tree splits around the pieces it touches, and the parts of the first and last
+        // of them outside the range join the trees before and after it, in O(log n) whatever the number of pieces.
+        NodeData kept[2];
+        size_t kept_count = 0;
+        if (first.remainder != Length{})
+        {
+            kept[kept_count++] = { trim_piece_right(&buffers, first_node->piece, start_split_pos) };
+        }
+        RedBlackTree before;
+        RedBlackTree rest;
+        root.split(buffers.rb_tree_blk, first.start_offset, &before, &rest);
+        RedBlackTree after;
+        if (last_node != nullptr)
+        {
+            // 'last' stays whole when the range ends where it starts, and goes entirely when the range ends the text.
+            auto pieces_end = last.start_offset;
+            if (last.remainder != Length{})
+            {
+                auto end_split_pos = buffer_position(&buffers, last_node->piece, last.remainder);
+                auto new_last = trim_piece_left(&buffers, last_node->piece, end_split_pos);
+                if (new_last.length != Length{})
+                {
+                    kept[kept_count++] = { new_last };
+                }
+                pieces_end = last.start_offset + last_node->piece.length;
+            }
+            RedBlackTree removed;
+            rest.split(buffers.rb_tree_blk, CharOffset{ rep(pieces_end) - rep(first.start_offset) }, &removed, &after);
+        }
+        if (kept_count == 0)
+        {
+            root = RedBlackTree::join(buffers.rb_tree_blk, before, after);
+        }
+        else if (kept_count == 1)
+        {
+            root = RedBlackTree::join(buffers.rb_tree_blk, before, kept[0], after);
+        }
+        else
+        {
+            root = RedBlackTree::join(buffers.rb_tree_blk, RedBlackTree::join(buffers.rb_tree_blk, before, kept[0], RedBlackTree{ }), kept[1], after);
+        }
+    }
 
-        auto new_first = trim_piece_right(&buffers, first_node->piece, start_split_pos);
-        if (last_node == nullptr)
+    bool Tree::internal_replace(CharOffset offset, Length length, String8 txt, AdoptBuffer adopt)
+    {
+        auto [node, remainder, node_start_offset, line] = node_at(&buffers, root.dup(), offset);
+        if (node == nullptr or node_start_offset + node->piece.length < offset + length)
+            return false;
+        // The text before and after the range stay as pieces of their own around the new one.
+        Piece piece = node->piece;
+        NodeData pieces[3];
+        size_t count = 0;
+        if (remainder != Length{ })
         {
-            remove_node_range(first, count);
+            pieces[count++] = { trim_piece_right(&buffers, piece, buffer_position(&buffers, piece, remainder)) };
         }
-        else
+        pieces[count++] = { is_yes(adopt) ? adopted_piece(txt) : build_piece(txt) };
+        if (remainder + length != piece.length)
         {
-            auto end_split_pos = buffer_position(&buffers, last_node->piece, last.remainder);
-            auto new_last = trim_piece_left(&buffers, last_node->piece, end_split_pos);
-            remove_node_range(first, count);
-            // There's an edge case here where we delete all the nodes up to 'last' but
-            // last itself remains untouched.  The test of 'remainder' in 'last' can identify
-            // this scenario to avoid inserting a duplicate of 'last'.
-            if (last.remainder != Length{})
-            {
-                if (new_last.length != Length{})
-                {
-                    root = root.insert(buffers.rb_tree_blk, { new_last }, first.start_offset);
-                }
-            }
+            pieces[count++] = { trim_piece_left(&buffers, piece, buffer_position(&buffers, piece, remainder + length)) };
+        }
+        end_last_insert = extend(offset, txt.size);
+        switch (count)
+        {
+        case 1:
+            root = root.replace(buffers.rb_tree_blk, pieces[0], node_start_offset);
+            break;
+        case 2:
+            root = root.replace_pair(buffers.rb_tree_blk, pieces[0], pieces[1], node_start_offset);
+            break;
+        default:
+            root = root.split_insert(buffers.rb_tree_blk, pieces[0], pieces[1], pieces[2], node_start_offset);
+            break;
+        }
+#ifdef TEXTBUF_DEBUG
+        satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
+        compute_buffer_meta();
+        return true;
+    }
+
+    void Tree::internal_move(CharOffset from, Length count, CharOffset to)
+    {
+        // The text is cut at the three offsets and the two spans between the first and the last trade places.
+        auto end = from + count;
+        auto backward = rep(to) < rep(from);
+        auto first = backward ? to : from;
+        auto second = backward ? from : end;
+        auto third = backward ? end : to;
+        RedBlackTree rest;
+        RedBlackTree tail;
+        split_text(&buffers, root, third, &rest, &tail);
+        RedBlackTree front;
+        RedBlackTree second_span;
+        split_text(&buffers, rest, second, &front, &second_span);
+        RedBlackTree head;
+        RedBlackTree first_span;
+        split_text(&buffers, front, first, &head, &first_span);
+        auto moved_lf = rep(tree_lf_count(backward ? second_span : first_span));
+        if (folds.count != 0 and moved_lf != 0)
+        {
+            // The folds take the move as the removal of the text followed by its insertion at 'to', with the lines of
+            // both offsets found before the tree changes.
+            bool from_moves = false;
+            bool to_moves = false;
+            auto from_line = edit_line(from, &from_moves);
+            auto to_line = edit_line(to, &to_moves);
+            edit_folds(&folds, from_line, moved_lf, 0, false);
+            // 'to' moved up by the lines of the text when it lay after it.
+            edit_folds(&folds, backward ? to_line : Line{ rep(to_line) - moved_lf }, 0, moved_lf, to_moves);
         }
+        auto* blk = buffers.rb_tree_blk;
+        root = RedBlackTree::join(blk, RedBlackTree::join(blk, RedBlackTree::join(blk, head, second_span), first_span), tail);
+        end_last_insert = CharOffset::Sentinel;
+        compute_buffer_meta();
+#ifdef TEXTBUF_DEBUG
+        satisfies_rb_invariants(root);
+#endif // TEXTBUF_DEBUG
+    }
 
-        if (new_first.length != Length{})
+    void Tree::split_text(const BufferCollection* buffers, const RedBlackTree& tree, CharOffset offset, RedBlackTree* before, RedBlackTree* after)
+    {
+        auto [node, remainder, node_start_offset, line] = node_at(buffers, tree.dup(), offset);
+        // Offsets at piece boundaries split the tree as it is.
+        if (node == nullptr or remainder == Length{ } or remainder == node->piece.length)
         {
-            root = root.insert(buffers.rb_tree_blk, { new_first }, first.start_offset);
+            tree.split(buffers->rb_tree_blk, offset, before, after);
+            return;
         }
+        // Otherwise the halves of the piece holding it join the trees on either side.
+        auto pos = buffer_position(buffers, node->piece, remainder);
+        RedBlackTree head;
+        RedBlackTree rest;
+        tree.split(buffers->rb_tree_blk, node_start_offset, &head, &rest);
+        RedBlackTree piece;
+        RedBlackTree tail;
+        rest.split(buffers->rb_tree_blk, CharOffset{ rep(node->piece.length) }, &piece, &tail);
+        *before = RedBlackTree::join(buffers->rb_tree_blk, head, { trim_piece_right(buffers, node->piece, pos) }, RedBlackTree{ });
+        *after = RedBlackTree::join(buffers->rb_tree_blk, RedBlackTree{ }, { trim_piece_left(buffers, node->piece, pos) }, tail);
     }
 
     // Fetches the length of the piece starting from the first line to 'index' or to the end of
@@ -1146,6 +2545,8 @@ namespace PieceTree
             return;
         assert(line != Line::IndexBeginning);
         auto line_index = rep(retract(line));
+        FRED_PREFETCH(node.root_ptr()->payload.left);
+        FRED_PREFETCH(node.root_ptr()->payload.right);
         if (rep(node.root().left_subtree_lf_count) >= line_index)
         {
             line_start<accumulate>(offset, buffers, node.left(), line);
@@ -1172,113 +2573,767 @@ namespace PieceTree
         }
     }
 
-    void Tree::line_end_crlf(CharOffset* offset, const BufferCollection* buffers, const RedBlackTree& root, const RedBlackTree& node, Line line)
+    void Tree::line_end_crlf(CharOffset* offset, const BufferCollection* buffers, const RedBlackTree& root, const RedBlackTree& node, Line line)
+    {
+        if (node.is_empty())
+            return;
+        assert(line != Line::IndexBeginning);
+        auto line_index = rep(retract(line));
+        if (rep(node.root().left_subtree_lf_count) >= line_index)
+        {
+            line_end_crlf(offset, buffers, root, node.left(), line);
+        }
+        // The desired line is directly within the node.
+        else if (rep(node.root().left_subtree_lf_count + node.root().piece.newline_count) >= line_index)
+        {
+            line_index -= rep(node.root().left_subtree_lf_count);
+            Length len = node.root().left_subtree_length;
+            if (line_index != 0)
+            {
+                len = len + accumulate_value_no_lf(buffers, node.root().piece, Line{ line_index - 1 });
+            }
+
+            // If the length is anything but 0, we need to check if the last character was a carriage return.
+            if (len != Length{})
+            {
+                auto last_char_offset = *offset + retract(len);
+                if (char_at(buffers, root, last_char_offset) == '\r' and char_at(buffers, root, extend(last_char_offset)) == '\n')
+                {
+                    len = retract(len);
+                }
+            }
+            *offset = *offset + len;
+        }
+        // assemble the LHS and RHS.
+        else
+        {
+            // This case implies that 'left_subtree_lf_count + piece NL count' is strictly < line_index.
+            // The content is somewhere in the middle.
+            auto& piece = node.root().piece;
+            line_index -= rep(node.root().left_subtree_lf_count + piece.newline_count);
+            *offset = *offset + node.root().left_subtree_length + piece.length;
+            line_end_crlf(offset, buffers, root, node.right(), Line{ line_index + 1 });
+        }
+    }
+
+    LineRange Tree::get_line_range(Line line) const
+    {
+        settle_typing();
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    LineRange Tree::get_line_range_crlf(Line line) const
+    {
+        settle_typing();
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_end_crlf(&range.last, &buffers, root, root, extend(line));
+        return range;
+    }
+
+    LineRange Tree::get_line_range_with_newline(Line line) const
+    {
+        settle_typing();
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
+        return range;
+    }
+
+    String8 Tree::get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const
+    {
+        settle_typing();
+        return line_slice_content(arena, &buffers, meta, root, line, first_column, max_columns);
+    }
+
+    LineRange Tree::get_line_range_slice(Line line, Column first_column, Length max_columns) const
+    {
+        settle_typing();
+        return line_slice(&buffers, root, line, first_column, max_columns);
+    }
+
+    LineRange Tree::line_slice(const BufferCollection* buffers, const RedBlackTree& root, Line line, Column first_column, Length max_columns)
+    {
+        LineRange range{ };
+        if (line == Line::IndexBeginning or root.is_empty())
+            return range;
+        line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&range.last, buffers, root, extend(line));
+        // Both ends are clamped to the line so that a window past the end of the line is simply empty.
+        auto line_length = rep(distance(range.first, range.last));
+        auto first = rep(first_column) < line_length ? rep(first_column) : line_length;
+        auto count = rep(max_columns) < line_length - first ? rep(max_columns) : line_length - first;
+        range.first = range.first + Length{ first };
+        range.last = range.first + Length{ count };
+        return range;
+    }
+
+    String8 Tree::line_slice_content(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, Line line, Column first_column, Length max_columns)
+    {
+        LineRange range = line_slice(buffers, root, line, first_column, max_columns);
+        if (range.first == range.last)
+            return str8_empty;
+        return get_range(arena, buffers, meta, root, range.first, distance(range.first, range.last));
+    }
+
+    OwningSnapshot* Tree::owning_snap(Arena::Arena* arena) const
+    {
+        uint8_t* blob = Arena::push_array_aligned<uint8_t>(arena, sizeof(OwningSnapshot), Arena::Alignment{ alignof(OwningSnapshot) });
+        OwningSnapshot* snap = new (blob) OwningSnapshot{ arena, this };
+        return snap;
+    }
+
+    ReferenceSnapshot Tree::ref_snap() const
+    {
+        return ReferenceSnapshot{ this };
+    }
+
+    BufferCollection Tree::buffer_collection_no_ref() const
+    {
+        settle_typing();
+        return buffers;
+    }
+
+    Line Tree::line_at(CharOffset offset) const
+    {
+        settle_typing();
+        if (is_empty())
+            return Line::Beginning;
+        auto result = node_at(&buffers, root.dup(), offset);
+        return result.line;
+    }
+
+    Line Tree::edit_line(CharOffset offset, bool* starts_line) const
+    {
+        *starts_line = true;
+        if (offset == CharOffset{ })
+            return Line::Beginning;
+        auto result = node_at(&buffers, root.dup(), retract(offset));
+        const Piece& piece = result.node->piece;
+        auto buf_offset = buffers.buffer_offset(piece.index, piece.first);
+        *starts_line = buffers.buffer_at(piece.index)->buffer.str[rep(buf_offset) + rep(result.remainder)] == '\n';
+        return *starts_line ? extend(result.line) : result.line;
+    }
+
+    char Tree::at(CharOffset offset) const
+    {
+        // Typed text which is not in the tree yet is read from the cache.
+        if (typing.length() != 0 and offset >= typing.first)
+        {
+            auto index = rep(distance(typing.first, offset));
+            if (index < typing.length())
+                return typing.at(index);
+            offset = retract(offset, typing.length());
+        }
+        return char_at(&buffers, root, offset);
+    }
+
+    char Tree::char_at(const BufferCollection* buffers, const RedBlackTree& node, CharOffset offset)
+    {
+        auto result = node_at(buffers, node.dup(), offset);
+        if (result.node == nullptr)
+            return '\0';
+        auto* buffer = buffers->buffer_at(result.node->piece.index);
+        auto buf_offset = buffers->buffer_offset(result.node->piece.index, result.node->piece.first);
+        const char* p = buffer->buffer.str + rep(buf_offset) + rep(result.remainder);
+        return *p;
+    }
+
+    String8 Tree::get_range(Arena::Arena* arena, CharOffset offset, Length count) const
+    {
+        settle_typing();
+        return Tree::get_range(arena, &buffers, meta, root, offset, count);
+    }
+
+    String8 Tree::get_range(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset, Length count)
+    {
+        if (rep(offset) >= rep(meta.total_content_length))
+            return str8_empty;
+        auto available = rep(distance(offset, CharOffset{ rep(meta.total_content_length) }));
+        String8 result = str8_cstr_alloc(arena, rep(count) < available ? rep(count) : available);
+        Tree::copy_range(buffers, meta, root, offset, count, result.str);
+        return result;
+    }
+
+    Length Tree::copy_range(CharOffset offset, Length count, char* dst) const
+    {
+        settle_typing();
+        return Tree::copy_range(&buffers, meta, root, offset, count, dst);
+    }
+
+    Length Tree::copy_range(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset, Length count, char* dst)
+    {
+        if (rep(offset) >= rep(meta.total_content_length))
+            return Length{ };
+        auto available = rep(distance(offset, CharOffset{ rep(meta.total_content_length) }));
+        auto remaining = rep(count) < available ? rep(count) : available;
+        // The walker performs a single descent to 'offset', after which whole piece spans are copied.
+        TreeWalker walker{ buffers, meta, root, offset };
+        char* out = dst;
+        while (remaining != 0)
+        {
+            String8View chunk = walker.next_chunk();
+            if (chunk.size == 0)
+                break;
+            auto amount = chunk.size < remaining ? chunk.size : remaining;
+            memcpy(out, chunk.str, amount);
+            out += amount;
+            remaining -= amount;
+        }
+        return Length{ static_cast<size_t>(out - dst) };
+    }
+
+#if FRED_CODE_POINT_SUMMARY
+    CodePointCount Tree::offset_to_codepoint(CharOffset offset) const
+    {
+        settle_typing();
+        return offset_to_codepoint(&buffers, root, offset);
+    }
+
+    CharOffset Tree::codepoint_to_offset(CodePointCount codepoint) const
+    {
+        settle_typing();
+        return codepoint_to_offset(&buffers, meta, root, codepoint);
+    }
+
+    CodePointCount Tree::codepoint_column(CharOffset offset) const
+    {
+        settle_typing();
+        return codepoint_column(&buffers, root, offset);
+    }
+
+    CharOffset Tree::codepoint_column_offset(Line line, CodePointCount column) const
+    {
+        settle_typing();
+        return codepoint_column_offset(&buffers, meta, root, line, column);
+    }
+
+    CodePointCount Tree::offset_to_codepoint(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        // Only the piece holding 'offset' is scanned and then only within one block of its buffer's index.
+        auto found = seek<CodePointSummary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        if (found.node == nullptr)
+            return found.prefix.summary.codepoints;
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto within = distance(CharOffset{ rep(found.prefix.length) }, offset);
+        return found.prefix.summary.codepoints + code_points_before(buffer, first + within) - code_points_before(buffer, first);
+    }
+
+    CharOffset Tree::codepoint_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CodePointCount codepoint)
+    {
+        if (rep(codepoint) >= rep(meta.summary.codepoints))
+            return CharOffset{ rep(meta.total_content_length) };
+        auto found = seek<CodePointSummary>(root, [&](const auto& prefix) { return rep(prefix.summary.codepoints) > rep(codepoint); });
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto last = buffers->buffer_offset(piece.index, piece.last);
+        auto target = code_points_before(buffer, first) + (codepoint - found.prefix.summary.codepoints);
+        return CharOffset{ rep(found.prefix.length) } + distance(first, code_point_offset(buffer, target, last));
+    }
+
+    CodePointCount Tree::codepoint_column(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        if (root.is_empty())
+            return CodePointCount{ };
+        auto line = node_at(buffers, root.dup(), offset).line;
+        CharOffset line_offset{ };
+        line_start<&Tree::accumulate_value>(&line_offset, buffers, root, line);
+        return offset_to_codepoint(buffers, root, offset) - offset_to_codepoint(buffers, root, line_offset);
+    }
+
+    CharOffset Tree::codepoint_column_offset(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, Line line, CodePointCount column)
+    {
+        if (root.is_empty())
+            return CharOffset{ };
+        if (line == Line::IndexBeginning)
+        {
+            line = Line::Beginning;
+        }
+        CharOffset first{ };
+        CharOffset last{ };
+        line_start<&Tree::accumulate_value>(&first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&last, buffers, root, extend(line));
+        auto result = codepoint_to_offset(buffers, meta, root, offset_to_codepoint(buffers, root, first) + column);
+        return rep(result) < rep(last) ? result : last;
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Position Tree::offset_to_utf16_position(CharOffset offset) const
+    {
+        settle_typing();
+        return offset_to_utf16_position(&buffers, root, offset);
+    }
+
+    CharOffset Tree::utf16_position_to_offset(Utf16Position position) const
+    {
+        settle_typing();
+        return utf16_position_to_offset(&buffers, meta, root, position);
+    }
+
+    Utf16Count Tree::offset_to_utf16(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        auto found = seek<Utf16Summary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        if (found.node == nullptr)
+            return found.prefix.summary.utf16_units;
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto within = distance(CharOffset{ rep(found.prefix.length) }, offset);
+        return found.prefix.summary.utf16_units + utf16_units_before(buffer, first + within) - utf16_units_before(buffer, first);
+    }
+
+    CharOffset Tree::utf16_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, Utf16Count units)
+    {
+        if (rep(units) >= rep(meta.summary.utf16_units))
+            return CharOffset{ rep(meta.total_content_length) };
+        auto found = seek<Utf16Summary>(root, [&](const auto& prefix) { return rep(prefix.summary.utf16_units) > rep(units); });
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto last = buffers->buffer_offset(piece.index, piece.last);
+        auto target = utf16_units_before(buffer, first) + (units - found.prefix.summary.utf16_units);
+        return CharOffset{ rep(found.prefix.length) } + distance(first, utf16_unit_offset(buffer, target, last));
+    }
+
+    Utf16Position Tree::offset_to_utf16_position(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        if (root.is_empty())
+            return { .line = Line::Beginning };
+        auto line = node_at(buffers, root.dup(), offset).line;
+        CharOffset line_offset{ };
+        line_start<&Tree::accumulate_value>(&line_offset, buffers, root, line);
+        return { .line = line,
+                    .character = offset_to_utf16(buffers, root, offset) - offset_to_utf16(buffers, root, line_offset) };
+    }
+
+    CharOffset Tree::utf16_position_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, Utf16Position position)
+    {
+        if (root.is_empty())
+            return CharOffset{ };
+        auto line = position.line == Line::IndexBeginning ? Line::Beginning : position.line;
+        CharOffset first{ };
+        CharOffset last{ };
+        line_start<&Tree::accumulate_value>(&first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&last, buffers, root, extend(line));
+        auto result = utf16_to_offset(buffers, meta, root, offset_to_utf16(buffers, root, first) + position.character);
+        return rep(result) < rep(last) ? result : last;
+    }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    uint64_t Tree::hash_range(CharOffset offset, Length count) const
+    {
+        settle_typing();
+        return hash_range(&buffers, meta, root, offset, count);
+    }
+
+    uint64_t Tree::hash_line(Line line) const
+    {
+        settle_typing();
+        return hash_line(&buffers, meta, root, line);
+    }
+
+    uint64_t Tree::prefix_hash(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        auto found = seek<HashSummary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        if (found.node == nullptr)
+            return found.prefix.summary.hash;
+        const Piece& piece = found.node->piece;
+        auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+        auto within = rep(offset) - rep(found.prefix.length);
+        auto before = hash_mul(found.prefix.summary.hash, hash_power(within));
+        return hash_add(before, buffer_hash(buffers->buffer_at(piece.index), first, first + within));
+    }
+
+    uint64_t Tree::hash_range(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset, Length count)
+    {
+        // The hash of a range is the hash of the prefix ending with it, less the hash of the prefix before it shifted
+        // past the range.
+        auto total = rep(meta.total_content_length);
+        auto first = rep(offset) < total ? rep(offset) : total;
+        auto last = rep(count) < total - first ? first + rep(count) : total;
+        auto before = hash_mul(prefix_hash(buffers, root, CharOffset{ first }), hash_power(last - first));
+        return hash_sub(prefix_hash(buffers, root, CharOffset{ last }), before);
+    }
+
+    uint64_t Tree::hash_line(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, Line line)
+    {
+        if (root.is_empty())
+            return 0;
+        if (line == Line::IndexBeginning)
+        {
+            line = Line::Beginning;
+        }
+        CharOffset first{ };
+        CharOffset last{ };
+        line_start<&Tree::accumulate_value>(&first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&last, buffers, root, extend(line));
+        return hash_range(buffers, meta, root, first, distance(first, last));
+    }
+#endif // FRED_HASH_SUMMARY
+
+#if FRED_WRAP_SUMMARY
+    void Tree::set_wrap_width(uint64_t width)
+    {
+        flush_typing();
+        if (width == wrap_width())
+            return;
+        if (width == 0)
+        {
+            buffers.wrap = nullptr;
+            return;
+        }
+        WrapIndex* wrap = buffers.wrap_cache;
+        while (wrap != nullptr and wrap->width != width)
+        {
+            wrap = wrap->next;
+        }
+        if (wrap == nullptr)
+        {
+            wrap = Arena::push_array<WrapIndex>(buffers.immutable_buf_arena, 1);
+            wrap->width = width;
+            wrap->next = buffers.wrap_cache;
+            buffers.wrap_cache = wrap;
+        }
+        extend_wrap_rows(buffers.immutable_buf_arena, wrap, &buffers);
+        buffers.wrap = wrap;
+        refresh_wrap_summaries();
+        compute_buffer_meta();
+    }
+
+    uint64_t Tree::visual_row_count() const
+    {
+        settle_typing();
+        if (buffers.wrap == nullptr)
+            return rep(line_count());
+        // The tail of a span without a LF is the whole span.
+        const WrapSummary& summary = meta.summary;
+        return summary.complete_rows() + WrapSummary::line_rows(summary.tail, buffers.wrap->width);
+    }
+
+    uint64_t Tree::visual_row(Line line, Column column) const
     {
-        if (node.is_empty())
-            return;
-        assert(line != Line::IndexBeginning);
-        auto line_index = rep(retract(line));
-        if (rep(node.root().left_subtree_lf_count) >= line_index)
+        settle_typing();
+        if (line == Line::IndexBeginning)
         {
-            line_end_crlf(offset, buffers, root, node.left(), line);
+            line = Line::Beginning;
         }
-        // The desired line is directly within the node.
-        else if (rep(node.root().left_subtree_lf_count + node.root().piece.newline_count) >= line_index)
+        if (rep(line) > rep(line_count()))
         {
-            line_index -= rep(node.root().left_subtree_lf_count);
-            Length len = node.root().left_subtree_length;
-            if (line_index != 0)
-            {
-                len = len + accumulate_value_no_lf(buffers, node.root().piece, Line{ line_index - 1 });
-            }
-
-            // If the length is anything but 0, we need to check if the last character was a carriage return.
-            if (len != Length{})
-            {
-                auto last_char_offset = *offset + retract(len);
-                if (char_at(buffers, root, last_char_offset) == '\r' and char_at(buffers, root, extend(last_char_offset)) == '\n')
-                {
-                    len = retract(len);
-                }
-            }
-            *offset = *offset + len;
+            line = Line{ rep(line_count()) };
         }
-        // assemble the LHS and RHS.
-        else
+        if (buffers.wrap == nullptr)
+            return rep(line) - 1;
+        auto width = buffers.wrap->width;
+        auto range = get_line_range(line);
+        auto last_row = WrapSummary::line_rows(distance(range.first, range.last), width) - 1;
+        auto row = rep(column) / width;
+        return wrap_before(&buffers, root, range.first).complete_rows() + (row < last_row ? row : last_row);
+    }
+
+    LinePosition Tree::visual_row_start(uint64_t row) const
+    {
+        settle_typing();
+        if (buffers.wrap == nullptr)
+            return { .line = Line{ (row < rep(line_count()) ? row : rep(line_count()) - 1) + 1 } };
+        auto row_count = visual_row_count();
+        if (row >= row_count)
         {
-            // This case implies that 'left_subtree_lf_count + piece NL count' is strictly < line_index.
-            // The content is somewhere in the middle.
-            auto& piece = node.root().piece;
-            line_index -= rep(node.root().left_subtree_lf_count + piece.newline_count);
-            *offset = *offset + node.root().left_subtree_length + piece.length;
-            line_end_crlf(offset, buffers, root, node.right(), Line{ line_index + 1 });
+            row = row_count - 1;
+        }
+        auto width = buffers.wrap->width;
+        auto found = seek<WrapSummary>(root, [&](const auto& prefix) { return prefix.summary.complete_rows() > row; });
+        const WrapSummary& before = found.prefix.summary;
+        auto line = Line{ rep(found.prefix.lf_count) + 1 };
+        auto local_row = row - before.complete_rows();
+        if (found.node == nullptr)
+            return { .line = line, .column = Column{ local_row * width } };
+        // The row is either in the line left open before the piece, which ends at the first LF of the piece, or in one
+        // of the lines the piece holds completely.
+        const Piece& piece = found.node->piece;
+        auto open_rows = WrapSummary::line_rows(before.tail + piece.summary.head, width);
+        if (local_row < open_rows)
+            return { .line = line, .column = Column{ local_row * width } };
+        const uint64_t* rows = wrap_rows(buffers.wrap, piece.index);
+        auto first = rep(piece.first.line) + 1;
+        auto target = rows[first] + local_row - open_rows;
+        auto* past = branchless_lower_bound(rows + first, rows + rep(piece.last.line) + 1, target + 1);
+        uint64_t k = (past - rows) - 1;
+        return { .line = Line{ rep(line) + k - rep(piece.first.line) }, .column = Column{ (target - rows[k]) * width } };
+    }
+
+    WrapSummary Tree::wrap_before(const BufferCollection* buffers, const RedBlackTree& root, CharOffset offset)
+    {
+        auto found = seek<WrapSummary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        auto within = distance(CharOffset{ rep(found.prefix.length) }, offset);
+        if (found.node == nullptr or within == Length{ })
+            return found.prefix.summary;
+        // The part of the piece before 'offset' is summarized as a piece of its own.
+        Piece part = found.node->piece;
+        part.last = buffer_position(buffers, part, within);
+        part.length = within;
+        return WrapSummary::combine(found.prefix.summary, WrapSummary::of(buffers, part));
+    }
+#endif // FRED_WRAP_SUMMARY
+
+    void Tree::add_fold(Line header, Line last, bool collapsed)
+    {
+        flush_typing();
+        if (header == Line::IndexBeginning)
+        {
+            header = Line::Beginning;
+        }
+        if (rep(last) > rep(line_count()))
+        {
+            last = Line{ rep(line_count()) };
         }
+        if (rep(last) <= rep(header))
+            return;
+        reserve_folds(&folds, folds.count + 1);
+        Arena::Temp scratch = Arena::scratch_begin({ &folds.arena, 1 });
+        Fold* list = copy_folds(scratch.arena, &folds, folds.count + 1);
+        auto at = find_fold(&folds, header);
+        // A fold already on 'header' is replaced.
+        auto replaced = at != folds.count and list[at].header == header;
+        memmove(list + at + 1, list + at + replaced, (folds.count - at - replaced) * sizeof(Fold));
+        list[at] = { .header = header, .last = last, .collapsed = collapsed };
+        assign_folds(&folds, list, folds.count + 1 - replaced);
+        Arena::scratch_end(scratch);
     }
 
-    LineRange Tree::get_line_range(Line line) const
+    void Tree::remove_fold(Line header)
     {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
-        return range;
+        flush_typing();
+        auto at = find_fold(&folds, header);
+        if (at == folds.count or get_fold(&folds, at).header != header)
+            return;
+        Arena::Temp scratch = Arena::scratch_begin({ &folds.arena, 1 });
+        Fold* list = copy_folds(scratch.arena, &folds, folds.count);
+        memmove(list + at, list + at + 1, (folds.count - at - 1) * sizeof(Fold));
+        assign_folds(&folds, list, folds.count - 1);
+        Arena::scratch_end(scratch);
     }
 
-    LineRange Tree::get_line_range_crlf(Line line) const
+    void Tree::set_fold_collapsed(Line header, bool collapsed)
     {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_end_crlf(&range.last, &buffers, root, root, extend(line));
-        return range;
+        flush_typing();
+        auto at = find_fold(&folds, header);
+        if (at == folds.count or get_fold(&folds, at).header != header)
+            return;
+        folds.collapsed[at] = collapsed;
+        folds.saved = nullptr;
+        rebuild_fold_runs(&folds);
     }
 
-    LineRange Tree::get_line_range_with_newline(Line line) const
+    void Tree::set_all_folds_collapsed(bool collapsed)
     {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
-        return range;
+        flush_typing();
+        for EachIndex(i, folds.count)
+        {
+            folds.collapsed[i] = collapsed;
+        }
+        folds.saved = nullptr;
+        rebuild_fold_runs(&folds);
     }
 
-    OwningSnapshot* Tree::owning_snap(Arena::Arena* arena) const
+    Fold Tree::fold_at(uint64_t index) const
     {
-        uint8_t* blob = Arena::push_array_aligned<uint8_t>(arena, sizeof(OwningSnapshot), Arena::Alignment{ alignof(OwningSnapshot) });
-        OwningSnapshot* snap = new (blob) OwningSnapshot{ arena, this };
-        return snap;
+        settle_typing();
+        return get_fold(&folds, index);
     }
 
-    ReferenceSnapshot Tree::ref_snap() const
+    Line Tree::visible_to_line(Line visible) const
     {
-        return ReferenceSnapshot{ this };
+        settle_typing();
+        auto last = rep(visible_line_count());
+        auto target = rep(visible) == 0 ? 1 : rep(visible) < last ? rep(visible) : last;
+        // Every run whose header is visible before 'target' hides lines before it.
+        auto runs = lower_bound_by(folds.run_count, target, [&](uint64_t i) { return run_header_line(&folds, i); });
+        return Line{ target + (runs == 0 ? 0 : folds.hidden_before[runs]) };
     }
 
-    BufferCollection Tree::buffer_collection_no_ref() const
+    Line Tree::line_to_visible(Line line) const
     {
-        return buffers;
+        settle_typing();
+        auto last = rep(line_count());
+        auto target = rep(line) == 0 ? 1 : rep(line) < last ? rep(line) : last;
+        // The last run starting at or before 'target'.
+        auto run = lower_bound_by(folds.run_count, target + 1, [&](uint64_t i) { return run_first_line(&folds, i); });
+        if (run == 0)
+            return Line{ target };
+        run -= 1;
+        if (target - run_first_line(&folds, run) < folds.hidden_before[run + 1] - folds.hidden_before[run])
+            return Line{ run_header_line(&folds, run) };
+        return Line{ target - folds.hidden_before[run + 1] };
     }
 
-    Line Tree::line_at(CharOffset offset) const
+    Length Tree::visible_line_count() const
     {
-        if (is_empty())
-            return Line::Beginning;
-        auto result = node_at(&buffers, root.dup(), offset);
-        return result.line;
+        settle_typing();
+        return Length{ rep(line_count()) - hidden_lines(&folds) };
     }
 
-    char Tree::at(CharOffset offset) const
+#if FRED_BRACKET_SUMMARY
+    namespace
     {
-        return char_at(&buffers, root, offset);
+        // Searches the bytes [first, last) of the subtree 'node', whose text spans [start, end), for the first byte
+        // after which the depth of bracket pair 'pair' is at most 'target'.  Subtrees which cannot hold it are skipped
+        // using their summary, so only the paths to the ends of the range and to the result are visited.
+        CharOffset subtree_bracket_forward(const BufferCollection* buffers, const RBNodeCounted* node, uint64_t start, uint64_t end, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
+        {
+            if (node == nil_node() or end <= first or last <= start)
+                return CharOffset::Sentinel;
+            const NodeData& data = node->payload.data;
+            const BracketDepth& span = data.subtree_summary.depths[pair];
+            if (first <= start and end <= last and *depth + span.min > target)
+            {
+                *depth += span.delta;
+                return CharOffset::Sentinel;
+            }
+            auto piece_start = start + rep(data.left_subtree_length);
+            auto piece_end = piece_start + rep(data.piece.length);
+            auto found = subtree_bracket_forward(buffers, node->payload.left, start, piece_start, first, last, pair, depth, target);
+            if (found == CharOffset::Sentinel)
+            {
+                found = piece_bracket_forward(buffers, data.piece, piece_start, first, last, pair, depth, target);
+            }
+            if (found == CharOffset::Sentinel)
+            {
+                found = subtree_bracket_forward(buffers, node->payload.right, piece_end, end, first, last, pair, depth, target);
+            }
+            return found;
+        }
+
+        // As above, but for the last byte before which the depth is at most 'target', with '*depth' given at 'last'.
+        CharOffset subtree_bracket_backward(const BufferCollection* buffers, const RBNodeCounted* node, uint64_t start, uint64_t end, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
+        {
+            if (node == nil_node() or end <= first or last <= start)
+                return CharOffset::Sentinel;
+            const NodeData& data = node->payload.data;
+            const BracketDepth& span = data.subtree_summary.depths[pair];
+            if (first <= start and end <= last and *depth - span.delta + span.min > target)
+            {
+                *depth -= span.delta;
+                return CharOffset::Sentinel;
+            }
+            auto piece_start = start + rep(data.left_subtree_length);
+            auto piece_end = piece_start + rep(data.piece.length);
+            auto found = subtree_bracket_backward(buffers, node->payload.right, piece_end, end, first, last, pair, depth, target);
+            if (found == CharOffset::Sentinel)
+            {
+                found = piece_bracket_backward(buffers, data.piece, piece_start, first, last, pair, depth, target);
+            }
+            if (found == CharOffset::Sentinel)
+            {
+                found = subtree_bracket_backward(buffers, node->payload.left, start, piece_start, first, last, pair, depth, target);
+            }
+            return found;
+        }
+
+        // The first byte at or after 'first' which closes an opening bracket of 'pair' found before 'first', skipping
+        // the 'ignored' ranges.
+        CharOffset bracket_closing(const BufferCollection* buffers, const RedBlackTree& root, uint64_t total, uint64_t first, uint64_t pair, const CharRange* ignored, uint64_t ignored_count)
+        {
+            int64_t depth = 0;
+            uint64_t i = 0;
+            while (first < total)
+            {
+                while (i < ignored_count and rep(ignored[i].last) <= first)
+                {
+                    ++i;
+                }
+                if (i < ignored_count and rep(ignored[i].first) <= first)
+                {
+                    first = rep(ignored[i].last);
+                    continue;
+                }
+                auto last = i < ignored_count and rep(ignored[i].first) < total ? rep(ignored[i].first) : total;
+                auto found = subtree_bracket_forward(buffers, root.root_ptr(), 0, total, first, last, pair, &depth, -1);
+                if (found != CharOffset::Sentinel)
+                    return found;
+                first = last;
+            }
+            return CharOffset::Sentinel;
+        }
+
+        // The last byte before 'last' which opens a bracket of 'pair' left unclosed at 'last', skipping the 'ignored'
+        // ranges.
+        CharOffset bracket_opening(const BufferCollection* buffers, const RedBlackTree& root, uint64_t total, uint64_t last, uint64_t pair, const CharRange* ignored, uint64_t ignored_count)
+        {
+            int64_t depth = 0;
+            uint64_t i = ignored_count;
+            while (last > 0)
+            {
+                while (i > 0 and rep(ignored[i - 1].first) >= last)
+                {
+                    --i;
+                }
+                if (i > 0 and rep(ignored[i - 1].last) >= last)
+                {
+                    last = rep(ignored[i - 1].first);
+                    continue;
+                }
+                auto first = i > 0 ? rep(ignored[i - 1].last) : 0;
+                auto found = subtree_bracket_backward(buffers, root.root_ptr(), 0, total, first, last, pair, &depth, -1);
+                if (found != CharOffset::Sentinel)
+                    return found;
+                last = first;
+            }
+            return CharOffset::Sentinel;
+        }
+    } // namespace [anon]
+
+    CharOffset Tree::match_bracket(CharOffset offset, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        settle_typing();
+        return match_bracket(&buffers, meta, root, offset, ignored, ignored_count);
     }
 
-    char Tree::char_at(const BufferCollection* buffers, const RedBlackTree& node, CharOffset offset)
+    CharOffset Tree::enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count) const
     {
-        auto result = node_at(buffers, node.dup(), offset);
-        if (result.node == nullptr)
-            return '\0';
-        auto* buffer = buffers->buffer_at(result.node->piece.index);
-        auto buf_offset = buffers->buffer_offset(result.node->piece.index, result.node->piece.first);
-        const char* p = buffer->buffer.str + rep(buf_offset) + rep(result.remainder);
-        return *p;
+        settle_typing();
+        return enclosing_bracket(&buffers, meta, root, offset, pair, ignored, ignored_count);
+    }
+
+    CharOffset Tree::match_bracket(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset, const CharRange* ignored, uint64_t ignored_count)
+    {
+        auto total = rep(meta.total_content_length);
+        if (rep(offset) >= total)
+            return CharOffset::Sentinel;
+        for EachIndex(i, ignored_count)
+        {
+            if (rep(offset) < rep(ignored[i].first))
+                break;
+            if (rep(offset) < rep(ignored[i].last))
+                return CharOffset::Sentinel;
+        }
+        char c = char_at(buffers, root, offset);
+        const BracketPairs& pairs = buffers->bracket_pairs;
+        for EachIndex(pair, pairs.count)
+        {
+            if (c == pairs.pairs[pair].open)
+                return bracket_closing(buffers, root, total, rep(offset) + 1, pair, ignored, ignored_count);
+            if (c == pairs.pairs[pair].close)
+                return bracket_opening(buffers, root, total, rep(offset), pair, ignored, ignored_count);
+        }
+        return CharOffset::Sentinel;
+    }
+
+    CharOffset Tree::enclosing_bracket(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count)
+    {
+        if (pair >= buffers->bracket_pairs.count)
+            return CharOffset::Sentinel;
+        auto total = rep(meta.total_content_length);
+        return bracket_opening(buffers, root, total, rep(offset) < total ? rep(offset) : total, pair, ignored, ignored_count);
     }
+#endif // FRED_BRACKET_SUMMARY
 
     String8 Tree::assemble_line(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& node, Line line)
     {
@@ -1290,7 +3345,7 @@ namespace PieceTree
         auto scratch = Arena::scratch_begin({ &arena, 1 });
         CharOffset line_offset{ };
         line_start<&Tree::accumulate_value>(&line_offset, buffers, node, line);
-        TreeWalker walker{ scratch.arena, buffers, meta, node, line_offset };
+        TreeWalker walker{ buffers, meta, node, line_offset };
         String8List serial_lst{};
         str8_serial_begin(scratch.arena, &serial_lst);
         while (not walker.exhausted())
@@ -1345,6 +3400,7 @@ namespace PieceTree
 
     String8 Tree::get_line_content(Arena::Arena* arena, Line line) const
     {
+        settle_typing();
         String8 result = str8_empty;
         if (line == Line::IndexBeginning)
             return result;
@@ -1377,7 +3433,7 @@ namespace PieceTree
         {
             auto scratch = Arena::scratch_begin({ &arena, 1 });
             IncompleteCRLF result = IncompleteCRLF::No;
-            TreeWalker walker{ scratch.arena, tree, line_offset };
+            TreeWalker walker{ tree, line_offset };
             String8List serial_lst{};
             str8_serial_begin(scratch.arena, &serial_lst);
             String8 prev_str = str8_empty;
@@ -1416,6 +3472,7 @@ namespace PieceTree
 
     IncompleteCRLF Tree::get_line_content_crlf(Arena::Arena* arena, String8* buf, Line line) const
     {
+        settle_typing();
         *buf = str8_empty;
         if (line == Line::IndexBeginning)
             return IncompleteCRLF::No;
@@ -1465,6 +3522,142 @@ namespace PieceTree
         return Tree::char_at(&buffers, root, offset);
     }
 
+    String8 OwningSnapshot::get_range(Arena::Arena* arena, CharOffset offset, Length count) const
+    {
+        return Tree::get_range(arena, &buffers, meta, root, offset, count);
+    }
+
+    Length OwningSnapshot::copy_range(CharOffset offset, Length count, char* dst) const
+    {
+        return Tree::copy_range(&buffers, meta, root, offset, count, dst);
+    }
+
+#if FRED_CODE_POINT_SUMMARY
+    CodePointCount OwningSnapshot::offset_to_codepoint(CharOffset offset) const
+    {
+        return Tree::offset_to_codepoint(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::codepoint_to_offset(CodePointCount codepoint) const
+    {
+        return Tree::codepoint_to_offset(&buffers, meta, root, codepoint);
+    }
+
+    CodePointCount OwningSnapshot::codepoint_column(CharOffset offset) const
+    {
+        return Tree::codepoint_column(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::codepoint_column_offset(Line line, CodePointCount column) const
+    {
+        return Tree::codepoint_column_offset(&buffers, meta, root, line, column);
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Position OwningSnapshot::offset_to_utf16_position(CharOffset offset) const
+    {
+        return Tree::offset_to_utf16_position(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::utf16_position_to_offset(Utf16Position position) const
+    {
+        return Tree::utf16_position_to_offset(&buffers, meta, root, position);
+    }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+    CharOffset OwningSnapshot::match_bracket(CharOffset offset, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::match_bracket(&buffers, meta, root, offset, ignored, ignored_count);
+    }
+
+    CharOffset OwningSnapshot::enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::enclosing_bracket(&buffers, meta, root, offset, pair, ignored, ignored_count);
+    }
+#endif // FRED_BRACKET_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    uint64_t OwningSnapshot::hash_range(CharOffset offset, Length count) const
+    {
+        return Tree::hash_range(&buffers, meta, root, offset, count);
+    }
+
+    uint64_t OwningSnapshot::hash_line(Line line) const
+    {
+        return Tree::hash_line(&buffers, meta, root, line);
+    }
+#endif // FRED_HASH_SUMMARY
+
+    String8 ReferenceSnapshot::get_range(Arena::Arena* arena, CharOffset offset, Length count) const
+    {
+        return Tree::get_range(arena, &buffers, meta, root, offset, count);
+    }
+
+    Length ReferenceSnapshot::copy_range(CharOffset offset, Length count, char* dst) const
+    {
+        return Tree::copy_range(&buffers, meta, root, offset, count, dst);
+    }
+
+#if FRED_CODE_POINT_SUMMARY
+    CodePointCount ReferenceSnapshot::offset_to_codepoint(CharOffset offset) const
+    {
+        return Tree::offset_to_codepoint(&buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::codepoint_to_offset(CodePointCount codepoint) const
+    {
+        return Tree::codepoint_to_offset(&buffers, meta, root, codepoint);
+    }
+
+    CodePointCount ReferenceSnapshot::codepoint_column(CharOffset offset) const
+    {
+        return Tree::codepoint_column(&buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::codepoint_column_offset(Line line, CodePointCount column) const
+    {
+        return Tree::codepoint_column_offset(&buffers, meta, root, line, column);
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Position ReferenceSnapshot::offset_to_utf16_position(CharOffset offset) const
+    {
+        return Tree::offset_to_utf16_position(&buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::utf16_position_to_offset(Utf16Position position) const
+    {
+        return Tree::utf16_position_to_offset(&buffers, meta, root, position);
+    }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+    CharOffset ReferenceSnapshot::match_bracket(CharOffset offset, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::match_bracket(&buffers, meta, root, offset, ignored, ignored_count);
+    }
+
+    CharOffset ReferenceSnapshot::enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::enclosing_bracket(&buffers, meta, root, offset, pair, ignored, ignored_count);
+    }
+#endif // FRED_BRACKET_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    uint64_t ReferenceSnapshot::hash_range(CharOffset offset, Length count) const
+    {
+        return Tree::hash_range(&buffers, meta, root, offset, count);
+    }
+
+    uint64_t ReferenceSnapshot::hash_line(Line line) const
+    {
+        return Tree::hash_line(&buffers, meta, root, line);
+    }
+#endif // FRED_HASH_SUMMARY
+
     Line OwningSnapshot::line_at(CharOffset offset) const
     {
         if (is_empty())
@@ -1521,6 +3714,16 @@ namespace PieceTree
         return range;
     }
 
+    String8 OwningSnapshot::get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice_content(arena, &buffers, meta, root, line, first_column, max_columns);
+    }
+
+    LineRange OwningSnapshot::get_line_range_slice(Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice(&buffers, root, line, first_column, max_columns);
+    }
+
     LineRange ReferenceSnapshot::get_line_range_with_newline(Line line) const
     {
         LineRange range{ };
@@ -1529,6 +3732,16 @@ namespace PieceTree
         return range;
     }
 
+    String8 ReferenceSnapshot::get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice_content(arena, &buffers, meta, root, line, first_column, max_columns);
+    }
+
+    LineRange ReferenceSnapshot::get_line_range_slice(Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice(&buffers, root, line, first_column, max_columns);
+    }
+
     LFCount Tree::line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end)
     {
         // If the end position is the beginning of a new line, then we can just return the difference in lines.
@@ -1550,6 +3763,103 @@ namespace PieceTree
         return LFCount{ rep(retract(end.line, rep(start.line))) };
     }
 
+#if FRED_CODE_POINT_SUMMARY
+    CodePointSummary CodePointSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        return { code_points_before(buffer, buffers->buffer_offset(piece.index, piece.last))
+                    - code_points_before(buffer, buffers->buffer_offset(piece.index, piece.first)) };
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Summary Utf16Summary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        return { utf16_units_before(buffer, buffers->buffer_offset(piece.index, piece.last))
+                    - utf16_units_before(buffer, buffers->buffer_offset(piece.index, piece.first)) };
+    }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_LINE_EXTENT_SUMMARY
+    LineExtent LineExtent::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        if (piece.first.line == piece.last.line)
+            return { .leading = piece.length, .trailing = piece.length };
+        // Line starts follow the LF, so the first line ends one byte before the next start.
+        auto leading = rep(buffer->line_starts.starts[rep(piece.first.line) + 1]) - rep(buffers->buffer_offset(piece.index, piece.first)) - 1;
+        return { .leading = Length{ leading },
+                    .trailing = Length{ rep(piece.last.column) },
+                    .longest = longest_buffer_line(buffer, rep(piece.first.line) + 1, rep(piece.last.line)),
+                    .has_lf = true };
+    }
+#endif // FRED_LINE_EXTENT_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+    BracketSummary BracketSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+        return buffer_brackets(buffers->bracket_pairs, buffers->buffer_at(piece.index), first, first + rep(piece.length));
+    }
+#endif // FRED_BRACKET_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    HashSummary HashSummary::combine(const HashSummary& left, const HashSummary& right)
+    {
+        auto right_power = right.power_minus_one + 1;
+        return { .hash = hash_add(hash_mul(left.hash, right_power), right.hash),
+                    .power_minus_one = hash_mul(left.power_minus_one + 1, right_power) - 1 };
+    }
+
+    HashSummary HashSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+        return { .hash = buffer_hash(buffers->buffer_at(piece.index), first, first + rep(piece.length)),
+                    .power_minus_one = hash_power(rep(piece.length)) - 1 };
+    }
+#endif // FRED_HASH_SUMMARY
+
+#if FRED_WRAP_SUMMARY
+    WrapSummary WrapSummary::combine(const WrapSummary& left, const WrapSummary& right)
+    {
+        if (left.width == 0)
+            return right;
+        if (right.width == 0)
+            return left;
+        if (left.width != right.width or left.width == stale)
+            return { .width = stale };
+        WrapSummary result{ .width = left.width };
+        result.head = left.spans_lf ? left.head : left.head + right.head;
+        result.tail = right.spans_lf ? right.tail : left.tail + right.tail;
+        result.rows = left.rows + right.rows;
+        // The line spanning the boundary is only complete when both sides end it with a LF.
+        if (left.spans_lf and right.spans_lf)
+        {
+            result.rows += line_rows(left.tail + right.head, left.width);
+        }
+        result.spans_lf = left.spans_lf or right.spans_lf;
+        return result;
+    }
+
+    WrapSummary WrapSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const WrapIndex* wrap = buffers->wrap;
+        if (wrap == nullptr)
+            return { .width = stale };
+        if (piece.first.line == piece.last.line)
+            return { .width = wrap->width, .head = piece.length, .tail = piece.length };
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        const uint64_t* rows = wrap_rows(wrap, piece.index);
+        auto head = rep(buffer->line_starts.starts[rep(piece.first.line) + 1]) - rep(buffers->buffer_offset(piece.index, piece.first)) - 1;
+        return { .width = wrap->width,
+                    .head = Length{ head },
+                    .tail = Length{ rep(piece.last.column) },
+                    .rows = rows[rep(piece.last.line)] - rows[rep(piece.first.line) + 1],
+                    .spans_lf = true };
+    }
+#endif // FRED_WRAP_SUMMARY
+
     Piece Tree::build_piece(String8 txt)
     {
         auto start_offset = buffers.mod_buffer.buffer.size;
@@ -1575,6 +3885,15 @@ namespace PieceTree
         grow_mut_buf(&buffers, txt.size);
         char* insert_at = buffers.mod_buffer.buffer.str + old_size;
         memcpy(insert_at, txt.str, txt.size);
+#if FRED_CODE_POINT_INDEX
+        extend_code_point_index(buffers.immutable_buf_arena, &buffers.mod_buffer.code_points, buffers.mod_buffer.buffer);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_BRACKET_SUMMARY
+        extend_bracket_index(buffers.immutable_buf_arena, buffers.bracket_pairs, &buffers.mod_buffer.brackets, buffers.mod_buffer.buffer);
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_WRAP_SUMMARY
+        extend_mod_wrap_rows(buffers.immutable_buf_arena, buffers.wrap, &buffers.mod_buffer);
+#endif // FRED_WRAP_SUMMARY
         Arena::scratch_end(scratch);
 
         // Build the new piece for the inserted buffer.
@@ -1587,17 +3906,35 @@ namespace PieceTree
                         .last = end_pos,
                         .length = Length{ end_offset - start_offset },
                         .newline_count = line_feed_count(&buffers, BufferIndex::ModBuf, start, end_pos) };
+        piece.summary = TreeSummary::of(&buffers, piece);
         // Update the last insertion.
         last_insert = end_pos;
         return piece;
     }
 
+    Piece Tree::adopted_piece(String8 txt)
+    {
+        auto index = adopt_buffer(txt);
+        const CharBuffer* buffer = buffers.buffer_at(index);
+        auto last_line = Line{ buffer->line_starts.count - 1 };
+        Piece piece = { .index = index,
+                        .first = { },
+                        .last = { .line = last_line, .column = Column{ txt.size - rep(buffer->line_starts.starts[rep(last_line)]) } },
+                        .length = Length{ txt.size },
+                        .newline_count = LFCount{ rep(last_line) } };
+        piece.summary = TreeSummary::of(&buffers, piece);
+        return piece;
+    }
+
     NodePosition Tree::node_at(const BufferCollection* buffers, RedBlackTree node, CharOffset off)
     {
         size_t node_start_offset = 0;
         size_t newline_count = 0;
         while (not node.is_empty())
         {
+            // Load both children while this node is inspected; the comparison decides which one is used.
+            FRED_PREFETCH(node.root_ptr()->payload.left);
+            FRED_PREFETCH(node.root_ptr()->payload.right);
             if (rep(node.root().left_subtree_length) > rep(off))
             {
                 node = node.left();
@@ -1652,6 +3989,14 @@ namespace PieceTree
         auto low = rep(piece.first.line);
         auto high = rep(piece.last.line);
 
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        if (buffer->line_start_samples.count != 0 and high - low > line_start_sample_stride)
+        {
+            auto line = sampled_line_search(buffer, low, high, offset);
+            return { .line = Line{ line },
+                        .column = Column{ offset - rep(starts->starts[line]) } };
+        }
+
         size_t mid = 0;
         size_t mid_start = 0;
         size_t mid_stop = 0;
@@ -1697,6 +4042,7 @@ namespace PieceTree
         new_piece.last = pos;
         new_piece.newline_count = new_lf_count;
         new_piece.length = new_len;
+        new_piece.summary = TreeSummary::of(buffers, new_piece);
 
         return new_piece;
     }
@@ -1715,6 +4061,7 @@ namespace PieceTree
         new_piece.first = pos;
         new_piece.newline_count = new_lf_count;
         new_piece.length = new_len;
+        new_piece.summary = TreeSummary::of(buffers, new_piece);
 
         return new_piece;
     }
@@ -1736,44 +4083,23 @@ namespace PieceTree
         auto old_piece = existing.node->piece;
         new_piece.first = old_piece.first;
         new_piece.newline_count = new_piece.newline_count + old_piece.newline_count;
+        new_piece.summary = TreeSummary::combine(old_piece.summary, new_piece.summary);
         new_piece.length = new_piece.length + old_piece.length;
-        root = root.remove(buffers.rb_tree_blk, existing.start_offset)
-                    .insert(buffers.rb_tree_blk, { new_piece }, existing.start_offset);
-    }
-
-    void Tree::remove_node_range(NodePosition first, Length length)
-    {
-        // Remove pieces until we reach the desired length.
-        Length deleted_len{};
-        // Because we could be deleting content in the range starting at 'first' where the piece
-        // length could be much larger than 'length', we need to adjust 'length' to contain the
-        // delta in length within the piece to the end where 'length' starts:
-        // "abcd"  "efg"
-        //     ^     ^
-        //     |_____|
-        //      length to delete = 3
-        // P1 length: 4
-        // P2 length: 3 (though this length does not matter)
-        // We're going to remove all of 'P1' and 'P2' in this range and the caller will re-insert
-        // these pieces with the correct lengths.  If we fail to adjust 'length' we will delete P1
-        // and believe that the entire range was deleted.
-        assert(first.node != nullptr);
-        auto total_length = first.node->piece.length;
-        // (total - remainder) is the section of 'length' where 'first' intersects.
-        length = length - (total_length - first.remainder) + total_length;
-        auto delete_at_offset = first.start_offset;
-        while (deleted_len < length and first.node != nullptr)
-        {
-            deleted_len = deleted_len + first.node->piece.length;
-            root = root.remove(buffers.rb_tree_blk, delete_at_offset);
-            first = node_at(&buffers, root.dup(), delete_at_offset);
-        }
+        root = root.replace(buffers.rb_tree_blk, { new_piece }, existing.start_offset);
     }
 
     void Tree::insert(CharOffset offset, String8 txt, SuppressHistory suppress_history)
     {
         if (txt.size == 0)
             return;
+        if (txt.size >= large_insert_size)
+        {
+            insert_owned(offset, str8_copy(buffers.immutable_buf_arena, txt), suppress_history);
+            return;
+        }
+        if (absorb_insert(offset, txt, suppress_history))
+            return;
+        flush_typing();
         // This allows us to undo blocks of code.
         if (is_no(suppress_history)
             and (end_last_insert != offset or root.is_empty()))
@@ -1783,11 +4109,71 @@ namespace PieceTree
         internal_insert(offset, txt);
     }
 
+    void Tree::insert_owned(CharOffset offset, String8 txt, SuppressHistory suppress_history)
+    {
+        if (txt.size == 0)
+            return;
+        flush_typing();
+        if (is_no(suppress_history)
+            and (end_last_insert != offset or root.is_empty()))
+        {
+            append_undo(root, offset);
+        }
+        internal_insert(offset, txt, AdoptBuffer::Yes);
+    }
+
+    void Tree::replace(CharOffset offset, Length count, String8 txt, SuppressHistory suppress_history)
+    {
+        if (rep(count) == 0 or root.is_empty())
+        {
+            insert(offset, txt, suppress_history);
+            return;
+        }
+        if (txt.size == 0)
+        {
+            remove(offset, count, suppress_history);
+            return;
+        }
+        flush_typing();
+        if (is_no(suppress_history))
+        {
+            append_undo(root, offset);
+        }
+        auto adopt = txt.size >= large_insert_size ? AdoptBuffer::Yes : AdoptBuffer::No;
+        if (is_yes(adopt))
+        {
+            txt = str8_copy(buffers.immutable_buf_arena, txt);
+        }
+        // Folds follow the lines each edit adds or removes, so they take the two edits.
+        if (folds.count != 0 or not internal_replace(offset, count, txt, adopt))
+        {
+            internal_remove(offset, count);
+            internal_insert(offset, txt, adopt);
+        }
+    }
+
+    void Tree::move_range(CharOffset from, Length count, CharOffset to, SuppressHistory suppress_history)
+    {
+        // Text moved into itself or to either of its edges stays where it is.
+        if (rep(count) == 0 or (rep(from) <= rep(to) and rep(to) <= rep(from + count)))
+            return;
+        flush_typing();
+        assert(rep(from + count) <= rep(length()) and rep(to) <= rep(length()));
+        if (is_no(suppress_history))
+        {
+            append_undo(root, from);
+        }
+        internal_move(from, count, to);
+    }
+
     void Tree::remove(CharOffset offset, Length count, SuppressHistory suppress_history)
     {
         // Rule out the obvious noop.
         if (rep(count) == 0 or root.is_empty())
             return;
+        if (absorb_remove(offset, count, suppress_history))
+            return;
+        flush_typing();
         if (is_no(suppress_history))
         {
             append_undo(root, offset);
@@ -1795,6 +4181,556 @@ namespace PieceTree
         internal_remove(offset, count);
     }
 
+    void Tree::set_typing_cache(bool enabled)
+    {
+        flush_typing();
+        if (enabled)
+        {
+            typing.reserve(buffers.immutable_buf_arena);
+        }
+        typing.enabled = enabled;
+    }
+
+    void Tree::flush_typing()
+    {
+        if (typing.length() == 0)
+            return;
+        auto first = typing.first;
+        auto txt = typing.take();
+        // The history step was taken when the typing began and the insertion point stays where the typing left it.
+        auto end = end_last_insert;
+        internal_insert(first, txt);
+        end_last_insert = end;
+    }
+
+    void Tree::settle_typing() const
+    {
+        if (typing.length() != 0)
+        {
+            const_cast<Tree*>(this)->flush_typing();
+        }
+    }
+
+    bool Tree::absorb_insert(CharOffset offset, String8 txt, SuppressHistory suppress_history)
+    {
+        if (not typing.enabled or folds.count != 0 or root.is_empty() or txt.size > typing.capacity)
+            return false;
+        if (typing.length() == 0)
+        {
+            // Typing begins here, with the history step the insertion would have taken.
+            if (is_no(suppress_history) and end_last_insert != offset)
+            {
+                append_undo(root, offset);
+            }
+            typing.first = offset;
+        }
+        else
+        {
+            // Only insertions into the typed text which take no history step stay in the cache.
+            if (not typing.holds(offset, Length{ }))
+                return false;
+            if (is_no(suppress_history) and end_last_insert != offset)
+                return false;
+            if (txt.size > typing.room())
+            {
+                flush_typing();
+                return absorb_insert(offset, txt, suppress_history);
+            }
+        }
+        typing.insert(rep(distance(typing.first, offset)), txt);
+        end_last_insert = extend(offset, txt.size);
+        return true;
+    }
+
+    bool Tree::absorb_remove(CharOffset offset, Length count, SuppressHistory suppress_history)
+    {
+        // Removals take a history step unless suppressed, so only suppressed ones inside the typed text stay in the
+        // cache.
+        if (typing.length() == 0 or is_no(suppress_history) or not typing.holds(offset, count))
+            return false;
+        typing.remove(rep(distance(typing.first, offset)), rep(count));
+        return true;
+    }
+
+    namespace
+    {
+        // Drops the heads held by nothing but the list, as no 'snap_to' can name them any more.
+        void prune_heads(HeadList* heads)
+        {
+            HeadEntry** link = &heads->first;
+            while (*link != nullptr)
+            {
+                HeadEntry* entry = *link;
+                uint64_t held = entry->given.root_ptr() == entry->current.root_ptr() ? 2 : 1;
+                if (os_atomic_u64_eval(&entry->given.root_ptr()->blk->ref_count) != held)
+                {
+                    link = &entry->next;
+                    continue;
+                }
+                *link = entry->next;
+                --heads->count;
+                entry->~HeadEntry();
+                SLLStackPush(heads->free_list, entry);
+            }
+        }
+
+        void push_head(Arena::Arena* arena, HeadList* heads, const RedBlackTree& root)
+        {
+            prune_heads(heads);
+            HeadEntry* entry = heads->free_list;
+            if (entry != nullptr)
+            {
+                SLLStackPop(heads->free_list);
+            }
+            else
+            {
+                entry = reinterpret_cast<HeadEntry*>(Arena::push_array_no_zero<uint8_t>(arena, sizeof(HeadEntry)));
+            }
+            new (entry) HeadEntry{ .next = heads->first, .given = root.dup(), .current = root.dup() };
+            heads->first = entry;
+            ++heads->count;
+        }
+
+        // Queues 'node' to be marked unless it already was.
+        void queue_node(Compaction* state, const RBNodeCounted* node)
+        {
+            if (node_map_find(&state->marked, node) != nullptr)
+                return;
+            node_map_insert(state->arena, &state->marked, node, node);
+            if (state->stack_count == state->stack_capacity)
+            {
+                auto capacity = state->stack_capacity == 0 ? 64 : state->stack_capacity * 2;
+                const RBNodeCounted** stack = Arena::push_array_no_zero<const RBNodeCounted*>(state->arena, capacity);
+                if (state->stack_count != 0)
+                {
+                    memcpy(stack, state->stack, state->stack_count * sizeof(const RBNodeCounted*));
+                }
+                state->stack = stack;
+                state->stack_capacity = capacity;
+            }
+            state->stack[state->stack_count++] = node;
+        }
+
+        void add_live_range(Compaction* state, const BufferCollection* buffers, const Piece& piece)
+        {
+            if (state->live_count == state->live_capacity)
+            {
+                auto capacity = state->live_capacity == 0 ? 64 : state->live_capacity * 2;
+                LiveRange* live = Arena::push_array_no_zero<LiveRange>(state->arena, capacity);
+                if (state->live_count != 0)
+                {
+                    memcpy(live, state->live, state->live_count * sizeof(LiveRange));
+                }
+                state->live = live;
+                state->live_capacity = capacity;
+            }
+            auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+            state->live[state->live_count++] = { .first = first, .last = first + rep(piece.length), .moved_to = 0 };
+        }
+
+        // Marks queued nodes, at most 'budget' of them, recording the mod buffer ranges of their pieces.
+        void mark_nodes(Compaction* state, const BufferCollection* buffers, uint64_t budget)
+        {
+            for (; state->stack_count != 0 and budget != 0; --budget)
+            {
+                const RBNodeCounted* node = state->stack[--state->stack_count];
+                const Piece& piece = node->payload.data.piece;
+                if (piece.index == BufferIndex::ModBuf)
+                {
+                    add_live_range(state, buffers, piece);
+                }
+                if (not nil_node(node->payload.left))
+                {
+                    queue_node(state, node->payload.left);
+                }
+                if (not nil_node(node->payload.right))
+                {
+                    queue_node(state, node->payload.right);
+                }
+            }
+        }
+    } // namespace [anon]
+
+    CompactionResult Tree::compact_mod_buffer(uint64_t budget)
+    {
+        if (compaction.arena == nullptr)
+        {
+            // Pin the history and the heads as they are now and queue their roots.
+            prune_heads(buffers.heads);
+            compaction.arena = Arena::alloc(Arena::default_params);
+            compaction.pinned = Arena::push_array_no_zero<const RBNodeCounted*>(compaction.arena, 1 + undo_stack.count + redo_stack.count + buffers.heads->count);
+            auto pin = [&](const RedBlackTree& tree) {
+                if (tree.is_empty())
+                    return;
+                compaction.pinned[compaction.pinned_count++] = take_node_ref(tree.root_ptr());
+                queue_node(&compaction, tree.root_ptr());
+            };
+            pin(root);
+            for EachNode(entry, undo_stack.first)
+            {
+                pin(entry->root);
+            }
+            for EachNode(entry, redo_stack.first)
+            {
+                pin(entry->root);
+            }
+            for EachNode(entry, buffers.heads->first)
+            {
+                pin(entry->current);
+            }
+        }
+        mark_nodes(&compaction, &buffers, budget);
+        if (compaction.stack_count != 0 or os_atomic_u64_eval(buffers.mod_buffer_pins) != 0)
+            return { .done = false, .reclaimed = Length{ } };
+        return { .done = true, .reclaimed = finish_compaction() };
+    }
+
+    Length Tree::finish_compaction()
+    {
+        flush_typing();
+        // Mark what was made since the compaction began.  The nodes marked before are pinned, so only new ones are
+        // visited.
+        auto queue = [&](const RedBlackTree& tree) {
+            if (not tree.is_empty())
+            {
+                queue_node(&compaction, tree.root_ptr());
+            }
+        };
+        queue(root);
+        for EachNode(entry, undo_stack.first)
+        {
+            queue(entry->root);
+        }
+        for EachNode(entry, redo_stack.first)
+        {
+            queue(entry->root);
+        }
+        for EachNode(entry, buffers.heads->first)
+        {
+            queue(entry->current);
+        }
+        mark_nodes(&compaction, &buffers, UINT64_MAX);
+
+        // Merge the ranges the pieces refer to and give each its place in the compacted buffer.
+        LiveRange* live = compaction.live;
+        std::sort(live, live + compaction.live_count, [](const LiveRange& a, const LiveRange& b) { return a.first < b.first; });
+        uint64_t live_count = 0;
+        uint64_t size = 0;
+        for EachIndex(i, compaction.live_count)
+        {
+            if (live_count != 0 and live[i].first <= live[live_count - 1].last)
+            {
+                if (live[i].last > live[live_count - 1].last)
+                {
+                    size += live[i].last - live[live_count - 1].last;
+                    live[live_count - 1].last = live[i].last;
+                }
+                continue;
+            }
+            live[live_count++] = { .first = live[i].first, .last = live[i].last, .moved_to = size };
+            size += live[i].last - live[i].first;
+        }
+
+        CharBuffer* mod = &buffers.mod_buffer;
+        LineStart* new_starts = Arena::push_array_no_zero<LineStart>(compaction.arena, mod->line_starts.count);
+        uint64_t start_count = 1;
+        new_starts[0] = LineStart{ 0 };
+        for EachIndex(i, live_count)
+        {
+            for (uint64_t b = live[i].first; b < live[i].last; ++b)
+            {
+                if (mod->buffer.str[b] == '\n')
+                {
+                    new_starts[start_count++] = LineStart{ live[i].moved_to + (b - live[i].first) + 1 };
+                }
+            }
+        }
+
+        // Rewrite the pieces while the old line starts are still in place.
+        PieceRewrite rewrite{ .starts = mod->line_starts.starts,
+                              .new_starts = new_starts,
+                              .new_start_count = start_count,
+                              .live = live,
+                              .live_count = live_count,
+                              .arena = compaction.arena,
+                              .copies = { } };
+        // Copies are remembered by the address of the original node, so every original root is held until all of them
+        // are rewritten.  Otherwise the nodes of a root replaced early could be released and their addresses taken by
+        // the copies made for the next ones.
+        const RBNodeCounted** originals = Arena::push_array_no_zero<const RBNodeCounted*>(compaction.arena, 1 + undo_stack.count + redo_stack.count + buffers.heads->count);
+        uint64_t original_count = 0;
+        auto rewrite_root = [&](RedBlackTree* tree) {
+            originals[original_count++] = take_node_ref(tree->root_ptr());
+            *tree = tree->rewrite_pieces(buffers.rb_tree_blk, &rewrite);
+        };
+        rewrite_root(&root);
+        for EachNode(entry, undo_stack.first)
+        {
+            rewrite_root(&entry->root);
+        }
+        for EachNode(entry, redo_stack.first)
+        {
+            rewrite_root(&entry->root);
+        }
+        for EachNode(entry, buffers.heads->first)
+        {
+            rewrite_root(&entry->current);
+        }
+        for EachIndex(i, original_count)
+        {
+            dec_node_ref(originals[i]);
+        }
+
+        // Move the text down and give back the rest.  Ranges only move towards the front, so they are moved in order.
+        for EachIndex(i, live_count)
+        {
+            memmove(mod->buffer.str + live[i].moved_to, mod->buffer.str + live[i].first, live[i].last - live[i].first);
+        }
+        auto reclaimed = mod->buffer.size - size;
+        Arena::pop(buffers.mut_buf_arena, Arena::AllocSize{ reclaimed });
+        mod->buffer.size = size;
+        mod->buffer.str[size] = 0;
+        memcpy(mod->line_starts.starts, new_starts, start_count * sizeof(LineStart));
+        Arena::pop(buffers.mut_buf_starts_arena, Arena::AllocSize{ (mod->line_starts.count - start_count) * sizeof(LineStart) });
+        mod->line_starts.count = start_count;
+        // The indexes over the buffer are built again in place.
+#if FRED_CODE_POINT_INDEX
+        mod->code_points.count = 0;
+        extend_code_point_index(buffers.immutable_buf_arena, &mod->code_points, mod->buffer);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_BRACKET_SUMMARY
+        mod->brackets.level_count = 0;
+        extend_bracket_index(buffers.immutable_buf_arena, buffers.bracket_pairs, &mod->brackets, mod->buffer);
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_WRAP_SUMMARY
+        for (WrapIndex* wrap = buffers.wrap_cache; wrap != nullptr; wrap = wrap->next)
+        {
+            wrap->mod_count = 0;
+        }
+        extend_mod_wrap_rows(buffers.immutable_buf_arena, buffers.wrap, mod);
+#endif // FRED_WRAP_SUMMARY
+        last_insert = { .line = Line{ start_count - 1 }, .column = Column{ size - rep(new_starts[start_count - 1]) } };
+        buffers.compactions += 1;
+
+        for EachIndex(i, compaction.pinned_count)
+        {
+            dec_node_ref(compaction.pinned[i]);
+        }
+        Arena::release(compaction.arena);
+        compaction = { };
+        return Length{ reclaimed };
+    }
+
+    namespace
+    {
+        size_t count_pieces(const RedBlackTree& node)
+        {
+            if (node.is_empty())
+                return 0;
+            return count_pieces(node.left()) + 1 + count_pieces(node.right());
+        }
+
+#if FRED_WRAP_SUMMARY
+        // Appends the pieces of 'node' to 'pieces' in order, with their rows wrapped at the current width.  The other
+        // summaries do not depend on the width and are kept.
+        void resummarize_pieces(const BufferCollection* buffers, const RedBlackTree& node, NodeData* pieces, size_t* count)
+        {
+            if (node.is_empty())
+                return;
+            resummarize_pieces(buffers, node.left(), pieces, count);
+            Piece piece = node.root().piece;
+            static_cast<WrapSummary&>(piece.summary) = WrapSummary::of(buffers, piece);
+            pieces[(*count)++] = { piece };
+            resummarize_pieces(buffers, node.right(), pieces, count);
+        }
+#endif // FRED_WRAP_SUMMARY
+
+        // Appends the pieces of 'node' to 'pieces' in order.
+        void collect_pieces(const RedBlackTree& node, NodeData* pieces, size_t* count)
+        {
+            if (node.is_empty())
+                return;
+            collect_pieces(node.left(), pieces, count);
+            pieces[(*count)++] = { node.root().piece };
+            collect_pieces(node.right(), pieces, count);
+        }
+
+        // Joins the neighbouring pieces which follow each other in the same buffer, in place, and returns the count left.
+        size_t join_contiguous_pieces(NodeData* pieces, size_t count)
+        {
+            size_t joined = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                Piece piece = pieces[i].piece;
+                Piece* prev = joined == 0 ? nullptr : &pieces[joined - 1].piece;
+                if (prev != nullptr and prev->index == piece.index and prev->last == piece.first)
+                {
+                    prev->last = piece.last;
+                    prev->length = prev->length + piece.length;
+                    prev->newline_count = LFCount{ rep(prev->newline_count) + rep(piece.newline_count) };
+                    prev->summary = TreeSummary::combine(prev->summary, piece.summary);
+                    continue;
+                }
+                pieces[joined++] = { piece };
+            }
+            return joined;
+        }
+
+        // The end of the run of pieces shorter than 'below' starting at 'first'.
+        size_t small_run_end(const NodeData* pieces, size_t count, size_t first, Length below)
+        {
+            size_t last = first;
+            while (last < count and pieces[last].piece.length < below)
+            {
+                ++last;
+            }
+            return last;
+        }
+    } // namespace [anon]
+
+    size_t Tree::piece_count() const
+    {
+        settle_typing();
+        return count_pieces(root);
+    }
+
+#if FRED_WRAP_SUMMARY
+    void Tree::refresh_summaries()
+    {
+        auto scratch = Arena::scratch_begin({ &buffers.immutable_buf_arena, 1 });
+        NodeData* pieces = Arena::push_array<NodeData>(scratch.arena, count_pieces(root));
+        size_t count = 0;
+        resummarize_pieces(&buffers, root, pieces, &count);
+        root = RedBlackTree::construct_from(buffers.rb_tree_blk, pieces, count);
+        Arena::scratch_end(scratch);
+    }
+
+    void Tree::refresh_wrap_summaries()
+    {
+        // A root summarized for another wrap width is summarized again once it becomes the current one.
+        if (buffers.wrap != nullptr and not root.is_empty() and tree_summary(root).width != buffers.wrap->width)
+        {
+            refresh_summaries();
+        }
+    }
+#endif // FRED_WRAP_SUMMARY
+
+    BufferIndex Tree::adopt_buffer(String8 txt)
+    {
+        Arena::Arena* arena = buffers.immutable_buf_arena;
+        LineStarts starts{};
+        populate_line_starts(arena, &starts, txt);
+        CharBuffer buffer{ .buffer = txt, .line_starts = starts, .line_start_samples = sample_line_starts(arena, starts) };
+#if FRED_CODE_POINT_INDEX
+        extend_code_point_index(arena, &buffer.code_points, txt);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_LINE_EXTENT_SUMMARY
+        buffer.line_lengths = build_line_length_index(arena, &buffer);
+#endif // FRED_LINE_EXTENT_SUMMARY
+#if FRED_BRACKET_SUMMARY
+        buffer.brackets = build_bracket_index(arena, buffers.bracket_pairs, txt);
+#endif // FRED_BRACKET_SUMMARY
+        auto count = buffers.orig_buffers.count;
+        if (count == buffers.orig_buffers.capacity)
+        {
+            // The previous array is left intact since snapshots may still refer to it.
+            auto capacity = count * 2 < 8 ? 8 : count * 2;
+            CharBuffer* buffers_arr = Arena::push_array_no_zero<CharBuffer>(arena, capacity);
+            if (count != 0)
+            {
+                memcpy(buffers_arr, buffers.orig_buffers.buffers, count * sizeof(CharBuffer));
+            }
+            buffers.orig_buffers.buffers = buffers_arr;
+            buffers.orig_buffers.capacity = capacity;
+        }
+        buffers.orig_buffers.buffers[count] = buffer;
+        buffers.orig_buffers.count = count + 1;
+#if FRED_WRAP_SUMMARY
+        if (buffers.wrap != nullptr)
+        {
+            extend_wrap_rows(arena, buffers.wrap, &buffers);
+        }
+#endif // FRED_WRAP_SUMMARY
+        return BufferIndex{ count };
+    }
+
+    DefragmentReport Tree::defragment(DefragmentPolicy policy)
+    {
+        flush_typing();
+        DefragmentReport report{ .pieces_before = count_pieces(root) };
+        auto scratch = Arena::scratch_begin({ &buffers.immutable_buf_arena, 1 });
+        NodeData* pieces = Arena::push_array<NodeData>(scratch.arena, report.pieces_before);
+        size_t count = 0;
+        collect_pieces(root, pieces, &count);
+        count = join_contiguous_pieces(pieces, count);
+
+        // Every run of small pieces becomes one piece of a new buffer holding all of the runs.
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t end = small_run_end(pieces, count, i, policy.copy_below);
+            for (size_t k = i; end - i > 1 and k < end; ++k)
+            {
+                total += rep(pieces[k].piece.length);
+            }
+            i = end > i ? end - 1 : i;
+        }
+        if (total != 0)
+        {
+            char* text = Arena::push_array_no_zero<char>(buffers.immutable_buf_arena, total);
+            auto index = BufferIndex{ buffers.orig_buffers.count };
+            uint64_t size = 0;
+            uint64_t line = 0;
+            uint64_t line_start = 0;
+            size_t kept = 0;
+            for (size_t i = 0; i < count;)
+            {
+                size_t end = small_run_end(pieces, count, i, policy.copy_below);
+                if (end - i < 2)
+                {
+                    pieces[kept++] = pieces[i++];
+                    continue;
+                }
+                Piece run{ .index = index, .first = { .line = Line{ line }, .column = Column{ size - line_start } } };
+                for (; i < end; ++i)
+                {
+                    const Piece& piece = pieces[i].piece;
+                    const char* first = buffers.buffer_at(piece.index)->buffer.str + rep(buffers.buffer_offset(piece.index, piece.first));
+                    memcpy(text + size, first, rep(piece.length));
+                    for EachIndex(c, rep(piece.length))
+                    {
+                        if (first[c] == '\n')
+                        {
+                            ++line;
+                            line_start = size + c + 1;
+                        }
+                    }
+                    size += rep(piece.length);
+                    run.length = run.length + piece.length;
+                    run.newline_count = LFCount{ rep(run.newline_count) + rep(piece.newline_count) };
+                }
+                run.last = { .line = Line{ line }, .column = Column{ size - line_start } };
+                pieces[kept++] = { run };
+            }
+            count = kept;
+            [[maybe_unused]] auto adopted = adopt_buffer(String8{ .str = text, .size = total });
+            assert(adopted == index);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (pieces[i].piece.index == index)
+                {
+                    pieces[i].piece.summary = TreeSummary::of(&buffers, pieces[i].piece);
+                }
+            }
+            report.copied = Length{ total };
+        }
+
+        root = RedBlackTree::construct_from(buffers.rb_tree_blk, pieces, count);
+        Arena::scratch_end(scratch);
+        report.pieces_after = count;
+        return report;
+    }
+
     void Tree::compute_buffer_meta()
     {
         ::PieceTree::compute_buffer_meta(&meta, root);
@@ -1802,7 +4738,7 @@ namespace PieceTree
 
     namespace
     {
-        void push_ur_node(Arena::Arena* arena, UndoRedoEntry** free_list, UndoRedoList* lst, const RedBlackTree& root, CharOffset op_offset)
+        void push_ur_node(Arena::Arena* arena, UndoRedoEntry** free_list, UndoRedoList* lst, const RedBlackTree& root, CharOffset op_offset, const FoldSnapshot* folds)
         {
             UndoRedoEntry* entry = nullptr;
             if (*free_list != nullptr)
@@ -1819,6 +4755,7 @@ namespace PieceTree
             zero_bytes(entry);
             new(&entry->root) RedBlackTree{ root.dup() };
             entry->op_offset = op_offset;
+            entry->folds = folds;
             SLLQueuePushFront(lst->first, lst->last, entry);
             ++lst->count;
         }
@@ -1846,31 +4783,41 @@ namespace PieceTree
                 SLLStackPush(free_undo_list, e);
             } while (redo_stack.first != nullptr);
         }
-        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, old_root, op_offset);
+        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, old_root, op_offset, save_folds(buffers.undo_redo_stack_arena, &folds));
     }
 
     UndoRedoResult Tree::try_undo(CharOffset op_offset)
     {
+        flush_typing();
         if (undo_stack.count == 0)
             return { .success = false, .op_offset = CharOffset{ } };
-        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &redo_stack, root, op_offset);
-        auto [nx, node, undo_offset] = static_cast<UndoRedoEntry&&>(*undo_stack.first);
+        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &redo_stack, root, op_offset, save_folds(buffers.undo_redo_stack_arena, &folds));
+        auto [nx, node, undo_offset, undo_folds] = static_cast<UndoRedoEntry&&>(*undo_stack.first);
         root = node.dup();
+        restore_folds(&folds, undo_folds);
         UndoRedoEntry* e = pop_ur_node(&undo_stack);
         SLLStackPush(free_undo_list, e);
+#if FRED_WRAP_SUMMARY
+        refresh_wrap_summaries();
+#endif // FRED_WRAP_SUMMARY
         compute_buffer_meta();
         return { .success = true, .op_offset = undo_offset };
     }
 
     UndoRedoResult Tree::try_redo(CharOffset op_offset)
     {
+        flush_typing();
         if (redo_stack.count == 0)
             return { .success = false, .op_offset = CharOffset{ } };
-        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, root, op_offset);
-        auto [nx, node, redo_offset] = static_cast<UndoRedoEntry&&>(*redo_stack.first);
+        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, root, op_offset, save_folds(buffers.undo_redo_stack_arena, &folds));
+        auto [nx, node, redo_offset, redo_folds] = static_cast<UndoRedoEntry&&>(*redo_stack.first);
         root = node.dup();
+        restore_folds(&folds, redo_folds);
         UndoRedoEntry* e = pop_ur_node(&redo_stack);
         SLLStackPush(free_undo_list, e);
+#if FRED_WRAP_SUMMARY
+        refresh_wrap_summaries();
+#endif // FRED_WRAP_SUMMARY
         compute_buffer_meta();
         return { .success = true, .op_offset = redo_offset };
     }
@@ -1878,18 +4825,45 @@ namespace PieceTree
     // Direct history manipulation.
     void Tree::commit_head(CharOffset offset)
     {
+        flush_typing();
         append_undo(root, offset);
     }
 
     RedBlackTree Tree::head() const
     {
+        settle_typing();
+        // Only roots with text are remembered, so the list holds no nil roots.
+        if (not root.is_empty())
+        {
+            push_head(buffers.undo_redo_stack_arena, buffers.heads, root);
+        }
         return root.dup();
     }
 
     void Tree::snap_to(const RedBlackTree& new_root)
     {
-        root = new_root.dup();
+        flush_typing();
+        HeadEntry* head = nullptr;
+        for EachNode(entry, buffers.heads->first)
+        {
+            if (entry->given.root_ptr() == new_root.root_ptr())
+            {
+                head = entry;
+                break;
+            }
+        }
+        root = head != nullptr ? head->current.dup() : new_root.dup();
+#if FRED_WRAP_SUMMARY
+        refresh_wrap_summaries();
+        if (head != nullptr)
+        {
+            // Keep the head summarized for the current width, so snapping back to it again does not redo the work.
+            head->current = root.dup();
+        }
+#endif // FRED_WRAP_SUMMARY
         compute_buffer_meta();
+        // A root from elsewhere may be shorter than the folds.
+        drop_folds_past(&folds, Line{ rep(meta.lf_count) + 1 });
     }
 
 #ifdef TEXTBUF_DEBUG
@@ -1915,7 +4889,17 @@ namespace PieceTree
             String8 persisted_txt = str8_copy(builder->immutable_buf_arena, txt);
             LineStarts starts{};
             populate_line_starts(builder->immutable_buf_arena, &starts, txt);
-            node->buffer = CharBuffer{ .buffer = persisted_txt, .line_starts = starts };
+            LineStarts samples = sample_line_starts(builder->immutable_buf_arena, starts);
+            node->buffer = CharBuffer{ .buffer = persisted_txt, .line_starts = starts, .line_start_samples = samples };
+#if FRED_CODE_POINT_INDEX
+            extend_code_point_index(builder->immutable_buf_arena, &node->buffer.code_points, persisted_txt);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_LINE_EXTENT_SUMMARY
+            node->buffer.line_lengths = build_line_length_index(builder->immutable_buf_arena, &node->buffer);
+#endif // FRED_LINE_EXTENT_SUMMARY
+#if FRED_BRACKET_SUMMARY
+            node->buffer.brackets = build_bracket_index(builder->immutable_buf_arena, builder->bracket_pairs, persisted_txt);
+#endif // FRED_BRACKET_SUMMARY
             SLLQueuePush(builder->buffers.first, builder->buffers.last, node);
             ++builder->buffers.count;
         }
@@ -1934,6 +4918,9 @@ namespace PieceTree
             .mut_buf_starts_arena = buffer_arenas[2],
             .mut_buf_arena = buffer_arenas[3],
             .buffers = {},
+#if FRED_BRACKET_SUMMARY
+            .bracket_pairs = default_bracket_pairs,
+#endif // FRED_BRACKET_SUMMARY
         };
         return result;
     }
@@ -1955,6 +4942,7 @@ namespace PieceTree
         }
         immut_buffers.buffers = buffers_arr;
         immut_buffers.count = builder->buffers.count;
+        immut_buffers.capacity = builder->buffers.count;
         // Allocate the atomic count.
         immut_buffers.ref_count = Arena::push_array<uint64_t>(builder->immutable_buf_arena, 1);
 
@@ -1971,7 +4959,12 @@ namespace PieceTree
             .orig_buffers = immut_buffers,
             .mod_buffer = {},
             .rb_tree_blk = rb_tree_blk,
+#if FRED_BRACKET_SUMMARY
+            .bracket_pairs = builder->bracket_pairs,
+#endif // FRED_BRACKET_SUMMARY
         };
+        buffers.mod_buffer_pins = Arena::push_array<uint64_t>(builder->immutable_buf_arena, 1);
+        buffers.heads = Arena::push_array<HeadList>(builder->immutable_buf_arena, 1);
         // Allocate the base of the mod buffer.
         // Note: Because we're wanting to build an endlessly growing array, we need to allocate the buffer ourselves and aligned
         // to 1 byte.
@@ -1999,6 +4992,9 @@ namespace PieceTree
             .mut_buf_starts_arena = buffer_arenas[2],
             .mut_buf_arena = buffer_arenas[3],
             .buffers = {},
+#if FRED_BRACKET_SUMMARY
+            .bracket_pairs = default_bracket_pairs,
+#endif // FRED_BRACKET_SUMMARY
         };
         return tree_builder_finish(&result);
     }
@@ -2012,7 +5008,7 @@ namespace PieceTree
     }
 
     OwningSnapshot::OwningSnapshot(Arena::Arena* mut_buf_arena, const Tree* tree):
-        root{ tree->root.dup() },
+        root{ (tree->settle_typing(), tree->root.dup()) },
         meta{ tree->meta },
         buffers{ take_buffer_ref(&tree->buffers) }
     {
@@ -2023,8 +5019,40 @@ namespace PieceTree
         starts.starts = Arena::push_array_no_zero<LineStart>(mut_buf_arena, starts.count);
         memcpy(starts.starts, buffers.mod_buffer.line_starts.starts, sizeof(LineStart) * starts.count);
         String8 buf = str8_copy(mut_buf_arena, buffers.mod_buffer.buffer);
+#if FRED_CODE_POINT_INDEX
+        CodePointIndex code_points{ };
+        code_points.count = buffers.mod_buffer.code_points.count;
+        code_points.capacity = code_points.count;
+#if FRED_CODE_POINT_SUMMARY
+        code_points.blocks = Arena::push_array_no_zero<CodePointCount>(mut_buf_arena, code_points.count);
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+        code_points.utf16_blocks = Arena::push_array_no_zero<Utf16Count>(mut_buf_arena, code_points.count);
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+        code_points.hash_blocks = Arena::push_array_no_zero<uint64_t>(mut_buf_arena, code_points.count);
+#endif // FRED_HASH_SUMMARY
+        if (code_points.count != 0)
+        {
+#if FRED_CODE_POINT_SUMMARY
+            memcpy(code_points.blocks, buffers.mod_buffer.code_points.blocks, sizeof(CodePointCount) * code_points.count);
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+            memcpy(code_points.utf16_blocks, buffers.mod_buffer.code_points.utf16_blocks, sizeof(Utf16Count) * code_points.count);
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+            memcpy(code_points.hash_blocks, buffers.mod_buffer.code_points.hash_blocks, sizeof(uint64_t) * code_points.count);
+#endif // FRED_HASH_SUMMARY
+        }
+#endif // FRED_CODE_POINT_INDEX
         buffers.mod_buffer.line_starts = starts;
         buffers.mod_buffer.buffer = buf;
+#if FRED_CODE_POINT_INDEX
+        buffers.mod_buffer.code_points = code_points;
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_BRACKET_SUMMARY
+        buffers.mod_buffer.brackets = copy_bracket_index(mut_buf_arena, buffers.mod_buffer.brackets);
+#endif // FRED_BRACKET_SUMMARY
     }
 
     OwningSnapshot::OwningSnapshot(Arena::Arena* mut_buf_arena, const Tree* tree, const RedBlackTree& dt):
@@ -2049,14 +5077,14 @@ namespace PieceTree
     }
 
     ReferenceSnapshot::ReferenceSnapshot(const Tree* tree):
-        root{ tree->root.dup() },
+        root{ (tree->settle_typing(), tree->root.dup()) },
         meta{ tree->meta },
-        buffers{ take_buffer_ref(&tree->buffers) } { }
+        buffers{ pin_buffers(&tree->buffers) } { }
 
     ReferenceSnapshot::ReferenceSnapshot(const Tree* tree, const RedBlackTree& dt):
         root{ dt.dup() },
         meta{ tree->meta },
-        buffers{ take_buffer_ref(&tree->buffers) }
+        buffers{ pin_buffers(&tree->buffers) }
     {
         // Compute the buffer meta for 'dt'.
         compute_buffer_meta(&meta, dt);
@@ -2065,7 +5093,7 @@ namespace PieceTree
     ReferenceSnapshot::ReferenceSnapshot(const ReferenceSnapshot& other):
         root{ other.root.dup() },
         meta{ other.meta },
-        buffers{ take_buffer_ref(&other.buffers) }
+        buffers{ pin_buffers(&other.buffers) }
     {
     }
 
@@ -2073,7 +5101,9 @@ namespace PieceTree
     {
         root = other.root.dup();
         meta = other.meta;
-        buffers = take_buffer_ref(&other.buffers);
+        BufferCollection old_buffers = buffers;
+        buffers = pin_buffers(&other.buffers);
+        unpin_buffers(&old_buffers);
         return *this;
     }
 
@@ -2081,102 +5111,127 @@ namespace PieceTree
     {
         // Reset the root since releasing the buffer below could cause the underlying nodes to be destroyed as well.
         root = RedBlackTree{};
-        dec_buffer_ref(&buffers);
+        unpin_buffers(&buffers);
     }
 
     namespace
     {
-        bool walker_stack_empty(const StackList& lst)
+        bool walker_stack_empty(const WalkerStack& stk)
         {
-            return lst.stack == nullptr;
+            return stk.count == 0;
         }
 
-        StackEntry* walker_stack_top(const StackList& lst)
+        StackEntry* walker_stack_top(WalkerStack& stk)
         {
-            return lst.stack;
+            return &stk.entries[stk.count - 1];
         }
 
-        void walker_stack_push(Arena::Arena* arena, StackList* lst, const RBNodeCounted* node, Direction dir)
+        const StackEntry* walker_stack_top(const WalkerStack& stk)
         {
-            StackEntry* e = lst->free_list;
-            if (e != nullptr)
-            {
-                SLLStackPop(lst->free_list);
-            }
-            else
-            {
-                e = Arena::push_array_no_zero<StackEntry>(arena, 1);
-            }
-            e->next = nullptr;
-            e->node = node;
-            e->dir = dir;
-            SLLStackPush(lst->stack, e);
+            return &stk.entries[stk.count - 1];
+        }
+
+        void walker_stack_push(WalkerStack* stk, const RBNodeCounted* node, Direction dir)
+        {
+            assert(stk->count < max_walker_depth);
+            stk->entries[stk->count++] = { .node = node, .dir = dir };
         }
 
-        void walker_stack_pop(StackList* lst)
+        void walker_stack_pop(WalkerStack* stk)
         {
-            assert(not walker_stack_empty(*lst));
-            StackEntry* e = lst->stack;
-            SLLStackPop(lst->stack);
-            e->next = nullptr;
-            SLLStackPush(lst->free_list, e);
+            assert(not walker_stack_empty(*stk));
+            --stk->count;
         }
 
-        void walker_stack_clear(StackList* lst)
+        void walker_stack_clear(WalkerStack* stk)
         {
-            while (not walker_stack_empty(*lst))
+            stk->count = 0;
+        }
+
+        void walker_stack_copy(WalkerStack* dst, const WalkerStack& src)
+        {
+            // Only the live portion of the stack is relevant.
+            memcpy(dst->entries, src.entries, src.count * sizeof(StackEntry));
+            dst->count = src.count;
+        }
+
+        // Hints what a walk visits after the piece of the node on top of 'stack'.  That is the subtree 'next' when there
+        // is one, whose root is all that is known of it, or else the parent waiting below on the stack (every entry
+        // below the top still has its piece to visit), whose node is loaded already so its text is hinted instead,
+        // from the end 'edge' where the walk enters it.
+        void prefetch_next(const BufferCollection* buffers, const WalkerStack& stack, const RBNodeCounted* next, BufferCursor Piece::* edge)
+        {
+            if (not nil_node(next))
             {
-                walker_stack_pop(lst);
+                FRED_PREFETCH(next);
+                return;
             }
+            if (stack.count < 2)
+                return;
+            const Piece& piece = stack.entries[stack.count - 2].node->payload.data.piece;
+            const CharBuffer* buffer = buffers->buffer_at(piece.index);
+            FRED_PREFETCH(buffer->buffer.str + rep(buffers->buffer_offset(piece.index, piece.*edge)));
         }
     } // namespace [anon]
 
-    TreeWalker::TreeWalker(Arena::Arena* arena, const Tree* tree, CharOffset offset):
-        buffers{ &tree->buffers },
-        root{ tree->root.dup() },
-        meta{ tree->meta },
-        arena{ arena },
-        total_offset{ offset }
-    {
-        // Populate initial stack state.
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Left);
-        fast_forward_to(offset);
-    }
+    TreeWalker::TreeWalker(const Tree* tree, CharOffset offset):
+        TreeWalker{ &tree->buffers, tree->meta, (tree->settle_typing(), tree->root), offset } { }
 
-    TreeWalker::TreeWalker(Arena::Arena* arena, const OwningSnapshot* snap, CharOffset offset):
-        buffers{ &snap->buffers },
-        root{ snap->root.dup() },
-        meta{ snap->meta },
-        arena{ arena },
+    TreeWalker::TreeWalker(const OwningSnapshot* snap, CharOffset offset):
+        TreeWalker{ &snap->buffers, snap->meta, snap->root, offset } { }
+
+    TreeWalker::TreeWalker(const ReferenceSnapshot* snap, CharOffset offset):
+        TreeWalker{ &snap->buffers, snap->meta, snap->root, offset } { }
+
+    TreeWalker::TreeWalker(const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset):
+        buffers{ buffers },
+        compactions{ buffers->compactions },
+        root{ root.dup() },
+        meta{ meta },
         total_offset{ offset }
     {
         // Populate initial stack state.
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Left);
+        walker_stack_push(&stack, this->root.root_ptr(), Direction::Left);
         fast_forward_to(offset);
     }
 
-    TreeWalker::TreeWalker(Arena::Arena* arena, const ReferenceSnapshot* snap, CharOffset offset):
-        buffers{ &snap->buffers },
-        root{ snap->root.dup() },
-        meta{ snap->meta },
-        arena{ arena },
-        total_offset{ offset }
+    TreeWalker::TreeWalker(Arena::Arena*, const Tree* tree, CharOffset offset):
+        TreeWalker{ tree, offset } { }
+
+    TreeWalker::TreeWalker(Arena::Arena*, const OwningSnapshot* snap, CharOffset offset):
+        TreeWalker{ snap, offset } { }
+
+    TreeWalker::TreeWalker(Arena::Arena*, const ReferenceSnapshot* snap, CharOffset offset):
+        TreeWalker{ snap, offset } { }
+
+    TreeWalker::TreeWalker(Arena::Arena*, const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset):
+        TreeWalker{ buffers, meta, root, offset } { }
+
+    TreeWalker::TreeWalker(const TreeWalker& other):
+        buffers{ other.buffers },
+        compactions{ other.compactions },
+        root{ other.root.dup() },
+        meta{ other.meta },
+        total_offset{ other.total_offset },
+        first_ptr{ other.first_ptr },
+        last_ptr{ other.last_ptr },
+        current_piece{ other.current_piece }
     {
-        // Populate initial stack state.
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Left);
-        fast_forward_to(offset);
+        walker_stack_copy(&stack, other.stack);
     }
 
-    TreeWalker::TreeWalker(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, CharOffset offset):
-        buffers{ buffers },
-        root{ root.dup() },
-        meta{ meta },
-        arena{ arena },
-        total_offset{ offset }
+    TreeWalker& TreeWalker::operator=(const TreeWalker& other)
     {
-        // Populate initial stack state.
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Left);
-        fast_forward_to(offset);
+        buffers = other.buffers;
+        compactions = other.compactions;
+        root = other.root.dup();
+        meta = other.meta;
+        total_offset = other.total_offset;
+        first_ptr = other.first_ptr;
+        last_ptr = other.last_ptr;
+        current_piece = other.current_piece;
+        walker_stack_copy(&stack, other.stack);
+        return *this;
     }
 
     char TreeWalker::next()
@@ -2200,8 +5255,31 @@ namespace PieceTree
         first_ptr = last_ptr;
         next();
     }
-    
-    
+
+    String8View TreeWalker::next_chunk()
+    {
+        if (exhausted())
+            return { };
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // Catchall.
+            if (first_ptr == last_ptr)
+                return next_chunk();
+        }
+        String8View chunk{ .str = first_ptr, .size = static_cast<uint64_t>(last_ptr - first_ptr) };
+        total_offset = total_offset + Length{ chunk.size };
+        first_ptr = last_ptr;
+        // Loading the next piece now lets 'exhausted' report the end as soon as the last chunk is out.
+        populate_ptrs();
+        return chunk;
+    }
+
+    String8View TreeWalker::chunk_at(CharOffset offset)
+    {
+        seek(offset);
+        return next_chunk();
+    }
 
     char TreeWalker::current()
     {
@@ -2217,8 +5295,9 @@ namespace PieceTree
 
     void TreeWalker::seek(CharOffset offset)
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         walker_stack_clear(&stack);
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Left);
+        walker_stack_push(&stack, root.root_ptr(), Direction::Left);
         total_offset = offset;
         fast_forward_to(offset);
     }
@@ -2231,11 +5310,11 @@ namespace PieceTree
         if (first_ptr != last_ptr)
             return false;
         // If there's more than one entry on the stack, we're still active.
-        if (stack.stack->next != nullptr)
+        if (stack.count > 1)
             return false;
         // Now, if there's exactly one entry and that entry itself is exhausted (no right subtree)
         // we're done.
-        StackEntry* entry = walker_stack_top(stack);
+        const StackEntry* entry = walker_stack_top(stack);
         // We descended into a null child, we're done.
         if (nil_node(entry->node))
             return true;
@@ -2251,6 +5330,7 @@ namespace PieceTree
 
     void TreeWalker::populate_ptrs()
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         if (exhausted())
             return;
         if (nil_node(walker_stack_top(stack)->node))
@@ -2260,7 +5340,7 @@ namespace PieceTree
             return;
         }
 
-        auto& [nxt, node, dir] = *walker_stack_top(stack);
+        auto& [node, dir] = *walker_stack_top(stack);
         if (dir == Direction::Left)
         {
             if (not nil_node(node->payload.left))
@@ -2268,7 +5348,7 @@ namespace PieceTree
                 const RBNodeCounted* left = node->payload.left;
                 // Change the dir for when we pop back.
                 walker_stack_top(stack)->dir = Direction::Center;
-                walker_stack_push(arena, &stack, left, Direction::Left);
+                walker_stack_push(&stack, left, Direction::Left);
                 populate_ptrs();
                 return;
             }
@@ -2285,6 +5365,8 @@ namespace PieceTree
             auto last_offset = buffers->buffer_offset(piece.index, piece.last);
             first_ptr = buffer->buffer.str + rep(first_offset);
             last_ptr = buffer->buffer.str + rep(last_offset);
+            // Start loading what comes next while this piece is consumed.
+            prefetch_next(buffers, stack, node->payload.right, &Piece::first);
             // Change this direction.
             current_piece = piece;
             walker_stack_top(stack)->dir = Direction::Right;
@@ -2294,7 +5376,7 @@ namespace PieceTree
         assert(dir == Direction::Right);
         const RBNodeCounted* right = node->payload.right;
         walker_stack_pop(&stack);
-        walker_stack_push(arena, &stack, right, Direction::Left);
+        walker_stack_push(&stack, right, Direction::Left);
         populate_ptrs();
     }
 
@@ -2308,7 +5390,7 @@ namespace PieceTree
                 // For when we revisit this node.
                 walker_stack_top(stack)->dir = Direction::Center;
                 node = node->payload.left;
-                walker_stack_push(arena, &stack, node, Direction::Left);
+                walker_stack_push(&stack, node, Direction::Left);
             }
             // It is inside this node.
             else if (rep(node->payload.data.left_subtree_length + node->payload.data.piece.length) > rep(offset))
@@ -2323,6 +5405,7 @@ namespace PieceTree
                 first_ptr = buffer->buffer.str + rep(first_offset) + rep(offset);
                 last_ptr = buffer->buffer.str + rep(last_offset);
                 current_piece = piece;
+                prefetch_next(buffers, stack, node->payload.right, &Piece::first);
                 return;
             }
             else
@@ -2333,47 +5416,81 @@ namespace PieceTree
                 auto offset_amount = rep(node->payload.data.left_subtree_length + node->payload.data.piece.length);
                 offset = retract(offset, offset_amount);
                 node = node->payload.right;
-                walker_stack_push(arena, &stack, node, Direction::Left);
+                walker_stack_push(&stack, node, Direction::Left);
             }
         }
     }
 
-    ReverseTreeWalker::ReverseTreeWalker(Arena::Arena* arena, const Tree* tree, CharOffset offset):
+    ReverseTreeWalker::ReverseTreeWalker(const Tree* tree, CharOffset offset):
         buffers{ &tree->buffers },
-        root{ tree->root.dup() },
+        compactions{ tree->buffers.compactions },
+        root{ (tree->settle_typing(), tree->root.dup()) },
         meta{ tree->meta },
-        arena{ arena },
         total_offset{ offset }
     {
         // Initial start.
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Right);
+        walker_stack_push(&stack, root.root_ptr(), Direction::Right);
         fast_forward_to(offset);
     }
 
-    ReverseTreeWalker::ReverseTreeWalker(Arena::Arena* arena, const OwningSnapshot* snap, CharOffset offset):
+    ReverseTreeWalker::ReverseTreeWalker(const OwningSnapshot* snap, CharOffset offset):
         buffers{ &snap->buffers },
+        compactions{ snap->buffers.compactions },
         root{ snap->root.dup() },
         meta{ snap->meta },
-        arena{ arena },
         total_offset{ offset }
     {
         // Initial start.
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Right);
+        walker_stack_push(&stack, root.root_ptr(), Direction::Right);
         fast_forward_to(offset);
     }
 
-    ReverseTreeWalker::ReverseTreeWalker(Arena::Arena* arena, const ReferenceSnapshot* snap, CharOffset offset):
+    ReverseTreeWalker::ReverseTreeWalker(const ReferenceSnapshot* snap, CharOffset offset):
         buffers{ &snap->buffers },
+        compactions{ snap->buffers.compactions },
         root{ snap->root.dup() },
         meta{ snap->meta },
-        arena{ arena },
         total_offset{ offset }
     {
         // Initial start.
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Right);
+        walker_stack_push(&stack, root.root_ptr(), Direction::Right);
         fast_forward_to(offset);
     }
 
+    ReverseTreeWalker::ReverseTreeWalker(Arena::Arena*, const Tree* tree, CharOffset offset):
+        ReverseTreeWalker{ tree, offset } { }
+
+    ReverseTreeWalker::ReverseTreeWalker(Arena::Arena*, const OwningSnapshot* snap, CharOffset offset):
+        ReverseTreeWalker{ snap, offset } { }
+
+    ReverseTreeWalker::ReverseTreeWalker(Arena::Arena*, const ReferenceSnapshot* snap, CharOffset offset):
+        ReverseTreeWalker{ snap, offset } { }
+
+    ReverseTreeWalker::ReverseTreeWalker(const ReverseTreeWalker& other):
+        buffers{ other.buffers },
+        compactions{ other.compactions },
+        root{ other.root.dup() },
+        meta{ other.meta },
+        total_offset{ other.total_offset },
+        first_ptr{ other.first_ptr },
+        last_ptr{ other.last_ptr }
+    {
+        walker_stack_copy(&stack, other.stack);
+    }
+
+    ReverseTreeWalker& ReverseTreeWalker::operator=(const ReverseTreeWalker& other)
+    {
+        buffers = other.buffers;
+        compactions = other.compactions;
+        root = other.root.dup();
+        meta = other.meta;
+        total_offset = other.total_offset;
+        first_ptr = other.first_ptr;
+        last_ptr = other.last_ptr;
+        walker_stack_copy(&stack, other.stack);
+        return *this;
+    }
+
     char ReverseTreeWalker::next()
     {
         if (first_ptr == last_ptr)
@@ -2394,6 +5511,32 @@ namespace PieceTree
         return *(--first_ptr);
     }
 
+    String8View ReverseTreeWalker::next_chunk()
+    {
+        if (exhausted())
+            return { };
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // Catchall.
+            if (first_ptr == last_ptr)
+                return next_chunk();
+        }
+        // Recall that 'last_ptr' is the start of the piece for the reverse walker.
+        String8View chunk{ .str = last_ptr, .size = static_cast<uint64_t>(first_ptr - last_ptr) };
+        total_offset = retract(total_offset, chunk.size);
+        first_ptr = last_ptr;
+        // Loading the next piece now lets 'exhausted' report the end as soon as the last chunk is out.
+        populate_ptrs();
+        return chunk;
+    }
+
+    String8View ReverseTreeWalker::chunk_at(CharOffset offset)
+    {
+        seek(offset);
+        return next_chunk();
+    }
+
     char ReverseTreeWalker::current()
     {
         if (first_ptr == last_ptr)
@@ -2408,8 +5551,9 @@ namespace PieceTree
 
     void ReverseTreeWalker::seek(CharOffset offset)
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         walker_stack_clear(&stack);
-        walker_stack_push(arena, &stack, root.root_ptr(), Direction::Right);
+        walker_stack_push(&stack, root.root_ptr(), Direction::Right);
         total_offset = offset;
         fast_forward_to(offset);
     }
@@ -2422,11 +5566,11 @@ namespace PieceTree
         if (first_ptr != last_ptr)
             return false;
         // If there's more than one entry on the stack, we're still active.
-        if (stack.stack->next != nullptr)
+        if (stack.count > 1)
             return false;
         // Now, if there's exactly one entry and that entry itself is exhausted (no right subtree)
         // we're done.
-        StackEntry* entry = walker_stack_top(stack);
+        const StackEntry* entry = walker_stack_top(stack);
         // We descended into a null child, we're done.
         if (nil_node(entry->node))
             return true;
@@ -2443,6 +5587,7 @@ namespace PieceTree
 
     void ReverseTreeWalker::populate_ptrs()
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         if (exhausted())
             return;
         if (nil_node(walker_stack_top(stack)->node))
@@ -2452,7 +5597,7 @@ namespace PieceTree
             return;
         }
 
-        auto& [nxt, node, dir] = *walker_stack_top(stack);
+        auto& [node, dir] = *walker_stack_top(stack);
         if (dir == Direction::Right)
         {
             if (not nil_node(node->payload.right))
@@ -2460,7 +5605,7 @@ namespace PieceTree
                 const RBNodeCounted* right = node->payload.right;
                 // Change the dir for when we pop back.
                 walker_stack_top(stack)->dir = Direction::Center;
-                walker_stack_push(arena, &stack, right, Direction::Right);
+                walker_stack_push(&stack, right, Direction::Right);
                 populate_ptrs();
                 return;
             }
@@ -2477,6 +5622,7 @@ namespace PieceTree
             auto last_offset = buffers->buffer_offset(piece.index, piece.last);
             last_ptr = buffer->buffer.str + rep(first_offset);
             first_ptr = buffer->buffer.str + rep(last_offset);
+            prefetch_next(buffers, stack, node->payload.left, &Piece::last);
             // Change this direction.
             walker_stack_top(stack)->dir = Direction::Left;
             return;
@@ -2485,7 +5631,7 @@ namespace PieceTree
         assert(dir == Direction::Left);
         const RBNodeCounted* left = node->payload.left;
         walker_stack_pop(&stack);
-        walker_stack_push(arena, &stack, left, Direction::Right);
+        walker_stack_push(&stack, left, Direction::Right);
         populate_ptrs();
     }
 
@@ -2500,7 +5646,7 @@ namespace PieceTree
                 // This parent is no longer relevant.
                 walker_stack_pop(&stack);
                 node = node->payload.left;
-                walker_stack_push(arena, &stack, node, Direction::Right);
+                walker_stack_push(&stack, node, Direction::Right);
             }
             // It is inside this node.
             else if (rep(node->payload.data.left_subtree_length + node->payload.data.piece.length) > rep(offset))
@@ -2515,6 +5661,7 @@ namespace PieceTree
                 // We extend offset because it is the point where we want to start and because this walker works by dereferencing
                 // 'first_ptr - 1', offset + 1 is our 'begin'.
                 first_ptr = buffer->buffer.str + rep(first_offset) + rep(extend(offset));
+                prefetch_next(buffers, stack, node->payload.left, &Piece::last);
                 return;
             }
             else
@@ -2524,9 +5671,386 @@ namespace PieceTree
                 auto offset_amount = rep(node->payload.data.left_subtree_length + node->payload.data.piece.length);
                 offset = retract(offset, offset_amount);
                 node = node->payload.right;
-                walker_stack_push(arena, &stack, node, Direction::Right);
+                walker_stack_push(&stack, node, Direction::Right);
+            }
+        }
+    }
+
+    TextCursor::TextCursor(const Tree* tree, CharOffset offset):
+        tree{ tree }
+    {
+        sync();
+        locate(offset);
+    }
+
+    char TextCursor::current()
+    {
+        sync();
+        if (rep(cursor_offset) >= rep(total_length))
+            return '\0';
+        return piece_ptr[rep(cursor_offset) - rep(piece_first)];
+    }
+
+    Line TextCursor::line()
+    {
+        sync();
+        if (piece == nullptr)
+            return Line::Beginning;
+        auto remainder = distance(piece_first, cursor_offset);
+        auto pos = Tree::buffer_position(&tree->buffers, *piece, remainder);
+        auto lf_count = rep(piece_lf_first) + rep(retract(pos.line, rep(piece->first.line)));
+        return Line{ lf_count + 1 };
+    }
+
+    Column TextCursor::column()
+    {
+        sync();
+        if (piece == nullptr)
+            return Column{ };
+        auto remainder = distance(piece_first, cursor_offset);
+        auto pos = Tree::buffer_position(&tree->buffers, *piece, remainder);
+        // If the line begins inside of this piece, the buffer column is the column.
+        if (pos.line != piece->first.line)
+            return pos.column;
+        auto offset = cursor_offset;
+        auto first = line_start(line());
+        locate(offset);
+        return Column{ rep(distance(first, offset)) };
+    }
+
+    void TextCursor::seek(CharOffset offset)
+    {
+        sync();
+        locate(offset);
+    }
+
+    void TextCursor::advance(Length count)
+    {
+        sync();
+        auto target = rep(cursor_offset) + rep(count);
+        // Stay within the current piece if possible.
+        if (piece != nullptr and target < rep(piece_first) + rep(piece->length))
+        {
+            cursor_offset = CharOffset{ target };
+            return;
+        }
+        locate(CharOffset{ target });
+    }
+
+    void TextCursor::retreat(Length count)
+    {
+        sync();
+        auto target = rep(cursor_offset) > rep(count) ? rep(cursor_offset) - rep(count) : 0;
+        if (piece != nullptr and target >= rep(piece_first))
+        {
+            cursor_offset = CharOffset{ target };
+            return;
+        }
+        locate(CharOffset{ target });
+    }
+
+    void TextCursor::seek_line(Line line, Column column)
+    {
+        sync();
+        auto last_line = Line{ rep(total_lf_count) + 1 };
+        if (line == Line::IndexBeginning)
+            line = Line::Beginning;
+        if (rep(line) > rep(last_line))
+            line = last_line;
+        auto first = line_start(line);
+        // Clamp the column to the line content.
+        CharOffset last = CharOffset{ rep(total_length) };
+        if (line != last_line)
+        {
+            last = retract(line_start(extend(line)));
+        }
+        auto target = first + Length{ rep(column) };
+        if (rep(target) > rep(last))
+            target = last;
+        locate(target);
+    }
+
+    void TextCursor::advance_lines(Length count)
+    {
+        auto col = column();
+        seek_line(Line{ rep(line()) + rep(count) }, col);
+    }
+
+    void TextCursor::retreat_lines(Length count)
+    {
+        auto col = column();
+        auto current_line = rep(line());
+        auto target = current_line > rep(count) ? current_line - rep(count) : rep(Line::Beginning);
+        seek_line(Line{ target }, col);
+    }
+
+    CharOffset TextCursor::offset_at(Line line, Column column)
+    {
+        seek_line(line, column);
+        return cursor_offset;
+    }
+
+    void TextCursor::sync()
+    {
+        tree->settle_typing();
+        if (root.root_ptr() == tree->root.root_ptr())
+            return;
+        root = tree->root.dup();
+        total_length = tree->meta.total_content_length;
+        total_lf_count = tree->meta.lf_count;
+        depth = 0;
+        piece = nullptr;
+        piece_ptr = nullptr;
+        locate(cursor_offset);
+    }
+
+    void TextCursor::push_entry(const PathEntry& entry)
+    {
+        assert(depth < max_walker_depth);
+        path[depth++] = entry;
+    }
+
+    void TextCursor::locate(CharOffset offset)
+    {
+        if (rep(offset) > rep(total_length))
+            offset = CharOffset{ rep(total_length) };
+        cursor_offset = offset;
+        if (total_length == Length{ })
+        {
+            depth = 0;
+            piece = nullptr;
+            piece_ptr = nullptr;
+            return;
+        }
+        // The end of the buffer is the end of the last piece.
+        auto probe = rep(offset) < rep(total_length) ? rep(offset) : rep(total_length) - 1;
+        // Climb until the subtree covers the target.
+        while (depth != 0 and (probe < rep(path[depth - 1].first) or probe >= rep(path[depth - 1].last)))
+        {
+            --depth;
+        }
+        if (depth == 0)
+        {
+            push_entry({ .node = root.root_ptr(),
+                         .first = CharOffset{ },
+                         .last = CharOffset{ rep(total_length) },
+                         .lf_first = LFCount{ },
+                         .lf_last = total_lf_count });
+        }
+        while (true)
+        {
+            const PathEntry& entry = path[depth - 1];
+            const NodeData& data = entry.node->payload.data;
+            auto left_last = entry.first + data.left_subtree_length;
+            auto left_lf_last = LFCount{ rep(entry.lf_first) + rep(data.left_subtree_lf_count) };
+            if (probe < rep(left_last))
+            {
+                push_entry({ .node = entry.node->payload.left,
+                             .first = entry.first,
+                             .last = left_last,
+                             .lf_first = entry.lf_first,
+                             .lf_last = left_lf_last });
+            }
+            else if (probe < rep(left_last + data.piece.length))
+            {
+                piece = &data.piece;
+                auto* buffer = tree->buffers.buffer_at(data.piece.index);
+                piece_ptr = buffer->buffer.str + rep(tree->buffers.buffer_offset(data.piece.index, data.piece.first));
+                piece_first = left_last;
+                piece_lf_first = left_lf_last;
+                return;
+            }
+            else
+            {
+                push_entry({ .node = entry.node->payload.right,
+                             .first = left_last + data.piece.length,
+                             .last = entry.last,
+                             .lf_first = LFCount{ rep(left_lf_last) + rep(data.piece.newline_count) },
+                             .lf_last = entry.lf_last });
+            }
+        }
+    }
+
+    CharOffset TextCursor::line_start(Line line)
+    {
+        // The start of line N follows the (N - 1)th LF.
+        auto lf = rep(line) - 1;
+        if (lf == 0 or total_length == Length{ })
+            return CharOffset{ };
+        while (depth != 0 and (lf <= rep(path[depth - 1].lf_first) or lf > rep(path[depth - 1].lf_last)))
+        {
+            --depth;
+        }
+        if (depth == 0)
+        {
+            push_entry({ .node = root.root_ptr(),
+                         .first = CharOffset{ },
+                         .last = CharOffset{ rep(total_length) },
+                         .lf_first = LFCount{ },
+                         .lf_last = total_lf_count });
+        }
+        while (true)
+        {
+            const PathEntry& entry = path[depth - 1];
+            const NodeData& data = entry.node->payload.data;
+            auto left_last = entry.first + data.left_subtree_length;
+            auto left_lf_last = LFCount{ rep(entry.lf_first) + rep(data.left_subtree_lf_count) };
+            if (lf <= rep(left_lf_last))
+            {
+                push_entry({ .node = entry.node->payload.left,
+                             .first = entry.first,
+                             .last = left_last,
+                             .lf_first = entry.lf_first,
+                             .lf_last = left_lf_last });
+            }
+            else if (lf <= rep(left_lf_last) + rep(data.piece.newline_count))
+            {
+                // The line begins inside of this piece (or immediately after it).
+                auto line_index = rep(data.piece.first.line) + (lf - rep(left_lf_last));
+                auto* starts = tree->buffers.buffer_at(data.piece.index)->line_starts.starts;
+                auto piece_offset = tree->buffers.buffer_offset(data.piece.index, data.piece.first);
+                return left_last + distance(piece_offset, CharOffset{ rep(starts[line_index]) });
+            }
+            else
+            {
+                push_entry({ .node = entry.node->payload.right,
+                             .first = left_last + data.piece.length,
+                             .last = entry.last,
+                             .lf_first = LFCount{ rep(left_lf_last) + rep(data.piece.newline_count) },
+                             .lf_last = entry.lf_last });
+            }
+        }
+    }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const Tree* tree, StripCRLF strip, Line line):
+        LineWalker{ arena, &tree->buffers, tree->meta, (tree->settle_typing(), tree->root), strip, line } { }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const OwningSnapshot* snap, StripCRLF strip, Line line):
+        LineWalker{ arena, &snap->buffers, snap->meta, snap->root, strip, line } { }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const ReferenceSnapshot* snap, StripCRLF strip, Line line):
+        LineWalker{ arena, &snap->buffers, snap->meta, snap->root, strip, line } { }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const RedBlackTree& root, StripCRLF strip, Line line):
+        arena{ arena },
+        walker{ buffers, meta, root, line_offset(buffers, root, line) },
+        strip{ strip },
+        next_line{ line == Line::IndexBeginning ? Line::Beginning : line }
+    {
+        // Past the last line there is nothing to produce.
+        if (rep(next_line) > rep(meta.lf_count) + 1)
+        {
+            done = true;
+        }
+    }
+
+    CharOffset LineWalker::line_offset(const BufferCollection* buffers, const RedBlackTree& root, Line line)
+    {
+        CharOffset offset{ };
+        if (rep(line) > rep(Line::Beginning) and not root.is_empty())
+        {
+            Tree::line_start<&Tree::accumulate_value>(&offset, buffers, root, line);
+        }
+        return offset;
+    }
+
+    void LineWalker::push_slice(String8View slice)
+    {
+        if (slice.size == 0)
+            return;
+        if (slice_count == slice_capacity)
+        {
+            auto new_capacity = slice_capacity == 0 ? 16 : slice_capacity * 2;
+            String8View* new_slices = Arena::push_array_no_zero<String8View>(arena, new_capacity);
+            if (slice_count != 0)
+            {
+                memcpy(new_slices, slices, slice_count * sizeof(String8View));
             }
+            slices = new_slices;
+            slice_capacity = new_capacity;
+        }
+        slices[slice_count++] = slice;
+    }
+
+    LineSlices LineWalker::next_slices()
+    {
+        slice_count = 0;
+        LineSlices result{ .slices = slices, .count = 0, .length = Length{ }, .incomplete_crlf = IncompleteCRLF::No };
+        if (done)
+            return result;
+        bool found_lf = false;
+        while (true)
+        {
+            if (chunk.size == 0)
+            {
+                chunk = walker.next_chunk();
+                // End of the buffer terminates the final line.
+                if (chunk.size == 0)
+                {
+                    done = true;
+                    break;
+                }
+            }
+            auto* lf = static_cast<const char*>(memchr(chunk.str, '\n', chunk.size));
+            if (lf != nullptr)
+            {
+                auto amount = static_cast<uint64_t>(lf - chunk.str);
+                push_slice({ .str = chunk.str, .size = amount });
+                chunk.str += amount + 1;
+                chunk.size -= amount + 1;
+                found_lf = true;
+                break;
+            }
+            push_slice(chunk);
+            chunk = { };
+        }
+        next_line = extend(next_line);
+        if (strip == StripCRLF::Yes)
+        {
+            bool had_cr = slice_count != 0 and slices[slice_count - 1].str[slices[slice_count - 1].size - 1] == '\r';
+            if (had_cr)
+            {
+                --slices[slice_count - 1].size;
+                if (slices[slice_count - 1].size == 0)
+                {
+                    --slice_count;
+                }
+            }
+            else if (found_lf)
+            {
+                result.incomplete_crlf = IncompleteCRLF::Yes;
+            }
+        }
+        uint64_t length = 0;
+        for EachIndex(i, slice_count)
+        {
+            length += slices[i].size;
+        }
+        result.slices = slices;
+        result.count = slice_count;
+        result.length = Length{ length };
+        return result;
+    }
+
+    String8View LineWalker::next()
+    {
+        LineSlices line = next_slices();
+        if (line.count == 0)
+            return { .str = "", .size = 0 };
+        if (line.count == 1)
+            return line.slices[0];
+        if (line_capacity < rep(line.length))
+        {
+            line_capacity = rep(line.length) < line_capacity * 2 ? line_capacity * 2 : rep(line.length);
+            line_buf = Arena::push_array_no_zero<char>(arena, line_capacity);
+        }
+        char* out = line_buf;
+        for EachIndex(i, line.count)
+        {
+            memcpy(out, line.slices[i].str, line.slices[i].size);
+            out += line.slices[i].size;
         }
+        return { .str = line_buf, .size = rep(line.length) };
     }
 
     SelectionNode* push_selection(Arena::Arena* arena, SelectionList* lst, Selection sel)
@@ -2574,7 +6098,6 @@ namespace PieceTree
 void print_buffer(const PieceTree::Tree* tree)
 {
     printf("--- Entire Buffer ---\n");
-    auto scratch = Arena::scratch_begin(Arena::no_conflicts);
 
     PieceTree::Length len = tree->length();
     for EachIndex(i, rep(len))
@@ -2582,7 +6105,7 @@ void print_buffer(const PieceTree::Tree* tree)
         printf("|%2zu", i);
     }
     printf("\n");
-    PieceTree::TreeWalker walker{ scratch.arena, tree };
+    PieceTree::TreeWalker walker{ tree };
     while (not walker.exhausted())
     {
         char c = walker.next();
@@ -2592,7 +6115,6 @@ void print_buffer(const PieceTree::Tree* tree)
             printf("| %c", c);
     }
     printf("\n");
-    Arena::scratch_end(scratch);
 }
 
 void flush()
@@ -25,6 +25,47 @@
 #define FRED_UNUSED(x) (void)x
 #define FRED_UNUSED_RESULT(x) (void)x
 
+// Software prefetch hints for the tree traversals.  Define FRED_NO_PREFETCH to compile them out.
+#if defined(FRED_NO_PREFETCH)
+#define FRED_PREFETCH(addr) FRED_UNUSED((addr))
+#elif defined(_MSC_VER)
+#include <xmmintrin.h>
+#define FRED_PREFETCH(addr) _mm_prefetch(reinterpret_cast<const char*>(addr), _MM_HINT_T0)
+#else
+#define FRED_PREFETCH(addr) __builtin_prefetch(addr)
+#endif
+
+// Lets empty members (e.g. an empty summary list) take no space.
+#if defined(_MSC_VER)
+#define FRED_NO_UNIQUE_ADDRESS [[msvc::no_unique_address]]
+#else
+#define FRED_NO_UNIQUE_ADDRESS [[no_unique_address]]
+#endif
+
+// Tree summaries.  Define any of these to 1 to keep the summary in every piece and node, along with the buffer indexes
+// and the queries built on it.  None is kept by default, so pieces and nodes hold only their lengths and line feeds and
+// edits compute nothing more.
+#ifndef FRED_CODE_POINT_SUMMARY
+#define FRED_CODE_POINT_SUMMARY 0 // Code point offsets and columns.
+#endif
+#ifndef FRED_UTF16_SUMMARY
+#define FRED_UTF16_SUMMARY 0 // UTF-16 positions.
+#endif
+#ifndef FRED_LINE_EXTENT_SUMMARY
+#define FRED_LINE_EXTENT_SUMMARY 0 // The longest line.
+#endif
+#ifndef FRED_BRACKET_SUMMARY
+#define FRED_BRACKET_SUMMARY 0 // Bracket matching.
+#endif
+#ifndef FRED_HASH_SUMMARY
+#define FRED_HASH_SUMMARY 0 // Rolling hashes of the text.
+#endif
+#ifndef FRED_WRAP_SUMMARY
+#define FRED_WRAP_SUMMARY 0 // Soft wrapping.
+#endif
+// The per-buffer index sampling code point, UTF-16 and hash prefixes, built when any of them is kept.
+#define FRED_CODE_POINT_INDEX (FRED_CODE_POINT_SUMMARY || FRED_UTF16_SUMMARY || FRED_HASH_SUMMARY)
+
 // Please implement this per your platform.
 #ifdef NDEBUG
 #define ASAN_POISON_MEMORY_REGION(addr, size) 
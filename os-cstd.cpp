@@ -26,7 +26,8 @@ namespace OS
     // Memory allocation.
     void* mem_reserve(AllocationSize size)
     {
-        return malloc(rep(size));
+        // The arena expects new pages to read as zero, as they would from the OS.
+        return calloc(1, rep(size));
     }
 
     bool mem_commit(void*, AllocationSize)
@@ -48,7 +49,7 @@ namespace OS
 
     void* mem_reserve_large(AllocationSize size)
     {
-        return malloc(rep(size));
+        return calloc(1, rep(size));
     }
 
     bool mem_commit_large(void*, AllocationSize)
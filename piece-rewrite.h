@@ -0,0 +1,148 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cassert>
+
+#include "arena.h"
+#include "enum-utils.h"
+#include "macros.h"
+#include "types.h"
+
+// The parts of a mod buffer compaction which do not depend on the tree: the map visiting each node shared by the
+// trees of a history once and the rewrite moving their pieces into the compacted buffer.
+namespace Editor
+{
+    // An open addressed map between nodes, used by a compaction to visit each node shared by the trees of a history
+    // once.  'capacity' is zero or a power of two.
+    struct NodeMap
+    {
+        const void** keys;
+        const void** values;
+        uint64_t capacity;
+        uint64_t count;
+    };
+
+    // The mod buffer bytes [first, last) which are kept by a compaction and move to 'moved_to'.
+    struct LiveRange
+    {
+        uint64_t first;
+        uint64_t last;
+        uint64_t moved_to;
+    };
+
+    inline uint64_t node_slot(const void* node, uint64_t capacity)
+    {
+        return (reinterpret_cast<uintptr_t>(node) * 0x9E3779B97F4A7C15ull >> 32) & (capacity - 1);
+    }
+
+    inline const void* node_map_find(const NodeMap* map, const void* key)
+    {
+        if (map->count == 0)
+            return nullptr;
+        auto slot = node_slot(key, map->capacity);
+        for (uint64_t probes = 0; probes != map->capacity and map->keys[slot] != nullptr; ++probes)
+        {
+            if (map->keys[slot] == key)
+                return map->values[slot];
+            slot = (slot + 1) & (map->capacity - 1);
+        }
+        return nullptr;
+    }
+
+    inline void node_map_insert(Arena::Arena* arena, NodeMap* map, const void* key, const void* value);
+
+    // Doubles the capacity, counting the entries again as they are moved.
+    inline void node_map_grow(Arena::Arena* arena, NodeMap* map)
+    {
+        NodeMap grown{ };
+        grown.capacity = map->capacity == 0 ? 64 : map->capacity * 2;
+        grown.keys = Arena::push_array<const void*>(arena, grown.capacity);
+        grown.values = Arena::push_array_no_zero<const void*>(arena, grown.capacity);
+        for EachIndex(i, map->capacity)
+        {
+            if (map->keys[i] != nullptr)
+            {
+                node_map_insert(arena, &grown, map->keys[i], map->values[i]);
+            }
+        }
+        *map = grown;
+    }
+
+    inline void node_map_insert(Arena::Arena* arena, NodeMap* map, const void* key, const void* value)
+    {
+        // The map is kept at most half full.
+        if ((map->count + 1) * 2 > map->capacity)
+        {
+            node_map_grow(arena, map);
+        }
+        auto slot = node_slot(key, map->capacity);
+        for (uint64_t probes = 1; map->keys[slot] != nullptr and map->keys[slot] != key; ++probes)
+        {
+            if (probes == map->capacity)
+            {
+                // Every slot is taken, so the count fell behind what the map holds.  Growing counts it again.
+                assert(false and "node map holds more entries than it counted");
+                node_map_grow(arena, map);
+                node_map_insert(arena, map, key, value);
+                return;
+            }
+            slot = (slot + 1) & (map->capacity - 1);
+        }
+        map->count += map->keys[slot] == nullptr;
+        map->keys[slot] = key;
+        map->values[slot] = value;
+    }
+
+    // Moves the mod buffer pieces of the trees of a history into the compacted mod buffer.  'starts' are the line starts
+    // of the old buffer, 'new_starts' those of the compacted one and 'live' the kept ranges, in order.  Copies are
+    // remembered by the original node, so the trees of a history, which share most of their nodes, are copied at the
+    // cost of their distinct nodes.
+    template <typename Piece, typename LineStart>
+    struct PieceRewrite
+    {
+        using BufferIndex = decltype(Piece::index);
+        using BufferCursor = decltype(Piece::first);
+        using Line = decltype(BufferCursor::line);
+
+        const LineStart* starts;
+        const LineStart* new_starts;
+        uint64_t new_start_count;
+        const LiveRange* live;
+        uint64_t live_count;
+        Arena::Arena* arena;
+        NodeMap copies;
+
+        // Returns whether 'piece' changed.
+        bool apply(Piece* piece) const
+        {
+            if (piece->index != BufferIndex::ModBuf)
+                return false;
+            auto first = rep(starts[rep(piece->first.line)]) + rep(piece->first.column);
+            // The piece lies in the last kept range starting at or before it.
+            const LiveRange* range = std::upper_bound(live, live + live_count, first,
+                                                      [](uint64_t offset, const LiveRange& r) { return offset < r.first; }) - 1;
+            auto moved = range->moved_to + (first - range->first);
+            piece->first = position(moved);
+            piece->last = position(moved + rep(piece->length));
+            return true;
+        }
+
+        BufferCursor position(uint64_t offset) const
+        {
+            uint64_t line = std::upper_bound(new_starts, new_starts + new_start_count, LineStart{ offset }) - new_starts - 1;
+            return { .line = Line{ line }, .column = Column{ offset - rep(new_starts[line]) } };
+        }
+
+        const void* copy_of(const void* node) const
+        {
+            return node_map_find(&copies, node);
+        }
+
+        void remember(const void* node, const void* copy)
+        {
+            node_map_insert(arena, &copies, node, copy);
+        }
+    };
+} // namespace Editor
@@ -4,6 +4,7 @@
 #include "fred-strings.h"
 #include "ratbuf_btree.h"
 #include "types.h"
+#include "typing-cache.h"
 
 #ifndef NDEBUG
 #define TEXTBUF_DEBUG
@@ -16,11 +17,14 @@ namespace RatchetPieceTree
 {
     using StorageTree = B_Tree<16>;
     
+    struct FoldSnapshot;
+
     struct UndoRedoEntry
     {
         UndoRedoEntry* next;
         StorageTree root;
         CharOffset op_offset;
+        const FoldSnapshot* folds;
     };
 
     struct UndoRedoList
@@ -34,6 +38,22 @@ namespace RatchetPieceTree
     using UndoStack = UndoRedoList;
     using RedoStack = UndoRedoList;
 
+    // A root handed out by 'Tree::head'.  A compaction rewrites 'current' with the history, so that 'snap_to' given
+    // the old root snaps to the rewritten one.
+    struct HeadEntry
+    {
+        HeadEntry* next;
+        StorageTree given;
+        StorageTree current;
+    };
+
+    struct HeadList
+    {
+        HeadEntry* first;
+        HeadEntry* free_list;
+        uint64_t count;
+    };
+
     enum class LineStart : size_t { };
 
     struct LineStarts
@@ -54,10 +74,63 @@ namespace RatchetPieceTree
         Line line = { };
     };
 
+    // Code point counts sampled every 'code_point_block_size' bytes of a buffer: 'blocks[k]' is the number of code
+    // points in the first 'k * code_point_block_size' bytes, so counting any prefix only scans part of one block.
+    // 'utf16_blocks' holds the matching UTF-16 code unit counts and 'hash_blocks' the rolling hash of each prefix.  Only
+    // the arrays of the summaries kept are built.
+    struct CodePointIndex
+    {
+#if FRED_CODE_POINT_SUMMARY
+        CodePointCount* blocks;
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+        Utf16Count* utf16_blocks;
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+        uint64_t* hash_blocks;
+#endif // FRED_HASH_SUMMARY
+        uint64_t count;
+        uint64_t capacity;
+    };
+
+    // Maximum line lengths over aligned groups of lines: 'levels[0][k]' covers lines [32k, 32k + 32) of a buffer and
+    // each following level covers 32 entries of the one below it, so the longest line in any range of lines is found
+    // by scanning a few entries per level.  Only built for large immutable buffers, empty otherwise.
+    struct LineLengthIndex
+    {
+        Length* levels[8];
+        uint64_t counts[8];
+        uint64_t level_count;
+    };
+
+    // Bracket nesting over aligned spans of a buffer: 'levels[0][k]' summarizes bytes [256k, 256k + 256) and each
+    // following level summarizes 32 entries of the one below it, so any range is summarized (or searched) a few
+    // entries per level at a time.  Built for large immutable buffers and extended as the mod buffer grows, empty
+    // otherwise.
+    struct BracketIndex
+    {
+        BracketSummary* levels[6];
+        uint64_t counts[6];
+        uint64_t capacities[6];
+        uint64_t level_count;
+    };
+
     struct CharBuffer
     {
         String8 buffer;
         LineStarts line_starts;
+        // A sparse copy of 'line_starts' used to accelerate 'buffer_position'.  Only built for large immutable
+        // buffers, empty otherwise.
+        LineStarts line_start_samples;
+#if FRED_CODE_POINT_INDEX
+        CodePointIndex code_points;
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_LINE_EXTENT_SUMMARY
+        LineLengthIndex line_lengths;
+#endif // FRED_LINE_EXTENT_SUMMARY
+#if FRED_BRACKET_SUMMARY
+        BracketIndex brackets;
+#endif // FRED_BRACKET_SUMMARY
     };
     
     struct ModBuffer
@@ -65,10 +138,28 @@ namespace RatchetPieceTree
         String8 buffer;
     };
 
+    // Visual rows of every buffer when soft wrapping at 'width' bytes: 'rows[i][k]' is the number of rows taken by
+    // lines [0, k) of original buffer 'i' and 'mod_rows' is the same for the mod buffer.  Only the index of the current
+    // width is extended as the buffers grow; the others catch up when their width is set again.
+    struct WrapIndex
+    {
+        uint64_t width;
+        uint64_t** rows;
+        uint64_t count;
+        uint64_t capacity;
+        uint64_t* mod_rows;
+        uint64_t mod_count;
+        uint64_t mod_capacity;
+        WrapIndex* next;
+    };
+
+    // Snapshots only read the [0, count) they were taken with, so buffers adopted later are appended in place while
+    // 'capacity' allows.
     struct ImmutableBufferArray
     {
-        const CharBuffer* buffers;
+        CharBuffer* buffers;
         uint64_t count;
+        uint64_t capacity;
         uint64_t* ref_count;
     };
     
@@ -108,6 +199,22 @@ namespace RatchetPieceTree
         ImmutableBufferArray orig_buffers;
         CharBuffer mod_buffer;
         BTreeBlock* rb_tree_blk;
+#if FRED_BRACKET_SUMMARY
+        // The pairs tracked by 'BracketSummary', fixed when the tree is built.
+        BracketPairs bracket_pairs;
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_WRAP_SUMMARY
+        // Soft wrap rows for 'WrapSummary', null while wrapping is off.
+        WrapIndex* wrap;
+        // The indexes of every width set so far, so that going back to a width reuses its rows.
+        WrapIndex* wrap_cache;
+#endif // FRED_WRAP_SUMMARY
+        // The number of reference snapshots reading 'mod_buffer' in place, which a compaction waits for.
+        uint64_t* mod_buffer_pins;
+        // The roots handed out by 'Tree::head', kept until only this list holds them.
+        HeadList* heads;
+        // The number of compactions which moved the mod buffer, checked by the walkers over the tree.
+        uint64_t compactions;
     };
 
     struct LineRange
@@ -117,6 +224,13 @@ namespace RatchetPieceTree
         bool operator==(const LineRange&) const = default;
     };
 
+    // The text [first, last).
+    struct CharRange
+    {
+        CharOffset first;
+        CharOffset last;
+    };
+
     struct UndoRedoResult
     {
         bool success;
@@ -136,10 +250,123 @@ namespace RatchetPieceTree
     // allows callers to suppress this behavior.
     enum class SuppressHistory : bool { No, Yes };
 
+    // Inserts of at least this many bytes become immutable buffers of their own instead of growing the mod buffer.
+    constexpr uint64_t large_insert_size = 64 * 1024;
+
+    // Whether inserted text is adopted as an immutable buffer of its own or copied into the mod buffer.
+    enum class AdoptBuffer : bool { No, Yes };
+
     struct BufferMeta
     {
         LFCount lf_count = { };
         Length total_content_length = { };
+        TreeSummary summary = { };
+    };
+
+    // A byte column within a line.
+    struct LinePosition
+    {
+        Line line = { };
+        Column column = { };
+
+        bool operator==(const LinePosition&) const = default;
+    };
+
+    // A folded region: the lines after 'header' through 'last' are hidden while it is collapsed.
+    struct Fold
+    {
+        Line header;
+        Line last;
+        bool collapsed;
+    };
+
+    // The folds recorded with a history entry.
+    struct FoldSnapshot
+    {
+        Fold* folds;
+        uint64_t count;
+    };
+
+    // The folds of a tree, in the order of their headers with at most one fold per header.  The header and last line of
+    // every fold are kept as marks, sorted in 'marks' as '2 * line' for a header and '2 * line + 1' for a last line,
+    // and fold 'i' refers to its marks through 'header_marks[i]' and 'last_marks[i]'.  The lines hidden by collapsed
+    // folds are kept as sorted, disjoint runs: run 'i' hides 'hidden_before[i + 1] - hidden_before[i]' lines from
+    // 'run_first[i]' and 'run_header[i]' is the visible line number of the line before it, so mapping between visible
+    // and real lines is a binary search.
+    // An edit moves the marks and runs after it by the lines it adds or removes, which is deferred: the marks from
+    // 'mark_gap' on and the runs from 'run_gap' on are stored 'shift' lines before their place, so an edit only moves
+    // those between it and the edit before.  Changing the folds, or an edit which collapses marks or lands in a
+    // collapsed fold, rebuilds them at the cost of the number of folds but never the number of lines.  The arrays live
+    // in 'arena', which only holds the current ones.
+    struct FoldSet
+    {
+        Arena::Arena* arena;
+        uint64_t* marks;
+        uint64_t* header_marks;
+        uint64_t* last_marks;
+        bool* collapsed;
+        uint64_t* run_first;
+        uint64_t* run_header;
+        uint64_t* hidden_before;
+        uint64_t count;
+        uint64_t run_count;
+        uint64_t capacity;
+        uint64_t mark_gap;
+        uint64_t run_gap;
+        uint64_t shift;
+        // The folds as the history last recorded them, or null once they changed since.
+        const FoldSnapshot* saved;
+    };
+
+    using Editor::LiveRange;
+    using Editor::NodeMap;
+
+    // A mod buffer compaction in progress.  The roots of the history when it began are pinned so that the nodes marked
+    // since stay alive, 'stack' holds the nodes left to mark and 'live' the mod buffer ranges of the pieces marked.
+    struct Compaction
+    {
+        Arena::Arena* arena;
+        StorageTree::NodePtr* pinned;
+        uint64_t pinned_count;
+        StorageTree::NodePtr* stack;
+        uint64_t stack_count;
+        uint64_t stack_capacity;
+        NodeMap marked;
+        LiveRange* live;
+        uint64_t live_count;
+        uint64_t live_capacity;
+    };
+
+    struct CompactionResult
+    {
+        // Whether the compaction finished with this step.
+        bool done;
+        // The bytes dropped from the mod buffer when it finished.
+        Length reclaimed;
+    };
+
+    struct DefragmentPolicy
+    {
+        // Runs of two or more neighbouring pieces, each shorter than this, are copied into one new immutable buffer
+        // where every run becomes a single piece.  Zero only joins pieces which already follow each other in a buffer.
+        Length copy_below;
+    };
+
+    struct DefragmentReport
+    {
+        size_t pieces_before;
+        size_t pieces_after;
+        // The bytes copied into the new immutable buffer.
+        Length copied;
+    };
+
+    // A position in the form used by language servers: 'character' counts UTF-16 code units from the start of 'line'.
+    struct Utf16Position
+    {
+        Line line = { };
+        Utf16Count character = { };
+
+        bool operator==(const Utf16Position&) const = default;
     };
 
     // Indicates whether or not line was missing a CR (e.g. only a '\n' was at the end).
@@ -152,6 +379,7 @@ namespace RatchetPieceTree
     {
     public:
         explicit Tree(BufferCollection buffers);
+        ~Tree();
 
         // Interface.
         // Initialization after populating initial immutable buffers from ctor.
@@ -160,6 +388,16 @@ namespace RatchetPieceTree
         // Manipulation.
         void insert(CharOffset offset, String8 txt, SuppressHistory suppress_history = SuppressHistory::No);
         void remove(CharOffset offset, Length count, SuppressHistory suppress_history = SuppressHistory::No);
+        // Inserts 'txt' as an immutable buffer of its own without copying it, so it must outlive the tree and its
+        // snapshots.  'insert' copies text of 'large_insert_size' bytes or more into such a buffer, which keeps the
+        // mod buffer (and the copies owning snapshots make of it) small.
+        void insert_owned(CharOffset offset, String8 txt, SuppressHistory suppress_history = SuppressHistory::No);
+        // Replaces 'count' bytes at 'offset' by 'txt' as one edit with a single undo entry.  Text lying inside one piece
+        // is spliced in with a single descent.
+        void replace(CharOffset offset, Length count, String8 txt, SuppressHistory suppress_history = SuppressHistory::No);
+        // Moves 'count' bytes at 'from' to 'to', an offset outside them, as one edit.  The tree is cut around the text
+        // and put back together in the new order, so no text is copied whatever its size.
+        void move_range(CharOffset from, Length count, CharOffset to, SuppressHistory suppress_history = SuppressHistory::No);
         UndoRedoResult try_undo(CharOffset op_offset);
         UndoRedoResult try_redo(CharOffset op_offset);
 
@@ -168,7 +406,8 @@ namespace RatchetPieceTree
         void commit_head(CharOffset offset);
         StorageTree head() const;
         // Snaps the tree back to the specified root.  This needs to be called with a root that is derived from
-        // the set of buffers based on its creation.
+        // the set of buffers based on its creation.  A root taken with 'head' before a compaction snaps to its
+        // rewritten copy.
         void snap_to(const StorageTree& new_root);
 
         // Queries.
@@ -179,20 +418,145 @@ namespace RatchetPieceTree
         LineRange get_line_range(Line line) const;
         LineRange get_line_range_crlf(Line line) const;
         LineRange get_line_range_with_newline(Line line) const;
+        // Column-windowed line access.  Only the window [first_column, first_column + max_columns) is located and
+        // copied, clamped to the line (excluding LF), so the cost does not depend on the length of the line.
+        String8 get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const;
+        LineRange get_line_range_slice(Line line, Column first_column, Length max_columns) const;
+        // Bulk extraction.  The range is clamped to the end of the buffer.
+        String8 get_range(Arena::Arena* arena, CharOffset offset, Length count) const;
+        // 'dst' must have room for 'count' bytes.  Returns the number of bytes copied.
+        Length copy_range(CharOffset offset, Length count, char* dst) const;
+#if FRED_CODE_POINT_SUMMARY
+        // Code point queries.  A code point begins at every byte which does not continue a UTF-8 sequence.
+        // 'offset_to_codepoint' counts the code points beginning before 'offset' and 'codepoint_to_offset' returns
+        // where the given code point begins, or the end of the buffer.
+        CodePointCount offset_to_codepoint(CharOffset offset) const;
+        CharOffset codepoint_to_offset(CodePointCount codepoint) const;
+        // Code point columns, relative to the start of the line.  The offset is clamped to the end of the line.
+        CodePointCount codepoint_column(CharOffset offset) const;
+        CharOffset codepoint_column_offset(Line line, CodePointCount column) const;
+
+        CodePointCount codepoint_count() const
+        {
+            settle_typing();
+            return meta.summary.codepoints;
+        }
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+        // UTF-16 positions.  'character' is clamped to the end of the line (excluding LF) and a position inside a
+        // surrogate pair maps to the start of the pair.
+        Utf16Position offset_to_utf16_position(CharOffset offset) const;
+        CharOffset utf16_position_to_offset(Utf16Position position) const;
+#endif // FRED_UTF16_SUMMARY
+#if FRED_BRACKET_SUMMARY
+        // Bracket matching over the collection's 'bracket_pairs'.  Brackets inside the 'ignored' ranges (sorted and
+        // disjoint, e.g. strings and comments) are skipped.  'match_bracket' returns the bracket matching the one at
+        // 'offset' and 'enclosing_bracket' the innermost unmatched opening bracket of 'pair' before 'offset'.  Both
+        // return CharOffset::Sentinel if there is none.
+        CharOffset match_bracket(CharOffset offset, const CharRange* ignored = nullptr, uint64_t ignored_count = 0) const;
+        CharOffset enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored = nullptr, uint64_t ignored_count = 0) const;
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_HASH_SUMMARY
+        // Rolling hashes of the text.  Equal text hashes equal in every tree and snapshot, so ranges can be compared or
+        // checked for changes without reading them.  The range is clamped to the end of the buffer and 'hash_line'
+        // excludes the LF.
+        uint64_t hash_range(CharOffset offset, Length count) const;
+        uint64_t hash_line(Line line) const;
+
+        uint64_t content_hash() const
+        {
+            settle_typing();
+            return meta.summary.hash;
+        }
+#endif // FRED_HASH_SUMMARY
+
+#if FRED_WRAP_SUMMARY
+        // Soft wrapping.  Lines are broken every 'width' bytes into visual rows and an empty line takes one row.  A
+        // width of 0 turns wrapping off and rows are lines.  Edits only summarize the pieces they touch, while a new
+        // width wraps every piece again and builds the tree bottom-up.  So does restoring a root built for another width
+        // through the history or 'snap_to', once for each root restored.
+        void set_wrap_width(uint64_t width);
+        uint64_t visual_row_count() const;
+        // The row holding 'column' of 'line', clamped to the line, and the position where 'row' begins.
+        uint64_t visual_row(Line line, Column column) const;
+        LinePosition visual_row_start(uint64_t row) const;
+
+        uint64_t wrap_width() const
+        {
+            return buffers.wrap == nullptr ? 0 : buffers.wrap->width;
+        }
+#endif // FRED_WRAP_SUMMARY
+
+        // Folding.  A collapsed fold hides the lines after 'header' through 'last', and folds may nest or overlap.  Folds
+        // follow the text through edits: lines removed around a fold are clamped into it and a fold left without lines
+        // is dropped.  Undo and redo bring back the folds as they were at that point of the history, while 'snap_to'
+        // only drops the folds reaching past the end of the text.  Visible lines are numbered from 'Line::Beginning'
+        // and a hidden line maps to the visible header hiding it.
+        void add_fold(Line header, Line last, bool collapsed = true);
+        void remove_fold(Line header);
+        void set_fold_collapsed(Line header, bool collapsed);
+        void set_all_folds_collapsed(bool collapsed);
+        Line visible_to_line(Line visible) const;
+        Line line_to_visible(Line line) const;
+        Length visible_line_count() const;
+
+        // Typing cache.  While enabled, text typed at the last insertion point collects in a small gap buffer in front
+        // of the tree, as do edits inside it which record no history.  It goes into the tree as one piece when the
+        // cursor jumps, history is recorded or 'flush_typing' is called.  'at', 'length' and the line feed counts
+        // look through it, while the other queries and the walkers, cursors and snapshots built from the tree flush
+        // it first.  Folds follow edits line by line, so a tree with folds writes every edit through.
+        void set_typing_cache(bool enabled);
+        void flush_typing();
+
+        // Mod buffer compaction.  Text the edits leave behind stays in the mod buffer, as do its line starts and indexes,
+        // until a compaction drops the bytes which no piece of the tree or its history refers to and moves the rest
+        // down.  Each step marks up to 'budget' nodes of the history as it was when the compaction began, so a long
+        // history is marked between keystrokes.  The step which finishes marks the nodes made since, moves the text
+        // and rewrites the pieces of the tree and its history, at the cost of the live text and the distinct nodes
+        // holding it, along with the roots taken with 'head'.  It waits while reference snapshots are alive.  Owning
+        // snapshots keep their own copy of the mod buffer, cursors descend the rewritten tree again and walkers over
+        // the tree must not be used across it, which they assert.
+        CompactionResult compact_mod_buffer(uint64_t budget);
+
+        Length mod_buffer_size() const
+        {
+            return Length{ buffers.mod_buffer.buffer.size };
+        }
+
+        // Defragmentation.  Joins the neighbouring pieces which are contiguous in their buffer, copies runs of small
+        // pieces as the policy asks and builds the tree again bottom-up.  The text is unchanged, so the new root
+        // replaces the current one without an undo entry and the history keeps its roots as they were.
+        DefragmentReport defragment(DefragmentPolicy policy);
+
+        uint64_t fold_count() const
+        {
+            return folds.count;
+        }
+
+        Fold fold_at(uint64_t index) const;
+
+#if FRED_LINE_EXTENT_SUMMARY
+        // The length of the longest line in bytes, excluding the LF.
+        Length max_line_length() const
+        {
+            settle_typing();
+            return meta.summary.longest_line();
+        }
+#endif // FRED_LINE_EXTENT_SUMMARY
 
         Length length() const
         {
-            return root.length();
+            return root.length() + Length{ typing.length() };
         }
 
         bool is_empty() const
         {
-            return meta.total_content_length == Length{};
+            return meta.total_content_length == Length{} and typing.length() == 0;
         }
 
         LFCount line_feed_count() const
         {
-            return root.lf_count();
+            return LFCount{ rep(root.lf_count()) + typing.lf_count };
         }
 
         Length line_count() const
@@ -200,10 +564,14 @@ namespace RatchetPieceTree
             return Length{ rep(line_feed_count()) + 1 };
         }
 
+        // The number of pieces making up the text.  Typing contiguous text extends one piece, so this stays put.
+        size_t piece_count() const;
+
         OwningSnapshot* owning_snap(Arena::Arena* arena) const;
         ReferenceSnapshot ref_snap() const;
         uint64_t depth() const
         {
+            settle_typing();
             return root.depth();
         }
         // Note, this will not increment refs.  That must be done by the caller.
@@ -211,14 +579,24 @@ namespace RatchetPieceTree
     private:
         friend class TreeWalker;
         friend class ReverseTreeWalker;
+        friend class LineWalker;
         friend class OwningSnapshot;
         friend class ReferenceSnapshot;
+        friend class TextCursor;
 #ifdef TEXTBUF_DEBUG
         friend void print_piece(const Piece& piece, const Tree* tree, int level);
 #endif // TEXTBUF_DEBUG
         friend void print_tree(const Tree& tree);
-        void internal_insert(CharOffset offset, String8 txt);
+        // Queries other than 'at', 'length' and the line feed counts read the tree alone, so they take the typed text
+        // into it first.  That leaves the text as it reads, which is why a const query may do it.
+        void settle_typing() const;
+        bool absorb_insert(CharOffset offset, String8 txt, SuppressHistory suppress_history);
+        bool absorb_remove(CharOffset offset, Length count, SuppressHistory suppress_history);
+        Length finish_compaction();
+        void internal_insert(CharOffset offset, String8 txt, AdoptBuffer adopt = AdoptBuffer::No);
         void internal_remove(CharOffset offset, Length count);
+        bool internal_replace(CharOffset offset, Length count, String8 txt, AdoptBuffer adopt);
+        void internal_move(CharOffset from, Length count, CharOffset to);
 
         using Accumulator = Length(*)(const BufferCollection*, const Piece&, Line);
 
@@ -230,9 +608,41 @@ namespace RatchetPieceTree
         static void populate_from_node(Arena::Arena* arena, String8List* lst, const BufferCollection* buffers, const StorageTree& node);
         static void populate_from_node(Arena::Arena* arena, String8List* lst, const BufferCollection* buffers, const StorageTree& node, Line line_index);
         static LFCount line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end);
+#if FRED_CODE_POINT_SUMMARY
+        static CodePointCount offset_to_codepoint(const BufferCollection* buffers, const StorageTree& root, CharOffset offset);
+        static CharOffset codepoint_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CodePointCount codepoint);
+        static CodePointCount codepoint_column(const BufferCollection* buffers, const StorageTree& root, CharOffset offset);
+        static CharOffset codepoint_column_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Line line, CodePointCount column);
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+        static Utf16Count offset_to_utf16(const BufferCollection* buffers, const StorageTree& root, CharOffset offset);
+        static CharOffset utf16_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Utf16Count units);
+        static Utf16Position offset_to_utf16_position(const BufferCollection* buffers, const StorageTree& root, CharOffset offset);
+        static CharOffset utf16_position_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Utf16Position position);
+#endif // FRED_UTF16_SUMMARY
+#if FRED_BRACKET_SUMMARY
+        static CharOffset match_bracket(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, const CharRange* ignored, uint64_t ignored_count);
+        static CharOffset enclosing_bracket(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count);
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_HASH_SUMMARY
+        static uint64_t prefix_hash(const BufferCollection* buffers, const StorageTree& root, CharOffset offset);
+        static uint64_t hash_range(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, Length count);
+        static uint64_t hash_line(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Line line);
+#endif // FRED_HASH_SUMMARY
+#if FRED_WRAP_SUMMARY
+        static WrapSummary wrap_before(const BufferCollection* buffers, const StorageTree& root, CharOffset offset);
+        void refresh_summaries();
+        void refresh_wrap_summaries();
+#endif // FRED_WRAP_SUMMARY
+        // Appends 'txt', which must outlive the tree and its snapshots, as a new immutable buffer.
+        BufferIndex adopt_buffer(String8 txt);
         static NodePosition node_at(const BufferCollection* buffers, const StorageTree& node, CharOffset off);
         static BufferCursor buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder);
         static char char_at(const BufferCollection* buffers, const StorageTree& node, CharOffset offset);
+        static String8 get_range(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, Length count);
+        static Length copy_range(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, Length count, char* dst);
+        static LineRange line_slice(const BufferCollection* buffers, const StorageTree& root, Line line, Column first_column, Length max_columns);
+        static String8 line_slice_content(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Line line, Column first_column, Length max_columns);
         static Piece trim_piece_right(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos);
         static Piece trim_piece_left(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos);
         
@@ -249,10 +659,13 @@ namespace RatchetPieceTree
         static String8 assemble_line(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& node, Line line);
         
         Piece build_piece(String8 txt);
+        Piece adopted_piece(String8 txt);
         void combine_pieces(NodePosition existing_piece, Piece new_piece);
         void remove_node_range(NodePosition first, Length length);
         void compute_buffer_meta();
         void append_undo(const StorageTree& old_root, CharOffset op_offset);
+        // The line holding 'offset' and whether 'offset' begins it, found with one descent.
+        Line edit_line(CharOffset offset, bool* starts_line) const;
 
         BufferCollection buffers;
         //Buffers buffers;
@@ -266,6 +679,9 @@ namespace RatchetPieceTree
         UndoStack undo_stack;
         RedoStack redo_stack;
         UndoRedoEntry* free_undo_list{};
+        FoldSet folds{};
+        Editor::TypingCache typing{};
+        Compaction compaction{};
     };
 
     // Tree building.
@@ -289,6 +705,10 @@ namespace RatchetPieceTree
         Arena::Arena* mut_buf_starts_arena;
         Arena::Arena* mut_buf_arena;
         ImmutableBufferList buffers;
+#if FRED_BRACKET_SUMMARY
+        // Defaults to (), [] and {}.  Must be set before any text is accepted.
+        BracketPairs bracket_pairs;
+#endif // FRED_BRACKET_SUMMARY
     };
 
     // Building/release.
@@ -314,6 +734,46 @@ namespace RatchetPieceTree
         LineRange get_line_range(Line line) const;
         LineRange get_line_range_crlf(Line line) const;
         LineRange get_line_range_with_newline(Line line) const;
+        String8 get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const;
+        LineRange get_line_range_slice(Line line, Column first_column, Length max_columns) const;
+        String8 get_range(Arena::Arena* arena, CharOffset offset, Length count) const;
+        Length copy_range(CharOffset offset, Length count, char* dst) const;
+#if FRED_CODE_POINT_SUMMARY
+        CodePointCount offset_to_codepoint(CharOffset offset) const;
+        CharOffset codepoint_to_offset(CodePointCount codepoint) const;
+        CodePointCount codepoint_column(CharOffset offset) const;
+        CharOffset codepoint_column_offset(Line line, CodePointCount column) const;
+
+        CodePointCount codepoint_count() const
+        {
+            return meta.summary.codepoints;
+        }
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+        Utf16Position offset_to_utf16_position(CharOffset offset) const;
+        CharOffset utf16_position_to_offset(Utf16Position position) const;
+#endif // FRED_UTF16_SUMMARY
+#if FRED_BRACKET_SUMMARY
+        CharOffset match_bracket(CharOffset offset, const CharRange* ignored = nullptr, uint64_t ignored_count = 0) const;
+        CharOffset enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored = nullptr, uint64_t ignored_count = 0) const;
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_HASH_SUMMARY
+        uint64_t hash_range(CharOffset offset, Length count) const;
+        uint64_t hash_line(Line line) const;
+
+        uint64_t content_hash() const
+        {
+            return meta.summary.hash;
+        }
+#endif // FRED_HASH_SUMMARY
+
+#if FRED_LINE_EXTENT_SUMMARY
+        Length max_line_length() const
+        {
+            return meta.summary.longest_line();
+        }
+#endif // FRED_LINE_EXTENT_SUMMARY
+
         bool is_empty() const
         {
             return meta.total_content_length == Length{};
@@ -336,6 +796,7 @@ namespace RatchetPieceTree
     private:
         friend class TreeWalker;
         friend class ReverseTreeWalker;
+        friend class LineWalker;
 
         StorageTree root;
         BufferMeta meta;
@@ -362,6 +823,46 @@ namespace RatchetPieceTree
         LineRange get_line_range(Line line) const;
         LineRange get_line_range_crlf(Line line) const;
         LineRange get_line_range_with_newline(Line line) const;
+        String8 get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const;
+        LineRange get_line_range_slice(Line line, Column first_column, Length max_columns) const;
+        String8 get_range(Arena::Arena* arena, CharOffset offset, Length count) const;
+        Length copy_range(CharOffset offset, Length count, char* dst) const;
+#if FRED_CODE_POINT_SUMMARY
+        CodePointCount offset_to_codepoint(CharOffset offset) const;
+        CharOffset codepoint_to_offset(CodePointCount codepoint) const;
+        CodePointCount codepoint_column(CharOffset offset) const;
+        CharOffset codepoint_column_offset(Line line, CodePointCount column) const;
+
+        CodePointCount codepoint_count() const
+        {
+            return meta.summary.codepoints;
+        }
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+        Utf16Position offset_to_utf16_position(CharOffset offset) const;
+        CharOffset utf16_position_to_offset(Utf16Position position) const;
+#endif // FRED_UTF16_SUMMARY
+#if FRED_BRACKET_SUMMARY
+        CharOffset match_bracket(CharOffset offset, const CharRange* ignored = nullptr, uint64_t ignored_count = 0) const;
+        CharOffset enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored = nullptr, uint64_t ignored_count = 0) const;
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_HASH_SUMMARY
+        uint64_t hash_range(CharOffset offset, Length count) const;
+        uint64_t hash_line(Line line) const;
+
+        uint64_t content_hash() const
+        {
+            return meta.summary.hash;
+        }
+#endif // FRED_HASH_SUMMARY
+
+#if FRED_LINE_EXTENT_SUMMARY
+        Length max_line_length() const
+        {
+            return meta.summary.longest_line();
+        }
+#endif // FRED_LINE_EXTENT_SUMMARY
+
         bool is_empty() const
         {
             return meta.total_content_length == Length{};
@@ -374,6 +875,7 @@ namespace RatchetPieceTree
     private:
         friend class TreeWalker;
         friend class ReverseTreeWalker;
+        friend class LineWalker;
 
         StorageTree root;
         BufferMeta meta;
@@ -395,6 +897,13 @@ namespace RatchetPieceTree
             return current_piece;
         };
         char next();
+        // Chunk iteration.  Returns the rest of the current piece (starting at 'offset()') and advances the
+        // walker past it.  An empty view means the walker is exhausted.  The view points directly into the
+        // buffers and remains valid for as long as the buffers do.
+        String8View next_chunk();
+        // Equivalent to 'seek(offset)' followed by 'next_chunk()'.  This matches the shape of the 'read'
+        // callback expected by incremental parsers.
+        String8View chunk_at(CharOffset offset);
         void seek(CharOffset offset);
         bool exhausted() const;
         Length remaining() const;
@@ -432,6 +941,7 @@ namespace RatchetPieceTree
         void fast_forward_to(CharOffset offset);
 
         const BufferCollection* buffers;
+        uint64_t compactions;
         StorageTree root;
         BufferMeta meta;
         CharOffset total_offset = CharOffset{ 0 };
@@ -450,6 +960,12 @@ namespace RatchetPieceTree
 
         char current() const;
         char next();
+        // Chunk iteration.  Returns the part of the current piece which ends at (and includes) 'offset()'
+        // and moves the walker before it.  The view is in buffer order, an empty view means the walker is
+        // exhausted.
+        String8View next_chunk();
+        // Equivalent to 'seek(offset)' followed by 'next_chunk()'.
+        String8View chunk_at(CharOffset offset);
         void seek(CharOffset offset);
         bool exhausted() const;
         Length remaining() const;
@@ -492,11 +1008,132 @@ namespace RatchetPieceTree
 
 
         const BufferCollection* buffers;
+        uint64_t compactions;
         StorageTree root;
         BufferMeta meta;
         CharOffset total_offset = CharOffset{ 0 };
     };
 
+    // Every non-root node of the storage tree has at least half of its children populated, so this bounds the
+    // depth of any tree addressable with 64-bit offsets.
+    constexpr size_t max_cursor_depth = 32;
+
+    // A cursor which remembers the root-to-leaf path of its current position.  Moving to a nearby offset or
+    // line only climbs to the lowest ancestor covering the target before descending again, and movement within
+    // the current piece does not touch the tree at all.  The cursor holds a reference to the root it was
+    // positioned against and re-descends (keeping its offset, clamped) once the tree's head has changed.
+    class TextCursor
+    {
+    public:
+        explicit TextCursor(const Tree* tree, CharOffset offset = CharOffset{ });
+
+        // Queries.
+        CharOffset offset() const
+        {
+            return cursor_offset;
+        }
+        // Returns '\0' at the end of the buffer.
+        char current();
+        Line line();
+        Column column();
+
+        // Movement.  All targets are clamped to the buffer.
+        void seek(CharOffset offset);
+        void advance(Length count);
+        void retreat(Length count);
+        // The column is clamped to the content of the line (not including the LF).
+        void seek_line(Line line, Column column = Column{ });
+        void advance_lines(Length count);
+        void retreat_lines(Length count);
+        // Converts (line, column) to an offset, as 'seek_line', and leaves the cursor there.
+        CharOffset offset_at(Line line, Column column);
+    private:
+        struct PathEntry
+        {
+            StorageTree::NodePtr node;
+            // Document offset and LFs before this subtree.
+            CharOffset first;
+            LFCount lf_first;
+        };
+
+        void sync();
+        void locate(CharOffset offset);
+        CharOffset line_start(Line line);
+        void push_entry(const PathEntry& entry);
+
+        const Tree* tree;
+        StorageTree root;
+        Length total_length = { };
+        LFCount total_lf_count = { };
+        PathEntry path[max_cursor_depth];
+        uint32_t depth = 0;
+        CharOffset cursor_offset = { };
+        // The piece in the leaf at the top of 'path' which contains the cursor.
+        const Piece* piece = nullptr;
+        const char* piece_ptr = nullptr;
+        CharOffset piece_first = { };
+        LFCount piece_lf_first = { };
+    };
+
+    // Indicates whether a trailing CR should be removed from lines, matching 'get_line_content_crlf'.
+    enum class StripCRLF : bool { No, Yes };
+
+    // A single line as a sequence of slices pointing directly into the buffers.  The slices are valid until the
+    // next call on the walker which produced them.
+    struct LineSlices
+    {
+        const String8View* slices;
+        uint64_t count;
+        Length length;
+        // Only meaningful when stripping CRLF: the line ended with a LF which was not preceded by a CR.
+        IncompleteCRLF incomplete_crlf;
+    };
+
+    // Streams every line of the buffer starting from a given line in a single pass over the pieces.  Unlike
+    // repeated 'get_line_content' calls, this does not descend the tree per line and only allocates when a
+    // scratch array needs to grow.
+    class LineWalker
+    {
+    public:
+        LineWalker(Arena::Arena* arena, const Tree* tree, StripCRLF strip = StripCRLF::No, Line line = Line::Beginning);
+        LineWalker(Arena::Arena* arena, const OwningSnapshot* snap, StripCRLF strip = StripCRLF::No, Line line = Line::Beginning);
+        LineWalker(Arena::Arena* arena, const ReferenceSnapshot* snap, StripCRLF strip = StripCRLF::No, Line line = Line::Beginning);
+        LineWalker(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, StripCRLF strip = StripCRLF::No, Line line = Line::Beginning);
+        LineWalker(const LineWalker&) = delete;
+
+        bool exhausted() const
+        {
+            return done;
+        }
+
+        // The line which will be produced by the next call.
+        Line line() const
+        {
+            return next_line;
+        }
+
+        LineSlices next_slices();
+        // Returns the next line as one contiguous view.  A line which lives in a single piece is borrowed directly
+        // from the buffers, otherwise it is copied into a buffer which is reused between calls.
+        String8View next();
+    private:
+        static CharOffset line_offset(const BufferCollection* buffers, const StorageTree& root, Line line);
+        void push_slice(String8View slice);
+
+        Arena::Arena* arena;
+        TreeWalker walker;
+        StripCRLF strip;
+        Line next_line;
+        bool done = false;
+        // The unconsumed portion of the walker's current chunk.
+        String8View chunk = { };
+        String8View* slices = nullptr;
+        uint64_t slice_count = 0;
+        uint64_t slice_capacity = 0;
+        char* line_buf = nullptr;
+        uint64_t line_capacity = 0;
+    };
+
     enum class EmptySelection : bool { No, Yes };
 
     struct SelectionMeta
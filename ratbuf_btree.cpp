@@ -2,6 +2,9 @@
 #include "ratbuf_btree.h"
 
 #include <cassert>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 #include "arena.h"
 #include "types.h"
@@ -27,6 +30,43 @@ namespace RatchetPieceTree
      size_t alloc_count;
      size_t dealloc_count;
 #endif
+    constexpr CodePointCount operator+(CodePointCount lhs, CodePointCount rhs)
+    {
+        return CodePointCount{ rep(lhs) + rep(rhs) };
+    }
+
+    constexpr CodePointCount operator-(CodePointCount lhs, CodePointCount rhs)
+    {
+        return CodePointCount{ rep(lhs) - rep(rhs) };
+    }
+
+    constexpr Utf16Count operator+(Utf16Count lhs, Utf16Count rhs)
+    {
+        return Utf16Count{ rep(lhs) + rep(rhs) };
+    }
+
+    constexpr Utf16Count operator-(Utf16Count lhs, Utf16Count rhs)
+    {
+        return Utf16Count{ rep(lhs) - rep(rhs) };
+    }
+
+#if FRED_LINE_EXTENT_SUMMARY
+    LineExtent LineExtent::combine(const LineExtent& left, const LineExtent& right)
+    {
+        LineExtent result;
+        result.leading = left.has_lf ? left.leading : left.leading + right.leading;
+        result.trailing = right.has_lf ? right.trailing : left.trailing + right.trailing;
+        result.longest = rep(left.longest) < rep(right.longest) ? right.longest : left.longest;
+        // The line spanning the boundary is only complete when both sides end it with a LF.
+        if (left.has_lf and right.has_lf and rep(left.trailing + right.leading) > rep(result.longest))
+        {
+            result.longest = left.trailing + right.leading;
+        }
+        result.has_lf = left.has_lf or right.has_lf;
+        return result;
+    }
+#endif // FRED_LINE_EXTENT_SUMMARY
+
     RatchetPieceTree::LFCount tree_lf_count(const StorageTree& root)
     {
         if (root.is_empty())
@@ -177,1544 +217,4118 @@ namespace RatchetPieceTree
         return res;
     }
 
-    BufferCursor buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder)
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren> B_Tree<MaxChildren>::replace(BufferCollection* blk, const NodeData& x, Offset at) const
     {
-        const LineStarts* starts = &buffers->buffer_at(piece.index)->line_starts;
-        auto start_offset = rep(starts->starts[rep(piece.first.line)]) + rep(piece.first.column);
-        auto offset = start_offset + rep(remainder);
-
-        // Binary search for 'offset' between start and ending offset.
-        auto low = rep(piece.first.line);
-        auto high = rep(piece.last.line);
+        assert(root_node != nullptr);
+        NodePtr new_root = replace_in(blk->rb_tree_blk, root_node, &x, 1, distance(Offset{0}, at));
+        return B_Tree<MaxChildren>(new_root, tree_depth);
+    }
 
-        size_t mid = 0;
-        size_t mid_start = 0;
-        size_t mid_stop = 0;
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren> B_Tree<MaxChildren>::splice(BufferCollection* blk, const NodeData* pieces, size_t count, Offset at) const
+    {
+        assert(root_node != nullptr and count != 0 and count <= 3);
+        NodePtr new_root = replace_in(blk->rb_tree_blk, root_node, pieces, count, distance(Offset{0}, at));
+        if (new_root == nullptr)
+            return B_Tree<MaxChildren>();
+        return B_Tree<MaxChildren>(new_root, tree_depth);
+    }
 
-        while (low <= high)
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::replace_in(BTreeBlock* blk, NodePtr node, const NodeData* pieces, size_t count, Length at)
+    {
+        // The child holding 'at' is the first whose end offset is strictly greater than it.
+        size_t slot = branchless_lower_bound(node->offsets.begin(), node->offsets.begin() + node->childCount, at + Length{ 1 }) - node->offsets.begin();
+        assert(slot < node->childCount);
+        NodePtr result;
+        size_t child_count = node->childCount;
+        // The copy starts out empty and takes the node's children as they are; only the replaced child differs.
+        if (node->isLeaf())
         {
-            mid = low + ((high - low) / 2);
-            mid_start = rep(starts->starts[mid]);
-
-            if (mid == high)
-                break;
-            mid_stop = rep(starts->starts[mid + 1]);
-
-            if (offset < mid_start)
+            if (node->childCount + count - 1 > MaxChildren)
+                return nullptr;
+            LeafNodePtr leaf = to_leaf_node(node);
+            LeafNodePtr copy = to_leaf_node(construct_leaf(blk, nullptr, 0, 0));
+            copy->children = leaf->children;
+            for (size_t i = slot + 1; i < leaf->childCount; ++i)
             {
-                high = mid - 1;
+                copy->children[i + count - 1] = leaf->children[i];
             }
-            else if (offset >= mid_stop)
+            for (size_t i = 0; i < count; ++i)
             {
-                low = mid + 1;
+                copy->children[slot + i] = pieces[i];
+            }
+            child_count += count - 1;
+            result = to_node(copy);
+        }
+        else
+        {
+            InternalNodePtr internal = to_internal_node(node);
+            Length child_at = slot == 0 ? at : at - node->offsets[slot - 1];
+            NodePtr child = replace_in(blk, internal->children[slot], pieces, count, child_at);
+            if (child == nullptr)
+                return nullptr;
+            InternalNodePtr copy = to_internal_node(construct_internal(blk, nullptr, 0, 0));
+            for (size_t i = 0; i < internal->childCount; ++i)
+            {
+                copy->children[i] = i == slot ? child : take_node_ref(internal->children[i]);
+            }
+            result = to_node(copy);
+        }
+        // The prefix sums before 'slot' are unchanged.
+        result->childCount = child_count;
+        result->offsets = node->offsets;
+        result->lineFeeds = node->lineFeeds;
+        result->summaries = node->summaries;
+        Length acc = slot == 0 ? Length{ 0 } : node->offsets[slot - 1];
+        LFCount linefeed = slot == 0 ? LFCount{ 0 } : node->lineFeeds[slot - 1];
+        TreeSummary summary = slot == 0 ? TreeSummary::identity() : node->summaries.get(slot - 1);
+        for (size_t i = slot; i < child_count; ++i)
+        {
+            if (node->isLeaf())
+            {
+                const Piece& piece = to_leaf_node(result)->children[i].piece;
+                acc = acc + piece.length;
+                linefeed = LFCount{ rep(linefeed) + rep(piece.newline_count) };
+                summary = TreeSummary::combine(summary, piece.summary);
             }
             else
             {
-                break;
+                const NodePtr child = to_internal_node(result)->children[i];
+                acc = acc + child->subTreeLength();
+                linefeed = LFCount{ rep(linefeed) + rep(child->subTreeLineFeeds()) };
+                summary = TreeSummary::combine(summary, child->subTreeSummary());
             }
+            result->offsets[i] = acc;
+            result->lineFeeds[i] = linefeed;
+            result->summaries.set(i, summary);
         }
-
-        return { .line = Line{ mid },
-                    .column = Column{ offset - mid_start } };
-    }
-
-    LFCount line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end)
-    {
-        // If the end position is the beginning of a new line, then we can just return the difference in lines.
-        if (rep(end.column) == 0)
-            return LFCount{ rep(retract(end.line, rep(start.line))) };
-        const LineStarts* starts = &buffers->buffer_at(index)->line_starts;
-        // It means, there is no LF after end.
-        if (end.line == Line{ starts->count - 1})
-            return LFCount{ rep(retract(end.line, rep(start.line))) };
-        // Due to the check above, we know that there's at least one more line after 'end.line'.
-        auto next_start_offset = starts->starts[rep(extend(end.line))];
-        auto end_offset = rep(starts->starts[rep(end.line)]) + rep(end.column);
-        // There are more than 1 character after end, which means it can't be LF.
-        if (rep(next_start_offset) > end_offset + 1)
-            return LFCount{ rep(retract(end.line, rep(start.line))) };
-        // This must be the case.  next_start_offset is a line down, so it is
-        // not possible for end_offset to be < it at this point.
-        assert(end_offset + 1 == rep(next_start_offset));
-        return LFCount{ rep(retract(end.line, rep(start.line))) };
-    }
-
-    Piece trim_piece_right(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
-    {
-        auto orig_end_offset = buffers->buffer_offset(piece.index, piece.last);
-
-        auto new_end_offset = buffers->buffer_offset(piece.index, pos);
-        auto new_lf_count = line_feed_count(buffers, piece.index, piece.first, pos);
-
-        auto len_delta = distance(new_end_offset, orig_end_offset);
-        auto new_len = retract(piece.length, rep(len_delta));
-
-        auto new_piece = piece;
-        new_piece.last = pos;
-        new_piece.newline_count = new_lf_count;
-        new_piece.length = new_len;
-
-        return new_piece;
+        result->offsets[MaxChildren-1] = acc;
+        result->lineFeeds[MaxChildren-1] = linefeed;
+        return result;
     }
 
-    Piece trim_piece_left(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren> B_Tree<MaxChildren>::rewrite_pieces(BTreeBlock* blk, PieceRewrite* rewrite) const
     {
-        auto orig_start_offset = buffers->buffer_offset(piece.index, piece.first);
-
-        auto new_start_offset = buffers->buffer_offset(piece.index, pos);
-        auto new_lf_count = line_feed_count(buffers, piece.index, pos, piece.last);
-
-        auto len_delta = distance(orig_start_offset, new_start_offset);
-        auto new_len = retract(piece.length, rep(len_delta));
-
-        auto new_piece = piece;
-        new_piece.first = pos;
-        new_piece.newline_count = new_lf_count;
-        new_piece.length = new_len;
-
-        return new_piece;
+        if (root_node == nullptr)
+            return B_Tree<MaxChildren>();
+        return B_Tree<MaxChildren>(rewrite_node(blk, root_node, rewrite), tree_depth);
     }
 
     template<size_t MaxChildren>
-    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::insertInto_leaf(Arena::Arena *arena, BufferCollection* blk, LeafNodePtr node, const NodeData& x, Length at) const
+    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::rewrite_node(BTreeBlock* blk, NodePtr node, PieceRewrite* rewrite)
     {
-        if(node)algo_mark(node, Traverse);
-        if(node==nullptr)
+        if (const void* copy = rewrite->copy_of(node))
+            return take_node_ref(static_cast<NodePtr>(const_cast<void*>(copy)));
+        NodePtr result;
+        if (node->isLeaf())
         {
-            B_Tree<MaxChildren>::TreeManipResult res;
-            res.nodes = Arena::push_array<NodePtr>(arena, 1);
-            res.count = 1;
-            res.depth = 1;
-            res.nodes[0] = construct_leaf(blk->rb_tree_blk, &x, 0, 1);
-            
-            return res;
+            LeafNodePtr leaf = to_leaf_node(node);
+            std::array<NodeData, MaxChildren> children = leaf->children;
+            bool changed = false;
+            for (size_t i = 0; i < leaf->childCount; ++i)
+            {
+                changed |= rewrite->apply(&children[i].piece);
+            }
+            result = changed ? construct_leaf(blk, children.data(), 0, leaf->childCount) : take_node_ref(node);
         }
-        Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
-        //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
-        auto offsets_end = node->offsets.begin()+node->childCount;
-        auto insertPoint = branchless_lower_bound(node->offsets.begin(), offsets_end, at);
-        auto insertIndex = insertPoint - node->offsets.begin();
-        
-        NodeData* resultch = Arena::push_array<NodeData>(scratch.arena, node->childCount+2);
-        size_t resultCount = 0;
+        else
+        {
+            InternalNodePtr internal = to_internal_node(node);
+            NodePtr children[MaxChildren];
+            bool changed = false;
+            for (size_t i = 0; i < internal->childCount; ++i)
+            {
+                children[i] = rewrite_node(blk, internal->children[i], rewrite);
+                changed |= children[i] != internal->children[i];
+            }
+            if (changed)
+            {
+                result = construct_internal(blk, children, 0, internal->childCount);
+            }
+            else
+            {
+                for (size_t i = 0; i < internal->childCount; ++i)
+                {
+                    dec_node_ref(children[i]);
+                }
+                result = take_node_ref(node);
+            }
+        }
+        rewrite->remember(node, result);
+        return result;
+    }
 
-        auto& children = (node->children);
+    namespace
+    {
+        // Line starts are sampled every 'line_start_sample_stride' entries so that a search over a large buffer
+        // touches a small top-level array followed by one contiguous block (256 bytes) of 'line_starts'.
+        constexpr uint64_t line_start_sample_stride = 32;
+        // Buffers with fewer lines than this are searched directly.
+        constexpr uint64_t line_start_sample_min_lines = line_start_sample_stride * 8;
 
-        auto child_it = children.begin();
-        auto child_insert = children.begin()+insertIndex;
-        auto child_end = children.begin()+node->childCount;
+#if FRED_LINE_EXTENT_SUMMARY
+        // Maximum line lengths are grouped 32 lines (or 32 entries of the previous level) at a time.
+        constexpr uint64_t line_length_group = 32;
 
-        Length insert_child_start {0};
-        if(insertIndex > 0)
+        Length buffer_line_length(const CharBuffer* buffer, uint64_t line)
         {
-            insert_child_start  = node->offsets[insertIndex-1];
+            const LineStarts& starts = buffer->line_starts;
+            if (line + 1 == starts.count)
+                return Length{ buffer->buffer.size - rep(starts.starts[line]) };
+            // Exclude the LF.
+            return Length{ rep(starts.starts[line + 1]) - rep(starts.starts[line]) - 1 };
         }
 
-        Length split_offset = at - insert_child_start;
-        for(; child_it!=child_insert; ++child_it)
+        LineLengthIndex build_line_length_index(Arena::Arena* arena, const CharBuffer* buffer)
         {
-            resultch[resultCount++] = (*child_it);
+            LineLengthIndex index{ };
+            if (buffer->line_starts.count < line_start_sample_min_lines)
+                return index;
+            uint64_t count = buffer->line_starts.count;
+            while (count > line_length_group and index.level_count < sizeof(index.levels) / sizeof(index.levels[0]))
+            {
+                auto level = index.level_count;
+                auto level_count = (count + line_length_group - 1) / line_length_group;
+                Length* entries = Arena::push_array<Length>(arena, level_count);
+                for EachIndex(i, count)
+                {
+                    auto value = level == 0 ? buffer_line_length(buffer, i) : index.levels[level - 1][i];
+                    Length* entry = &entries[i / line_length_group];
+                    *entry = rep(value) > rep(*entry) ? value : *entry;
+                }
+                index.levels[level] = entries;
+                index.counts[level] = level_count;
+                ++index.level_count;
+                count = level_count;
+            }
+            return index;
         }
-        auto splitting_piece = (*child_it).piece;
-        if(split_offset > Length{0} && split_offset < splitting_piece.length)
-        {
-            BufferCollection* buffers = blk;
-
-            auto insert_pos = buffer_position(buffers, splitting_piece, split_offset);
 
-            auto new_len_right = distance(buffers->buffer_offset(splitting_piece.index, insert_pos),
-                                        buffers->buffer_offset(splitting_piece.index, splitting_piece.last));
-            auto new_piece_right = splitting_piece;
-            new_piece_right.first = insert_pos;
-            new_piece_right.length = new_len_right;
-            new_piece_right.newline_count = line_feed_count(buffers, splitting_piece.index, insert_pos, splitting_piece.last);
-
-            // Remove the original node tail.
-            auto new_piece_left = trim_piece_right(buffers, splitting_piece, insert_pos);
-
-            auto new_piece = x.piece;
-
-            NodeData first{
-                .piece = new_piece_left
+        // The longest of the lines [first, last) of 'buffer'.
+        Length longest_buffer_line(const CharBuffer* buffer, uint64_t first, uint64_t last)
+        {
+            const LineLengthIndex& index = buffer->line_lengths;
+            size_t result = 0;
+            auto visit = [&](uint64_t level, uint64_t i)
+            {
+                auto length = rep(level == 0 ? buffer_line_length(buffer, i) : index.levels[level - 1][i]);
+                result = length > result ? length : result;
             };
-            resultch[resultCount++] = (first);
+            uint64_t level = 0;
+            while (first < last)
+            {
+                // Scan the unaligned ends of the range on this level and continue with the groups in between.
+                if (level == index.level_count or last - first < 2 * line_length_group)
+                {
+                    for (; first < last; ++first)
+                    {
+                        visit(level, first);
+                    }
+                    break;
+                }
+                for (; first % line_length_group != 0; ++first)
+                {
+                    visit(level, first);
+                }
+                for (; last % line_length_group != 0; --last)
+                {
+                    visit(level, last - 1);
+                }
+                first /= line_length_group;
+                last /= line_length_group;
+                ++level;
+            }
+            return Length{ result };
+        }
+#endif // FRED_LINE_EXTENT_SUMMARY
 
-            resultch[resultCount++] = (x);
+#if FRED_BRACKET_SUMMARY
+        // Bracket nesting is indexed in blocks of 256 bytes, grouped 32 at a time on each following level.
+        constexpr uint64_t bracket_block_size = 256;
+        constexpr uint64_t bracket_group = 32;
 
-            NodeData second = NodeData
-            {
-                .piece = new_piece_right
-            };
+        constexpr BracketPairs default_bracket_pairs = { .pairs = { { '(', ')' }, { '[', ']' }, { '{', '}' } }, .count = 3 };
 
-            resultch[resultCount++] = (second);
-            ++child_it;
+        int32_t bracket_step(const BracketPair& pair, char c)
+        {
+            return (c == pair.open) - (c == pair.close);
         }
-        else
+
+        BracketSummary scan_brackets(const BracketPairs& pairs, const char* first, uint64_t size)
         {
-            //TODO(ratchetfreak): combine pieces with modbuf?
-            if(split_offset == Length{0})
+            BracketSummary result{ };
+            for EachIndex(i, size)
             {
-                resultch[resultCount++] = (x);
-                resultch[resultCount++] = (*child_it);
-                ++child_it;
+                for EachIndex(p, pairs.count)
+                {
+                    BracketDepth& depth = result.depths[p];
+                    depth.delta += bracket_step(pairs.pairs[p], first[i]);
+                    depth.min = depth.delta < depth.min ? depth.delta : depth.min;
+                }
             }
-            else
+            return result;
+        }
+
+        // Extends 'index' to cover every complete block of 'buf'.  Only the entries past the ones already indexed are
+        // computed, so appending to a buffer scans just the appended bytes.
+        void extend_bracket_index(Arena::Arena* arena, const BracketPairs& pairs, BracketIndex* index, String8 buf)
+        {
+            if (pairs.count == 0)
+                return;
+            uint64_t count = buf.size / bracket_block_size;
+            for (uint64_t level = 0; count != 0 and level < sizeof(index->levels) / sizeof(index->levels[0]); ++level)
             {
-                auto node_data = *child_it;
-                if(node_data.piece.index == x.piece.index && node_data.piece.last == x.piece.first)
+                auto have = level < index->level_count ? index->counts[level] : 0;
+                if (count > index->capacities[level])
                 {
-                    Piece old_piece = node_data.piece;
-                    NodeData d = x;
-                    Piece &new_piece = d.piece;
-                    new_piece.first = old_piece.first;
-                    new_piece.newline_count = LFCount{rep(new_piece.newline_count) + rep(old_piece.newline_count)};
-                    new_piece.length = new_piece.length + old_piece.length;
-                    resultch[resultCount++] = (d);
-                    ++child_it;
+                    // The previous array is left intact since snapshots may still refer to it.
+                    auto capacity = index->capacities[level] * 2 < count ? count : index->capacities[level] * 2;
+                    BracketSummary* entries = Arena::push_array_no_zero<BracketSummary>(arena, capacity);
+                    if (have != 0)
+                    {
+                        memcpy(entries, index->levels[level], have * sizeof(BracketSummary));
+                    }
+                    index->levels[level] = entries;
+                    index->capacities[level] = capacity;
                 }
-                else
+                BracketSummary* entries = index->levels[level];
+                for (uint64_t i = have; i < count; ++i)
                 {
-                    resultch[resultCount++] = (*child_it);
-                    ++child_it;
-                    resultch[resultCount++] = (x);
+                    if (level == 0)
+                    {
+                        entries[i] = scan_brackets(pairs, buf.str + i * bracket_block_size, bracket_block_size);
+                        continue;
+                    }
+                    entries[i] = BracketSummary{ };
+                    for EachIndex(j, bracket_group)
+                    {
+                        entries[i] = BracketSummary::combine(entries[i], index->levels[level - 1][i * bracket_group + j]);
+                    }
                 }
+                index->counts[level] = count;
+                index->level_count = level < index->level_count ? index->level_count : level + 1;
+                count /= bracket_group;
             }
         }
 
-        for(; child_it!=child_end; ++child_it)
+        BracketIndex build_bracket_index(Arena::Arena* arena, const BracketPairs& pairs, String8 buf)
         {
-            resultch[resultCount++] = (*child_it);
+            BracketIndex index{ };
+            if (buf.size / bracket_block_size >= bracket_group)
+            {
+                extend_bracket_index(arena, pairs, &index, buf);
+            }
+            return index;
         }
-        
-        B_Tree<MaxChildren>::TreeManipResult res;
-        if(resultCount > MaxChildren)
+
+        // A copy of 'index' which stays valid after the indexed buffer is rewritten in place.
+        BracketIndex copy_bracket_index(Arena::Arena* arena, const BracketIndex& index)
         {
-            res.nodes = Arena::push_array<NodePtr>(arena, 2);
-            size_t mid = resultCount/2;
-            res.nodes[0] = (construct_leaf(blk->rb_tree_blk, resultch, 0, mid));
-            res.nodes[1] = (construct_leaf(blk->rb_tree_blk, resultch, mid, resultCount));
-            res.count = 2;
-            res.depth = 1;
+            BracketIndex result = index;
+            for EachIndex(level, index.level_count)
+            {
+                result.levels[level] = Arena::push_array_no_zero<BracketSummary>(arena, index.counts[level]);
+                memcpy(result.levels[level], index.levels[level], index.counts[level] * sizeof(BracketSummary));
+                result.capacities[level] = index.counts[level];
+            }
+            return result;
         }
-        else
+
+        uint64_t bracket_span_size(uint64_t level)
         {
-            res.nodes = Arena::push_array<NodePtr>(arena, 1);
-            res.nodes[0] = (construct_leaf(blk->rb_tree_blk, resultch, 0, resultCount));
-            res.count = 1;
-            res.depth = 1;
+            uint64_t size = bracket_block_size;
+            for (; level != 0; --level)
+            {
+                size *= bracket_group;
+            }
+            return size;
         }
-        Arena::scratch_end(scratch);
-        return res;
-    }
-
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::remove_from_leafs(Arena::Arena *arena, BufferCollection* blk, LeafNodePtr a, LeafNodePtr b, LeafNodePtr c, Length at, Length len) const
-    {
-        Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
-        //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
-        
-        // b or c might be nullptr
 
-        NodeData *allLeafs = Arena::push_array<NodeData>(scratch.arena, MaxChildren*3);
-        size_t leaflength = 0;
+        // The number of index levels holding a span which starts at 'first' and ends by 'last'.
+        uint64_t bracket_levels_from(const BracketIndex& index, uint64_t first, uint64_t last)
         {
-            auto ch = (a->children);
-            for(auto it = ch.begin(); it != ch.begin()+a->childCount;++it)
+            uint64_t levels = 0;
+            uint64_t size = bracket_block_size;
+            while (levels < index.level_count and first % size == 0 and first + size <= last and first / size < index.counts[levels])
             {
-                allLeafs[leaflength++]=(*it);
+                ++levels;
+                size *= bracket_group;
             }
+            return levels;
         }
-        if(b!=nullptr)
+
+        // The number of index levels holding a span which ends at 'last' and starts at or after 'first'.
+        uint64_t bracket_levels_to(const BracketIndex& index, uint64_t first, uint64_t last)
         {
-            auto ch = (b->children);
-            for(auto it = ch.begin(); it != ch.begin()+b->childCount;++it)
+            uint64_t levels = 0;
+            uint64_t size = bracket_block_size;
+            while (levels < index.level_count and last % size == 0 and last - first >= size and last / size <= index.counts[levels])
             {
-                allLeafs[leaflength++]=(*it);
+                ++levels;
+                size *= bracket_group;
             }
+            return levels;
         }
-        if(c!=nullptr)
+
+        // Summarizes the bytes [first, last) of 'buffer'.
+        BracketSummary buffer_brackets(const BracketPairs& pairs, const CharBuffer* buffer, uint64_t first, uint64_t last)
         {
-            auto ch = (c->children);
-            for(auto it = ch.begin(); it != ch.begin()+c->childCount;++it)
+            const BracketIndex& index = buffer->brackets;
+            BracketSummary result{ };
+            while (first < last)
             {
-                allLeafs[leaflength++]=(*it);
+                auto levels = bracket_levels_from(index, first, last);
+                if (levels != 0)
+                {
+                    auto size = bracket_span_size(levels - 1);
+                    result = BracketSummary::combine(result, index.levels[levels - 1][first / size]);
+                    first += size;
+                    continue;
+                }
+                auto next = (first / bracket_block_size + 1) * bracket_block_size;
+                next = next < last ? next : last;
+                result = BracketSummary::combine(result, scan_brackets(pairs, buffer->buffer.str + first, next - first));
+                first = next;
             }
+            return result;
         }
-        size_t numLeafs = leaflength;
-        (void)numLeafs;
 
-        
-        NodeData *allChildren = Arena::push_array<NodeData>(scratch.arena, MaxChildren*3 + 3);
-        size_t resultCount = 0;
-
-        int i = 0;
-
-        for(;i < leaflength && allLeafs[i].piece.length <= at;i++)
+        // Finds the first byte of [first, last) in 'buffer' after which the depth of bracket pair 'pair', which is
+        // '*depth' before 'first', is at most 'target'.  If there is none, '*depth' is advanced to 'last'.
+        CharOffset find_bracket_forward(const BracketPairs& pairs, uint64_t pair, const CharBuffer* buffer, uint64_t first, uint64_t last, int64_t* depth, int64_t target)
         {
-            auto current_leaf = allLeafs[i];
-            allChildren[resultCount++] = (current_leaf);
-            at = at - current_leaf.piece.length;
+            const BracketIndex& index = buffer->brackets;
+            while (first < last)
+            {
+                // Skip the largest indexed span which cannot hold the byte.
+                auto levels = bracket_levels_from(index, first, last);
+                bool skipped = false;
+                while (levels != 0 and not skipped)
+                {
+                    --levels;
+                    auto size = bracket_span_size(levels);
+                    const BracketDepth& span = index.levels[levels][first / size].depths[pair];
+                    if (*depth + span.min > target)
+                    {
+                        *depth += span.delta;
+                        first += size;
+                        skipped = true;
+                    }
+                }
+                if (skipped)
+                    continue;
+                *depth += bracket_step(pairs.pairs[pair], buffer->buffer.str[first]);
+                if (*depth <= target)
+                    return CharOffset{ first };
+                ++first;
+            }
+            return CharOffset::Sentinel;
         }
 
-        //trim or split allLeafs[i].piece
-        if(at+len <= allLeafs[i].piece.length)
+        // Finds the last byte of [first, last) in 'buffer' before which the depth of bracket pair 'pair', which is
+        // '*depth' at 'last', is at most 'target'.  If there is none, '*depth' is moved back to 'first'.
+        CharOffset find_bracket_backward(const BracketPairs& pairs, uint64_t pair, const CharBuffer* buffer, uint64_t first, uint64_t last, int64_t* depth, int64_t target)
         {
-            auto piece_to_split = allLeafs[i].piece;
-            auto start_split_pos = buffer_position(blk, piece_to_split, at);
-
-            auto end_split_pos = buffer_position(blk, piece_to_split, at+len);
-            auto piece_left = trim_piece_left(blk, piece_to_split, end_split_pos);
-            Piece piece_right = trim_piece_right(blk, piece_to_split, start_split_pos);
-
-            if(rep(piece_right.length) > 0)
-                allChildren[resultCount++] = {piece_right};
-            if(rep(piece_left.length) > 0)
-                allChildren[resultCount++] = {piece_left};
-
-            //split
-            i++;
+            const BracketIndex& index = buffer->brackets;
+            while (first < last)
+            {
+                auto levels = bracket_levels_to(index, first, last);
+                bool skipped = false;
+                while (levels != 0 and not skipped)
+                {
+                    --levels;
+                    auto size = bracket_span_size(levels);
+                    const BracketDepth& span = index.levels[levels][last / size - 1].depths[pair];
+                    if (*depth - span.delta + span.min > target)
+                    {
+                        *depth -= span.delta;
+                        last -= size;
+                        skipped = true;
+                    }
+                }
+                if (skipped)
+                    continue;
+                --last;
+                *depth -= bracket_step(pairs.pairs[pair], buffer->buffer.str[last]);
+                if (*depth <= target)
+                    return CharOffset{ last };
+            }
+            return CharOffset::Sentinel;
         }
-        else
+
+        // Searches the bytes [first, last) of the document which lie in 'piece', starting at 'start', as above.
+        CharOffset piece_bracket_forward(const BufferCollection* buffers, const Piece& piece, uint64_t start, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
         {
-            if(rep(at)>0)
+            auto end = start + rep(piece.length);
+            first = first > start ? first : start;
+            last = last < end ? last : end;
+            if (first >= last)
+                return CharOffset::Sentinel;
+            const BracketDepth& span = piece.summary.depths[pair];
+            if (first == start and last == end and *depth + span.min > target)
             {
-                auto start_split_pos = buffer_position(blk, allLeafs[i].piece, at);
-                auto trimright = trim_piece_right(blk, allLeafs[i].piece, start_split_pos);
-                allChildren[resultCount++] = {trimright};
+                *depth += span.delta;
+                return CharOffset::Sentinel;
             }
-            len = len -  (allLeafs[i].piece.length - at);
-            i++;
-            for(;i < leaflength && allLeafs[i].piece.length <= len;i++)
+            auto base = rep(buffers->buffer_offset(piece.index, piece.first));
+            auto found = find_bracket_forward(buffers->bracket_pairs, pair, buffers->buffer_at(piece.index), base + first - start, base + last - start, depth, target);
+            if (found == CharOffset::Sentinel)
+                return found;
+            return CharOffset{ start + rep(found) - base };
+        }
+
+        CharOffset piece_bracket_backward(const BufferCollection* buffers, const Piece& piece, uint64_t start, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
+        {
+            auto end = start + rep(piece.length);
+            first = first > start ? first : start;
+            last = last < end ? last : end;
+            if (first >= last)
+                return CharOffset::Sentinel;
+            const BracketDepth& span = piece.summary.depths[pair];
+            if (first == start and last == end and *depth - span.delta + span.min > target)
             {
-                len  = len - allLeafs[i].piece.length;
+                *depth -= span.delta;
+                return CharOffset::Sentinel;
             }
-            if(rep(len) > 0 && i < leaflength)
-            {
-                auto end_split_pos = buffer_position(blk, allLeafs[i].piece, len);
+            auto base = rep(buffers->buffer_offset(piece.index, piece.first));
+            auto found = find_bracket_backward(buffers->bracket_pairs, pair, buffers->buffer_at(piece.index), base + first - start, base + last - start, depth, target);
+            if (found == CharOffset::Sentinel)
+                return found;
+            return CharOffset{ start + rep(found) - base };
+        }
+#endif // FRED_BRACKET_SUMMARY
 
-                auto piece_left = trim_piece_left(blk, allLeafs[i].piece, end_split_pos);
-                allChildren[resultCount++] = {piece_left};
-                i++;
+        LineStarts sample_line_starts(Arena::Arena* arena, const LineStarts& starts)
+        {
+            LineStarts result{};
+            if (starts.count < line_start_sample_min_lines)
+                return result;
+            result.count = (starts.count + line_start_sample_stride - 1) / line_start_sample_stride;
+            result.starts = Arena::push_array_no_zero<LineStart>(arena, result.count);
+            for EachIndex(i, result.count)
+            {
+                result.starts[i] = starts.starts[i * line_start_sample_stride];
             }
+            return result;
         }
 
-        //add rest
-
-        for(;i< leaflength;i++)
+        // A B-tree node spans several cache lines.  Hint all of the summary lines a descent reads so they are fetched
+        // in parallel rather than one at a time by the search.
+        template <typename NodeT>
+        void prefetch_node(const NodeT* node)
         {
-            allChildren[resultCount++] = allLeafs[i];
+            const char* first = reinterpret_cast<const char*>(node);
+            for (size_t i = 0; i < sizeof(NodeT); i += 64)
+            {
+                FRED_PREFETCH(first + i);
+            }
         }
 
-        TreeManipResult result;
-        result.depth = 1;
-        if(resultCount > MaxChildren*3)
+        // Hints the start of a piece's text, for a piece which is about to be visited.
+        void prefetch_piece(const BufferCollection* buffers, const Piece& piece)
         {
-            
-            size_t from = 0;
-            size_t perChild = resultCount/4;
-            result.nodes = Arena::push_array<NodePtr>(arena, 4);
-            result.count = 4;
+            const CharBuffer* buffer = buffers->buffer_at(piece.index);
+            FRED_PREFETCH(buffer->buffer.str + rep(buffers->buffer_offset(piece.index, piece.first)));
+        }
 
-            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
-            from+=perChild;
-            if(resultCount%4 > 1)
+        // Finds the line in [low, high] which contains 'offset' using the sampled index of 'buffer'.
+        size_t sampled_line_search(const CharBuffer* buffer, size_t low, size_t high, size_t offset)
+        {
+            const LineStarts& starts = buffer->line_starts;
+            const LineStarts& samples = buffer->line_start_samples;
+            // The first sample past 'offset' ends the block we are interested in.  Since 'starts[low] <= offset', the
+            // sample for 'low' is never past it.
+            auto* first_sample = samples.starts + low / line_start_sample_stride;
+            auto* last_sample = samples.starts + high / line_start_sample_stride + 1;
+            auto* past = branchless_lower_bound(first_sample + 1, last_sample, LineStart{ offset + 1 });
+            auto first = static_cast<size_t>(past - samples.starts - 1) * line_start_sample_stride;
+            auto last = first + line_start_sample_stride < starts.count ? first + line_start_sample_stride : starts.count;
+            // Counting rather than searching keeps the block scan branch-free so it can be vectorized.
+            size_t line = first;
+            for (size_t i = first + 1; i < last; ++i)
             {
-                perChild+=1;
+                line += rep(starts.starts[i]) <= offset;
             }
-            result.nodes[1] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
-            from+=perChild;
-            result.nodes[2] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
-            from+=perChild;
-            result.nodes[3] = (construct_leaf(blk->rb_tree_blk, allChildren, from, resultCount));
+            return line < high ? line : high;
         }
-        else if(resultCount > MaxChildren*2)
-        {
-            size_t from = 0;
-            size_t perChild = resultCount/3;
-            result.nodes = Arena::push_array<NodePtr>(arena, 3);
-            result.count = 3;
+#if FRED_CODE_POINT_INDEX
+        constexpr uint64_t code_point_block_size = 256;
+#endif // FRED_CODE_POINT_INDEX
 
-            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
-            from+=perChild;
-            if(resultCount%3 > 1)
+#if FRED_CODE_POINT_SUMMARY
+        uint64_t count_code_points(const char* first, uint64_t size)
+        {
+            uint64_t count = 0;
+            for EachIndex(i, size)
             {
-                perChild+=1;
+                // Every byte other than a continuation byte (10xxxxxx) begins a code point.
+                count += (static_cast<uint8_t>(first[i]) & 0xC0) != 0x80;
             }
-            result.nodes[1] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
-            from+=perChild;
-            result.nodes[2] = (construct_leaf(blk->rb_tree_blk, allChildren, from, resultCount));
+            return count;
         }
-        else if(resultCount > MaxChildren)
-        {
-            
-            size_t from = 0;
-            size_t mid = resultCount/2;
-            result.nodes = Arena::push_array<NodePtr>(arena, 2);
-            result.count = 2;
+#endif // FRED_CODE_POINT_SUMMARY
 
-            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+mid));
+#if FRED_UTF16_SUMMARY
+        uint64_t count_utf16_units(const char* first, uint64_t size)
+        {
+            uint64_t count = 0;
+            for EachIndex(i, size)
+            {
+                auto b = static_cast<uint8_t>(first[i]);
+                // Four byte sequences (lead byte 11110xxx) are encoded as a surrogate pair.
+                count += ((b & 0xC0) != 0x80) + (b >= 0xF0);
+            }
+            return count;
+        }
+#endif // FRED_UTF16_SUMMARY
 
-            result.nodes[1] = (construct_leaf(blk->rb_tree_blk, allChildren, mid, resultCount));
+#if FRED_HASH_SUMMARY
+        // Rolling hashes are computed modulo the Mersenne prime 2^61 - 1.
+        constexpr uint64_t hash_modulus = (uint64_t{ 1 } << 61) - 1;
+        constexpr uint64_t hash_base = 0x9E3779B97F4A7C15 % hash_modulus;
 
-        }
-        else if(resultCount > 0)
+        uint64_t hash_mul(uint64_t a, uint64_t b)
         {
-            result.nodes = Arena::push_array<NodePtr>(arena, 1);
-            result.count = 1;
-
-            //assert(allChildren.size() >= MaxChildren/2);
-            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, 0, resultCount));
+#if defined(_MSC_VER)
+            uint64_t high;
+            uint64_t low = _umul128(a, b, &high);
+#else
+            auto product = static_cast<unsigned __int128>(a) * b;
+            auto low = static_cast<uint64_t>(product);
+            auto high = static_cast<uint64_t>(product >> 64);
+#endif
+            // 2^61 is 1 modulo the prime, so the bits above 61 fold back onto the low ones.
+            uint64_t result = (low & hash_modulus) + (low >> 61) + (high << 3);
+            result = (result & hash_modulus) + (result >> 61);
+            return result >= hash_modulus ? result - hash_modulus : result;
         }
-        else
+
+        uint64_t hash_add(uint64_t a, uint64_t b)
         {
-            result.nodes = nullptr;
-            result.count = 0;
+            auto result = a + b;
+            return result >= hash_modulus ? result - hash_modulus : result;
         }
-        Arena::scratch_end(scratch);
-        return result;
-    }
-
 
-    void Tree::insert(CharOffset offset, String8 txt, SuppressHistory suppress_history)
-    {
-        if (txt.size == 0)
-            return;
-        // This allows us to undo blocks of code.
-        if (is_no(suppress_history)
-            and (end_last_insert != offset or root.is_empty()))
+        uint64_t hash_sub(uint64_t a, uint64_t b)
         {
-            append_undo(root, offset);
+            return a >= b ? a - b : a + hash_modulus - b;
         }
-        internal_insert(offset, txt);
-    }
 
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::insertInto(Arena::Arena *arena, BufferCollection* blk, const NodePtr node, const NodeData& x, Length at) const
-    {
-        if(node)algo_mark(node, Traverse);
-        //TODO(ratchetfreak) : change result to be 1 or more ChildPtrs which is exactly the x node with the insert
-        if(node==nullptr||node->isLeaf())
+        // 'hash_base' to the power 'n'.
+        uint64_t hash_power(uint64_t n)
         {
-            return insertInto_leaf(arena, blk, to_leaf_node(node), x, at);
+            uint64_t result = 1;
+            uint64_t square = hash_base;
+            for (; n != 0; n >>= 1)
+            {
+                if (n & 1)
+                {
+                    result = hash_mul(result, square);
+                }
+                square = hash_mul(square, square);
+            }
+            return result;
         }
-        else
-        {
-            Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
-            //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
-            InternalNodePtr in = to_internal_node(node);
-            NodeVector node_children = (in->children);
-            auto offsets_end = node->offsets.begin()+node->childCount;
-            auto insertPoint = branchless_lower_bound(node->offsets.begin(), offsets_end, at);
-            size_t insertIndex = insertPoint - node->offsets.begin();
-            auto insertChIt = node_children+insertIndex;
-            auto insertChItEnd = node_children+node->childCount;
-
-            NodeVector resultch = Arena::push_array<NodePtr>(scratch.arena, in->childCount + 2);
-            size_t resultCount = 0;
-            auto child_it = (node_children);
 
-            for(; child_it!=insertChIt; ++child_it)
+        // Extends 'hash' (of some text) by the bytes [first, first + size).
+        uint64_t hash_bytes(uint64_t hash, const char* first, uint64_t size)
+        {
+            for EachIndex(i, size)
             {
-                resultch[resultCount++] = take_node_ref(*child_it);
-                
+                // Offset by one so that leading NUL bytes still change the hash.
+                hash = hash_add(hash_mul(hash, hash_base), static_cast<uint8_t>(first[i]) + uint64_t{ 1 });
             }
+            return hash;
+        }
+#endif // FRED_HASH_SUMMARY
 
-            Length childInsert = at;
-            if(insertIndex>0)
+#if FRED_CODE_POINT_INDEX
+        // A copy of the first 'count' entries of 'blocks' in a new array of 'capacity' entries.
+        template <typename T>
+        T* grow_blocks(Arena::Arena* arena, const T* blocks, uint64_t count, uint64_t capacity)
+        {
+            T* result = Arena::push_array_no_zero<T>(arena, capacity);
+            if (count != 0)
             {
-                childInsert = childInsert - node->offsets[insertIndex - 1];
+                memcpy(result, blocks, count * sizeof(T));
             }
-            auto insert_child = node_children[insertIndex];
-            auto insert_result = insertInto(scratch.arena, blk, insert_child, x, childInsert);
-
-            size_t newNumChildren = insert_result.count;
+            return result;
+        }
 
-            for(int i = 0; i< newNumChildren;i++)
+        // Extends 'index' to cover every block boundary of 'buf'.
+        void extend_code_point_index(Arena::Arena* arena, CodePointIndex* index, String8 buf)
+        {
+            auto needed = buf.size / code_point_block_size + 1;
+            if (needed <= index->count)
+                return;
+            if (needed > index->capacity)
             {
-                resultch[resultCount++] = (insert_result.nodes[i]);
+                // The previous arrays are left intact since snapshots may still refer to them.
+                auto capacity = index->capacity * 2 < needed ? needed : index->capacity * 2;
+#if FRED_CODE_POINT_SUMMARY
+                index->blocks = grow_blocks(arena, index->blocks, index->count, capacity);
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+                index->utf16_blocks = grow_blocks(arena, index->utf16_blocks, index->count, capacity);
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+                index->hash_blocks = grow_blocks(arena, index->hash_blocks, index->count, capacity);
+#endif // FRED_HASH_SUMMARY
+                index->capacity = capacity;
             }
-            child_it++;
-            for(; child_it!=insertChItEnd;  ++child_it)
+            if (index->count == 0)
             {
-                resultch[resultCount++] = take_node_ref(*child_it);
+#if FRED_CODE_POINT_SUMMARY
+                index->blocks[0] = CodePointCount{ };
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+                index->utf16_blocks[0] = Utf16Count{ };
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+                index->hash_blocks[0] = 0;
+#endif // FRED_HASH_SUMMARY
+                index->count = 1;
             }
-
-            TreeManipResult manipresult{};
-            manipresult.depth = insert_result.depth+1;
-            manipresult.nodes = Arena::push_array<NodePtr>(arena, in->childCount + 2);
-            if(resultCount > MaxChildren)
+            for (uint64_t k = index->count; k < needed; ++k)
             {
-                //split the to-be inserted node into two
-                size_t numLChild = resultCount/2;
-
-                NodePtr leftChild = construct_internal(blk->rb_tree_blk, resultch, 0, numLChild);
-                NodePtr rightChild = construct_internal(blk->rb_tree_blk,resultch, numLChild, resultCount);
-
-                manipresult.nodes[manipresult.count++] = leftChild;
-                manipresult.nodes[manipresult.count++] = rightChild;
-
-                //return manipresult;
+                const char* block = buf.str + (k - 1) * code_point_block_size;
+#if FRED_CODE_POINT_SUMMARY
+                index->blocks[k] = extend(index->blocks[k - 1], count_code_points(block, code_point_block_size));
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+                index->utf16_blocks[k] = extend(index->utf16_blocks[k - 1], count_utf16_units(block, code_point_block_size));
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+                index->hash_blocks[k] = hash_bytes(index->hash_blocks[k - 1], block, code_point_block_size);
+#endif // FRED_HASH_SUMMARY
             }
-            else
+            index->count = needed;
+        }
+#endif // FRED_CODE_POINT_INDEX
+
+#if FRED_WRAP_SUMMARY
+        // Fills 'rows[k]' for lines k in [first, last) of 'buffer' from 'rows[first - 1]'.
+        void fill_wrap_rows(uint64_t* rows, uint64_t first, uint64_t last, const CharBuffer* buffer, uint64_t width)
+        {
+            for (uint64_t k = first; k < last; ++k)
             {
-                auto newChild = construct_internal(blk->rb_tree_blk, resultch
-                , 0, resultCount);
-                manipresult.nodes[manipresult.count++] = newChild;
-                
+                // Line k - 1 ends one byte before the start of line k.
+                auto length = rep(buffer->line_starts.starts[k]) - rep(buffer->line_starts.starts[k - 1]) - 1;
+                rows[k] = rows[k - 1] + WrapSummary::line_rows(Length{ length }, width);
             }
-            Arena::scratch_end(scratch);
-            return manipresult;
         }
-        // return {};
-    }
 
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::remove_from(Arena::Arena *arena, BufferCollection* blk, NodePtr a, NodePtr b, NodePtr c, Length at, Length len) const
-    {
-        // at least one of a and c should not participate in the remove
-        // that way the result is always big enough to make at least 1 node
-        if(a)algo_mark(a, Collect);
-        if(b)algo_mark(b, Collect);
-        if(c)algo_mark(c, Collect);
+        // Extends the mod buffer rows of 'wrap' to the lines completed since the last call.
+        void extend_mod_wrap_rows(Arena::Arena* arena, WrapIndex* wrap, const CharBuffer* mod_buffer)
+        {
+            if (wrap == nullptr)
+                return;
+            auto needed = mod_buffer->line_starts.count;
+            if (needed <= wrap->mod_count)
+                return;
+            if (needed > wrap->mod_capacity)
+            {
+                // The previous array is left intact since snapshots may still refer to it.
+                auto capacity = wrap->mod_capacity * 2 < needed ? needed : wrap->mod_capacity * 2;
+                uint64_t* rows = Arena::push_array_no_zero<uint64_t>(arena, capacity);
+                if (wrap->mod_count != 0)
+                {
+                    memcpy(rows, wrap->mod_rows, wrap->mod_count * sizeof(uint64_t));
+                }
+                wrap->mod_rows = rows;
+                wrap->mod_capacity = capacity;
+            }
+            if (wrap->mod_count == 0)
+            {
+                wrap->mod_rows[0] = 0;
+                wrap->mod_count = 1;
+            }
+            fill_wrap_rows(wrap->mod_rows, wrap->mod_count, needed, mod_buffer, wrap->width);
+            wrap->mod_count = needed;
+        }
 
-        if(a->isLeaf())
+        // Extends 'wrap' to the original buffers adopted and the mod buffer lines completed since it was last current.
+        void extend_wrap_rows(Arena::Arena* arena, WrapIndex* wrap, const BufferCollection* buffers)
         {
-            assert(!b || b->isLeaf());
-            assert(!c || c->isLeaf());
-            
-            return remove_from_leafs(arena, blk, 
-                to_leaf_node(a), 
-                to_leaf_node(b), 
-                to_leaf_node(c), 
-                at, len);
+            auto count = buffers->orig_buffers.count;
+            if (count > wrap->capacity)
+            {
+                // The previous array is left intact since snapshots may still refer to it.
+                auto capacity = wrap->capacity * 2 < count ? count : wrap->capacity * 2;
+                uint64_t** rows = Arena::push_array_no_zero<uint64_t*>(arena, capacity);
+                if (wrap->count != 0)
+                {
+                    memcpy(rows, wrap->rows, wrap->count * sizeof(uint64_t*));
+                }
+                wrap->rows = rows;
+                wrap->capacity = capacity;
+            }
+            for (uint64_t i = wrap->count; i < count; ++i)
+            {
+                const CharBuffer* buffer = &buffers->orig_buffers.buffers[i];
+                wrap->rows[i] = Arena::push_array_no_zero<uint64_t>(arena, buffer->line_starts.count);
+                wrap->rows[i][0] = 0;
+                fill_wrap_rows(wrap->rows[i], 1, buffer->line_starts.count, buffer, wrap->width);
+            }
+            wrap->count = count;
+            extend_mod_wrap_rows(arena, wrap, &buffers->mod_buffer);
         }
-        else if(c==nullptr && b == nullptr && a->childCount<=3)
+
+        const uint64_t* wrap_rows(const WrapIndex* wrap, BufferIndex index)
         {
-            InternalNodePtr ina = to_internal_node(a);
-            if(a->childCount==3 && 
-                    at < ina->offsets[0] && 
-                    (extend(at, rep(len))) > ina->offsets[1] )
-                return remove_from(arena, blk, 
-                    ina->children[0], 
-                    ina->children[2], 
-                    nullptr,
-                    at, retract(len, rep(ina->offsets[1] - ina->offsets[0])));
-            else
-                return remove_from(arena, blk, 
-                    ina->children[0], 
-                    (a->childCount>1)?ina->children[1]:nullptr, 
-                    (a->childCount>2)?ina->children[2]:nullptr, 
-                    at, len);
+            return index == BufferIndex::ModBuf ? wrap->mod_rows : wrap->rows[rep(index)];
         }
-        else
+#endif // FRED_WRAP_SUMMARY
+
+        // The line of mark 'mark' times two, plus one for a last line.
+        uint64_t mark_key(const FoldSet* set, uint64_t mark)
         {
-            Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
-            //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
-            
-            size_t totalChildCount = (a?a->childCount:0)+(b?b->childCount:0)+(c?c->childCount:0);
-            assert(!b || !b->isLeaf());
-            assert(!c || !c->isLeaf());
-            NodeVector resultChildren = Arena::push_array<NodePtr>(scratch.arena, totalChildCount+3);
-            size_t childCount = 0;
-            //allocate extra at head and nill it to skip bounds checks later
-            NodeVector allChildren = Arena::push_array<NodePtr>(scratch.arena, totalChildCount+3)+3;
-            Length* allOffsets = Arena::push_array<Length>(scratch.arena, totalChildCount+3)+3;
+            return set->marks[mark] + (mark < set->mark_gap ? 0 : 2 * set->shift);
+        }
+
+        uint64_t run_first_line(const FoldSet* set, uint64_t run)
+        {
+            return set->run_first[run] + (run < set->run_gap ? 0 : set->shift);
+        }
+
+        uint64_t run_header_line(const FoldSet* set, uint64_t run)
+        {
+            return set->run_header[run] + (run < set->run_gap ? 0 : set->shift);
+        }
+
+        Fold get_fold(const FoldSet* set, uint64_t index)
+        {
+            return { .header = Line{ mark_key(set, set->header_marks[index]) / 2 },
+                        .last = Line{ mark_key(set, set->last_marks[index]) / 2 },
+                        .collapsed = set->collapsed[index] };
+        }
 
+        // The first of the 'count' ascending values read through 'value' which is not below 'target'.
+        template <typename F>
+        uint64_t lower_bound_by(uint64_t count, uint64_t target, F value)
+        {
+            uint64_t first = 0;
+            while (count != 0)
             {
-                InternalNodePtr ina = to_internal_node(a);
-                NodeVector chA = (ina->children);
-                auto outputIt = allChildren;
-                auto offsetsOutIt = allOffsets;
-                totalChildCount = a->childCount;
-                outputIt = std::copy_n(chA, a->childCount, outputIt);
-                for EachIndex(i, a->childCount)
+                auto half = count / 2;
+                if (value(first + half) < target)
                 {
-                    *offsetsOutIt++ = a->offsets[i];
+                    first += half + 1;
+                    count -= half + 1;
                 }
-                auto total_offset = a->offsets[a->childCount-1];
-                if(b!=nullptr)
+                else
                 {
-                    InternalNodePtr inb = to_internal_node(b);
-                    NodeVector chB = (inb->children);
-                    outputIt = std::copy_n(chB, b->childCount, outputIt);
-                    for EachIndex(i, b->childCount)
-                    {
-                        *offsetsOutIt++ = total_offset + b->offsets[i];
-                    }
-                    totalChildCount = totalChildCount + b->childCount;
-                    total_offset = total_offset+ b->offsets[b->childCount-1];
+                    count = half;
                 }
-                
-                if(c!=nullptr)
+            }
+            return first;
+        }
+
+        void rebuild_fold_runs(FoldSet* set)
+        {
+            uint64_t runs = 0;
+            uint64_t run_last = 0;
+            uint64_t hidden = 0;
+            for EachIndex(i, set->count)
+            {
+                if (not set->collapsed[i])
+                    continue;
+                const Fold fold = get_fold(set, i);
+                auto first = rep(fold.header) + 1;
+                // Folds nested in (or overlapping) the open run only extend it.
+                if (runs != 0 and first <= run_last + 1)
                 {
-                    InternalNodePtr inc = to_internal_node(c);
-                    NodeVector chC = (inc->children);
-                    outputIt = std::copy_n(chC, c->childCount, outputIt);
-                    for EachIndex(i, c->childCount)
-                    {
-                        *offsetsOutIt++ = total_offset + c->offsets[i];
-                    }
-                    totalChildCount = totalChildCount + c->childCount;
+                    run_last = rep(fold.last) > run_last ? rep(fold.last) : run_last;
+                    continue;
+                }
+                if (runs != 0)
+                {
+                    hidden += run_last - set->run_first[runs - 1] + 1;
                 }
+                set->run_first[runs] = first;
+                set->run_header[runs] = first - 1 - hidden;
+                set->hidden_before[runs] = hidden;
+                run_last = rep(fold.last);
+                ++runs;
             }
-            NodePtr recA = nullptr;
-            NodePtr recB = nullptr;
-            NodePtr recC = nullptr;
+            if (runs != 0)
+            {
+                set->hidden_before[runs] = hidden + run_last - set->run_first[runs - 1] + 1;
+            }
+            set->run_count = runs;
+            set->run_gap = runs;
+        }
 
-            Length offset = at;
+        uint64_t hidden_lines(const FoldSet* set)
+        {
+            return set->run_count == 0 ? 0 : set->hidden_before[set->run_count];
+        }
 
-            Length aplusbplusc {0};
-            int i = 0;
-            for(; i<totalChildCount &&
-                    allOffsets[i] < offset;i++)
+        // The index of the first fold whose header is not before 'header'.
+        uint64_t find_fold(const FoldSet* set, Line header)
+        {
+            return lower_bound_by(set->count, 2 * rep(header), [&](uint64_t i) { return mark_key(set, set->header_marks[i]); });
+        }
+
+        // Replaces the folds with 'folds', sorted by header, dropping those left without lines or sharing a header with
+        // the one before.  The set must have room for all of them.
+        void assign_folds(FoldSet* set, const Fold* folds, uint64_t count)
+        {
+            struct Mark
             {
+                uint64_t key;
+                uint64_t fold;
+            };
+            Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+            Mark* marks = Arena::push_array_no_zero<Mark>(scratch.arena, 2 * count);
+            uint64_t kept = 0;
+            for EachIndex(i, count)
+            {
+                const Fold& fold = folds[i];
+                if (rep(fold.last) <= rep(fold.header) or (kept != 0 and marks[2 * kept - 2].key == 2 * rep(fold.header)))
+                    continue;
+                marks[2 * kept] = { .key = 2 * rep(fold.header), .fold = kept };
+                marks[2 * kept + 1] = { .key = 2 * rep(fold.last) + 1, .fold = kept };
+                set->collapsed[kept] = fold.collapsed;
+                ++kept;
             }
-            
-            
-            auto newoffset = offset - allOffsets[i-3];
-            
-            //now allChildren[i] is the first node that needs removing anything
-            for (int64_t j = 0; j < (i-2); j += 1)
+            std::sort(marks, marks + 2 * kept, [](const Mark& a, const Mark& b) { return a.key < b.key; });
+            for EachIndex(i, 2 * kept)
             {
-                resultChildren[childCount++] = take_node_ref(allChildren[j]);
-                algo_mark(allChildren[j], Skip);
+                set->marks[i] = marks[i].key;
+                (marks[i].key % 2 == 0 ? set->header_marks : set->last_marks)[marks[i].fold] = i;
             }
-            
-            auto start_offset = allOffsets[i-3];
-            (void) start_offset;
-            
-            recA = allChildren[i-2];
-            recB = allChildren[i-1];
-            recC = allChildren[i];
-            aplusbplusc =  allOffsets[i] - allOffsets[i-3];
-            
-            Length to_remove_from_first_found = aplusbplusc - newoffset;
-            i++;
-            TreeManipResult res;
-            
-            algo_mark(recC, Traverse);
+            Arena::scratch_end(scratch);
+            set->count = kept;
+            set->mark_gap = 2 * kept;
+            set->shift = 0;
+            set->saved = nullptr;
+            rebuild_fold_runs(set);
+        }
+
+        // The folds in header order, as 'assign_folds' takes them.
+        Fold* copy_folds(Arena::Arena* arena, const FoldSet* set, uint64_t room)
+        {
+            Fold* folds = Arena::push_array_no_zero<Fold>(arena, room);
+            for EachIndex(i, set->count)
+            {
+                folds[i] = get_fold(set, i);
+            }
+            return folds;
+        }
+
+        void reserve_folds(FoldSet* set, uint64_t needed)
+        {
+            if (needed <= set->capacity)
+                return;
+            auto capacity = set->capacity * 2 < needed ? needed : set->capacity * 2;
+            if (set->arena == nullptr)
+            {
+                set->arena = Arena::alloc(Arena::default_params);
+            }
+            // The arena only holds the arrays, so they are set aside while it is cleared for the longer ones.
+            Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+            Fold* folds = copy_folds(scratch.arena, set, set->count);
+            Arena::clear(set->arena);
+            set->marks = Arena::push_array_no_zero<uint64_t>(set->arena, 2 * capacity);
+            set->header_marks = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->last_marks = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->collapsed = Arena::push_array_no_zero<bool>(set->arena, capacity);
+            // There is at most one run per fold.
+            set->run_first = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->run_header = Arena::push_array_no_zero<uint64_t>(set->arena, capacity);
+            set->hidden_before = Arena::push_array_no_zero<uint64_t>(set->arena, capacity + 1);
+            set->capacity = capacity;
+            auto saved = set->saved;
+            assign_folds(set, folds, set->count);
+            set->saved = saved;
+            Arena::scratch_end(scratch);
+        }
+
+        // Moves the gaps to 'mark_gap' and 'run_gap', storing the marks and runs crossing them at or before their place.
+        void move_fold_gaps(FoldSet* set, uint64_t mark_gap, uint64_t run_gap)
+        {
+            for (uint64_t i = mark_gap; i < set->mark_gap; ++i)
+            {
+                set->marks[i] -= 2 * set->shift;
+            }
+            for (uint64_t i = set->mark_gap; i < mark_gap; ++i)
+            {
+                set->marks[i] += 2 * set->shift;
+            }
+            for (uint64_t i = run_gap; i < set->run_gap; ++i)
+            {
+                set->run_first[i] -= set->shift;
+                set->run_header[i] -= set->shift;
+            }
+            for (uint64_t i = set->run_gap; i < run_gap; ++i)
+            {
+                set->run_first[i] += set->shift;
+                set->run_header[i] += set->shift;
+            }
+            set->mark_gap = mark_gap;
+            set->run_gap = run_gap;
+        }
+
+        // Moves the folds over an edit which replaced lines [first, first + removed] with 'inserted' + 1 lines.  Lines
+        // inside the removed ones collapse onto 'first' and a fold ending on the last edited line keeps all of it.  When
+        // 'first_moves' the edit began at the start of 'first', which moves down with the lines after it.
+        void edit_folds(FoldSet* set, Line first, uint64_t removed, uint64_t inserted, bool first_moves)
+        {
+            auto last = rep(first) + removed;
+            // The marks from 'boundary' on move by the lines the edit adds or removes and those from the line after
+            // 'first' up to it collapse onto 'first'.
+            auto boundary = 2 * last + (first_moves ? 0 : 1);
+            auto key_at = [&](uint64_t mark) { return mark_key(set, mark); };
+            auto moving = lower_bound_by(2 * set->count, boundary, key_at);
+            auto collapsing = lower_bound_by(2 * set->count, 2 * rep(first) + 2, key_at);
+            // Removing the lines of a fold which start on 'first' leaves it without lines.
+            auto emptied = false;
+            if (inserted == 0 and removed != 0)
+            {
+                auto at = find_fold(set, first);
+                emptied = at != set->count and get_fold(set, at).header == first and get_fold(set, at).last == Line{ last };
+            }
+            if (collapsing < moving or emptied)
+            {
+                auto move = [&](Line line, bool ends)
+                {
+                    if (rep(line) > last or ((ends or first_moves) and rep(line) == last))
+                        return Line{ rep(line) - removed + inserted };
+                    return rep(line) > rep(first) ? first : line;
+                };
+                Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+                Fold* folds = copy_folds(scratch.arena, set, set->count);
+                for EachIndex(i, set->count)
+                {
+                    folds[i].header = move(folds[i].header, false);
+                    folds[i].last = move(folds[i].last, true);
+                }
+                assign_folds(set, folds, set->count);
+                Arena::scratch_end(scratch);
+                return;
+            }
+            auto run = lower_bound_by(set->run_count, boundary, [&](uint64_t i) { return 2 * (run_first_line(set, i) - 1); });
+            // A collapsed fold reaching past the edit from before it grows or shrinks with it.
+            auto reaches = run != 0 and 2 * (run_first_line(set, run - 1) + set->hidden_before[run] - set->hidden_before[run - 1] - 1) + 1 >= boundary;
+            move_fold_gaps(set, moving, run);
+            set->shift += inserted - removed;
+            set->saved = nullptr;
+            if (reaches)
+            {
+                rebuild_fold_runs(set);
+            }
+        }
+
+        void drop_folds_past(FoldSet* set, Line last_line)
+        {
+            // The last mark is the greatest last line.
+            if (set->count == 0 or mark_key(set, 2 * set->count - 1) / 2 <= rep(last_line))
+                return;
+            Arena::Temp scratch = Arena::scratch_begin({ &set->arena, 1 });
+            Fold* folds = copy_folds(scratch.arena, set, set->count);
+            uint64_t count = 0;
+            for EachIndex(i, set->count)
+            {
+                if (rep(folds[i].last) <= rep(last_line))
+                {
+                    folds[count++] = folds[i];
+                }
+            }
+            assign_folds(set, folds, count);
+            Arena::scratch_end(scratch);
+        }
+
+        // The folds as they are now, copied only when they changed since the history last recorded them.
+        const FoldSnapshot* save_folds(Arena::Arena* arena, FoldSet* set)
+        {
+            if (set->count == 0)
+                return nullptr;
+            if (set->saved == nullptr)
+            {
+                FoldSnapshot* snapshot = Arena::push_array<FoldSnapshot>(arena, 1);
+                snapshot->folds = copy_folds(arena, set, set->count);
+                snapshot->count = set->count;
+                set->saved = snapshot;
+            }
+            return set->saved;
+        }
+
+        void restore_folds(FoldSet* set, const FoldSnapshot* snapshot)
+        {
+            if (snapshot == nullptr)
+            {
+                set->count = 0;
+                set->run_count = 0;
+                set->saved = nullptr;
+                return;
+            }
+            reserve_folds(set, snapshot->count);
+            assign_folds(set, snapshot->folds, snapshot->count);
+            set->saved = snapshot;
+        }
+
+#if FRED_CODE_POINT_SUMMARY
+        // The number of code points in the first 'offset' bytes of 'buffer'.
+        CodePointCount code_points_before(const CharBuffer* buffer, CharOffset offset)
+        {
+            auto block = rep(offset) / code_point_block_size;
+            auto block_start = block * code_point_block_size;
+            return extend(buffer->code_points.blocks[block], count_code_points(buffer->buffer.str + block_start, rep(offset) - block_start));
+        }
+
+        // Finds the offset in 'buffer' where code point 'codepoint' (counted from the start of the buffer) begins,
+        // without going past 'last'.
+        CharOffset code_point_offset(const CharBuffer* buffer, CodePointCount codepoint, CharOffset last)
+        {
+            const CodePointIndex& index = buffer->code_points;
+            // The last block boundary with at most 'codepoint' code points before it.
+            auto* past = branchless_lower_bound(index.blocks, index.blocks + index.count, extend(codepoint));
+            auto block = static_cast<uint64_t>(past - index.blocks) - 1;
+            auto seen = rep(index.blocks[block]);
+            auto offset = block * code_point_block_size;
+            for (; offset < rep(last); ++offset)
+            {
+                if ((static_cast<uint8_t>(buffer->buffer.str[offset]) & 0xC0) == 0x80)
+                    continue;
+                if (seen == rep(codepoint))
+                    break;
+                ++seen;
+            }
+            return CharOffset{ offset };
+        }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+        // The number of UTF-16 code units in the first 'offset' bytes of 'buffer'.
+        Utf16Count utf16_units_before(const CharBuffer* buffer, CharOffset offset)
+        {
+            auto block = rep(offset) / code_point_block_size;
+            auto block_start = block * code_point_block_size;
+            return extend(buffer->code_points.utf16_blocks[block], count_utf16_units(buffer->buffer.str + block_start, rep(offset) - block_start));
+        }
+
+        // Finds the offset in 'buffer' of the code point holding UTF-16 code unit 'units' (counted from the start of
+        // the buffer), without going past 'last'.
+        CharOffset utf16_unit_offset(const CharBuffer* buffer, Utf16Count units, CharOffset last)
+        {
+            const CodePointIndex& index = buffer->code_points;
+            auto* past = branchless_lower_bound(index.utf16_blocks, index.utf16_blocks + index.count, extend(units));
+            auto block = static_cast<uint64_t>(past - index.utf16_blocks) - 1;
+            auto seen = rep(index.utf16_blocks[block]);
+            auto offset = block * code_point_block_size;
+            for (; offset < rep(last); ++offset)
+            {
+                auto b = static_cast<uint8_t>(buffer->buffer.str[offset]);
+                if ((b & 0xC0) == 0x80)
+                    continue;
+                auto width = b >= 0xF0 ? 2 : 1;
+                if (seen + width > rep(units))
+                    break;
+                seen += width;
+            }
+            return CharOffset{ offset };
+        }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_HASH_SUMMARY
+        // The rolling hash of the first 'offset' bytes of 'buffer'.
+        uint64_t buffer_prefix_hash(const CharBuffer* buffer, uint64_t offset)
+        {
+            auto block = offset / code_point_block_size;
+            auto block_start = block * code_point_block_size;
+            return hash_bytes(buffer->code_points.hash_blocks[block], buffer->buffer.str + block_start, offset - block_start);
+        }
+
+        // The rolling hash of the bytes [first, last) of 'buffer'.
+        uint64_t buffer_hash(const CharBuffer* buffer, uint64_t first, uint64_t last)
+        {
+            auto before = hash_mul(buffer_prefix_hash(buffer, first), hash_power(last - first));
+            return hash_sub(buffer_prefix_hash(buffer, last), before);
+        }
+#endif // FRED_HASH_SUMMARY
+    } // namespace [anon]
+
+    BufferCursor buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder)
+    {
+        const LineStarts* starts = &buffers->buffer_at(piece.index)->line_starts;
+        auto start_offset = rep(starts->starts[rep(piece.first.line)]) + rep(piece.first.column);
+        auto offset = start_offset + rep(remainder);
+
+        // Binary search for 'offset' between start and ending offset.
+        auto low = rep(piece.first.line);
+        auto high = rep(piece.last.line);
+
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        if (buffer->line_start_samples.count != 0 and high - low > line_start_sample_stride)
+        {
+            auto line = sampled_line_search(buffer, low, high, offset);
+            return { .line = Line{ line },
+                        .column = Column{ offset - rep(starts->starts[line]) } };
+        }
+
+        size_t mid = 0;
+        size_t mid_start = 0;
+        size_t mid_stop = 0;
+
+        while (low <= high)
+        {
+            mid = low + ((high - low) / 2);
+            mid_start = rep(starts->starts[mid]);
+
+            if (mid == high)
+                break;
+            mid_stop = rep(starts->starts[mid + 1]);
+
+            if (offset < mid_start)
+            {
+                high = mid - 1;
+            }
+            else if (offset >= mid_stop)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        return { .line = Line{ mid },
+                    .column = Column{ offset - mid_start } };
+    }
+
+    LFCount line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end)
+    {
+        // If the end position is the beginning of a new line, then we can just return the difference in lines.
+        if (rep(end.column) == 0)
+            return LFCount{ rep(retract(end.line, rep(start.line))) };
+        const LineStarts* starts = &buffers->buffer_at(index)->line_starts;
+        // It means, there is no LF after end.
+        if (end.line == Line{ starts->count - 1})
+            return LFCount{ rep(retract(end.line, rep(start.line))) };
+        // Due to the check above, we know that there's at least one more line after 'end.line'.
+        auto next_start_offset = starts->starts[rep(extend(end.line))];
+        auto end_offset = rep(starts->starts[rep(end.line)]) + rep(end.column);
+        // There are more than 1 character after end, which means it can't be LF.
+        if (rep(next_start_offset) > end_offset + 1)
+            return LFCount{ rep(retract(end.line, rep(start.line))) };
+        // This must be the case.  next_start_offset is a line down, so it is
+        // not possible for end_offset to be < it at this point.
+        assert(end_offset + 1 == rep(next_start_offset));
+        return LFCount{ rep(retract(end.line, rep(start.line))) };
+    }
+
+#if FRED_CODE_POINT_SUMMARY
+    CodePointSummary CodePointSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        return { code_points_before(buffer, buffers->buffer_offset(piece.index, piece.last))
+                    - code_points_before(buffer, buffers->buffer_offset(piece.index, piece.first)) };
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Summary Utf16Summary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        return { utf16_units_before(buffer, buffers->buffer_offset(piece.index, piece.last))
+                    - utf16_units_before(buffer, buffers->buffer_offset(piece.index, piece.first)) };
+    }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_LINE_EXTENT_SUMMARY
+    LineExtent LineExtent::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        if (piece.first.line == piece.last.line)
+            return { .leading = piece.length, .trailing = piece.length };
+        // Line starts follow the LF, so the first line ends one byte before the next start.
+        auto leading = rep(buffer->line_starts.starts[rep(piece.first.line) + 1]) - rep(buffers->buffer_offset(piece.index, piece.first)) - 1;
+        return { .leading = Length{ leading },
+                    .trailing = Length{ rep(piece.last.column) },
+                    .longest = longest_buffer_line(buffer, rep(piece.first.line) + 1, rep(piece.last.line)),
+                    .has_lf = true };
+    }
+#endif // FRED_LINE_EXTENT_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+    BracketSummary BracketSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+        return buffer_brackets(buffers->bracket_pairs, buffers->buffer_at(piece.index), first, first + rep(piece.length));
+    }
+#endif // FRED_BRACKET_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    HashSummary HashSummary::combine(const HashSummary& left, const HashSummary& right)
+    {
+        auto right_power = right.power_minus_one + 1;
+        return { .hash = hash_add(hash_mul(left.hash, right_power), right.hash),
+                    .power_minus_one = hash_mul(left.power_minus_one + 1, right_power) - 1 };
+    }
+
+    HashSummary HashSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+        return { .hash = buffer_hash(buffers->buffer_at(piece.index), first, first + rep(piece.length)),
+                    .power_minus_one = hash_power(rep(piece.length)) - 1 };
+    }
+#endif // FRED_HASH_SUMMARY
+
+#if FRED_WRAP_SUMMARY
+    WrapSummary WrapSummary::combine(const WrapSummary& left, const WrapSummary& right)
+    {
+        if (left.width == 0)
+            return right;
+        if (right.width == 0)
+            return left;
+        if (left.width != right.width or left.width == stale)
+            return { .width = stale };
+        WrapSummary result{ .width = left.width };
+        result.head = left.spans_lf ? left.head : left.head + right.head;
+        result.tail = right.spans_lf ? right.tail : left.tail + right.tail;
+        result.rows = left.rows + right.rows;
+        // The line spanning the boundary is only complete when both sides end it with a LF.
+        if (left.spans_lf and right.spans_lf)
+        {
+            result.rows += line_rows(left.tail + right.head, left.width);
+        }
+        result.spans_lf = left.spans_lf or right.spans_lf;
+        return result;
+    }
+
+    WrapSummary WrapSummary::of(const BufferCollection* buffers, const Piece& piece)
+    {
+        const WrapIndex* wrap = buffers->wrap;
+        if (wrap == nullptr)
+            return { .width = stale };
+        if (piece.first.line == piece.last.line)
+            return { .width = wrap->width, .head = piece.length, .tail = piece.length };
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        const uint64_t* rows = wrap_rows(wrap, piece.index);
+        auto head = rep(buffer->line_starts.starts[rep(piece.first.line) + 1]) - rep(buffers->buffer_offset(piece.index, piece.first)) - 1;
+        return { .width = wrap->width,
+                    .head = Length{ head },
+                    .tail = Length{ rep(piece.last.column) },
+                    .rows = rows[rep(piece.last.line)] - rows[rep(piece.first.line) + 1],
+                    .spans_lf = true };
+    }
+#endif // FRED_WRAP_SUMMARY
+
+    Piece trim_piece_right(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
+    {
+        auto orig_end_offset = buffers->buffer_offset(piece.index, piece.last);
+
+        auto new_end_offset = buffers->buffer_offset(piece.index, pos);
+        auto new_lf_count = line_feed_count(buffers, piece.index, piece.first, pos);
+
+        auto len_delta = distance(new_end_offset, orig_end_offset);
+        auto new_len = retract(piece.length, rep(len_delta));
+
+        auto new_piece = piece;
+        new_piece.last = pos;
+        new_piece.newline_count = new_lf_count;
+        new_piece.length = new_len;
+        new_piece.summary = TreeSummary::of(buffers, new_piece);
+
+        return new_piece;
+    }
+
+    Piece trim_piece_left(const BufferCollection* buffers, const Piece& piece, const BufferCursor& pos)
+    {
+        auto orig_start_offset = buffers->buffer_offset(piece.index, piece.first);
+
+        auto new_start_offset = buffers->buffer_offset(piece.index, pos);
+        auto new_lf_count = line_feed_count(buffers, piece.index, pos, piece.last);
+
+        auto len_delta = distance(orig_start_offset, new_start_offset);
+        auto new_len = retract(piece.length, rep(len_delta));
+
+        auto new_piece = piece;
+        new_piece.first = pos;
+        new_piece.newline_count = new_lf_count;
+        new_piece.length = new_len;
+        new_piece.summary = TreeSummary::of(buffers, new_piece);
+
+        return new_piece;
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::insertInto_leaf(Arena::Arena *arena, BufferCollection* blk, LeafNodePtr node, const NodeData& x, Length at) const
+    {
+        if(node)algo_mark(node, Traverse);
+        if(node==nullptr)
+        {
+            B_Tree<MaxChildren>::TreeManipResult res;
+            res.nodes = Arena::push_array<NodePtr>(arena, 1);
+            res.count = 1;
+            res.depth = 1;
+            res.nodes[0] = construct_leaf(blk->rb_tree_blk, &x, 0, 1);
+            
+            return res;
+        }
+        Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
+        //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
+        auto offsets_end = node->offsets.begin()+node->childCount;
+        auto insertPoint = branchless_lower_bound(node->offsets.begin(), offsets_end, at);
+        auto insertIndex = insertPoint - node->offsets.begin();
+        
+        NodeData* resultch = Arena::push_array<NodeData>(scratch.arena, node->childCount+2);
+        size_t resultCount = 0;
+
+        auto& children = (node->children);
+
+        auto child_it = children.begin();
+        auto child_insert = children.begin()+insertIndex;
+        auto child_end = children.begin()+node->childCount;
+
+        Length insert_child_start {0};
+        if(insertIndex > 0)
+        {
+            insert_child_start  = node->offsets[insertIndex-1];
+        }
+
+        Length split_offset = at - insert_child_start;
+        for(; child_it!=child_insert; ++child_it)
+        {
+            resultch[resultCount++] = (*child_it);
+        }
+        auto splitting_piece = (*child_it).piece;
+        if(split_offset > Length{0} && split_offset < splitting_piece.length)
+        {
+            BufferCollection* buffers = blk;
+
+            auto insert_pos = buffer_position(buffers, splitting_piece, split_offset);
+
+            auto new_len_right = distance(buffers->buffer_offset(splitting_piece.index, insert_pos),
+                                        buffers->buffer_offset(splitting_piece.index, splitting_piece.last));
+            auto new_piece_right = splitting_piece;
+            new_piece_right.first = insert_pos;
+            new_piece_right.length = new_len_right;
+            new_piece_right.newline_count = line_feed_count(buffers, splitting_piece.index, insert_pos, splitting_piece.last);
+            new_piece_right.summary = TreeSummary::of(buffers, new_piece_right);
+
+            // Remove the original node tail.
+            auto new_piece_left = trim_piece_right(buffers, splitting_piece, insert_pos);
+
+            auto new_piece = x.piece;
+
+            NodeData first{
+                .piece = new_piece_left
+            };
+            resultch[resultCount++] = (first);
+
+            resultch[resultCount++] = (x);
+
+            NodeData second = NodeData
+            {
+                .piece = new_piece_right
+            };
+
+            resultch[resultCount++] = (second);
+            ++child_it;
+        }
+        else
+        {
+            //TODO(ratchetfreak): combine pieces with modbuf?
+            if(split_offset == Length{0})
+            {
+                resultch[resultCount++] = (x);
+                resultch[resultCount++] = (*child_it);
+                ++child_it;
+            }
+            else
+            {
+                auto node_data = *child_it;
+                if(node_data.piece.index == x.piece.index && node_data.piece.last == x.piece.first)
+                {
+                    Piece old_piece = node_data.piece;
+                    NodeData d = x;
+                    Piece &new_piece = d.piece;
+                    new_piece.first = old_piece.first;
+                    new_piece.newline_count = LFCount{rep(new_piece.newline_count) + rep(old_piece.newline_count)};
+                    new_piece.summary = TreeSummary::combine(old_piece.summary, new_piece.summary);
+                    new_piece.length = new_piece.length + old_piece.length;
+                    resultch[resultCount++] = (d);
+                    ++child_it;
+                }
+                else
+                {
+                    resultch[resultCount++] = (*child_it);
+                    ++child_it;
+                    resultch[resultCount++] = (x);
+                }
+            }
+        }
+
+        for(; child_it!=child_end; ++child_it)
+        {
+            resultch[resultCount++] = (*child_it);
+        }
+        
+        B_Tree<MaxChildren>::TreeManipResult res;
+        if(resultCount > MaxChildren)
+        {
+            res.nodes = Arena::push_array<NodePtr>(arena, 2);
+            size_t mid = resultCount/2;
+            res.nodes[0] = (construct_leaf(blk->rb_tree_blk, resultch, 0, mid));
+            res.nodes[1] = (construct_leaf(blk->rb_tree_blk, resultch, mid, resultCount));
+            res.count = 2;
+            res.depth = 1;
+        }
+        else
+        {
+            res.nodes = Arena::push_array<NodePtr>(arena, 1);
+            res.nodes[0] = (construct_leaf(blk->rb_tree_blk, resultch, 0, resultCount));
+            res.count = 1;
+            res.depth = 1;
+        }
+        Arena::scratch_end(scratch);
+        return res;
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::remove_from_leafs(Arena::Arena *arena, BufferCollection* blk, LeafNodePtr a, LeafNodePtr b, LeafNodePtr c, Length at, Length len) const
+    {
+        Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
+        //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
+        
+        // b or c might be nullptr
+
+        NodeData *allLeafs = Arena::push_array<NodeData>(scratch.arena, MaxChildren*3);
+        size_t leaflength = 0;
+        {
+            auto ch = (a->children);
+            for(auto it = ch.begin(); it != ch.begin()+a->childCount;++it)
+            {
+                allLeafs[leaflength++]=(*it);
+            }
+        }
+        if(b!=nullptr)
+        {
+            auto ch = (b->children);
+            for(auto it = ch.begin(); it != ch.begin()+b->childCount;++it)
+            {
+                allLeafs[leaflength++]=(*it);
+            }
+        }
+        if(c!=nullptr)
+        {
+            auto ch = (c->children);
+            for(auto it = ch.begin(); it != ch.begin()+c->childCount;++it)
+            {
+                allLeafs[leaflength++]=(*it);
+            }
+        }
+        size_t numLeafs = leaflength;
+        (void)numLeafs;
+
+        
+        NodeData *allChildren = Arena::push_array<NodeData>(scratch.arena, MaxChildren*3 + 3);
+        size_t resultCount = 0;
+
+        int i = 0;
+
+        for(;i < leaflength && allLeafs[i].piece.length <= at;i++)
+        {
+            auto current_leaf = allLeafs[i];
+            allChildren[resultCount++] = (current_leaf);
+            at = at - current_leaf.piece.length;
+        }
+
+        //trim or split allLeafs[i].piece
+        if(at+len <= allLeafs[i].piece.length)
+        {
+            auto piece_to_split = allLeafs[i].piece;
+            auto start_split_pos = buffer_position(blk, piece_to_split, at);
+
+            auto end_split_pos = buffer_position(blk, piece_to_split, at+len);
+            auto piece_left = trim_piece_left(blk, piece_to_split, end_split_pos);
+            Piece piece_right = trim_piece_right(blk, piece_to_split, start_split_pos);
+
+            if(rep(piece_right.length) > 0)
+                allChildren[resultCount++] = {piece_right};
+            if(rep(piece_left.length) > 0)
+                allChildren[resultCount++] = {piece_left};
+
+            //split
+            i++;
+        }
+        else
+        {
+            if(rep(at)>0)
+            {
+                auto start_split_pos = buffer_position(blk, allLeafs[i].piece, at);
+                auto trimright = trim_piece_right(blk, allLeafs[i].piece, start_split_pos);
+                allChildren[resultCount++] = {trimright};
+            }
+            len = len -  (allLeafs[i].piece.length - at);
+            i++;
+            for(;i < leaflength && allLeafs[i].piece.length <= len;i++)
+            {
+                len  = len - allLeafs[i].piece.length;
+            }
+            if(rep(len) > 0 && i < leaflength)
+            {
+                auto end_split_pos = buffer_position(blk, allLeafs[i].piece, len);
+
+                auto piece_left = trim_piece_left(blk, allLeafs[i].piece, end_split_pos);
+                allChildren[resultCount++] = {piece_left};
+                i++;
+            }
+        }
+
+        //add rest
+
+        for(;i< leaflength;i++)
+        {
+            allChildren[resultCount++] = allLeafs[i];
+        }
+
+        TreeManipResult result;
+        result.depth = 1;
+        if(resultCount > MaxChildren*3)
+        {
+            
+            size_t from = 0;
+            size_t perChild = resultCount/4;
+            result.nodes = Arena::push_array<NodePtr>(arena, 4);
+            result.count = 4;
+
+            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
+            from+=perChild;
+            if(resultCount%4 > 1)
+            {
+                perChild+=1;
+            }
+            result.nodes[1] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
+            from+=perChild;
+            result.nodes[2] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
+            from+=perChild;
+            result.nodes[3] = (construct_leaf(blk->rb_tree_blk, allChildren, from, resultCount));
+        }
+        else if(resultCount > MaxChildren*2)
+        {
+            size_t from = 0;
+            size_t perChild = resultCount/3;
+            result.nodes = Arena::push_array<NodePtr>(arena, 3);
+            result.count = 3;
+
+            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
+            from+=perChild;
+            if(resultCount%3 > 1)
+            {
+                perChild+=1;
+            }
+            result.nodes[1] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+perChild));
+            from+=perChild;
+            result.nodes[2] = (construct_leaf(blk->rb_tree_blk, allChildren, from, resultCount));
+        }
+        else if(resultCount > MaxChildren)
+        {
+            
+            size_t from = 0;
+            size_t mid = resultCount/2;
+            result.nodes = Arena::push_array<NodePtr>(arena, 2);
+            result.count = 2;
+
+            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, from, from+mid));
+
+            result.nodes[1] = (construct_leaf(blk->rb_tree_blk, allChildren, mid, resultCount));
+
+        }
+        else if(resultCount > 0)
+        {
+            result.nodes = Arena::push_array<NodePtr>(arena, 1);
+            result.count = 1;
+
+            //assert(allChildren.size() >= MaxChildren/2);
+            result.nodes[0] = (construct_leaf(blk->rb_tree_blk, allChildren, 0, resultCount));
+        }
+        else
+        {
+            result.nodes = nullptr;
+            result.count = 0;
+        }
+        Arena::scratch_end(scratch);
+        return result;
+    }
+
+
+    void Tree::insert(CharOffset offset, String8 txt, SuppressHistory suppress_history)
+    {
+        if (txt.size == 0)
+            return;
+        if (txt.size >= large_insert_size)
+        {
+            insert_owned(offset, str8_copy(buffers.immutable_buf_arena, txt), suppress_history);
+            return;
+        }
+        if (absorb_insert(offset, txt, suppress_history))
+            return;
+        flush_typing();
+        // This allows us to undo blocks of code.
+        if (is_no(suppress_history)
+            and (end_last_insert != offset or root.is_empty()))
+        {
+            append_undo(root, offset);
+        }
+        internal_insert(offset, txt);
+    }
+
+    void Tree::insert_owned(CharOffset offset, String8 txt, SuppressHistory suppress_history)
+    {
+        if (txt.size == 0)
+            return;
+        flush_typing();
+        if (is_no(suppress_history)
+            and (end_last_insert != offset or root.is_empty()))
+        {
+            append_undo(root, offset);
+        }
+        internal_insert(offset, txt, AdoptBuffer::Yes);
+    }
+
+    void Tree::replace(CharOffset offset, Length count, String8 txt, SuppressHistory suppress_history)
+    {
+        if (rep(count) == 0 or root.is_empty())
+        {
+            insert(offset, txt, suppress_history);
+            return;
+        }
+        if (txt.size == 0)
+        {
+            remove(offset, count, suppress_history);
+            return;
+        }
+        flush_typing();
+        if (is_no(suppress_history))
+        {
+            append_undo(root, offset);
+        }
+        auto adopt = txt.size >= large_insert_size ? AdoptBuffer::Yes : AdoptBuffer::No;
+        if (is_yes(adopt))
+        {
+            txt = str8_copy(buffers.immutable_buf_arena, txt);
+        }
+        // Folds follow the lines each edit adds or removes, so they take the two edits.
+        if (folds.count != 0 or not internal_replace(offset, count, txt, adopt))
+        {
+            internal_remove(offset, count);
+            internal_insert(offset, txt, adopt);
+        }
+    }
+
+    void Tree::move_range(CharOffset from, Length count, CharOffset to, SuppressHistory suppress_history)
+    {
+        // Text moved into itself or to either of its edges stays where it is.
+        if (rep(count) == 0 or (rep(from) <= rep(to) and rep(to) <= rep(from + count)))
+            return;
+        flush_typing();
+        assert(rep(from + count) <= rep(length()) and rep(to) <= rep(length()));
+        if (is_no(suppress_history))
+        {
+            append_undo(root, from);
+        }
+        internal_move(from, count, to);
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::insertInto(Arena::Arena *arena, BufferCollection* blk, const NodePtr node, const NodeData& x, Length at) const
+    {
+        if(node)algo_mark(node, Traverse);
+        //TODO(ratchetfreak) : change result to be 1 or more ChildPtrs which is exactly the x node with the insert
+        if(node==nullptr||node->isLeaf())
+        {
+            return insertInto_leaf(arena, blk, to_leaf_node(node), x, at);
+        }
+        else
+        {
+            Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
+            //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
+            InternalNodePtr in = to_internal_node(node);
+            NodeVector node_children = (in->children);
+            auto offsets_end = node->offsets.begin()+node->childCount;
+            auto insertPoint = branchless_lower_bound(node->offsets.begin(), offsets_end, at);
+            size_t insertIndex = insertPoint - node->offsets.begin();
+            auto insertChIt = node_children+insertIndex;
+            auto insertChItEnd = node_children+node->childCount;
+
+            NodeVector resultch = Arena::push_array<NodePtr>(scratch.arena, in->childCount + 2);
+            size_t resultCount = 0;
+            auto child_it = (node_children);
+
+            for(; child_it!=insertChIt; ++child_it)
+            {
+                resultch[resultCount++] = take_node_ref(*child_it);
+                
+            }
+
+            Length childInsert = at;
+            if(insertIndex>0)
+            {
+                childInsert = childInsert - node->offsets[insertIndex - 1];
+            }
+            auto insert_child = node_children[insertIndex];
+            auto insert_result = insertInto(scratch.arena, blk, insert_child, x, childInsert);
+
+            size_t newNumChildren = insert_result.count;
+
+            for(int i = 0; i< newNumChildren;i++)
+            {
+                resultch[resultCount++] = (insert_result.nodes[i]);
+            }
+            child_it++;
+            for(; child_it!=insertChItEnd;  ++child_it)
+            {
+                resultch[resultCount++] = take_node_ref(*child_it);
+            }
+
+            TreeManipResult manipresult{};
+            manipresult.depth = insert_result.depth+1;
+            manipresult.nodes = Arena::push_array<NodePtr>(arena, in->childCount + 2);
+            if(resultCount > MaxChildren)
+            {
+                //split the to-be inserted node into two
+                size_t numLChild = resultCount/2;
+
+                NodePtr leftChild = construct_internal(blk->rb_tree_blk, resultch, 0, numLChild);
+                NodePtr rightChild = construct_internal(blk->rb_tree_blk,resultch, numLChild, resultCount);
+
+                manipresult.nodes[manipresult.count++] = leftChild;
+                manipresult.nodes[manipresult.count++] = rightChild;
+
+                //return manipresult;
+            }
+            else
+            {
+                auto newChild = construct_internal(blk->rb_tree_blk, resultch
+                , 0, resultCount);
+                manipresult.nodes[manipresult.count++] = newChild;
+                
+            }
+            Arena::scratch_end(scratch);
+            return manipresult;
+        }
+        // return {};
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::TreeManipResult B_Tree<MaxChildren>::remove_from(Arena::Arena *arena, BufferCollection* blk, NodePtr a, NodePtr b, NodePtr c, Length at, Length len) const
+    {
+        // at least one of a and c should not participate in the remove
+        // that way the result is always big enough to make at least 1 node
+        if(a)algo_mark(a, Collect);
+        if(b)algo_mark(b, Collect);
+        if(c)algo_mark(c, Collect);
+
+        if(a->isLeaf())
+        {
+            assert(!b || b->isLeaf());
+            assert(!c || c->isLeaf());
+            
+            return remove_from_leafs(arena, blk, 
+                to_leaf_node(a), 
+                to_leaf_node(b), 
+                to_leaf_node(c), 
+                at, len);
+        }
+        else if(c==nullptr && b == nullptr && a->childCount<=3)
+        {
+            InternalNodePtr ina = to_internal_node(a);
+            if(a->childCount==3 && 
+                    at < ina->offsets[0] && 
+                    (extend(at, rep(len))) > ina->offsets[1] )
+                return remove_from(arena, blk, 
+                    ina->children[0], 
+                    ina->children[2], 
+                    nullptr,
+                    at, retract(len, rep(ina->offsets[1] - ina->offsets[0])));
+            else
+                return remove_from(arena, blk, 
+                    ina->children[0], 
+                    (a->childCount>1)?ina->children[1]:nullptr, 
+                    (a->childCount>2)?ina->children[2]:nullptr, 
+                    at, len);
+        }
+        else
+        {
+            Arena::Temp scratch = Arena::scratch_begin_vararg(arena, blk->rb_tree_blk->alloc_arena);
+            //Arena::Temp scratch = Arena::scratch_begin({&arena, 1});
+            
+            size_t totalChildCount = (a?a->childCount:0)+(b?b->childCount:0)+(c?c->childCount:0);
+            assert(!b || !b->isLeaf());
+            assert(!c || !c->isLeaf());
+            NodeVector resultChildren = Arena::push_array<NodePtr>(scratch.arena, totalChildCount+3);
+            size_t childCount = 0;
+            //allocate extra at head and nill it to skip bounds checks later
+            NodeVector allChildren = Arena::push_array<NodePtr>(scratch.arena, totalChildCount+3)+3;
+            Length* allOffsets = Arena::push_array<Length>(scratch.arena, totalChildCount+3)+3;
+
+            {
+                InternalNodePtr ina = to_internal_node(a);
+                NodeVector chA = (ina->children);
+                auto outputIt = allChildren;
+                auto offsetsOutIt = allOffsets;
+                totalChildCount = a->childCount;
+                outputIt = std::copy_n(chA, a->childCount, outputIt);
+                for EachIndex(i, a->childCount)
+                {
+                    *offsetsOutIt++ = a->offsets[i];
+                }
+                auto total_offset = a->offsets[a->childCount-1];
+                if(b!=nullptr)
+                {
+                    InternalNodePtr inb = to_internal_node(b);
+                    NodeVector chB = (inb->children);
+                    outputIt = std::copy_n(chB, b->childCount, outputIt);
+                    for EachIndex(i, b->childCount)
+                    {
+                        *offsetsOutIt++ = total_offset + b->offsets[i];
+                    }
+                    totalChildCount = totalChildCount + b->childCount;
+                    total_offset = total_offset+ b->offsets[b->childCount-1];
+                }
+                
+                if(c!=nullptr)
+                {
+                    InternalNodePtr inc = to_internal_node(c);
+                    NodeVector chC = (inc->children);
+                    outputIt = std::copy_n(chC, c->childCount, outputIt);
+                    for EachIndex(i, c->childCount)
+                    {
+                        *offsetsOutIt++ = total_offset + c->offsets[i];
+                    }
+                    totalChildCount = totalChildCount + c->childCount;
+                }
+            }
+            NodePtr recA = nullptr;
+            NodePtr recB = nullptr;
+            NodePtr recC = nullptr;
+
+            Length offset = at;
+
+            Length aplusbplusc {0};
+            int i = 0;
+            for(; i<totalChildCount &&
+                    allOffsets[i] < offset;i++)
+            {
+            }
+            
+            
+            auto newoffset = offset - allOffsets[i-3];
+            
+            //now allChildren[i] is the first node that needs removing anything
+            for (int64_t j = 0; j < (i-2); j += 1)
+            {
+                resultChildren[childCount++] = take_node_ref(allChildren[j]);
+                algo_mark(allChildren[j], Skip);
+            }
+            
+            auto start_offset = allOffsets[i-3];
+            (void) start_offset;
+            
+            recA = allChildren[i-2];
+            recB = allChildren[i-1];
+            recC = allChildren[i];
+            aplusbplusc =  allOffsets[i] - allOffsets[i-3];
+            
+            Length to_remove_from_first_found = aplusbplusc - newoffset;
+            i++;
+            TreeManipResult res;
+            
+            algo_mark(recC, Traverse);
+
+            if(len < to_remove_from_first_found)
+            {
+                //everything to be removed is in recC, ensure recA and recB are filled
+
+                if(i < 3)
+                {
+                    recA = allChildren[0];
+                    recB = allChildren[1];
+                    recC = allChildren[2];
+                    i = 3;
+                    newoffset = offset;
+                }
+                res = remove_from(scratch.arena, blk, recA, recB, recC, newoffset, len);
+            }
+            else
+            {
+                offset = newoffset;
+                Length to_remove_from_rest = len - to_remove_from_first_found;
+
+                auto streelen = (allOffsets[i]-allOffsets[i-1]);
+                for(;i< totalChildCount &&
+                        streelen < to_remove_from_rest;i++)
+                {
+                    to_remove_from_rest = to_remove_from_rest - 
+                            (allOffsets[i]-allOffsets[i-1]);
+                    streelen = (allOffsets[i+1]-allOffsets[i]);
+                            //allChildren[i]->subTreeLength();
+                    algo_mark(allChildren[i], Collect);
+                }
+                if(i >= totalChildCount && !recA)
+                {
+                    //end of array and not enough to fill a node
+                    assert(c==nullptr); // can only come from root
+                    if(recB)
+                    {
+                        Arena::scratch_end(scratch);
+                        return remove_from(arena, blk, recB, recC, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
+                    }
+                    else
+                    {
+                        Arena::scratch_end(scratch);
+                        return remove_from(arena, blk, recC, nullptr, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
+                    }
+                }
+                //now allChildren[i] is the last child to remove anything from
+                if(i < totalChildCount)
+                {
+                    if(recA)
+                    {
+                        offset = offset - recA->subTreeLength();
+                        resultChildren[childCount++] = take_node_ref(recA);
+                    }
+                    recA = recB;
+                    recB = recC;
+                    recC = allChildren[i];
+                    i++;
+                    
+                    algo_mark(recC, Traverse);
+                }
+                //recA and recB might still be nullptr
+                while(!recA)
+                {
+                    if(i >= totalChildCount)
+                    {
+                        
+                        //end of array and not enough to fill a node
+                        //can only happen at root
+                        assert(c==nullptr);
+                        if(recB)
+                        {
+                            Arena::scratch_end(scratch);
+                            return remove_from(arena, blk, recB, recC, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
+                        }
+                        else
+                        {
+                            Arena::scratch_end(scratch);
+                            return remove_from(arena, blk, recC, nullptr, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
+                        }
+                    }
+                    recA = recB;
+                    recB = recC;
+                    recC = allChildren[i];
+                    i++;
+                    
+                    algo_mark(recC, Traverse);
+                }
+                res = remove_from(scratch.arena, blk, recA, recB, recC, offset, to_remove_from_first_found + to_remove_from_rest);
+            }
+
+            for EachIndex(it, res.count)
+            {
+                resultChildren[childCount++] = res.nodes[it];
+            }
+
+            for(;i<totalChildCount;i++)
+            {
+                resultChildren[childCount++] = take_node_ref(allChildren[i]);
+            }
+
+            TreeManipResult result;
+            result.depth = res.depth+1;
+            if(childCount > MaxChildren*3)
+            {
+                size_t from = 0;
+                size_t perChild = childCount/4;
+                result.nodes = Arena::push_array<NodePtr>(arena, 4);
+                result.count = 4;
+
+                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
+                from+=perChild;
+                if(childCount%4 > 1)
+                {
+                    perChild+=1;
+                }
+                result.nodes[1] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
+                from+=perChild;
+                result.nodes[2] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
+                from+=perChild;
+                result.nodes[3] = (construct_internal(blk->rb_tree_blk, resultChildren, from, childCount));
+            }
+            else if(childCount > MaxChildren*2)
+            {
+                size_t from = 0;
+                size_t perChild = childCount/3;
+
+                result.nodes = Arena::push_array<NodePtr>(arena, 3);
+                result.count = 3;
+                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
+                from+=perChild;
+                if(childCount%3 > 1)
+                {
+                    perChild+=1;
+                }
+                result.nodes[1] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
+                from+=perChild;
+                result.nodes[2] = (construct_internal(blk->rb_tree_blk, resultChildren, from, childCount));
+            }
+            else if(childCount > MaxChildren)
+            {
+                size_t from = 0;
+                size_t mid = childCount/2;
+                result.nodes = Arena::push_array<NodePtr>(arena, 2);
+                result.count = 2;
+                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+mid));
+
+                result.nodes[1] = (construct_internal(blk->rb_tree_blk, resultChildren, mid, childCount));
+
+            }
+            else
+            {
+                assert(childCount >= MaxChildren/2 || c==nullptr);
+                result.nodes = Arena::push_array<NodePtr>(arena, 1);
+                result.count = 1;
+                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, 0, childCount));
+            }
+            Arena::scratch_end(scratch);
+            return result;
+        }
+    }
+
+    template<size_t MaxChildren>
+    void B_Tree<MaxChildren>::split(BufferCollection* blk, Offset at, B_Tree* before, B_Tree* after) const
+    {
+        if (root_node == nullptr)
+        {
+            *before = B_Tree<MaxChildren>();
+            *after = B_Tree<MaxChildren>();
+            return;
+        }
+        split_node(blk, root_node, tree_depth, distance(Offset{ 0 }, at), before, after);
+    }
+
+    template<size_t MaxChildren>
+    void B_Tree<MaxChildren>::split_node(BufferCollection* blk, NodePtr node, uint32_t depth, Length at, B_Tree* before, B_Tree* after)
+    {
+        if (at == Length{ 0 })
+        {
+            *before = B_Tree<MaxChildren>();
+            *after = B_Tree<MaxChildren>(take_node_ref(node), depth);
+            return;
+        }
+        if (not (at < node->subTreeLength()))
+        {
+            *before = B_Tree<MaxChildren>(take_node_ref(node), depth);
+            *after = B_Tree<MaxChildren>();
+            return;
+        }
+        // The child holding 'at' is the first whose end offset is strictly greater than it.
+        size_t slot = branchless_lower_bound(node->offsets.begin(), node->offsets.begin() + node->childCount, at + Length{ 1 }) - node->offsets.begin();
+        Length child_at = slot == 0 ? at : at - node->offsets[slot - 1];
+        if (node->isLeaf())
+        {
+            LeafNodePtr leaf = to_leaf_node(node);
+            NodeData pieces[MaxChildren + 1];
+            std::copy_n(leaf->children.begin(), slot, pieces);
+            size_t count = slot;
+            if (child_at == Length{ 0 })
+            {
+                pieces[count++] = leaf->children[slot];
+            }
+            else
+            {
+                const Piece& piece = leaf->children[slot].piece;
+                auto pos = buffer_position(blk, piece, child_at);
+                pieces[count++] = { trim_piece_right(blk, piece, pos) };
+                pieces[count++] = { trim_piece_left(blk, piece, pos) };
+            }
+            size_t mid = count - 1;
+            for (size_t i = slot + 1; i < leaf->childCount; ++i)
+            {
+                pieces[count++] = leaf->children[i];
+            }
+            *before = B_Tree<MaxChildren>(construct_leaf(blk->rb_tree_blk, pieces, 0, mid), depth);
+            *after = B_Tree<MaxChildren>(construct_leaf(blk->rb_tree_blk, pieces, mid, count), depth);
+            return;
+        }
+        // The children on either side of the one holding 'at' stay whole and join the halves it splits into.  Each
+        // join costs the difference in height of its trees, which telescopes over the path to the height of the tree.
+        InternalNodePtr internal = to_internal_node(node);
+        B_Tree<MaxChildren> child_before;
+        B_Tree<MaxChildren> child_after;
+        split_node(blk, internal->children[slot], depth - 1, child_at, &child_before, &child_after);
+        *before = concat(blk->rb_tree_blk, child_range(blk->rb_tree_blk, internal, depth, 0, slot), child_before);
+        *after = concat(blk->rb_tree_blk, child_after, child_range(blk->rb_tree_blk, internal, depth, slot + 1, node->childCount));
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren> B_Tree<MaxChildren>::child_range(BTreeBlock* blk, InternalNodePtr node, uint32_t depth, size_t begin, size_t end)
+    {
+        if (begin == end)
+            return B_Tree<MaxChildren>();
+        if (end - begin == 1)
+            return B_Tree<MaxChildren>(take_node_ref(node->children[begin]), depth - 1);
+        NodePtr children[MaxChildren];
+        for (size_t i = begin; i < end; ++i)
+        {
+            children[i - begin] = take_node_ref(node->children[i]);
+        }
+        return B_Tree<MaxChildren>(construct_internal(blk, children, 0, end - begin), depth);
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren> B_Tree<MaxChildren>::concat(BTreeBlock* blk, const B_Tree& left, const B_Tree& right)
+    {
+        if (left.is_empty())
+            return right.dup();
+        if (right.is_empty())
+            return left.dup();
+        NodePtr nodes[2];
+        size_t count;
+        uint32_t depth;
+        if (left.tree_depth >= right.tree_depth)
+        {
+            count = join_right(blk, left.root_node, left.tree_depth, right.root_node, right.tree_depth, nodes);
+            depth = left.tree_depth;
+        }
+        else
+        {
+            count = join_left(blk, left.root_node, left.tree_depth, right.root_node, right.tree_depth, nodes);
+            depth = right.tree_depth;
+        }
+        if (count == 1)
+            return B_Tree<MaxChildren>(nodes[0], depth);
+        return B_Tree<MaxChildren>(construct_internal(blk, nodes, 0, count), depth + 1);
+    }
+
+    template<size_t MaxChildren>
+    size_t B_Tree<MaxChildren>::join_right(BTreeBlock* blk, NodePtr left, uint32_t left_depth, NodePtr right, uint32_t right_depth, NodeVector out)
+    {
+        if (left_depth == right_depth)
+            return merge_nodes(blk, left, right, out);
+        // 'right' joins the last child; when that splits in two, this node may split in turn.
+        InternalNodePtr internal = to_internal_node(left);
+        NodePtr children[MaxChildren + 1];
+        size_t last = left->childCount - 1;
+        for (size_t i = 0; i < last; ++i)
+        {
+            children[i] = take_node_ref(internal->children[i]);
+        }
+        size_t count = last + join_right(blk, internal->children[last], left_depth - 1, right, right_depth, children + last);
+        return pack_internal(blk, children, count, out);
+    }
+
+    template<size_t MaxChildren>
+    size_t B_Tree<MaxChildren>::join_left(BTreeBlock* blk, NodePtr left, uint32_t left_depth, NodePtr right, uint32_t right_depth, NodeVector out)
+    {
+        if (left_depth == right_depth)
+            return merge_nodes(blk, left, right, out);
+        // 'left' joins the first child; when that splits in two, this node may split in turn.
+        InternalNodePtr internal = to_internal_node(right);
+        NodePtr children[MaxChildren + 1];
+        size_t count = join_left(blk, left, left_depth, internal->children[0], right_depth - 1, children);
+        for (size_t i = 1; i < right->childCount; ++i)
+        {
+            children[count++] = take_node_ref(internal->children[i]);
+        }
+        return pack_internal(blk, children, count, out);
+    }
+
+    template<size_t MaxChildren>
+    size_t B_Tree<MaxChildren>::merge_nodes(BTreeBlock* blk, NodePtr left, NodePtr right, NodeVector out)
+    {
+        // Nodes which are at least half full are siblings as they are.  Otherwise one of them is a root, which may
+        // hold fewer children, and their children fill one node or are dealt over two.
+        if (left->childCount >= MaxChildren/2 and right->childCount >= MaxChildren/2)
+        {
+            out[0] = take_node_ref(left);
+            out[1] = take_node_ref(right);
+            return 2;
+        }
+        size_t count = left->childCount + right->childCount;
+        if (left->isLeaf())
+        {
+            NodeData pieces[MaxChildren * 2];
+            std::copy_n(to_leaf_node(left)->children.begin(), left->childCount, pieces);
+            std::copy_n(to_leaf_node(right)->children.begin(), right->childCount, pieces + left->childCount);
+            if (count <= MaxChildren)
+            {
+                out[0] = construct_leaf(blk, pieces, 0, count);
+                return 1;
+            }
+            out[0] = construct_leaf(blk, pieces, 0, count/2);
+            out[1] = construct_leaf(blk, pieces, count/2, count);
+            return 2;
+        }
+        NodePtr children[MaxChildren * 2];
+        for (size_t i = 0; i < left->childCount; ++i)
+        {
+            children[i] = take_node_ref(to_internal_node(left)->children[i]);
+        }
+        for (size_t i = 0; i < right->childCount; ++i)
+        {
+            children[left->childCount + i] = take_node_ref(to_internal_node(right)->children[i]);
+        }
+        return pack_internal(blk, children, count, out);
+    }
+
+    template<size_t MaxChildren>
+    size_t B_Tree<MaxChildren>::pack_internal(BTreeBlock* blk, NodeVector children, size_t count, NodeVector out)
+    {
+        if (count <= MaxChildren)
+        {
+            out[0] = construct_internal(blk, children, 0, count);
+            return 1;
+        }
+        out[0] = construct_internal(blk, children, 0, count/2);
+        out[1] = construct_internal(blk, children, count/2, count);
+        return 2;
+    }
+
+    template<size_t MaxChildren>
+    void dec_node_ref(const BNodeCountedGeneric<MaxChildren>* node)
+    {
+        if (node == nullptr)
+            return;
+        
+        
+        uint64_t count = os_atomic_u64_dec_eval(&node->blk->ref_count);
+        if (count == 0)
+        {
+            
+            NEW_NODE_DEALLOC();
+            BNodeCountedGeneric<MaxChildren>* mut_node = const_cast<BNodeCountedGeneric<MaxChildren>*>(node);
+            if(node->type == NodeType::INTERNAL)
+            {
+                BNodeCountedInternal<MaxChildren> *in = to_internal_node(mut_node);
+                for EachIndex(i, in->childCount)
+                {
+                    dec_node_ref(in->children[i]);
+                }
+            }
+            // Finally, detach this node and add to the free list atomically.
+            FreeList old_head{};
+            FreeList next_head{};
+            static_assert(alignof(FreeList) == 16);
+            FreeList *frl;
+            if(node->type == NodeType::LEAF)
+                frl = &node->blk->base_blk->free_list.leaf;
+            else if(node->type == NodeType::INTERNAL)
+                frl = &node->blk->base_blk->free_list.internal;
+            else
+            {
+                __debugbreak();
+                frl = nullptr;
+            }
+            os_atomic_u128_eval(frl, &old_head);
+            do
+            {
+                mut_node->next = reinterpret_cast<BNodeCountedGeneric<MaxChildren>*>(old_head.head);
+                next_head.head = reinterpret_cast<BNodeCounted*>(mut_node);
+                next_head.tag = old_head.tag + 1;
+            } while (not os_atomic_u128_eval_cond_assign(frl, next_head, &old_head));
+        }
+    }
+
+
+    template<size_t MaxChildren>
+    BNodeCountedGeneric<MaxChildren>* take_node_ref( BNodeCountedGeneric<MaxChildren>* node)
+    {
+        if (node != nullptr)
+        {
+            FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(&node->blk->ref_count));
+        }
+        return node;
+    }
+    
+    template<size_t MaxChildren>
+    BNodeCountedGeneric<MaxChildren>* take_node_ref( BNodeCountedInternal<MaxChildren>* node)
+    {
+        return take_node_ref(to_node(node));
+    }
+    
+    template<size_t MaxChildren>
+    BNodeCountedGeneric<MaxChildren>* take_node_ref( BNodeCountedLeaf<MaxChildren>* node)
+    {
+        return take_node_ref(to_node(node));
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::construct_leaf(BTreeBlock* blk, const NodeData* data, size_t begin, size_t end) 
+    {
+        NEW_NODE_ALLOC();
+        LeafNodePtr node = nullptr;
+        BNodeBlock* node_blk = nullptr;
+        // Try to fetch a node from the free list atomically.
+        {
+            BNodeFreeList old_head;
+            BNodeFreeList next_head{};
+            os_atomic_u128_eval(&blk->free_list.leaf, &old_head.leaf);
+            do
+            {
+                if (old_head.leaf.head == nullptr)
+                {
+                    node = nullptr;
+                    break;
+                }
+                node = reinterpret_cast<LeafNodePtr>(old_head.leaf.head);
+                next_head.leaf.head = old_head.leaf.head->next;
+                next_head.leaf.tag = old_head.leaf.tag + 1;
+            } while (not os_atomic_u128_eval_cond_assign(&blk->free_list.leaf, next_head.leaf, &old_head.leaf));
+            if (node != nullptr)
+            {
+                node_blk = node->blk;
+            }
+        }
+
+        if (node==nullptr)
+        {
+            node = Arena::push_array_no_zero<BNodeCountedLeaf<MaxChildren>>(blk->alloc_arena, 1);
+            node_blk = Arena::push_array<BNodeBlock>(blk->alloc_arena, 1);
+        }
+        
+        zero_bytes(node);
+        zero_bytes(node_blk);
+        
+        node->blk = node_blk;
+        node_blk->base_blk = blk;
+        
+        take_node_ref(node);
+        node->type = NodeType::LEAF;
+
+        size_t numChild = end-begin;
+        assert(numChild <= MaxChildren);
+        auto result = to_node(node);
+        std::array<NodeData, MaxChildren>& new_left_children = node->children;
+        std::array<Length, MaxChildren>&  new_left_offsets = result->offsets;
+        std::array<LFCount, MaxChildren>&  new_left_linefeed = result->lineFeeds;
+        result->childCount = numChild;
+        Length acc{0};
+        LFCount linefeed{0};
+        TreeSummary summary = TreeSummary::identity();
+        for(int i = 0; i < numChild; i++)
+        {
+            new_left_children[i] =data[begin+i];
+            acc = acc + data[begin+i].piece.length;
+            new_left_offsets[i] = acc;
+            linefeed =LFCount {rep(linefeed) + rep(data[begin+i].piece.newline_count)};
+            new_left_linefeed[i] = linefeed;
+            summary = TreeSummary::combine(summary, data[begin+i].piece.summary);
+            result->summaries.set(i, summary);
+        }
+        new_left_offsets[MaxChildren-1] = acc;
+        new_left_linefeed[MaxChildren-1] = linefeed;
+        
+        algo_mark(result, Made);
+        return result;
+    }
+
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::construct_internal(BTreeBlock* blk, B_Tree<MaxChildren>::NodeVector data, size_t begin, size_t end) 
+    {
+        NEW_NODE_ALLOC();
+        InternalNodePtr node = nullptr;
+        BNodeBlock* node_blk = nullptr;
+        // Try to fetch a node from the free list atomically.
+        {
+            BNodeFreeList old_head;
+            BNodeFreeList next_head{};
+            os_atomic_u128_eval(&blk->free_list.leaf, &old_head.leaf);
+            do
+            {
+                if (old_head.leaf.head == nullptr)
+                {
+                    node = nullptr;
+                    break;
+                }
+                node = reinterpret_cast<InternalNodePtr>(old_head.leaf.head);
+                next_head.leaf.head = old_head.leaf.head->next;
+                next_head.leaf.tag = old_head.leaf.tag + 1;
+            } while (not os_atomic_u128_eval_cond_assign(&blk->free_list.leaf, next_head.leaf, &old_head.leaf));
+            if (node!=nullptr)
+            {
+                node_blk = node->blk;
+            }
+        }
+
+        if (node==nullptr)
+        {
+            node = Arena::push_array_no_zero<BNodeCountedInternal<MaxChildren>>(blk->alloc_arena, 1);
+            node_blk = Arena::push_array<BNodeBlock>(blk->alloc_arena, 1);
+        }
+        
+        zero_bytes(node);
+        zero_bytes(node_blk);
+        
+        node->blk = node_blk;
+        node_blk->base_blk = blk;
+        
+        take_node_ref(node);
+        node->type = NodeType::INTERNAL;
+
+        size_t numChild = end-begin;
+        assert(numChild <= MaxChildren);
+        auto result = to_node(node);
+        
+        assert(numChild <= MaxChildren);
+        NodeVector new_left_children = &node->children[0];
+        std::array<Length, MaxChildren>&  new_left_offsets = result->offsets;
+        std::array<LFCount, MaxChildren>&  new_left_linefeed = result->lineFeeds;
+        result->childCount = numChild;
+        Length acc{0};
+        LFCount linefeed{0};
+        TreeSummary summary = TreeSummary::identity();
+        for(int i = 0; i < numChild; i++)
+        {
+            new_left_children[i] = data[begin+i];
+            //take_node_ref(data[begin+i]);
+             acc = acc + data[begin+i]->subTreeLength();
+            new_left_offsets[i] = acc;
+            linefeed =LFCount {rep(linefeed) + rep(data[begin+i]->subTreeLineFeeds())};
+            new_left_linefeed[i] = linefeed;
+            summary = TreeSummary::combine(summary, data[begin+i]->subTreeSummary());
+            result->summaries.set(i, summary);
+        }
+        new_left_offsets[MaxChildren-1] = acc;
+        new_left_linefeed[MaxChildren-1] = linefeed;
+
+        algo_mark(result, Made);
+        return result;
+    }
+
+
+    template<size_t MaxChildren>
+    BNodeCountedInternal<MaxChildren>* to_internal_node(BNodeCountedGeneric<MaxChildren>* n)
+    {
+        assert(n == nullptr || n->type == NodeType::INTERNAL);
+        return reinterpret_cast<BNodeCountedInternal<MaxChildren>*>(n);
+    }
+    template<size_t MaxChildren>
+    BNodeCountedLeaf<MaxChildren>* to_leaf_node(BNodeCountedGeneric<MaxChildren>* n)
+    {
+        assert(n == nullptr || n->type == NodeType::LEAF);
+        return reinterpret_cast<BNodeCountedLeaf<MaxChildren>*>(n);
+    }
+    template<size_t MaxChildren>
+    BNodeCountedGeneric<MaxChildren>* to_node(BNodeCountedGeneric<MaxChildren>* n)
+    {
+        return n;
+    }
+
+    template<size_t MaxChildren>
+    BNodeCountedGeneric<MaxChildren>* to_node(BNodeCountedLeaf<MaxChildren>* n)
+    {
+        return reinterpret_cast<BNodeCountedGeneric<MaxChildren>*>(n);
+    }
+    template<size_t MaxChildren>
+    BNodeCountedGeneric<MaxChildren>* to_node(BNodeCountedInternal<MaxChildren>* n)
+    {
+        return reinterpret_cast<BNodeCountedGeneric<MaxChildren>*>(n);
+    }
+
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::B_Tree(B_Tree<MaxChildren>&& other):
+        root_node{ other.root_node },
+        tree_depth{ other.tree_depth }
+    {
+        other.root_node = nullptr;
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>& B_Tree<MaxChildren>::operator=(B_Tree<MaxChildren>&& other)
+    {
+        tree_depth = other.tree_depth;
+        // Swap these, so the dtor for 'other' will handle decrementing the ref.
+        NodePtr old_root = root_node;
+        root_node = other.root_node;
+        other.root_node = old_root;
+        return *this;
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::~B_Tree()
+    {
+        dec_node_ref(root_node);
+    }
+
+    template<size_t MaxChildren>
+    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::root_ptr() const
+    {
+        return root_node;
+    }
+
+#ifdef TEXTBUF_DEBUG
+    template<size_t MaxChildren>
+    void satisfies_btree_invariant(const B_Tree<MaxChildren>& root)
+    {
+        // 1. every node other than root has >= MaxChildren/2 children 
+        // 1.5. nodes are hardcoded to contain <= MaxChildren
+        // 2. all leafNodes are at the same depth
+        
+        typedef B_Tree<MaxChildren>::NodePtr NPtr;
+        typedef B_Tree<MaxChildren>::InternalNodePtr INPtr;
+        typedef B_Tree<MaxChildren>::LeafNodePtr LNPtr;
+        //typedef B_Tree<MaxChildren>::ChildArray  ChArr;
+        //typedef B_Tree<MaxChildren>::LeafArray  LeafArr;
+        std::vector<NPtr> layer;
+        std::vector<NPtr> next_layer;
+        
+        if(root.is_empty())
+        {
+            assert(root.depth() == 0);
+            return;
+        }
+        if(root.root_ptr()->isLeaf())
+        {
+            assert(root.depth() == 1);
+            assert(root.root_ptr()->childCount > 0);
+            assert(root.root_ptr()->childCount <= MaxChildren);
+            return;
+        }
+        assert(root.root_ptr()->childCount > 0);
+        assert(root.root_ptr()->childCount <= MaxChildren);
+        INPtr rn = to_internal_node(root.root_ptr());
+        auto& children = (rn->children);
+        next_layer.assign(&children[0], &children[0]+root.root_ptr()->childCount);
+        int layerCount = 2;
+        while(!next_layer.front()->isLeaf())
+        {
+            layerCount++;
+            layer = std::move(next_layer);
+            next_layer.clear();
+            for(auto nodeIt = layer.begin(); nodeIt != layer.end();++nodeIt)
+            {
+        
+                assert(!(*nodeIt)->isLeaf());
+                assert((*nodeIt)->childCount >= MaxChildren/2);
+                INPtr in = to_internal_node(*nodeIt);
+                auto& node_children = (in->children);
+                assert((*nodeIt)->offsets.back() == (*nodeIt)->offsets[(*nodeIt)->childCount-1]);
+                assert((*nodeIt)->lineFeeds.back() == (*nodeIt)->lineFeeds[(*nodeIt)->childCount-1]);
+                
+                LFCount prevLineEnd{};
+                Length prevOffset{};
+                for(size_t childIndex = 0; childIndex < (*nodeIt)->childCount; childIndex++)
+                {
+                    auto& node = node_children[childIndex];
+                    auto offsetDifference = rep((*nodeIt)->offsets[childIndex]) - rep(prevOffset);
+                    assert(rep(node->offsets.back()) == offsetDifference);
+                    prevOffset = (*nodeIt)->offsets[childIndex];
+                    
+                    auto lineDifference = rep((*nodeIt)->lineFeeds[childIndex]) - rep(prevLineEnd);
+                    assert(rep(node->lineFeeds.back()) == lineDifference);
+                    prevLineEnd = (*nodeIt)->lineFeeds[childIndex];
+                }
+                next_layer.insert(next_layer.end(), &node_children[0], &node_children[0]+(*nodeIt)->childCount);
+            }
+        }
+        assert(root.depth() == layerCount);
+        layer = std::move(next_layer);
+        for(auto nodeIt = layer.begin(); nodeIt != layer.end();++nodeIt)
+        {
+            assert((*nodeIt)->isLeaf());
+                
+            LNPtr ln = to_leaf_node(*nodeIt);
+            auto& node_children = ((ln)->children);
+            LFCount prevLineEnd{};
+            Length prevOffset{};
+            for(size_t childIndex = 0; childIndex < (*nodeIt)->childCount; childIndex++)
+                {
+                    auto& piece = node_children[childIndex].piece;
+                    auto offsetDifference = rep((*nodeIt)->offsets[childIndex]) - rep(prevOffset);
+                    assert(rep(piece.length) == offsetDifference);
+                    prevOffset = (*nodeIt)->offsets[childIndex];
+                    
+                    auto lineDifference = rep((*nodeIt)->lineFeeds[childIndex]) - rep(prevLineEnd);
+                    auto bufferline = rep(piece.last.line) - rep(piece.first.line);
+                    assert(rep(piece.newline_count) == lineDifference);
+                    assert(bufferline == lineDifference);
+                    prevLineEnd = (*nodeIt)->lineFeeds[childIndex];
+                }
+            assert((*nodeIt)->isLeaf());
+            assert((*nodeIt)->childCount >= MaxChildren/2);
+        }
+    }
+#endif
+}
+
+namespace RatchetPieceTree
+{
+        namespace
+    {
+        struct LineStartsNode
+        {
+            LineStartsNode* next;
+            LineStart start;
+        };
+
+        struct LineStartsList
+        {
+            LineStartsNode* first;
+            LineStartsNode* last;
+            uint64_t count;
+        };
+
+        void push_line_starts_node(Arena::Arena* arena, LineStartsList* lst, LineStart start)
+        {
+            LineStartsNode* node = Arena::push_array<LineStartsNode>(arena, 1);
+            node->start = start;
+            SLLQueuePush(lst->first, lst->last, node);
+            ++lst->count;
+        }
+
+        LineStarts join_line_starts_list(Arena::Arena* arena, const LineStartsList& lst)
+        {
+            LineStarts result{};
+            result.starts = Arena::push_array_no_zero<LineStart>(arena, lst.count);
+            result.count = lst.count;
+            uint64_t i = 0;
+            for EachNode(n, lst.first)
+            {
+                result.starts[i++] = n->start;
+            }
+            return result;
+        }
+
+        void populate_line_starts(Arena::Arena* arena, LineStarts* starts, String8 buf)
+        {
+            LineStartsList lst{};
+            LineStart start { };
+            auto scratch = Arena::scratch_begin({ &arena, 1 });
+            push_line_starts_node(scratch.arena, &lst, start);
+            for EachIndex(i, buf.size)
+            {
+                char c = buf.str[i];
+                if (c == '\n')
+                {
+                    start = LineStart{ i + 1 };
+                    push_line_starts_node(scratch.arena, &lst, start);
+                }
+            }
+            *starts = join_line_starts_list(arena, lst);
+            Arena::scratch_end(scratch);
+        }
+
+        void compute_buffer_meta(BufferMeta* meta, const StorageTree& root)
+        {
+            meta->lf_count = tree_lf_count(root);
+            meta->total_content_length = tree_length(root);
+            meta->summary = root.summary();
+        }
+
+        void append_mut_buf_start(BufferCollection* collection, LineStart start)
+        {
+            LineStart* new_starts = Arena::push_array_no_zero_aligned<LineStart>(collection->mut_buf_starts_arena, 1, Arena::Alignment{ alignof(LineStart) });
+            LineStarts* starts = &collection->mod_buffer.line_starts;
+            if(starts->starts == nullptr)
+            {
+                assert(starts->count == 0);
+                starts->starts = new_starts;
+            }
+            assert(starts->starts + starts->count == new_starts);
+            new_starts[0] = start;
+            ++starts->count;
+        }
+
+        void grow_mut_buf(BufferCollection* collection, uint64_t grow_by)
+        {
+            if (grow_by == 0)
+                return;
+            char* buf = Arena::push_array_no_zero_aligned<char>(collection->mut_buf_arena, grow_by, Arena::Alignment{ alignof(char) });
+            FRED_UNUSED(buf);
+            // When this buffer is created, it was originally designated a null-terminator slot at the beginning, so new buffers we
+            // allocate will need a null-terminator appended.
+            assert(collection->mod_buffer.buffer.str + collection->mod_buffer.buffer.size + 1 == buf);
+            // Note: We do not change the base of 'str', only its size.
+            collection->mod_buffer.buffer.size += grow_by;
+            // Append our null to the newly returned buffer piece.
+            collection->mod_buffer.buffer.str[collection->mod_buffer.buffer.size] = 0;
+        }
+    } // namespace [anon]
+    
+    const CharBuffer* BufferCollection::buffer_at(BufferIndex index) const
+    {
+        if (index == BufferIndex::ModBuf)
+            return &mod_buffer;
+        return &orig_buffers.buffers[rep(index)];
+    }
+
+    CharOffset BufferCollection::buffer_offset(BufferIndex index, const BufferCursor& cursor) const
+    {
+        LineStart* starts = buffer_at(index)->line_starts.starts;
+        return CharOffset{ rep(starts[rep(cursor.line)]) + rep(cursor.column) };
+    }
+
+    // Buffer collection management.
+    void dec_buffer_ref(BufferCollection* collection)
+    {
+        uint64_t count = os_atomic_u64_dec_eval(collection->orig_buffers.ref_count);
+        if (count == 0)
+        {
+            // Note: The arena used to allocate nodes is the same one for the immutable buffers,
+            // so we do not need to release it.
+            Arena::release(collection->mut_buf_starts_arena);
+            Arena::release(collection->undo_redo_stack_arena);
+            Arena::release(collection->mut_buf_arena);
+            Arena::release(collection->immutable_buf_arena);
+        }
+    }
+
+    BufferCollection take_buffer_ref(const BufferCollection* collection)
+    {
+        FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(collection->orig_buffers.ref_count));
+        return *collection;
+    }
+
+    namespace
+    {
+        // Reference snapshots read the mod buffer in place, so they hold a pin which compaction waits for.
+        BufferCollection pin_buffers(const BufferCollection* collection)
+        {
+            FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(collection->mod_buffer_pins));
+            return take_buffer_ref(collection);
+        }
+
+        void unpin_buffers(BufferCollection* collection)
+        {
+            FRED_UNUSED_RESULT(os_atomic_u64_dec_eval(collection->mod_buffer_pins));
+            dec_buffer_ref(collection);
+        }
+    } // namespace [anon]
+    
+    Tree::Tree(BufferCollection buffers):
+        buffers{ buffers }
+    {
+        build_tree();
+    }
+
+    Tree::~Tree()
+    {
+        // A compaction in progress keeps the history it began with pinned.
+        if (compaction.arena != nullptr)
+        {
+            for EachIndex(i, compaction.pinned_count)
+            {
+                dec_node_ref(compaction.pinned[i]);
+            }
+            Arena::release(compaction.arena);
+        }
+        if (folds.arena != nullptr)
+        {
+            Arena::release(folds.arena);
+        }
+        for EachNode(entry, buffers.heads->first)
+        {
+            entry->~HeadEntry();
+        }
+    }
+
+    BufferCollection Tree::buffer_collection_no_ref() const
+    {
+        settle_typing();
+        return buffers;
+    }
+    
+    BufferCursor Tree::buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder)
+    {
+        const LineStarts* starts = &buffers->buffer_at(piece.index)->line_starts;
+        auto start_offset = rep(starts->starts[rep(piece.first.line)]) + rep(piece.first.column);
+        auto offset = start_offset + rep(remainder);
+
+        // Binary search for 'offset' between start and ending offset.
+        auto low = rep(piece.first.line);
+        auto high = rep(piece.last.line);
+
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        if (buffer->line_start_samples.count != 0 and high - low > line_start_sample_stride)
+        {
+            auto line = sampled_line_search(buffer, low, high, offset);
+            return { .line = Line{ line },
+                        .column = Column{ offset - rep(starts->starts[line]) } };
+        }
+
+        size_t mid = 0;
+        size_t mid_start = 0;
+        size_t mid_stop = 0;
+
+        while (low <= high)
+        {
+            mid = low + ((high - low) / 2);
+            mid_start = rep(starts->starts[mid]);
+
+            if (mid == high)
+                break;
+            mid_stop = rep(starts->starts[mid + 1]);
+
+            if (offset < mid_start)
+            {
+                high = mid - 1;
+            }
+            else if (offset >= mid_stop)
+            {
+                low = mid + 1;
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        return { .line = Line{ mid },
+                    .column = Column{ offset - mid_start } };
+    }
+
+    void Tree::build_tree()
+    {
+        take_buffer_ref(&buffers);
+        // In order to maintain the invariant of other buffers, the mod_buffer needs a single line-start of 0.
+        append_mut_buf_start(&buffers, {});
+        last_insert = { };
+
+        const auto buf_count = buffers.orig_buffers.count;
+        
+        size_t leafCount = 0;
+        Arena::Temp scratch = Arena::scratch_begin({&buffers.immutable_buf_arena, 1});
+        NodeData* leafNodes = Arena::push_array<NodeData>(scratch.arena, buf_count);
+
+        for (size_t i = 0; i < buf_count; ++i)
+        {
+            const auto& buf = buffers.orig_buffers.buffers[i];
+            assert(buf.line_starts.count>0);
+            // If this immutable buffer is empty, we can avoid creating a piece for it altogether.
+            if (buf.buffer.size == 0)
+                continue;
+            auto last_line = Line{ buf.line_starts.count - 1 };
+            // Create a new node that spans this buffer and retains an index to it.
+            // Insert the node into the balanced tree.
+            Piece piece {
+                .index = BufferIndex{ i },
+                .first = { .line = Line{ 0 }, .column = Column{ 0 } },
+                .last = { .line = last_line, .column = Column{ buf.buffer.size - rep(buf.line_starts.starts[rep(last_line)]) } },
+                .length = Length{ buf.buffer.size },
+                // Note: the number of newlines
+                .newline_count = LFCount{ rep(last_line) }
+            };
+            piece.summary = TreeSummary::of(&buffers, piece);
+            leafNodes[leafCount++]={piece};
+        }
+        root = root.construct_from(buffers.rb_tree_blk, leafNodes, leafCount);
+        
+        Arena::scratch_end(scratch);
+        compute_buffer_meta();
+    }
+
+    void Tree::remove(CharOffset offset, Length count, SuppressHistory suppress_history)
+    {
+        // Rule out the obvious noop.
+        if (rep(count) == 0 or root.is_empty())
+            return;
+        if (absorb_remove(offset, count, suppress_history))
+            return;
+        flush_typing();
+        if (is_no(suppress_history))
+        {
+            append_undo(root, offset);
+        }
+        internal_remove(offset, count);
+    }
+
+    void Tree::set_typing_cache(bool enabled)
+    {
+        flush_typing();
+        if (enabled)
+        {
+            typing.reserve(buffers.immutable_buf_arena);
+        }
+        typing.enabled = enabled;
+    }
 
-            if(len < to_remove_from_first_found)
-            {
-                //everything to be removed is in recC, ensure recA and recB are filled
+    void Tree::flush_typing()
+    {
+        if (typing.length() == 0)
+            return;
+        auto first = typing.first;
+        auto txt = typing.take();
+        // The history step was taken when the typing began and the insertion point stays where the typing left it.
+        // The typed text may continue the piece typed before it, which the insertion checks from where it began.
+        auto end = end_last_insert;
+        end_last_insert = typing.first;
+        internal_insert(first, txt);
+        end_last_insert = end;
+    }
 
-                if(i < 3)
-                {
-                    recA = allChildren[0];
-                    recB = allChildren[1];
-                    recC = allChildren[2];
-                    i = 3;
-                    newoffset = offset;
-                }
-                res = remove_from(scratch.arena, blk, recA, recB, recC, newoffset, len);
+    void Tree::settle_typing() const
+    {
+        if (typing.length() != 0)
+        {
+            const_cast<Tree*>(this)->flush_typing();
+        }
+    }
+
+    bool Tree::absorb_insert(CharOffset offset, String8 txt, SuppressHistory suppress_history)
+    {
+        if (not typing.enabled or folds.count != 0 or root.is_empty() or txt.size > typing.capacity)
+            return false;
+        if (typing.length() == 0)
+        {
+            // Typing begins here, with the history step the insertion would have taken.
+            if (is_no(suppress_history) and end_last_insert != offset)
+            {
+                append_undo(root, offset);
             }
-            else
+            typing.first = offset;
+        }
+        else
+        {
+            // Only insertions into the typed text which take no history step stay in the cache.
+            if (not typing.holds(offset, Length{ }))
+                return false;
+            if (is_no(suppress_history) and end_last_insert != offset)
+                return false;
+            if (txt.size > typing.room())
             {
-                offset = newoffset;
-                Length to_remove_from_rest = len - to_remove_from_first_found;
+                flush_typing();
+                return absorb_insert(offset, txt, suppress_history);
+            }
+        }
+        typing.insert(rep(distance(typing.first, offset)), txt);
+        end_last_insert = extend(offset, txt.size);
+        return true;
+    }
 
-                auto streelen = (allOffsets[i]-allOffsets[i-1]);
-                for(;i< totalChildCount &&
-                        streelen < to_remove_from_rest;i++)
-                {
-                    to_remove_from_rest = to_remove_from_rest - 
-                            (allOffsets[i]-allOffsets[i-1]);
-                    streelen = (allOffsets[i+1]-allOffsets[i]);
-                            //allChildren[i]->subTreeLength();
-                    algo_mark(allChildren[i], Collect);
-                }
-                if(i >= totalChildCount && !recA)
-                {
-                    //end of array and not enough to fill a node
-                    assert(c==nullptr); // can only come from root
-                    if(recB)
-                    {
-                        Arena::scratch_end(scratch);
-                        return remove_from(arena, blk, recB, recC, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
-                    }
-                    else
-                    {
-                        Arena::scratch_end(scratch);
-                        return remove_from(arena, blk, recC, nullptr, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
-                    }
-                }
-                //now allChildren[i] is the last child to remove anything from
-                if(i < totalChildCount)
-                {
-                    if(recA)
-                    {
-                        offset = offset - recA->subTreeLength();
-                        resultChildren[childCount++] = recA;
-                    }
-                    recA = recB;
-                    recB = recC;
-                    recC = allChildren[i];
-                    i++;
-                    
-                    algo_mark(recC, Traverse);
-                }
-                //recA and recB might still be nullptr
-                while(!recA)
+    bool Tree::absorb_remove(CharOffset offset, Length count, SuppressHistory suppress_history)
+    {
+        // Removals take a history step unless suppressed, so only suppressed ones inside the typed text stay in the
+        // cache.
+        if (typing.length() == 0 or is_no(suppress_history) or not typing.holds(offset, count))
+            return false;
+        typing.remove(rep(distance(typing.first, offset)), rep(count));
+        return true;
+    }
+
+    namespace
+    {
+        // Drops the heads held by nothing but the list, as no 'snap_to' can name them any more.
+        void prune_heads(HeadList* heads)
+        {
+            HeadEntry** link = &heads->first;
+            while (*link != nullptr)
+            {
+                HeadEntry* entry = *link;
+                uint64_t held = entry->given.root_ptr() == entry->current.root_ptr() ? 2 : 1;
+                if (os_atomic_u64_eval(&entry->given.root_ptr()->blk->ref_count) != held)
                 {
-                    if(i >= totalChildCount)
-                    {
-                        
-                        //end of array and not enough to fill a node
-                        //can only happen at root
-                        assert(c==nullptr);
-                        if(recB)
-                        {
-                            Arena::scratch_end(scratch);
-                            return remove_from(arena, blk, recB, recC, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
-                        }
-                        else
-                        {
-                            Arena::scratch_end(scratch);
-                            return remove_from(arena, blk, recC, nullptr, nullptr, offset, to_remove_from_first_found + to_remove_from_rest);
-                        }
-                    }
-                    recA = recB;
-                    recB = recC;
-                    recC = allChildren[i];
-                    i++;
-                    
-                    algo_mark(recC, Traverse);
+                    link = &entry->next;
+                    continue;
                 }
-                res = remove_from(scratch.arena, blk, recA, recB, recC, offset, to_remove_from_first_found + to_remove_from_rest);
+                *link = entry->next;
+                --heads->count;
+                entry->~HeadEntry();
+                SLLStackPush(heads->free_list, entry);
             }
+        }
 
-            for EachIndex(it, res.count)
+        void push_head(Arena::Arena* arena, HeadList* heads, const StorageTree& root)
+        {
+            prune_heads(heads);
+            HeadEntry* entry = heads->free_list;
+            if (entry != nullptr)
             {
-                resultChildren[childCount++] = res.nodes[it];
+                SLLStackPop(heads->free_list);
             }
-
-            for(;i<totalChildCount;i++)
+            else
             {
-                resultChildren[childCount++] = take_node_ref(allChildren[i]);
+                entry = reinterpret_cast<HeadEntry*>(Arena::push_array_no_zero<uint8_t>(arena, sizeof(HeadEntry)));
             }
+            new (entry) HeadEntry{ .next = heads->first, .given = root.dup(), .current = root.dup() };
+            heads->first = entry;
+            ++heads->count;
+        }
 
-            TreeManipResult result;
-            result.depth = res.depth+1;
-            if(childCount > MaxChildren*3)
+        // Queues 'node' to be marked unless it already was.
+        void queue_node(Compaction* state, StorageTree::NodePtr node)
+        {
+            if (node_map_find(&state->marked, node) != nullptr)
+                return;
+            node_map_insert(state->arena, &state->marked, node, node);
+            if (state->stack_count == state->stack_capacity)
             {
-                size_t from = 0;
-                size_t perChild = childCount/4;
-                result.nodes = Arena::push_array<NodePtr>(arena, 4);
-                result.count = 4;
-
-                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
-                from+=perChild;
-                if(childCount%4 > 1)
+                auto capacity = state->stack_capacity == 0 ? 64 : state->stack_capacity * 2;
+                StorageTree::NodePtr* stack = Arena::push_array_no_zero<StorageTree::NodePtr>(state->arena, capacity);
+                if (state->stack_count != 0)
                 {
-                    perChild+=1;
+                    memcpy(stack, state->stack, state->stack_count * sizeof(StorageTree::NodePtr));
                 }
-                result.nodes[1] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
-                from+=perChild;
-                result.nodes[2] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
-                from+=perChild;
-                result.nodes[3] = (construct_internal(blk->rb_tree_blk, resultChildren, from, childCount));
+                state->stack = stack;
+                state->stack_capacity = capacity;
             }
-            else if(childCount > MaxChildren*2)
-            {
-                size_t from = 0;
-                size_t perChild = childCount/3;
+            state->stack[state->stack_count++] = node;
+        }
 
-                result.nodes = Arena::push_array<NodePtr>(arena, 3);
-                result.count = 3;
-                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
-                from+=perChild;
-                if(childCount%3 > 1)
+        void add_live_range(Compaction* state, const BufferCollection* buffers, const Piece& piece)
+        {
+            if (state->live_count == state->live_capacity)
+            {
+                auto capacity = state->live_capacity == 0 ? 64 : state->live_capacity * 2;
+                LiveRange* live = Arena::push_array_no_zero<LiveRange>(state->arena, capacity);
+                if (state->live_count != 0)
                 {
-                    perChild+=1;
+                    memcpy(live, state->live, state->live_count * sizeof(LiveRange));
                 }
-                result.nodes[1] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+perChild));
-                from+=perChild;
-                result.nodes[2] = (construct_internal(blk->rb_tree_blk, resultChildren, from, childCount));
+                state->live = live;
+                state->live_capacity = capacity;
             }
-            else if(childCount > MaxChildren)
-            {
-                size_t from = 0;
-                size_t mid = childCount/2;
-                result.nodes = Arena::push_array<NodePtr>(arena, 2);
-                result.count = 2;
-                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, from, from+mid));
-
-                result.nodes[1] = (construct_internal(blk->rb_tree_blk, resultChildren, mid, childCount));
+            auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+            state->live[state->live_count++] = { .first = first, .last = first + rep(piece.length), .moved_to = 0 };
+        }
 
-            }
-            else
+        // Marks queued nodes, at most 'budget' of them, recording the mod buffer ranges of their pieces.
+        void mark_nodes(Compaction* state, const BufferCollection* buffers, uint64_t budget)
+        {
+            for (; state->stack_count != 0 and budget != 0; --budget)
             {
-                assert(childCount >= MaxChildren/2 || c==nullptr);
-                result.nodes = Arena::push_array<NodePtr>(arena, 1);
-                result.count = 1;
-                result.nodes[0] = (construct_internal(blk->rb_tree_blk, resultChildren, 0, childCount));
+                StorageTree::NodePtr node = state->stack[--state->stack_count];
+                if (node->isLeaf())
+                {
+                    auto leaf = to_leaf_node(node);
+                    for (size_t i = 0; i < leaf->childCount; ++i)
+                    {
+                        if (leaf->children[i].piece.index == BufferIndex::ModBuf)
+                        {
+                            add_live_range(state, buffers, leaf->children[i].piece);
+                        }
+                    }
+                }
+                else
+                {
+                    auto internal = to_internal_node(node);
+                    for (size_t i = 0; i < internal->childCount; ++i)
+                    {
+                        queue_node(state, internal->children[i]);
+                    }
+                }
             }
-            Arena::scratch_end(scratch);
-            return result;
         }
-    }
+    } // namespace [anon]
 
-    template<size_t MaxChildren>
-    void dec_node_ref(const BNodeCountedGeneric<MaxChildren>* node)
+    CompactionResult Tree::compact_mod_buffer(uint64_t budget)
     {
-        if (node == nullptr)
-            return;
-        
-        
-        uint64_t count = os_atomic_u64_dec_eval(&node->blk->ref_count);
-        if (count == 0)
+        if (compaction.arena == nullptr)
         {
-            
-            NEW_NODE_DEALLOC();
-            BNodeCountedGeneric<MaxChildren>* mut_node = const_cast<BNodeCountedGeneric<MaxChildren>*>(node);
-            if(node->type == NodeType::INTERNAL)
+            // Pin the history and the heads as they are now and queue their roots.
+            prune_heads(buffers.heads);
+            compaction.arena = Arena::alloc(Arena::default_params);
+            compaction.pinned = Arena::push_array_no_zero<StorageTree::NodePtr>(compaction.arena, 1 + undo_stack.count + redo_stack.count + buffers.heads->count);
+            auto pin = [&](const StorageTree& tree) {
+                if (tree.is_empty())
+                    return;
+                compaction.pinned[compaction.pinned_count++] = take_node_ref(tree.root_ptr());
+                queue_node(&compaction, tree.root_ptr());
+            };
+            pin(root);
+            for EachNode(entry, undo_stack.first)
             {
-                BNodeCountedInternal<MaxChildren> *in = to_internal_node(mut_node);
-                for EachIndex(i, in->childCount)
-                {
-                    dec_node_ref(in->children[i]);
-                }
+                pin(entry->root);
             }
-            // Finally, detach this node and add to the free list atomically.
-            FreeList old_head{};
-            FreeList next_head{};
-            static_assert(alignof(FreeList) == 16);
-            FreeList *frl;
-            if(node->type == NodeType::LEAF)
-                frl = &node->blk->base_blk->free_list.leaf;
-            else if(node->type == NodeType::INTERNAL)
-                frl = &node->blk->base_blk->free_list.internal;
-            else
+            for EachNode(entry, redo_stack.first)
             {
-                __debugbreak();
-                frl = nullptr;
+                pin(entry->root);
             }
-            os_atomic_u128_eval(frl, &old_head);
-            do
+            for EachNode(entry, buffers.heads->first)
             {
-                mut_node->next = reinterpret_cast<BNodeCountedGeneric<MaxChildren>*>(old_head.head);
-                next_head.head = reinterpret_cast<BNodeCounted*>(mut_node);
-                next_head.tag = old_head.tag + 1;
-            } while (not os_atomic_u128_eval_cond_assign(frl, next_head, &old_head));
-        }
-    }
-
-
-    template<size_t MaxChildren>
-    BNodeCountedGeneric<MaxChildren>* take_node_ref( BNodeCountedGeneric<MaxChildren>* node)
-    {
-        if (node != nullptr)
-        {
-            FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(&node->blk->ref_count));
+                pin(entry->current);
+            }
         }
-        return node;
-    }
-    
-    template<size_t MaxChildren>
-    BNodeCountedGeneric<MaxChildren>* take_node_ref( BNodeCountedInternal<MaxChildren>* node)
-    {
-        return take_node_ref(to_node(node));
-    }
-    
-    template<size_t MaxChildren>
-    BNodeCountedGeneric<MaxChildren>* take_node_ref( BNodeCountedLeaf<MaxChildren>* node)
-    {
-        return take_node_ref(to_node(node));
-    }
-
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::construct_leaf(BTreeBlock* blk, const NodeData* data, size_t begin, size_t end) 
-    {
-        NEW_NODE_ALLOC();
-        LeafNodePtr node = nullptr;
-        BNodeBlock* node_blk = nullptr;
-        // Try to fetch a node from the free list atomically.
+        mark_nodes(&compaction, &buffers, budget);
+        if (compaction.stack_count != 0 or os_atomic_u64_eval(buffers.mod_buffer_pins) != 0)
+            return { .done = false, .reclaimed = Length{ } };
+        return { .done = true, .reclaimed = finish_compaction() };
+    }
+
+    Length Tree::finish_compaction()
+    {
+        flush_typing();
+        // Mark what was made since the compaction began.  The nodes marked before are pinned, so only new ones are
+        // visited.
+        auto queue = [&](const StorageTree& tree) {
+            if (not tree.is_empty())
+            {
+                queue_node(&compaction, tree.root_ptr());
+            }
+        };
+        queue(root);
+        for EachNode(entry, undo_stack.first)
         {
-            BNodeFreeList old_head;
-            BNodeFreeList next_head{};
-            os_atomic_u128_eval(&blk->free_list.leaf, &old_head.leaf);
-            do
+            queue(entry->root);
+        }
+        for EachNode(entry, redo_stack.first)
+        {
+            queue(entry->root);
+        }
+        for EachNode(entry, buffers.heads->first)
+        {
+            queue(entry->current);
+        }
+        mark_nodes(&compaction, &buffers, UINT64_MAX);
+
+        // Merge the ranges the pieces refer to and give each its place in the compacted buffer.
+        LiveRange* live = compaction.live;
+        std::sort(live, live + compaction.live_count, [](const LiveRange& a, const LiveRange& b) { return a.first < b.first; });
+        uint64_t live_count = 0;
+        uint64_t size = 0;
+        for EachIndex(i, compaction.live_count)
+        {
+            if (live_count != 0 and live[i].first <= live[live_count - 1].last)
             {
-                if (old_head.leaf.head == nullptr)
+                if (live[i].last > live[live_count - 1].last)
                 {
-                    node = nullptr;
-                    break;
+                    size += live[i].last - live[live_count - 1].last;
+                    live[live_count - 1].last = live[i].last;
                 }
-                node = reinterpret_cast<LeafNodePtr>(old_head.leaf.head);
-                next_head.leaf.head = old_head.leaf.head->next;
-                next_head.leaf.tag = old_head.leaf.tag + 1;
-            } while (not os_atomic_u128_eval_cond_assign(&blk->free_list.leaf, next_head.leaf, &old_head.leaf));
-            if (node != nullptr)
+                continue;
+            }
+            live[live_count++] = { .first = live[i].first, .last = live[i].last, .moved_to = size };
+            size += live[i].last - live[i].first;
+        }
+
+        CharBuffer* mod = &buffers.mod_buffer;
+        LineStart* new_starts = Arena::push_array_no_zero<LineStart>(compaction.arena, mod->line_starts.count);
+        uint64_t start_count = 1;
+        new_starts[0] = LineStart{ 0 };
+        for EachIndex(i, live_count)
+        {
+            for (uint64_t b = live[i].first; b < live[i].last; ++b)
             {
-                node_blk = node->blk;
+                if (mod->buffer.str[b] == '\n')
+                {
+                    new_starts[start_count++] = LineStart{ live[i].moved_to + (b - live[i].first) + 1 };
+                }
             }
         }
 
-        if (node==nullptr)
+        // Rewrite the pieces while the old line starts are still in place.
+        PieceRewrite rewrite{ .starts = mod->line_starts.starts,
+                              .new_starts = new_starts,
+                              .new_start_count = start_count,
+                              .live = live,
+                              .live_count = live_count,
+                              .arena = compaction.arena,
+                              .copies = { } };
+        // Copies are remembered by the address of the original node, so every original root is held until all of them
+        // are rewritten.  Otherwise the nodes of a root replaced early could be released and their addresses taken by
+        // the copies made for the next ones.
+        StorageTree::NodePtr* originals = Arena::push_array_no_zero<StorageTree::NodePtr>(compaction.arena, 1 + undo_stack.count + redo_stack.count + buffers.heads->count);
+        uint64_t original_count = 0;
+        auto rewrite_root = [&](StorageTree* tree) {
+            originals[original_count++] = take_node_ref(tree->root_ptr());
+            *tree = tree->rewrite_pieces(buffers.rb_tree_blk, &rewrite);
+        };
+        rewrite_root(&root);
+        for EachNode(entry, undo_stack.first)
         {
-            node = Arena::push_array_no_zero<BNodeCountedLeaf<MaxChildren>>(blk->alloc_arena, 1);
-            node_blk = Arena::push_array<BNodeBlock>(blk->alloc_arena, 1);
+            rewrite_root(&entry->root);
+        }
+        for EachNode(entry, redo_stack.first)
+        {
+            rewrite_root(&entry->root);
+        }
+        for EachNode(entry, buffers.heads->first)
+        {
+            rewrite_root(&entry->current);
+        }
+        for EachIndex(i, original_count)
+        {
+            dec_node_ref(originals[i]);
         }
-        
-        zero_bytes(node);
-        zero_bytes(node_blk);
-        
-        node->blk = node_blk;
-        node_blk->base_blk = blk;
-        
-        take_node_ref(node);
-        node->type = NodeType::LEAF;
 
-        size_t numChild = end-begin;
-        assert(numChild <= MaxChildren);
-        auto result = to_node(node);
-        std::array<NodeData, MaxChildren>& new_left_children = node->children;
-        std::array<Length, MaxChildren>&  new_left_offsets = result->offsets;
-        std::array<LFCount, MaxChildren>&  new_left_linefeed = result->lineFeeds;
-        result->childCount = numChild;
-        Length acc{0};
-        LFCount linefeed{0};
-        for(int i = 0; i < numChild; i++)
+        // Move the text down and give back the rest.  Ranges only move towards the front, so they are moved in order.
+        for EachIndex(i, live_count)
         {
-            new_left_children[i] =data[begin+i];
-            acc = acc + data[begin+i].piece.length;
-            new_left_offsets[i] = acc;
-            linefeed =LFCount {rep(linefeed) + rep(data[begin+i].piece.newline_count)};
-            new_left_linefeed[i] = linefeed;
+            memmove(mod->buffer.str + live[i].moved_to, mod->buffer.str + live[i].first, live[i].last - live[i].first);
         }
-        new_left_offsets[MaxChildren-1] = acc;
-        new_left_linefeed[MaxChildren-1] = linefeed;
-        
-        algo_mark(result, Made);
-        return result;
-    }
+        auto reclaimed = mod->buffer.size - size;
+        Arena::pop(buffers.mut_buf_arena, Arena::AllocSize{ reclaimed });
+        mod->buffer.size = size;
+        mod->buffer.str[size] = 0;
+        memcpy(mod->line_starts.starts, new_starts, start_count * sizeof(LineStart));
+        Arena::pop(buffers.mut_buf_starts_arena, Arena::AllocSize{ (mod->line_starts.count - start_count) * sizeof(LineStart) });
+        mod->line_starts.count = start_count;
+        // The indexes over the buffer are built again in place.
+#if FRED_CODE_POINT_INDEX
+        mod->code_points.count = 0;
+        extend_code_point_index(buffers.immutable_buf_arena, &mod->code_points, mod->buffer);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_BRACKET_SUMMARY
+        mod->brackets.level_count = 0;
+        extend_bracket_index(buffers.immutable_buf_arena, buffers.bracket_pairs, &mod->brackets, mod->buffer);
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_WRAP_SUMMARY
+        for (WrapIndex* wrap = buffers.wrap_cache; wrap != nullptr; wrap = wrap->next)
+        {
+            wrap->mod_count = 0;
+        }
+        extend_mod_wrap_rows(buffers.immutable_buf_arena, buffers.wrap, mod);
+#endif // FRED_WRAP_SUMMARY
+        last_insert = { .line = Line{ start_count - 1 }, .column = Column{ size - rep(new_starts[start_count - 1]) } };
+        buffers.compactions += 1;
 
+        for EachIndex(i, compaction.pinned_count)
+        {
+            dec_node_ref(compaction.pinned[i]);
+        }
+        Arena::release(compaction.arena);
+        compaction = { };
+        return Length{ reclaimed };
+    }
 
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::construct_internal(BTreeBlock* blk, B_Tree<MaxChildren>::NodeVector data, size_t begin, size_t end) 
+    void Tree::line_end_crlf(CharOffset* offset, const BufferCollection* buffers, StorageTree::NodePtr node, Line line)
     {
-        NEW_NODE_ALLOC();
-        InternalNodePtr node = nullptr;
-        BNodeBlock* node_blk = nullptr;
-        // Try to fetch a node from the free list atomically.
+        
+        assert(line != Line::IndexBeginning);
+        auto line_index = rep(retract(line));
+
+        StorageTree::NodePtr n = (node);
+        StorageTree::NodePtr prevNode = nullptr;
+        
+        while(!n->isLeaf())
         {
-            BNodeFreeList old_head;
-            BNodeFreeList next_head{};
-            os_atomic_u128_eval(&blk->free_list.leaf, &old_head.leaf);
-            do
+            StorageTree::InternalNodePtr in = to_internal_node(node);
+            StorageTree::NodeVector children = (&in->children[0]);
+            int i;
+            for(i = 0; i < n->childCount;i++)
             {
-                if (old_head.leaf.head == nullptr)
+                if(line_index <= rep(n->lineFeeds[i]))
                 {
-                    node = nullptr;
+                    if(i>0)
+                    {
+                        line_index -= rep(n->lineFeeds[i-1]);
+                        *offset = *offset + (n->offsets[i-1]);
+                    }
+                    n = children[i];
+                    if(i>0)
+                    {
+                        prevNode = children[i];
+                    }
+                    else
+                    {
+                        if(prevNode!=nullptr)
+                        {
+                            
+                            StorageTree::InternalNodePtr pn = to_internal_node(node);
+                            const StorageTree::NodeVector prevChildren = (&pn->children[0]);
+                            prevNode = prevChildren[prevNode->childCount-1];
+                        }
+                    }
+                    i=0;
                     break;
                 }
-                node = reinterpret_cast<InternalNodePtr>(old_head.leaf.head);
-                next_head.leaf.head = old_head.leaf.head->next;
-                next_head.leaf.tag = old_head.leaf.tag + 1;
-            } while (not os_atomic_u128_eval_cond_assign(&blk->free_list.leaf, next_head.leaf, &old_head.leaf));
-            if (node!=nullptr)
-            {
-                node_blk = node->blk;
+                //line_index -= rep(n->lineFeeds[i]);
+                //*offset = *offset + (n->offsets[i]);
+                
+            }
+            if(i==n->childCount){
+                i--;
+                line_index -= rep(n->lineFeeds[i-1]);
+                *offset = *offset + (n->offsets[i-1]);
+
+                n = children[i];
             }
         }
+        StorageTree::LeafNodePtr ln = to_leaf_node(n);
 
-        if (node==nullptr)
+        NodeData* children = (&ln->children[0]);
+        int i;
+        for(i = 0; i < n->childCount;i++)
         {
-            node = Arena::push_array_no_zero<BNodeCountedInternal<MaxChildren>>(blk->alloc_arena, 1);
-            node_blk = Arena::push_array<BNodeBlock>(blk->alloc_arena, 1);
+            if(line_index <= rep(children[i].piece.newline_count))
+            {
+                break;
+            }
+            line_index -= rep(children[i].piece.newline_count);
+            *offset = *offset + children[i].piece.length;
+        }
+        if(i==n->childCount){
+            return;
         }
-        
-        zero_bytes(node);
-        zero_bytes(node_blk);
-        
-        node->blk = node_blk;
-        node_blk->base_blk = blk;
-        
-        take_node_ref(node);
-        node->type = NodeType::INTERNAL;
 
-        size_t numChild = end-begin;
-        assert(numChild <= MaxChildren);
-        auto result = to_node(node);
-        
-        assert(numChild <= MaxChildren);
-        NodeVector new_left_children = &node->children[0];
-        std::array<Length, MaxChildren>&  new_left_offsets = result->offsets;
-        std::array<LFCount, MaxChildren>&  new_left_linefeed = result->lineFeeds;
-        result->childCount = numChild;
-        Length acc{0};
-        LFCount linefeed{0};
-        for(int i = 0; i < numChild; i++)
+        Piece piece = children[i].piece;
+        Piece prevPiece;
+        if(i>0)
         {
-            new_left_children[i] = data[begin+i];
-            //take_node_ref(data[begin+i]);
-             acc = acc + data[begin+i]->subTreeLength();
-            new_left_offsets[i] = acc;
-            linefeed =LFCount {rep(linefeed) + rep(data[begin+i]->subTreeLineFeeds())};
-            new_left_linefeed[i] = linefeed;
+            prevPiece = children[i-1].piece;
         }
-        new_left_offsets[MaxChildren-1] = acc;
-        new_left_linefeed[MaxChildren-1] = linefeed;
+        else
+        {
+            if(prevNode != nullptr)
+            {
+                
+                StorageTree::LeafNodePtr pln = to_leaf_node(prevNode);
 
-        algo_mark(result, Made);
-        return result;
+                NodeData* prevChildren = (&pln->children[0]);
+                prevPiece = prevChildren[prevNode->childCount-1].piece;
+            }
+        }
+        Length len  {0};
+        if (line_index != 0)
+        {
+            len = len + accumulate_value_no_lf(buffers, piece, Line{ line_index - 1 });
+            if(len == Length{})
+            {
+                if(prevPiece.length != Length{})
+                    assert(false);
+            }
+            else
+            {
+                auto* charbuffer = buffers->buffer_at(piece.index);
+                auto buf_offset = buffers->buffer_offset(piece.index, piece.first)+len;
+                const char* p = charbuffer->buffer.str + rep(buf_offset);
+                if(*p == '\n')
+                {
+                    p--;
+                    
+                    if(*p == '\r')
+                    {
+                        p--;
+                        len = retract(len);
+                    }
+                }
+            }
+        }
+        *offset = *offset + len;
     }
 
-
-    template<size_t MaxChildren>
-    BNodeCountedInternal<MaxChildren>* to_internal_node(BNodeCountedGeneric<MaxChildren>* n)
+    LineRange Tree::get_line_range(Line line) const
     {
-        assert(n == nullptr || n->type == NodeType::INTERNAL);
-        return reinterpret_cast<BNodeCountedInternal<MaxChildren>*>(n);
+        settle_typing();
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
+        return range;
     }
-    template<size_t MaxChildren>
-    BNodeCountedLeaf<MaxChildren>* to_leaf_node(BNodeCountedGeneric<MaxChildren>* n)
+    LineRange Tree::get_line_range_crlf(Line line) const
     {
-        assert(n == nullptr || n->type == NodeType::LEAF);
-        return reinterpret_cast<BNodeCountedLeaf<MaxChildren>*>(n);
+        settle_typing();
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_end_crlf(&range.last, &buffers, (root.root_ptr()), extend(line));
+        return range;
+    }
+
+    LineRange Tree::get_line_range_with_newline(Line line) const
+    {
+        settle_typing();
+        LineRange range{ };
+        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
+        line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
+        return range;
     }
-    template<size_t MaxChildren>
-    BNodeCountedGeneric<MaxChildren>* to_node(BNodeCountedGeneric<MaxChildren>* n)
+
+    String8 Tree::get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const
     {
-        return n;
+        settle_typing();
+        return line_slice_content(arena, &buffers, meta, root, line, first_column, max_columns);
     }
 
-    template<size_t MaxChildren>
-    BNodeCountedGeneric<MaxChildren>* to_node(BNodeCountedLeaf<MaxChildren>* n)
+    LineRange Tree::get_line_range_slice(Line line, Column first_column, Length max_columns) const
     {
-        return reinterpret_cast<BNodeCountedGeneric<MaxChildren>*>(n);
+        settle_typing();
+        return line_slice(&buffers, root, line, first_column, max_columns);
     }
-    template<size_t MaxChildren>
-    BNodeCountedGeneric<MaxChildren>* to_node(BNodeCountedInternal<MaxChildren>* n)
+
+    LineRange Tree::line_slice(const BufferCollection* buffers, const StorageTree& root, Line line, Column first_column, Length max_columns)
     {
-        return reinterpret_cast<BNodeCountedGeneric<MaxChildren>*>(n);
+        LineRange range{ };
+        if (line == Line::IndexBeginning or root.is_empty())
+            return range;
+        line_start<&Tree::accumulate_value>(&range.first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&range.last, buffers, root, extend(line));
+        // Both ends are clamped to the line so that a window past the end of the line is simply empty.
+        auto line_length = rep(distance(range.first, range.last));
+        auto first = rep(first_column) < line_length ? rep(first_column) : line_length;
+        auto count = rep(max_columns) < line_length - first ? rep(max_columns) : line_length - first;
+        range.first = range.first + Length{ first };
+        range.last = range.first + Length{ count };
+        return range;
     }
 
-
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::B_Tree(B_Tree<MaxChildren>&& other):
-        root_node{ other.root_node },
-        tree_depth{ other.tree_depth }
+    String8 Tree::line_slice_content(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Line line, Column first_column, Length max_columns)
     {
-        other.root_node = nullptr;
+        LineRange range = line_slice(buffers, root, line, first_column, max_columns);
+        if (range.first == range.last)
+            return str8_empty;
+        return get_range(arena, buffers, meta, root, range.first, distance(range.first, range.last));
     }
-
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>& B_Tree<MaxChildren>::operator=(B_Tree<MaxChildren>&& other)
+    OwningSnapshot* Tree::owning_snap(Arena::Arena* arena) const
     {
-        tree_depth = other.tree_depth;
-        // Swap these, so the dtor for 'other' will handle decrementing the ref.
-        NodePtr old_root = root_node;
-        root_node = other.root_node;
-        other.root_node = old_root;
-        return *this;
+        uint8_t* blob = Arena::push_array_aligned<uint8_t>(arena, sizeof(OwningSnapshot), Arena::Alignment{ alignof(OwningSnapshot) });
+        OwningSnapshot* snap = new (blob) OwningSnapshot{ arena, this };
+        return snap;
+    }
+    ReferenceSnapshot Tree::ref_snap() const
+    {
+        return ReferenceSnapshot{ this };
+    }
+    
+    char Tree::at(CharOffset offset) const
+    {
+        // Typed text which is not in the tree yet is read from the cache.
+        if (typing.length() != 0 and offset >= typing.first)
+        {
+            auto index = rep(distance(typing.first, offset));
+            if (index < typing.length())
+                return typing.at(index);
+            offset = retract(offset, typing.length());
+        }
+        auto result = node_at(&buffers, root, offset);
+        if (result.node == nullptr)
+            return '\0';
+        auto* buffer = buffers.buffer_at(result.node->piece.index);
+        auto buf_offset = buffers.buffer_offset(result.node->piece.index, result.node->piece.first);
+        const char* p = buffer->buffer.str + rep(buf_offset) + rep(result.remainder);
+        return *p;
+    }
+    
+    String8 Tree::get_range(Arena::Arena* arena, CharOffset offset, Length count) const
+    {
+        settle_typing();
+        return Tree::get_range(arena, &buffers, meta, root, offset, count);
     }
 
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::~B_Tree()
+    String8 Tree::get_range(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, Length count)
     {
-        dec_node_ref(root_node);
+        if (rep(offset) >= rep(meta.total_content_length))
+            return str8_empty;
+        auto available = rep(distance(offset, CharOffset{ rep(meta.total_content_length) }));
+        String8 result = str8_cstr_alloc(arena, rep(count) < available ? rep(count) : available);
+        Tree::copy_range(buffers, meta, root, offset, count, result.str);
+        return result;
     }
 
-    template<size_t MaxChildren>
-    B_Tree<MaxChildren>::NodePtr B_Tree<MaxChildren>::root_ptr() const
+    Length Tree::copy_range(CharOffset offset, Length count, char* dst) const
     {
-        return root_node;
+        settle_typing();
+        return Tree::copy_range(&buffers, meta, root, offset, count, dst);
     }
 
-#ifdef TEXTBUF_DEBUG
-    template<size_t MaxChildren>
-    void satisfies_btree_invariant(const B_Tree<MaxChildren>& root)
+    Length Tree::copy_range(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, Length count, char* dst)
     {
-        // 1. every node other than root has >= MaxChildren/2 children 
-        // 1.5. nodes are hardcoded to contain <= MaxChildren
-        // 2. all leafNodes are at the same depth
-        
-        typedef B_Tree<MaxChildren>::NodePtr NPtr;
-        typedef B_Tree<MaxChildren>::InternalNodePtr INPtr;
-        typedef B_Tree<MaxChildren>::LeafNodePtr LNPtr;
-        //typedef B_Tree<MaxChildren>::ChildArray  ChArr;
-        //typedef B_Tree<MaxChildren>::LeafArray  LeafArr;
-        std::vector<NPtr> layer;
-        std::vector<NPtr> next_layer;
-        
-        if(root.is_empty())
-        {
-            assert(root.depth() == 0);
-            return;
-        }
-        if(root.root_ptr()->isLeaf())
-        {
-            assert(root.depth() == 1);
-            assert(root.root_ptr()->childCount > 0);
-            assert(root.root_ptr()->childCount <= MaxChildren);
-            return;
-        }
-        assert(root.root_ptr()->childCount > 0);
-        assert(root.root_ptr()->childCount <= MaxChildren);
-        INPtr rn = to_internal_node(root.root_ptr());
-        auto& children = (rn->children);
-        next_layer.assign(&children[0], &children[0]+root.root_ptr()->childCount);
-        int layerCount = 2;
-        while(!next_layer.front()->isLeaf())
-        {
-            layerCount++;
-            layer = std::move(next_layer);
-            next_layer.clear();
-            for(auto nodeIt = layer.begin(); nodeIt != layer.end();++nodeIt)
-            {
-        
-                assert(!(*nodeIt)->isLeaf());
-                assert((*nodeIt)->childCount >= MaxChildren/2);
-                INPtr in = to_internal_node(*nodeIt);
-                auto& node_children = (in->children);
-                assert((*nodeIt)->offsets.back() == (*nodeIt)->offsets[(*nodeIt)->childCount-1]);
-                assert((*nodeIt)->lineFeeds.back() == (*nodeIt)->lineFeeds[(*nodeIt)->childCount-1]);
-                
-                LFCount prevLineEnd{};
-                Length prevOffset{};
-                for(size_t childIndex = 0; childIndex < (*nodeIt)->childCount; childIndex++)
-                {
-                    auto& node = node_children[childIndex];
-                    auto offsetDifference = rep((*nodeIt)->offsets[childIndex]) - rep(prevOffset);
-                    assert(rep(node->offsets.back()) == offsetDifference);
-                    prevOffset = (*nodeIt)->offsets[childIndex];
-                    
-                    auto lineDifference = rep((*nodeIt)->lineFeeds[childIndex]) - rep(prevLineEnd);
-                    assert(rep(node->lineFeeds.back()) == lineDifference);
-                    prevLineEnd = (*nodeIt)->lineFeeds[childIndex];
-                }
-                next_layer.insert(next_layer.end(), &node_children[0], &node_children[0]+(*nodeIt)->childCount);
-            }
-        }
-        assert(root.depth() == layerCount);
-        layer = std::move(next_layer);
-        for(auto nodeIt = layer.begin(); nodeIt != layer.end();++nodeIt)
+        if (rep(offset) >= rep(meta.total_content_length))
+            return Length{ };
+        auto available = rep(distance(offset, CharOffset{ rep(meta.total_content_length) }));
+        auto remaining = rep(count) < available ? rep(count) : available;
+        // The walker performs a single descent to 'offset', after which whole piece spans are copied.
+        auto scratch = Arena::scratch_begin(Arena::no_conflicts);
+        TreeWalker walker{ scratch.arena, buffers, meta, root, offset };
+        char* out = dst;
+        while (remaining != 0)
         {
-            assert((*nodeIt)->isLeaf());
-                
-            LNPtr ln = to_leaf_node(*nodeIt);
-            auto& node_children = ((ln)->children);
-            LFCount prevLineEnd{};
-            Length prevOffset{};
-            for(size_t childIndex = 0; childIndex < (*nodeIt)->childCount; childIndex++)
-                {
-                    auto& piece = node_children[childIndex].piece;
-                    auto offsetDifference = rep((*nodeIt)->offsets[childIndex]) - rep(prevOffset);
-                    assert(rep(piece.length) == offsetDifference);
-                    prevOffset = (*nodeIt)->offsets[childIndex];
-                    
-                    auto lineDifference = rep((*nodeIt)->lineFeeds[childIndex]) - rep(prevLineEnd);
-                    auto bufferline = rep(piece.last.line) - rep(piece.first.line);
-                    assert(rep(piece.newline_count) == lineDifference);
-                    assert(bufferline == lineDifference);
-                    prevLineEnd = (*nodeIt)->lineFeeds[childIndex];
-                }
-            assert((*nodeIt)->isLeaf());
-            assert((*nodeIt)->childCount >= MaxChildren/2);
+            String8View chunk = walker.next_chunk();
+            if (chunk.size == 0)
+                break;
+            auto amount = chunk.size < remaining ? chunk.size : remaining;
+            memcpy(out, chunk.str, amount);
+            out += amount;
+            remaining -= amount;
         }
+        Arena::scratch_end(scratch);
+        return Length{ static_cast<size_t>(out - dst) };
     }
-#endif
-}
 
-namespace RatchetPieceTree
-{
-        namespace
+#if FRED_CODE_POINT_SUMMARY
+    CodePointCount Tree::offset_to_codepoint(CharOffset offset) const
     {
-        struct LineStartsNode
-        {
-            LineStartsNode* next;
-            LineStart start;
-        };
+        settle_typing();
+        return offset_to_codepoint(&buffers, root, offset);
+    }
 
-        struct LineStartsList
-        {
-            LineStartsNode* first;
-            LineStartsNode* last;
-            uint64_t count;
-        };
+    CharOffset Tree::codepoint_to_offset(CodePointCount codepoint) const
+    {
+        settle_typing();
+        return codepoint_to_offset(&buffers, meta, root, codepoint);
+    }
 
-        void push_line_starts_node(Arena::Arena* arena, LineStartsList* lst, LineStart start)
-        {
-            LineStartsNode* node = Arena::push_array<LineStartsNode>(arena, 1);
-            node->start = start;
-            SLLQueuePush(lst->first, lst->last, node);
-            ++lst->count;
-        }
+    CodePointCount Tree::codepoint_column(CharOffset offset) const
+    {
+        settle_typing();
+        return codepoint_column(&buffers, root, offset);
+    }
 
-        LineStarts join_line_starts_list(Arena::Arena* arena, const LineStartsList& lst)
-        {
-            LineStarts result{};
-            result.starts = Arena::push_array_no_zero<LineStart>(arena, lst.count);
-            result.count = lst.count;
-            uint64_t i = 0;
-            for EachNode(n, lst.first)
-            {
-                result.starts[i++] = n->start;
-            }
-            return result;
-        }
+    CharOffset Tree::codepoint_column_offset(Line line, CodePointCount column) const
+    {
+        settle_typing();
+        return codepoint_column_offset(&buffers, meta, root, line, column);
+    }
 
-        void populate_line_starts(Arena::Arena* arena, LineStarts* starts, String8 buf)
-        {
-            LineStartsList lst{};
-            LineStart start { };
-            auto scratch = Arena::scratch_begin({ &arena, 1 });
-            push_line_starts_node(scratch.arena, &lst, start);
-            for EachIndex(i, buf.size)
-            {
-                char c = buf.str[i];
-                if (c == '\n')
-                {
-                    start = LineStart{ i + 1 };
-                    push_line_starts_node(scratch.arena, &lst, start);
-                }
-            }
-            *starts = join_line_starts_list(arena, lst);
-            Arena::scratch_end(scratch);
-        }
+    CodePointCount Tree::offset_to_codepoint(const BufferCollection* buffers, const StorageTree& root, CharOffset offset)
+    {
+        // Only the piece holding 'offset' is scanned and then only within one block of its buffer's index.
+        auto found = seek<CodePointSummary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        if (found.node == nullptr)
+            return found.prefix.summary.codepoints;
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto within = distance(CharOffset{ rep(found.prefix.length) }, offset);
+        return found.prefix.summary.codepoints + code_points_before(buffer, first + within) - code_points_before(buffer, first);
+    }
 
-        void compute_buffer_meta(BufferMeta* meta, const StorageTree& root)
-        {
-            meta->lf_count = tree_lf_count(root);
-            meta->total_content_length = tree_length(root);
-        }
+    CharOffset Tree::codepoint_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CodePointCount codepoint)
+    {
+        if (rep(codepoint) >= rep(meta.summary.codepoints))
+            return CharOffset{ rep(meta.total_content_length) };
+        auto found = seek<CodePointSummary>(root, [&](const auto& prefix) { return rep(prefix.summary.codepoints) > rep(codepoint); });
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto last = buffers->buffer_offset(piece.index, piece.last);
+        auto target = code_points_before(buffer, first) + (codepoint - found.prefix.summary.codepoints);
+        return CharOffset{ rep(found.prefix.length) } + distance(first, code_point_offset(buffer, target, last));
+    }
 
-        void append_mut_buf_start(BufferCollection* collection, LineStart start)
-        {
-            LineStart* new_starts = Arena::push_array_no_zero_aligned<LineStart>(collection->mut_buf_starts_arena, 1, Arena::Alignment{ alignof(LineStart) });
-            LineStarts* starts = &collection->mod_buffer.line_starts;
-            if(starts->starts == nullptr)
-            {
-                assert(starts->count == 0);
-                starts->starts = new_starts;
-            }
-            assert(starts->starts + starts->count == new_starts);
-            new_starts[0] = start;
-            ++starts->count;
-        }
+    CodePointCount Tree::codepoint_column(const BufferCollection* buffers, const StorageTree& root, CharOffset offset)
+    {
+        if (root.is_empty())
+            return CodePointCount{ };
+        auto line = node_at(buffers, root, offset).line;
+        CharOffset line_offset{ };
+        line_start<&Tree::accumulate_value>(&line_offset, buffers, root, line);
+        return offset_to_codepoint(buffers, root, offset) - offset_to_codepoint(buffers, root, line_offset);
+    }
 
-        void grow_mut_buf(BufferCollection* collection, uint64_t grow_by)
+    CharOffset Tree::codepoint_column_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Line line, CodePointCount column)
+    {
+        if (root.is_empty())
+            return CharOffset{ };
+        if (line == Line::IndexBeginning)
         {
-            if (grow_by == 0)
-                return;
-            char* buf = Arena::push_array_no_zero_aligned<char>(collection->mut_buf_arena, grow_by, Arena::Alignment{ alignof(char) });
-            FRED_UNUSED(buf);
-            // When this buffer is created, it was originally designated a null-terminator slot at the beginning, so new buffers we
-            // allocate will need a null-terminator appended.
-            assert(collection->mod_buffer.buffer.str + collection->mod_buffer.buffer.size + 1 == buf);
-            // Note: We do not change the base of 'str', only its size.
-            collection->mod_buffer.buffer.size += grow_by;
-            // Append our null to the newly returned buffer piece.
-            collection->mod_buffer.buffer.str[collection->mod_buffer.buffer.size] = 0;
+            line = Line::Beginning;
         }
-    } // namespace [anon]
-    
-    const CharBuffer* BufferCollection::buffer_at(BufferIndex index) const
+        CharOffset first{ };
+        CharOffset last{ };
+        line_start<&Tree::accumulate_value>(&first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&last, buffers, root, extend(line));
+        auto result = codepoint_to_offset(buffers, meta, root, offset_to_codepoint(buffers, root, first) + column);
+        return rep(result) < rep(last) ? result : last;
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Position Tree::offset_to_utf16_position(CharOffset offset) const
     {
-        if (index == BufferIndex::ModBuf)
-            return &mod_buffer;
-        return &orig_buffers.buffers[rep(index)];
+        settle_typing();
+        return offset_to_utf16_position(&buffers, root, offset);
     }
 
-    CharOffset BufferCollection::buffer_offset(BufferIndex index, const BufferCursor& cursor) const
+    CharOffset Tree::utf16_position_to_offset(Utf16Position position) const
     {
-        LineStart* starts = buffer_at(index)->line_starts.starts;
-        return CharOffset{ rep(starts[rep(cursor.line)]) + rep(cursor.column) };
+        settle_typing();
+        return utf16_position_to_offset(&buffers, meta, root, position);
     }
 
-    // Buffer collection management.
-    void dec_buffer_ref(BufferCollection* collection)
+    Utf16Count Tree::offset_to_utf16(const BufferCollection* buffers, const StorageTree& root, CharOffset offset)
     {
-        uint64_t count = os_atomic_u64_dec_eval(collection->orig_buffers.ref_count);
-        if (count == 0)
-        {
-            // Note: The arena used to allocate nodes is the same one for the immutable buffers,
-            // so we do not need to release it.
-            Arena::release(collection->mut_buf_starts_arena);
-            Arena::release(collection->undo_redo_stack_arena);
-            Arena::release(collection->mut_buf_arena);
-            Arena::release(collection->immutable_buf_arena);
-        }
+        auto found = seek<Utf16Summary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        if (found.node == nullptr)
+            return found.prefix.summary.utf16_units;
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto within = distance(CharOffset{ rep(found.prefix.length) }, offset);
+        return found.prefix.summary.utf16_units + utf16_units_before(buffer, first + within) - utf16_units_before(buffer, first);
     }
 
-    BufferCollection take_buffer_ref(const BufferCollection* collection)
+    CharOffset Tree::utf16_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Utf16Count units)
     {
-        FRED_UNUSED_RESULT(os_atomic_u64_inc_eval(collection->orig_buffers.ref_count));
-        return *collection;
+        if (rep(units) >= rep(meta.summary.utf16_units))
+            return CharOffset{ rep(meta.total_content_length) };
+        auto found = seek<Utf16Summary>(root, [&](const auto& prefix) { return rep(prefix.summary.utf16_units) > rep(units); });
+        const Piece& piece = found.node->piece;
+        const CharBuffer* buffer = buffers->buffer_at(piece.index);
+        auto first = buffers->buffer_offset(piece.index, piece.first);
+        auto last = buffers->buffer_offset(piece.index, piece.last);
+        auto target = utf16_units_before(buffer, first) + (units - found.prefix.summary.utf16_units);
+        return CharOffset{ rep(found.prefix.length) } + distance(first, utf16_unit_offset(buffer, target, last));
     }
-    
-    Tree::Tree(BufferCollection buffers):
-        buffers{ buffers }
+
+    Utf16Position Tree::offset_to_utf16_position(const BufferCollection* buffers, const StorageTree& root, CharOffset offset)
     {
-        build_tree();
+        if (root.is_empty())
+            return { .line = Line::Beginning };
+        auto line = node_at(buffers, root, offset).line;
+        CharOffset line_offset{ };
+        line_start<&Tree::accumulate_value>(&line_offset, buffers, root, line);
+        return { .line = line,
+                    .character = offset_to_utf16(buffers, root, offset) - offset_to_utf16(buffers, root, line_offset) };
     }
 
-    BufferCollection Tree::buffer_collection_no_ref() const
+    CharOffset Tree::utf16_position_to_offset(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Utf16Position position)
     {
-        return buffers;
+        if (root.is_empty())
+            return CharOffset{ };
+        auto line = position.line == Line::IndexBeginning ? Line::Beginning : position.line;
+        CharOffset first{ };
+        CharOffset last{ };
+        line_start<&Tree::accumulate_value>(&first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&last, buffers, root, extend(line));
+        auto result = utf16_to_offset(buffers, meta, root, offset_to_utf16(buffers, root, first) + position.character);
+        return rep(result) < rep(last) ? result : last;
     }
-    
-    BufferCursor Tree::buffer_position(const BufferCollection* buffers, const Piece& piece, Length remainder)
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    uint64_t Tree::hash_range(CharOffset offset, Length count) const
     {
-        const LineStarts* starts = &buffers->buffer_at(piece.index)->line_starts;
-        auto start_offset = rep(starts->starts[rep(piece.first.line)]) + rep(piece.first.column);
-        auto offset = start_offset + rep(remainder);
+        settle_typing();
+        return hash_range(&buffers, meta, root, offset, count);
+    }
 
-        // Binary search for 'offset' between start and ending offset.
-        auto low = rep(piece.first.line);
-        auto high = rep(piece.last.line);
+    uint64_t Tree::hash_line(Line line) const
+    {
+        settle_typing();
+        return hash_line(&buffers, meta, root, line);
+    }
 
-        size_t mid = 0;
-        size_t mid_start = 0;
-        size_t mid_stop = 0;
+    uint64_t Tree::prefix_hash(const BufferCollection* buffers, const StorageTree& root, CharOffset offset)
+    {
+        auto found = seek<HashSummary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        if (found.node == nullptr)
+            return found.prefix.summary.hash;
+        const Piece& piece = found.node->piece;
+        auto first = rep(buffers->buffer_offset(piece.index, piece.first));
+        auto within = rep(offset) - rep(found.prefix.length);
+        auto before = hash_mul(found.prefix.summary.hash, hash_power(within));
+        return hash_add(before, buffer_hash(buffers->buffer_at(piece.index), first, first + within));
+    }
 
-        while (low <= high)
-        {
-            mid = low + ((high - low) / 2);
-            mid_start = rep(starts->starts[mid]);
+    uint64_t Tree::hash_range(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, Length count)
+    {
+        // The hash of a range is the hash of the prefix ending with it, less the hash of the prefix before it shifted
+        // past the range.
+        auto total = rep(meta.total_content_length);
+        auto first = rep(offset) < total ? rep(offset) : total;
+        auto last = rep(count) < total - first ? first + rep(count) : total;
+        auto before = hash_mul(prefix_hash(buffers, root, CharOffset{ first }), hash_power(last - first));
+        return hash_sub(prefix_hash(buffers, root, CharOffset{ last }), before);
+    }
 
-            if (mid == high)
-                break;
-            mid_stop = rep(starts->starts[mid + 1]);
+    uint64_t Tree::hash_line(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, Line line)
+    {
+        if (root.is_empty())
+            return 0;
+        if (line == Line::IndexBeginning)
+        {
+            line = Line::Beginning;
+        }
+        CharOffset first{ };
+        CharOffset last{ };
+        line_start<&Tree::accumulate_value>(&first, buffers, root, line);
+        line_start<&Tree::accumulate_value_no_lf>(&last, buffers, root, extend(line));
+        return hash_range(buffers, meta, root, first, distance(first, last));
+    }
+#endif // FRED_HASH_SUMMARY
 
-            if (offset < mid_start)
-            {
-                high = mid - 1;
-            }
-            else if (offset >= mid_stop)
-            {
-                low = mid + 1;
-            }
-            else
-            {
-                break;
-            }
+#if FRED_WRAP_SUMMARY
+    void Tree::set_wrap_width(uint64_t width)
+    {
+        flush_typing();
+        if (width == wrap_width())
+            return;
+        if (width == 0)
+        {
+            buffers.wrap = nullptr;
+            return;
         }
+        WrapIndex* wrap = buffers.wrap_cache;
+        while (wrap != nullptr and wrap->width != width)
+        {
+            wrap = wrap->next;
+        }
+        if (wrap == nullptr)
+        {
+            wrap = Arena::push_array<WrapIndex>(buffers.immutable_buf_arena, 1);
+            wrap->width = width;
+            wrap->next = buffers.wrap_cache;
+            buffers.wrap_cache = wrap;
+        }
+        extend_wrap_rows(buffers.immutable_buf_arena, wrap, &buffers);
+        buffers.wrap = wrap;
+        refresh_wrap_summaries();
+        compute_buffer_meta();
+    }
 
-        return { .line = Line{ mid },
-                    .column = Column{ offset - mid_start } };
+    uint64_t Tree::visual_row_count() const
+    {
+        settle_typing();
+        if (buffers.wrap == nullptr)
+            return rep(line_count());
+        // The tail of a span without a LF is the whole span.
+        const WrapSummary& summary = meta.summary;
+        return summary.complete_rows() + WrapSummary::line_rows(summary.tail, buffers.wrap->width);
     }
 
-    void Tree::build_tree()
+    uint64_t Tree::visual_row(Line line, Column column) const
     {
-        take_buffer_ref(&buffers);
-        // In order to maintain the invariant of other buffers, the mod_buffer needs a single line-start of 0.
-        append_mut_buf_start(&buffers, {});
-        last_insert = { };
+        settle_typing();
+        if (line == Line::IndexBeginning)
+        {
+            line = Line::Beginning;
+        }
+        if (rep(line) > rep(line_count()))
+        {
+            line = Line{ rep(line_count()) };
+        }
+        if (buffers.wrap == nullptr)
+            return rep(line) - 1;
+        auto width = buffers.wrap->width;
+        auto range = get_line_range(line);
+        auto last_row = WrapSummary::line_rows(distance(range.first, range.last), width) - 1;
+        auto row = rep(column) / width;
+        return wrap_before(&buffers, root, range.first).complete_rows() + (row < last_row ? row : last_row);
+    }
 
-        const auto buf_count = buffers.orig_buffers.count;
-        
-        size_t leafCount = 0;
-        Arena::Temp scratch = Arena::scratch_begin({&buffers.immutable_buf_arena, 1});
-        NodeData* leafNodes = Arena::push_array<NodeData>(scratch.arena, buf_count);
+    LinePosition Tree::visual_row_start(uint64_t row) const
+    {
+        settle_typing();
+        if (buffers.wrap == nullptr)
+            return { .line = Line{ (row < rep(line_count()) ? row : rep(line_count()) - 1) + 1 } };
+        auto row_count = visual_row_count();
+        if (row >= row_count)
+        {
+            row = row_count - 1;
+        }
+        auto width = buffers.wrap->width;
+        auto found = seek<WrapSummary>(root, [&](const auto& prefix) { return prefix.summary.complete_rows() > row; });
+        const WrapSummary& before = found.prefix.summary;
+        auto line = Line{ rep(found.prefix.lf_count) + 1 };
+        auto local_row = row - before.complete_rows();
+        if (found.node == nullptr)
+            return { .line = line, .column = Column{ local_row * width } };
+        // The row is either in the line left open before the piece, which ends at the first LF of the piece, or in one
+        // of the lines the piece holds completely.
+        const Piece& piece = found.node->piece;
+        auto open_rows = WrapSummary::line_rows(before.tail + piece.summary.head, width);
+        if (local_row < open_rows)
+            return { .line = line, .column = Column{ local_row * width } };
+        const uint64_t* rows = wrap_rows(buffers.wrap, piece.index);
+        auto first = rep(piece.first.line) + 1;
+        auto target = rows[first] + local_row - open_rows;
+        auto* past = branchless_lower_bound(rows + first, rows + rep(piece.last.line) + 1, target + 1);
+        uint64_t k = (past - rows) - 1;
+        return { .line = Line{ rep(line) + k - rep(piece.first.line) }, .column = Column{ (target - rows[k]) * width } };
+    }
 
-        for (size_t i = 0; i < buf_count; ++i)
+    WrapSummary Tree::wrap_before(const BufferCollection* buffers, const StorageTree& root, CharOffset offset)
+    {
+        auto found = seek<WrapSummary>(root, [&](const auto& prefix) { return rep(prefix.length) > rep(offset); });
+        auto within = distance(CharOffset{ rep(found.prefix.length) }, offset);
+        if (found.node == nullptr or within == Length{ })
+            return found.prefix.summary;
+        // The part of the piece before 'offset' is summarized as a piece of its own.
+        Piece part = found.node->piece;
+        part.last = buffer_position(buffers, part, within);
+        part.length = within;
+        return WrapSummary::combine(found.prefix.summary, WrapSummary::of(buffers, part));
+    }
+#endif // FRED_WRAP_SUMMARY
+
+    void Tree::add_fold(Line header, Line last, bool collapsed)
+    {
+        flush_typing();
+        if (header == Line::IndexBeginning)
         {
-            const auto& buf = buffers.orig_buffers.buffers[i];
-            assert(buf.line_starts.count>0);
-            // If this immutable buffer is empty, we can avoid creating a piece for it altogether.
-            if (buf.buffer.size == 0)
-                continue;
-            auto last_line = Line{ buf.line_starts.count - 1 };
-            // Create a new node that spans this buffer and retains an index to it.
-            // Insert the node into the balanced tree.
-            Piece piece {
-                .index = BufferIndex{ i },
-                .first = { .line = Line{ 0 }, .column = Column{ 0 } },
-                .last = { .line = last_line, .column = Column{ buf.buffer.size - rep(buf.line_starts.starts[rep(last_line)]) } },
-                .length = Length{ buf.buffer.size },
-                // Note: the number of newlines
-                .newline_count = LFCount{ rep(last_line) }
-            };
-            leafNodes[leafCount++]={piece};
+            header = Line::Beginning;
         }
-        root = root.construct_from(buffers.rb_tree_blk, leafNodes, leafCount);
-        
+        if (rep(last) > rep(line_count()))
+        {
+            last = Line{ rep(line_count()) };
+        }
+        if (rep(last) <= rep(header))
+            return;
+        reserve_folds(&folds, folds.count + 1);
+        Arena::Temp scratch = Arena::scratch_begin({ &folds.arena, 1 });
+        Fold* list = copy_folds(scratch.arena, &folds, folds.count + 1);
+        auto at = find_fold(&folds, header);
+        // A fold already on 'header' is replaced.
+        auto replaced = at != folds.count and list[at].header == header;
+        memmove(list + at + 1, list + at + replaced, (folds.count - at - replaced) * sizeof(Fold));
+        list[at] = { .header = header, .last = last, .collapsed = collapsed };
+        assign_folds(&folds, list, folds.count + 1 - replaced);
         Arena::scratch_end(scratch);
-        compute_buffer_meta();
     }
 
-    void Tree::remove(CharOffset offset, Length count, SuppressHistory suppress_history)
+    void Tree::remove_fold(Line header)
     {
-        // Rule out the obvious noop.
-        if (rep(count) == 0 or root.is_empty())
+        flush_typing();
+        auto at = find_fold(&folds, header);
+        if (at == folds.count or get_fold(&folds, at).header != header)
             return;
-        if (is_no(suppress_history))
+        Arena::Temp scratch = Arena::scratch_begin({ &folds.arena, 1 });
+        Fold* list = copy_folds(scratch.arena, &folds, folds.count);
+        memmove(list + at, list + at + 1, (folds.count - at - 1) * sizeof(Fold));
+        assign_folds(&folds, list, folds.count - 1);
+        Arena::scratch_end(scratch);
+    }
+
+    void Tree::set_fold_collapsed(Line header, bool collapsed)
+    {
+        flush_typing();
+        auto at = find_fold(&folds, header);
+        if (at == folds.count or get_fold(&folds, at).header != header)
+            return;
+        folds.collapsed[at] = collapsed;
+        folds.saved = nullptr;
+        rebuild_fold_runs(&folds);
+    }
+
+    void Tree::set_all_folds_collapsed(bool collapsed)
+    {
+        flush_typing();
+        for EachIndex(i, folds.count)
         {
-            append_undo(root, offset);
+            folds.collapsed[i] = collapsed;
         }
-        internal_remove(offset, count);
+        folds.saved = nullptr;
+        rebuild_fold_runs(&folds);
     }
 
-    void Tree::line_end_crlf(CharOffset* offset, const BufferCollection* buffers, StorageTree::NodePtr node, Line line)
+    Fold Tree::fold_at(uint64_t index) const
     {
-        
-        assert(line != Line::IndexBeginning);
-        auto line_index = rep(retract(line));
+        settle_typing();
+        return get_fold(&folds, index);
+    }
 
-        StorageTree::NodePtr n = (node);
-        StorageTree::NodePtr prevNode = nullptr;
-        
-        while(!n->isLeaf())
+    Line Tree::visible_to_line(Line visible) const
+    {
+        settle_typing();
+        auto last = rep(visible_line_count());
+        auto target = rep(visible) == 0 ? 1 : rep(visible) < last ? rep(visible) : last;
+        // Every run whose header is visible before 'target' hides lines before it.
+        auto runs = lower_bound_by(folds.run_count, target, [&](uint64_t i) { return run_header_line(&folds, i); });
+        return Line{ target + (runs == 0 ? 0 : folds.hidden_before[runs]) };
+    }
+
+    Line Tree::line_to_visible(Line line) const
+    {
+        settle_typing();
+        auto last = rep(line_count());
+        auto target = rep(line) == 0 ? 1 : rep(line) < last ? rep(line) : last;
+        // The last run starting at or before 'target'.
+        auto run = lower_bound_by(folds.run_count, target + 1, [&](uint64_t i) { return run_first_line(&folds, i); });
+        if (run == 0)
+            return Line{ target };
+        run -= 1;
+        if (target - run_first_line(&folds, run) < folds.hidden_before[run + 1] - folds.hidden_before[run])
+            return Line{ run_header_line(&folds, run) };
+        return Line{ target - folds.hidden_before[run + 1] };
+    }
+
+    Length Tree::visible_line_count() const
+    {
+        settle_typing();
+        return Length{ rep(line_count()) - hidden_lines(&folds) };
+    }
+
+#if FRED_BRACKET_SUMMARY
+    namespace
+    {
+        // Searches the bytes [first, last) of the subtree 'node', whose text starts at 'start', for the first byte
+        // after which the depth of bracket pair 'pair' is at most 'target'.  Children which cannot hold it are skipped
+        // using their summary, so only the paths to the ends of the range and to the result are visited.
+        CharOffset subtree_bracket_forward(const BufferCollection* buffers, StorageTree::NodePtr node, uint64_t start, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
         {
-            StorageTree::InternalNodePtr in = to_internal_node(node);
-            StorageTree::NodeVector children = (&in->children[0]);
-            int i;
-            for(i = 0; i < n->childCount;i++)
+            for EachIndex(i, node->childCount)
             {
-                if(line_index <= rep(n->lineFeeds[i]))
+                auto child_start = start + (i == 0 ? 0 : rep(node->offsets[i - 1]));
+                auto child_end = start + rep(node->offsets[i]);
+                if (child_end <= first)
+                    continue;
+                if (last <= child_start)
+                    break;
+                CharOffset found;
+                if (node->isLeaf())
                 {
-                    if(i>0)
-                    {
-                        line_index -= rep(n->lineFeeds[i-1]);
-                        *offset = *offset + (n->offsets[i-1]);
-                    }
-                    n = children[i];
-                    if(i>0)
-                    {
-                        prevNode = children[i];
-                    }
-                    else
+                    found = piece_bracket_forward(buffers, to_leaf_node(node)->children[i].piece, child_start, first, last, pair, depth, target);
+                }
+                else
+                {
+                    StorageTree::NodePtr child = to_internal_node(node)->children[i];
+                    const BracketDepth& span = child->subTreeSummary().depths[pair];
+                    if (first <= child_start and child_end <= last and *depth + span.min > target)
                     {
-                        if(prevNode!=nullptr)
-                        {
-                            
-                            StorageTree::InternalNodePtr pn = to_internal_node(node);
-                            const StorageTree::NodeVector prevChildren = (&pn->children[0]);
-                            prevNode = prevChildren[prevNode->childCount-1];
-                        }
+                        *depth += span.delta;
+                        continue;
                     }
-                    i=0;
-                    break;
+                    found = subtree_bracket_forward(buffers, child, child_start, first, last, pair, depth, target);
                 }
-                //line_index -= rep(n->lineFeeds[i]);
-                //*offset = *offset + (n->offsets[i]);
-                
-            }
-            if(i==n->childCount){
-                i--;
-                line_index -= rep(n->lineFeeds[i-1]);
-                *offset = *offset + (n->offsets[i-1]);
-
-                n = children[i];
+                if (found != CharOffset::Sentinel)
+                    return found;
             }
+            return CharOffset::Sentinel;
         }
-        StorageTree::LeafNodePtr ln = to_leaf_node(n);
 
-        NodeData* children = (&ln->children[0]);
-        int i;
-        for(i = 0; i < n->childCount;i++)
+        // As above, but for the last byte before which the depth is at most 'target', with '*depth' given at 'last'.
+        CharOffset subtree_bracket_backward(const BufferCollection* buffers, StorageTree::NodePtr node, uint64_t start, uint64_t first, uint64_t last, uint64_t pair, int64_t* depth, int64_t target)
         {
-            if(line_index <= rep(children[i].piece.newline_count))
+            for (auto i = node->childCount; i-- > 0;)
             {
-                break;
+                auto child_start = start + (i == 0 ? 0 : rep(node->offsets[i - 1]));
+                auto child_end = start + rep(node->offsets[i]);
+                if (last <= child_start)
+                    continue;
+                if (child_end <= first)
+                    break;
+                CharOffset found;
+                if (node->isLeaf())
+                {
+                    found = piece_bracket_backward(buffers, to_leaf_node(node)->children[i].piece, child_start, first, last, pair, depth, target);
+                }
+                else
+                {
+                    StorageTree::NodePtr child = to_internal_node(node)->children[i];
+                    const BracketDepth& span = child->subTreeSummary().depths[pair];
+                    if (first <= child_start and child_end <= last and *depth - span.delta + span.min > target)
+                    {
+                        *depth -= span.delta;
+                        continue;
+                    }
+                    found = subtree_bracket_backward(buffers, child, child_start, first, last, pair, depth, target);
+                }
+                if (found != CharOffset::Sentinel)
+                    return found;
             }
-            line_index -= rep(children[i].piece.newline_count);
-            *offset = *offset + children[i].piece.length;
-        }
-        if(i==n->childCount){
-            return;
-        }
-
-        Piece piece = children[i].piece;
-        Piece prevPiece;
-        if(i>0)
-        {
-            prevPiece = children[i-1].piece;
+            return CharOffset::Sentinel;
         }
-        else
-        {
-            if(prevNode != nullptr)
-            {
-                
-                StorageTree::LeafNodePtr pln = to_leaf_node(prevNode);
 
-                NodeData* prevChildren = (&pln->children[0]);
-                prevPiece = prevChildren[prevNode->childCount-1].piece;
-            }
-        }
-        Length len  {0};
-        if (line_index != 0)
+        // The first byte at or after 'first' which closes an opening bracket of 'pair' found before 'first', skipping
+        // the 'ignored' ranges.
+        CharOffset bracket_closing(const BufferCollection* buffers, const StorageTree& root, uint64_t total, uint64_t first, uint64_t pair, const CharRange* ignored, uint64_t ignored_count)
         {
-            len = len + accumulate_value_no_lf(buffers, piece, Line{ line_index - 1 });
-            if(len == Length{})
+            int64_t depth = 0;
+            uint64_t i = 0;
+            while (first < total)
             {
-                if(prevPiece.length != Length{})
-                    assert(false);
+                while (i < ignored_count and rep(ignored[i].last) <= first)
+                {
+                    ++i;
+                }
+                if (i < ignored_count and rep(ignored[i].first) <= first)
+                {
+                    first = rep(ignored[i].last);
+                    continue;
+                }
+                auto last = i < ignored_count and rep(ignored[i].first) < total ? rep(ignored[i].first) : total;
+                auto found = subtree_bracket_forward(buffers, root.root_ptr(), 0, first, last, pair, &depth, -1);
+                if (found != CharOffset::Sentinel)
+                    return found;
+                first = last;
             }
-            else
+            return CharOffset::Sentinel;
+        }
+
+        // The last byte before 'last' which opens a bracket of 'pair' left unclosed at 'last', skipping the 'ignored'
+        // ranges.
+        CharOffset bracket_opening(const BufferCollection* buffers, const StorageTree& root, uint64_t total, uint64_t last, uint64_t pair, const CharRange* ignored, uint64_t ignored_count)
+        {
+            int64_t depth = 0;
+            uint64_t i = ignored_count;
+            while (last > 0)
             {
-                auto* charbuffer = buffers->buffer_at(piece.index);
-                auto buf_offset = buffers->buffer_offset(piece.index, piece.first)+len;
-                const char* p = charbuffer->buffer.str + rep(buf_offset);
-                if(*p == '\n')
+                while (i > 0 and rep(ignored[i - 1].first) >= last)
                 {
-                    p--;
-                    
-                    if(*p == '\r')
-                    {
-                        p--;
-                        len = retract(len);
-                    }
+                    --i;
                 }
+                if (i > 0 and rep(ignored[i - 1].last) >= last)
+                {
+                    last = rep(ignored[i - 1].first);
+                    continue;
+                }
+                auto first = i > 0 ? rep(ignored[i - 1].last) : 0;
+                auto found = subtree_bracket_backward(buffers, root.root_ptr(), 0, first, last, pair, &depth, -1);
+                if (found != CharOffset::Sentinel)
+                    return found;
+                last = first;
             }
+            return CharOffset::Sentinel;
         }
-        *offset = *offset + len;
-    }
+    } // namespace [anon]
 
-    LineRange Tree::get_line_range(Line line) const
-    {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_start<&Tree::accumulate_value_no_lf>(&range.last, &buffers, root, extend(line));
-        return range;
-    }
-    LineRange Tree::get_line_range_crlf(Line line) const
+    CharOffset Tree::match_bracket(CharOffset offset, const CharRange* ignored, uint64_t ignored_count) const
     {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_end_crlf(&range.last, &buffers, (root.root_ptr()), extend(line));
-        return range;
+        settle_typing();
+        return match_bracket(&buffers, meta, root, offset, ignored, ignored_count);
     }
 
-    LineRange Tree::get_line_range_with_newline(Line line) const
-    {
-        LineRange range{ };
-        line_start<&Tree::accumulate_value>(&range.first, &buffers, root, line);
-        line_start<&Tree::accumulate_value>(&range.last, &buffers, root, extend(line));
-        return range;
-    }
-    OwningSnapshot* Tree::owning_snap(Arena::Arena* arena) const
+    CharOffset Tree::enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count) const
     {
-        uint8_t* blob = Arena::push_array_aligned<uint8_t>(arena, sizeof(OwningSnapshot), Arena::Alignment{ alignof(OwningSnapshot) });
-        OwningSnapshot* snap = new (blob) OwningSnapshot{ arena, this };
-        return snap;
+        settle_typing();
+        return enclosing_bracket(&buffers, meta, root, offset, pair, ignored, ignored_count);
     }
-    ReferenceSnapshot Tree::ref_snap() const
+
+    CharOffset Tree::match_bracket(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, const CharRange* ignored, uint64_t ignored_count)
     {
-        return ReferenceSnapshot{ this };
+        auto total = rep(meta.total_content_length);
+        if (rep(offset) >= total)
+            return CharOffset::Sentinel;
+        for EachIndex(i, ignored_count)
+        {
+            if (rep(offset) < rep(ignored[i].first))
+                break;
+            if (rep(offset) < rep(ignored[i].last))
+                return CharOffset::Sentinel;
+        }
+        auto position = node_at(buffers, root, offset);
+        char c = buffers->buffer_at(position.node->piece.index)->buffer.str[rep(buffers->buffer_offset(position.node->piece.index, position.node->piece.first)) + rep(position.remainder)];
+        const BracketPairs& pairs = buffers->bracket_pairs;
+        for EachIndex(pair, pairs.count)
+        {
+            if (c == pairs.pairs[pair].open)
+                return bracket_closing(buffers, root, total, rep(offset) + 1, pair, ignored, ignored_count);
+            if (c == pairs.pairs[pair].close)
+                return bracket_opening(buffers, root, total, rep(offset), pair, ignored, ignored_count);
+        }
+        return CharOffset::Sentinel;
     }
-    
-    char Tree::at(CharOffset offset) const
+
+    CharOffset Tree::enclosing_bracket(const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count)
     {
-        auto result = node_at(&buffers, root, offset);
-        if (result.node == nullptr)
-            return '\0';
-        auto* buffer = buffers.buffer_at(result.node->piece.index);
-        auto buf_offset = buffers.buffer_offset(result.node->piece.index, result.node->piece.first);
-        const char* p = buffer->buffer.str + rep(buf_offset) + rep(result.remainder);
-        return *p;
+        if (pair >= buffers->bracket_pairs.count)
+            return CharOffset::Sentinel;
+        auto total = rep(meta.total_content_length);
+        return bracket_opening(buffers, root, total, rep(offset) < total ? rep(offset) : total, pair, ignored, ignored_count);
     }
-    
+#endif // FRED_BRACKET_SUMMARY
+
     Line Tree::line_at(CharOffset offset) const
     {
+        settle_typing();
         if (is_empty())
             return Line::Beginning;
         auto result = node_at(&buffers, root, offset);
         return result.line;
     }
 
+    Line Tree::edit_line(CharOffset offset, bool* starts_line) const
+    {
+        *starts_line = true;
+        if (offset == CharOffset{ })
+            return Line::Beginning;
+        auto result = node_at(&buffers, root, retract(offset));
+        const Piece& piece = result.node->piece;
+        auto buf_offset = buffers.buffer_offset(piece.index, piece.first);
+        *starts_line = buffers.buffer_at(piece.index)->buffer.str[rep(buf_offset) + rep(result.remainder)] == '\n';
+        return *starts_line ? extend(result.line) : result.line;
+    }
+
     LFCount Tree::line_feed_count(const BufferCollection* buffers, BufferIndex index, const BufferCursor& start, const BufferCursor& end)
     {
         // If the end position is the beginning of a new line, then we can just return the difference in lines.
@@ -1738,6 +4352,7 @@ namespace RatchetPieceTree
 
     String8 Tree::get_line_content(Arena::Arena* arena, Line line) const
     {
+        settle_typing();
         
         // Reset the buffer.
         
@@ -1752,17 +4367,45 @@ namespace RatchetPieceTree
     // Direct history manipulation.
     void Tree::commit_head(CharOffset offset)
     {
+        flush_typing();
         append_undo(root, offset);
     }
 
     StorageTree Tree::head() const
     {
+        settle_typing();
+        // Only roots with text are remembered, so the list holds no empty roots.
+        if (not root.is_empty())
+        {
+            push_head(buffers.undo_redo_stack_arena, buffers.heads, root);
+        }
         return root.dup();
     }
+
     void Tree::snap_to(const StorageTree& new_root)
     {
-        root = new_root.dup();
+        flush_typing();
+        HeadEntry* head = nullptr;
+        for EachNode(entry, buffers.heads->first)
+        {
+            if (entry->given.root_ptr() == new_root.root_ptr())
+            {
+                head = entry;
+                break;
+            }
+        }
+        root = head != nullptr ? head->current.dup() : new_root.dup();
+#if FRED_WRAP_SUMMARY
+        refresh_wrap_summaries();
+        if (head != nullptr)
+        {
+            // Keep the head summarized for the current width, so snapping back to it again does not redo the work.
+            head->current = root.dup();
+        }
+#endif // FRED_WRAP_SUMMARY
         compute_buffer_meta();
+        // A root from elsewhere may be shorter than the folds.
+        drop_folds_past(&folds, Line{ rep(meta.lf_count) + 1 });
     }
 
     String8 Tree::assemble_line(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& node, Line line) 
@@ -1836,6 +4479,15 @@ namespace RatchetPieceTree
         grow_mut_buf(&buffers, txt.size);
         char* insert_at = buffers.mod_buffer.buffer.str + old_size;
         memcpy(insert_at, txt.str, txt.size);
+#if FRED_CODE_POINT_INDEX
+        extend_code_point_index(buffers.immutable_buf_arena, &buffers.mod_buffer.code_points, buffers.mod_buffer.buffer);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_BRACKET_SUMMARY
+        extend_bracket_index(buffers.immutable_buf_arena, buffers.bracket_pairs, &buffers.mod_buffer.brackets, buffers.mod_buffer.buffer);
+#endif // FRED_BRACKET_SUMMARY
+#if FRED_WRAP_SUMMARY
+        extend_mod_wrap_rows(buffers.immutable_buf_arena, buffers.wrap, &buffers.mod_buffer);
+#endif // FRED_WRAP_SUMMARY
         Arena::scratch_end(scratch);
 
         // Build the new piece for the inserted buffer.
@@ -1848,11 +4500,40 @@ namespace RatchetPieceTree
                         .last = end_pos,
                         .length = Length{ end_offset - start_offset },
                         .newline_count = line_feed_count(&buffers, BufferIndex::ModBuf, start, end_pos) };
+        piece.summary = TreeSummary::of(&buffers, piece);
         // Update the last insertion.
         last_insert = end_pos;
         return piece;
     }
 
+    Piece Tree::adopted_piece(String8 txt)
+    {
+        auto index = adopt_buffer(txt);
+        const CharBuffer* buffer = buffers.buffer_at(index);
+        auto last_line = Line{ buffer->line_starts.count - 1 };
+        Piece piece = { .index = index,
+                        .first = { },
+                        .last = { .line = last_line, .column = Column{ txt.size - rep(buffer->line_starts.starts[rep(last_line)]) } },
+                        .length = Length{ txt.size },
+                        .newline_count = LFCount{ rep(last_line) } };
+        piece.summary = TreeSummary::of(&buffers, piece);
+        return piece;
+    }
+
+    void Tree::combine_pieces(NodePosition existing, Piece new_piece)
+    {
+        // This transformation is only valid under the following conditions.
+        assert(existing.node->piece.index == BufferIndex::ModBuf);
+        // This assumes that the piece was just built.
+        assert(existing.node->piece.last == new_piece.first);
+        auto old_piece = existing.node->piece;
+        new_piece.first = old_piece.first;
+        new_piece.newline_count = LFCount{ rep(new_piece.newline_count) + rep(old_piece.newline_count) };
+        new_piece.summary = TreeSummary::combine(old_piece.summary, new_piece.summary);
+        new_piece.length = new_piece.length + old_piece.length;
+        root = root.replace(&buffers, { new_piece }, existing.start_offset);
+    }
+
     NodePosition Tree::node_at(const BufferCollection* buffers, const StorageTree &tree, CharOffset off)
     {
         if (tree.is_empty())
@@ -1866,13 +4547,15 @@ namespace RatchetPieceTree
             return result;
         }
         
+        prefetch_node(node);
         while(!node->isLeaf())
         {
             StorageTree::InternalNodePtr in = to_internal_node(node);
             StorageTree::NodeVector children = (&in->children[0]);
             size_t i = 0;
             size_t childCount = in->childCount;
-            auto it = branchless_lower_bound(in->offsets.begin(), in->offsets.begin()+childCount, distance(Offset{node_start_offset}, off));
+            // The child containing 'off' is the first whose end offset is strictly greater than it.
+            auto it = branchless_lower_bound(in->offsets.begin(), in->offsets.begin()+childCount, distance(Offset{node_start_offset}, off) + Length{ 1 });
             //if(it != in->offsets.begin()) it--;
             for(; i<childCount; i++)
             {
@@ -1906,11 +4589,12 @@ namespace RatchetPieceTree
                 }
                 node = children[childCount-1];
             }
+            prefetch_node(node);
         }
         StorageTree::LeafNodePtr ln = to_leaf_node(node);
             
         auto& children = (ln->children);
-        auto it = branchless_lower_bound(ln->offsets.begin(), ln->offsets.begin()+ln->childCount, distance(Offset{node_start_offset}, off));
+        auto it = branchless_lower_bound(ln->offsets.begin(), ln->offsets.begin()+ln->childCount, distance(Offset{node_start_offset}, off) + Length{ 1 });
         if(it == ln->offsets.begin()+ln->childCount) it--;
         //if(it != ln->offsets.begin()) it--;
         int i = 0;
@@ -1960,6 +4644,245 @@ namespace RatchetPieceTree
                     .line = Line{ extend(newline_count) } };
         return result;
     }
+    namespace
+    {
+        size_t count_pieces(StorageTree::NodePtr node)
+        {
+            if (node->isLeaf())
+                return node->childCount;
+            size_t count = 0;
+            auto internal = to_internal_node(node);
+            for (size_t i = 0; i < internal->childCount; ++i)
+            {
+                count += count_pieces(internal->children[i]);
+            }
+            return count;
+        }
+
+#if FRED_WRAP_SUMMARY
+        // Appends the pieces of 'node' to 'pieces' in order, with their rows wrapped at the current width.  The other
+        // summaries do not depend on the width and are kept.
+        void resummarize_pieces(const BufferCollection* buffers, StorageTree::NodePtr node, NodeData* pieces, size_t* count)
+        {
+            if (node->isLeaf())
+            {
+                auto leaf = to_leaf_node(node);
+                for (size_t i = 0; i < leaf->childCount; ++i)
+                {
+                    Piece piece = leaf->children[i].piece;
+                    static_cast<WrapSummary&>(piece.summary) = WrapSummary::of(buffers, piece);
+                    pieces[(*count)++] = { piece };
+                }
+                return;
+            }
+            auto internal = to_internal_node(node);
+            for (size_t i = 0; i < internal->childCount; ++i)
+            {
+                resummarize_pieces(buffers, internal->children[i], pieces, count);
+            }
+        }
+#endif // FRED_WRAP_SUMMARY
+
+        // Appends the pieces of 'node' to 'pieces' in order.
+        void collect_pieces(StorageTree::NodePtr node, NodeData* pieces, size_t* count)
+        {
+            if (node->isLeaf())
+            {
+                auto leaf = to_leaf_node(node);
+                for (size_t i = 0; i < leaf->childCount; ++i)
+                {
+                    pieces[(*count)++] = { leaf->children[i].piece };
+                }
+                return;
+            }
+            auto internal = to_internal_node(node);
+            for (size_t i = 0; i < internal->childCount; ++i)
+            {
+                collect_pieces(internal->children[i], pieces, count);
+            }
+        }
+
+        // Joins the neighbouring pieces which follow each other in the same buffer, in place, and returns the count left.
+        size_t join_contiguous_pieces(NodeData* pieces, size_t count)
+        {
+            size_t joined = 0;
+            for (size_t i = 0; i < count; ++i)
+            {
+                Piece piece = pieces[i].piece;
+                Piece* prev = joined == 0 ? nullptr : &pieces[joined - 1].piece;
+                if (prev != nullptr and prev->index == piece.index and prev->last == piece.first)
+                {
+                    prev->last = piece.last;
+                    prev->length = prev->length + piece.length;
+                    prev->newline_count = LFCount{ rep(prev->newline_count) + rep(piece.newline_count) };
+                    prev->summary = TreeSummary::combine(prev->summary, piece.summary);
+                    continue;
+                }
+                pieces[joined++] = { piece };
+            }
+            return joined;
+        }
+
+        // The end of the run of pieces shorter than 'below' starting at 'first'.
+        size_t small_run_end(const NodeData* pieces, size_t count, size_t first, Length below)
+        {
+            size_t last = first;
+            while (last < count and pieces[last].piece.length < below)
+            {
+                ++last;
+            }
+            return last;
+        }
+    } // namespace [anon]
+
+    size_t Tree::piece_count() const
+    {
+        settle_typing();
+        if (root.is_empty())
+            return 0;
+        return count_pieces(root.root_ptr());
+    }
+
+#if FRED_WRAP_SUMMARY
+    void Tree::refresh_summaries()
+    {
+        Arena::Temp scratch = Arena::scratch_begin({&buffers.immutable_buf_arena, 1});
+        NodeData* pieces = Arena::push_array<NodeData>(scratch.arena, count_pieces(root.root_ptr()));
+        size_t count = 0;
+        resummarize_pieces(&buffers, root.root_ptr(), pieces, &count);
+        root = root.construct_from(buffers.rb_tree_blk, pieces, count);
+        Arena::scratch_end(scratch);
+    }
+
+    void Tree::refresh_wrap_summaries()
+    {
+        // A root summarized for another wrap width is summarized again once it becomes the current one.
+        if (buffers.wrap != nullptr and not root.is_empty() and root.summary().width != buffers.wrap->width)
+        {
+            refresh_summaries();
+        }
+    }
+#endif // FRED_WRAP_SUMMARY
+
+    BufferIndex Tree::adopt_buffer(String8 txt)
+    {
+        Arena::Arena* arena = buffers.immutable_buf_arena;
+        LineStarts starts{};
+        populate_line_starts(arena, &starts, txt);
+        CharBuffer buffer{ .buffer = txt, .line_starts = starts, .line_start_samples = sample_line_starts(arena, starts) };
+#if FRED_CODE_POINT_INDEX
+        extend_code_point_index(arena, &buffer.code_points, txt);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_LINE_EXTENT_SUMMARY
+        buffer.line_lengths = build_line_length_index(arena, &buffer);
+#endif // FRED_LINE_EXTENT_SUMMARY
+#if FRED_BRACKET_SUMMARY
+        buffer.brackets = build_bracket_index(arena, buffers.bracket_pairs, txt);
+#endif // FRED_BRACKET_SUMMARY
+        auto count = buffers.orig_buffers.count;
+        if (count == buffers.orig_buffers.capacity)
+        {
+            // The previous array is left intact since snapshots may still refer to it.
+            auto capacity = count * 2 < 8 ? 8 : count * 2;
+            CharBuffer* buffers_arr = Arena::push_array_no_zero<CharBuffer>(arena, capacity);
+            if (count != 0)
+            {
+                memcpy(buffers_arr, buffers.orig_buffers.buffers, count * sizeof(CharBuffer));
+            }
+            buffers.orig_buffers.buffers = buffers_arr;
+            buffers.orig_buffers.capacity = capacity;
+        }
+        buffers.orig_buffers.buffers[count] = buffer;
+        buffers.orig_buffers.count = count + 1;
+#if FRED_WRAP_SUMMARY
+        if (buffers.wrap != nullptr)
+        {
+            extend_wrap_rows(arena, buffers.wrap, &buffers);
+        }
+#endif // FRED_WRAP_SUMMARY
+        return BufferIndex{ count };
+    }
+
+    DefragmentReport Tree::defragment(DefragmentPolicy policy)
+    {
+        flush_typing();
+        DefragmentReport report{ .pieces_before = root.is_empty() ? 0 : count_pieces(root.root_ptr()) };
+        auto scratch = Arena::scratch_begin({ &buffers.immutable_buf_arena, 1 });
+        NodeData* pieces = Arena::push_array<NodeData>(scratch.arena, report.pieces_before);
+        size_t count = 0;
+        if (not root.is_empty())
+        {
+            collect_pieces(root.root_ptr(), pieces, &count);
+        }
+        count = join_contiguous_pieces(pieces, count);
+
+        // Every run of small pieces becomes one piece of a new buffer holding all of the runs.
+        uint64_t total = 0;
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t end = small_run_end(pieces, count, i, policy.copy_below);
+            for (size_t k = i; end - i > 1 and k < end; ++k)
+            {
+                total += rep(pieces[k].piece.length);
+            }
+            i = end > i ? end - 1 : i;
+        }
+        if (total != 0)
+        {
+            char* text = Arena::push_array_no_zero<char>(buffers.immutable_buf_arena, total);
+            auto index = BufferIndex{ buffers.orig_buffers.count };
+            uint64_t size = 0;
+            uint64_t line = 0;
+            uint64_t line_start = 0;
+            size_t kept = 0;
+            for (size_t i = 0; i < count;)
+            {
+                size_t end = small_run_end(pieces, count, i, policy.copy_below);
+                if (end - i < 2)
+                {
+                    pieces[kept++] = pieces[i++];
+                    continue;
+                }
+                Piece run{ .index = index, .first = { .line = Line{ line }, .column = Column{ size - line_start } } };
+                for (; i < end; ++i)
+                {
+                    const Piece& piece = pieces[i].piece;
+                    const char* first = buffers.buffer_at(piece.index)->buffer.str + rep(buffers.buffer_offset(piece.index, piece.first));
+                    memcpy(text + size, first, rep(piece.length));
+                    for EachIndex(c, rep(piece.length))
+                    {
+                        if (first[c] == '\n')
+                        {
+                            ++line;
+                            line_start = size + c + 1;
+                        }
+                    }
+                    size += rep(piece.length);
+                    run.length = run.length + piece.length;
+                    run.newline_count = LFCount{ rep(run.newline_count) + rep(piece.newline_count) };
+                }
+                run.last = { .line = Line{ line }, .column = Column{ size - line_start } };
+                pieces[kept++] = { run };
+            }
+            count = kept;
+            [[maybe_unused]] auto adopted = adopt_buffer(String8{ .str = text, .size = total });
+            assert(adopted == index);
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (pieces[i].piece.index == index)
+                {
+                    pieces[i].piece.summary = TreeSummary::of(&buffers, pieces[i].piece);
+                }
+            }
+            report.copied = Length{ total };
+        }
+
+        root = root.construct_from(buffers.rb_tree_blk, pieces, count);
+        Arena::scratch_end(scratch);
+        report.pieces_after = count;
+        return report;
+    }
+
     void Tree::compute_buffer_meta()
     {
         ::RatchetPieceTree::compute_buffer_meta(&meta, root);
@@ -1968,7 +4891,7 @@ namespace RatchetPieceTree
 
     namespace
     {
-        void push_ur_node(Arena::Arena* arena, UndoRedoEntry** free_list, UndoRedoList* lst, const StorageTree& root, CharOffset op_offset)
+        void push_ur_node(Arena::Arena* arena, UndoRedoEntry** free_list, UndoRedoList* lst, const StorageTree& root, CharOffset op_offset, const FoldSnapshot* folds)
         {
             UndoRedoEntry* entry = nullptr;
             if (*free_list != nullptr)
@@ -1985,6 +4908,7 @@ namespace RatchetPieceTree
             zero_bytes(entry);
             entry->root = root.dup();
             entry->op_offset = op_offset;
+            entry->folds = folds;
             SLLQueuePushFront(lst->first, lst->last, entry);
             ++lst->count;
         }
@@ -2013,56 +4937,92 @@ namespace RatchetPieceTree
                 SLLStackPush(free_undo_list, e);
             } while (redo_stack.first != nullptr);
         }
-        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, old_root, op_offset);
+        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, old_root, op_offset, save_folds(buffers.undo_redo_stack_arena, &folds));
     }
 
     UndoRedoResult Tree::try_undo(CharOffset op_offset)
     {
+        flush_typing();
         if (undo_stack.count == 0)
             return { .success = false, .op_offset = CharOffset{ } };
-        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &redo_stack, root, op_offset);
-        auto [nx, node, undo_offset] = static_cast<UndoRedoEntry&&>(*undo_stack.first);
+        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &redo_stack, root, op_offset, save_folds(buffers.undo_redo_stack_arena, &folds));
+        auto [nx, node, undo_offset, undo_folds] = static_cast<UndoRedoEntry&&>(*undo_stack.first);
         root = node.dup();
+        restore_folds(&folds, undo_folds);
         UndoRedoEntry* e = pop_ur_node(&undo_stack);
         SLLStackPush(free_undo_list, e);
+#if FRED_WRAP_SUMMARY
+        refresh_wrap_summaries();
+#endif // FRED_WRAP_SUMMARY
         compute_buffer_meta();
         return { .success = true, .op_offset = undo_offset };
     }
 
     UndoRedoResult Tree::try_redo(CharOffset op_offset)
     {
+        flush_typing();
         if (redo_stack.count == 0)
             return { .success = false, .op_offset = CharOffset{ } };
-        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, root, op_offset);
-        auto [nx, node, redo_offset] = static_cast<UndoRedoEntry&&>(*redo_stack.first);
+        push_ur_node(buffers.undo_redo_stack_arena, &free_undo_list, &undo_stack, root, op_offset, save_folds(buffers.undo_redo_stack_arena, &folds));
+        auto [nx, node, redo_offset, redo_folds] = static_cast<UndoRedoEntry&&>(*redo_stack.first);
         root = node.dup();
+        restore_folds(&folds, redo_folds);
         UndoRedoEntry* e = pop_ur_node(&redo_stack);
         SLLStackPush(free_undo_list, e);
+#if FRED_WRAP_SUMMARY
+        refresh_wrap_summaries();
+#endif // FRED_WRAP_SUMMARY
         compute_buffer_meta();
         return { .success = true, .op_offset = redo_offset };
     }
 
-    void Tree::internal_insert(CharOffset offset, String8 txt)
+    void Tree::internal_insert(CharOffset offset, String8 txt, AdoptBuffer adopt)
     {
         assert(txt.size>0);
         ScopeGuard guard{ [&] {
+            // The folds move by the line feeds the edit adds, counted against 'meta' before it is updated.  The text
+            // before 'offset' is unchanged, so its line is found in the new tree.
+            if (folds.count != 0 and rep(root.lf_count()) != rep(meta.lf_count))
+            {
+                bool line_moves = false;
+                auto fold_line = edit_line(offset, &line_moves);
+                edit_folds(&folds, fold_line, 0, rep(root.lf_count()) - rep(meta.lf_count), line_moves);
+            }
             compute_buffer_meta();
 #ifdef TEXTBUF_DEBUG
             satisfies_btree_invariant(root);
 #endif
         } };
+        // Only an insertion where the last one ended can extend the piece it made.
+        auto continues = offset == end_last_insert;
         end_last_insert = extend(offset, txt.size);
+        // Adopted text is a buffer of its own, so it never extends the piece typed last.
+        auto make_piece = [&] { return is_yes(adopt) ? adopted_piece(txt) : build_piece(txt); };
 
         
         if (root.is_empty())
         {
-            auto piece = build_piece(txt);
+            auto piece = make_piece();
             root = root.insert(&buffers, { piece }, CharOffset{ 0 });
             
         }
         else
         {
-            auto piece = build_piece(txt);
+            // Typing: text inserted right after the piece ending at the last insertion is appended to the mod buffer
+            // directly behind it, so that piece is extended in place and only its path is copied.
+            if (continues and is_no(adopt) and offset != CharOffset{ })
+            {
+                auto prev = node_at(&buffers, root, retract(offset));
+                if (prev.node->piece.index == BufferIndex::ModBuf
+                    and prev.node->piece.last == last_insert
+                    and prev.start_offset + prev.node->piece.length == offset)
+                {
+                    auto new_piece = make_piece();
+                    combine_pieces(prev, new_piece);
+                    return;
+                }
+            }
+            auto piece = make_piece();
             root = root.insert(&buffers, { piece }, offset);
         }
         //FIXME (ratchetfreak): release tree
@@ -2072,6 +5032,14 @@ namespace RatchetPieceTree
     {
         assert(rep(count) != 0 and not root.is_empty());
         ScopeGuard guard{ [&] {
+            // The folds move by the line feeds the edit removes, counted against 'meta' before it is updated.  The
+            // text before 'offset' is unchanged, so its line is found in the new tree.
+            if (folds.count != 0 and rep(root.lf_count()) != rep(meta.lf_count))
+            {
+                bool starts_line = false;
+                auto fold_line = edit_line(offset, &starts_line);
+                edit_folds(&folds, fold_line, rep(meta.lf_count) - rep(root.lf_count()), 0, false);
+            }
             compute_buffer_meta();
 #ifdef TEXTBUF_DEBUG
             satisfies_btree_invariant(root);
@@ -2083,6 +5051,83 @@ namespace RatchetPieceTree
         //FIXME (ratchetfreak): release tree
     }
 
+    bool Tree::internal_replace(CharOffset offset, Length length, String8 txt, AdoptBuffer adopt)
+    {
+        auto [node, remainder, node_start_offset, line] = node_at(&buffers, root, offset);
+        if (node == nullptr or node_start_offset + node->piece.length < offset + length)
+            return false;
+        // The text before and after the range stay as pieces of their own around the new one.
+        Piece piece = node->piece;
+        NodeData pieces[3];
+        size_t count = 0;
+        if (remainder != Length{ })
+        {
+            pieces[count++] = { ::RatchetPieceTree::trim_piece_right(&buffers, piece, buffer_position(&buffers, piece, remainder)) };
+        }
+        size_t mid = count;
+        pieces[count++] = { is_yes(adopt) ? adopted_piece(txt) : build_piece(txt) };
+        if (remainder + length != piece.length)
+        {
+            pieces[count++] = { ::RatchetPieceTree::trim_piece_left(&buffers, piece, buffer_position(&buffers, piece, remainder + length)) };
+        }
+        end_last_insert = extend(offset, txt.size);
+        auto spliced = root.splice(&buffers, pieces, count, node_start_offset);
+        if (spliced.is_empty())
+        {
+            // The leaf is full: the text it holds goes and the new piece is inserted, splitting the leaf.
+            root = root.remove(&buffers, offset, length);
+            root = root.insert(&buffers, pieces[mid], offset);
+        }
+        else
+        {
+            root = static_cast<StorageTree&&>(spliced);
+        }
+#ifdef TEXTBUF_DEBUG
+        satisfies_btree_invariant(root);
+#endif
+        compute_buffer_meta();
+        return true;
+    }
+
+    void Tree::internal_move(CharOffset from, Length count, CharOffset to)
+    {
+        // The text is cut at the three offsets and the two spans between the first and the last trade places.
+        auto end = from + count;
+        auto backward = rep(to) < rep(from);
+        auto first = backward ? to : from;
+        auto second = backward ? from : end;
+        auto third = backward ? end : to;
+        StorageTree rest;
+        StorageTree tail;
+        root.split(&buffers, third, &rest, &tail);
+        StorageTree front;
+        StorageTree second_span;
+        rest.split(&buffers, second, &front, &second_span);
+        StorageTree head;
+        StorageTree first_span;
+        front.split(&buffers, first, &head, &first_span);
+        auto moved_lf = rep((backward ? second_span : first_span).lf_count());
+        if (folds.count != 0 and moved_lf != 0)
+        {
+            // The folds take the move as the removal of the text followed by its insertion at 'to', with the lines of
+            // both offsets found before the tree changes.
+            bool from_moves = false;
+            bool to_moves = false;
+            auto from_line = edit_line(from, &from_moves);
+            auto to_line = edit_line(to, &to_moves);
+            edit_folds(&folds, from_line, moved_lf, 0, false);
+            // 'to' moved up by the lines of the text when it lay after it.
+            edit_folds(&folds, backward ? to_line : Line{ rep(to_line) - moved_lf }, 0, moved_lf, to_moves);
+        }
+        auto* blk = buffers.rb_tree_blk;
+        root = StorageTree::concat(blk, StorageTree::concat(blk, StorageTree::concat(blk, head, second_span), first_span), tail);
+        end_last_insert = CharOffset::Sentinel;
+        compute_buffer_meta();
+#ifdef TEXTBUF_DEBUG
+        satisfies_btree_invariant(root);
+#endif
+    }
+
     // Fetches the length of the piece starting from the first line to 'index' or to the end of
     // the piece.
     Length Tree::accumulate_value_no_lf(const BufferCollection* buffers, const Piece& piece, Line index)
@@ -2118,7 +5163,7 @@ namespace RatchetPieceTree
         auto line_index = rep(retract(line));
 
         StorageTree::NodePtr n = node.root_ptr();
-        
+        prefetch_node(n);
         while(!n->isLeaf())
         {
             StorageTree::InternalNodePtr in = to_internal_node(n);
@@ -2148,6 +5193,7 @@ namespace RatchetPieceTree
 
                 n = children[i];
             }
+            prefetch_node(n);
         }
         StorageTree::LeafNodePtr ln = to_leaf_node(n);
             
@@ -2202,7 +5248,17 @@ namespace RatchetPieceTree
             String8 persisted_txt = str8_copy(builder->immutable_buf_arena, txt);
             LineStarts starts{};
             populate_line_starts(builder->immutable_buf_arena, &starts, txt);
-            node->buffer = CharBuffer{ .buffer = persisted_txt, .line_starts = starts };
+            LineStarts samples = sample_line_starts(builder->immutable_buf_arena, starts);
+            node->buffer = CharBuffer{ .buffer = persisted_txt, .line_starts = starts, .line_start_samples = samples };
+#if FRED_CODE_POINT_INDEX
+            extend_code_point_index(builder->immutable_buf_arena, &node->buffer.code_points, persisted_txt);
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_LINE_EXTENT_SUMMARY
+            node->buffer.line_lengths = build_line_length_index(builder->immutable_buf_arena, &node->buffer);
+#endif // FRED_LINE_EXTENT_SUMMARY
+#if FRED_BRACKET_SUMMARY
+            node->buffer.brackets = build_bracket_index(builder->immutable_buf_arena, builder->bracket_pairs, persisted_txt);
+#endif // FRED_BRACKET_SUMMARY
             SLLQueuePush(builder->buffers.first, builder->buffers.last, node);
             ++builder->buffers.count;
         }
@@ -2221,6 +5277,9 @@ namespace RatchetPieceTree
             .mut_buf_starts_arena = buffer_arenas[2],
             .mut_buf_arena = buffer_arenas[3],
             .buffers = {},
+#if FRED_BRACKET_SUMMARY
+            .bracket_pairs = default_bracket_pairs,
+#endif // FRED_BRACKET_SUMMARY
         };
         return result;
     }
@@ -2242,6 +5301,7 @@ namespace RatchetPieceTree
         }
         immut_buffers.buffers = buffers_arr;
         immut_buffers.count = builder->buffers.count;
+        immut_buffers.capacity = builder->buffers.count;
         // Allocate the atomic count.
         immut_buffers.ref_count = Arena::push_array<uint64_t>(builder->immutable_buf_arena, 1);
 
@@ -2259,7 +5319,12 @@ namespace RatchetPieceTree
             .orig_buffers = immut_buffers,
             .mod_buffer = {},
             .rb_tree_blk = rb_tree_blk,
+#if FRED_BRACKET_SUMMARY
+            .bracket_pairs = builder->bracket_pairs,
+#endif // FRED_BRACKET_SUMMARY
         };
+        buffers.mod_buffer_pins = Arena::push_array<uint64_t>(builder->immutable_buf_arena, 1);
+        buffers.heads = Arena::push_array<HeadList>(builder->immutable_buf_arena, 1);
         // Allocate the base of the mod buffer.
         // Note: Because we're wanting to build an endlessly growing array, we need to allocate the buffer ourselves and aligned
         // to 1 byte.
@@ -2285,6 +5350,9 @@ namespace RatchetPieceTree
             .mut_buf_starts_arena = buffer_arenas[2],
             .mut_buf_arena = buffer_arenas[3],
             .buffers = {},
+#if FRED_BRACKET_SUMMARY
+            .bracket_pairs = default_bracket_pairs,
+#endif // FRED_BRACKET_SUMMARY
         };
         return tree_builder_finish(&result);
     }
@@ -2299,7 +5367,7 @@ namespace RatchetPieceTree
 
 
     OwningSnapshot::OwningSnapshot(Arena::Arena* mut_buf_arena, const Tree* tree):
-        root{ tree->root.dup() },
+        root{ (tree->settle_typing(), tree->root.dup()) },
         meta{ tree->meta },
         buffers{ take_buffer_ref(&tree->buffers) } 
     {
@@ -2310,8 +5378,40 @@ namespace RatchetPieceTree
         starts.starts = Arena::push_array_no_zero<LineStart>(mut_buf_arena, starts.count);
         memcpy(starts.starts, buffers.mod_buffer.line_starts.starts, sizeof(LineStart) * starts.count);
         String8 buf = str8_copy(mut_buf_arena, buffers.mod_buffer.buffer);
+#if FRED_CODE_POINT_INDEX
+        CodePointIndex code_points{ };
+        code_points.count = buffers.mod_buffer.code_points.count;
+        code_points.capacity = code_points.count;
+#if FRED_CODE_POINT_SUMMARY
+        code_points.blocks = Arena::push_array_no_zero<CodePointCount>(mut_buf_arena, code_points.count);
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+        code_points.utf16_blocks = Arena::push_array_no_zero<Utf16Count>(mut_buf_arena, code_points.count);
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+        code_points.hash_blocks = Arena::push_array_no_zero<uint64_t>(mut_buf_arena, code_points.count);
+#endif // FRED_HASH_SUMMARY
+        if (code_points.count != 0)
+        {
+#if FRED_CODE_POINT_SUMMARY
+            memcpy(code_points.blocks, buffers.mod_buffer.code_points.blocks, sizeof(CodePointCount) * code_points.count);
+#endif // FRED_CODE_POINT_SUMMARY
+#if FRED_UTF16_SUMMARY
+            memcpy(code_points.utf16_blocks, buffers.mod_buffer.code_points.utf16_blocks, sizeof(Utf16Count) * code_points.count);
+#endif // FRED_UTF16_SUMMARY
+#if FRED_HASH_SUMMARY
+            memcpy(code_points.hash_blocks, buffers.mod_buffer.code_points.hash_blocks, sizeof(uint64_t) * code_points.count);
+#endif // FRED_HASH_SUMMARY
+        }
+#endif // FRED_CODE_POINT_INDEX
         buffers.mod_buffer.line_starts = starts;
         buffers.mod_buffer.buffer = buf;
+#if FRED_CODE_POINT_INDEX
+        buffers.mod_buffer.code_points = code_points;
+#endif // FRED_CODE_POINT_INDEX
+#if FRED_BRACKET_SUMMARY
+        buffers.mod_buffer.brackets = copy_bracket_index(mut_buf_arena, buffers.mod_buffer.brackets);
+#endif // FRED_BRACKET_SUMMARY
     }
 
     OwningSnapshot::OwningSnapshot(Arena::Arena* mut_buf_arena, const Tree* tree, const StorageTree& dt):
@@ -2323,15 +5423,83 @@ namespace RatchetPieceTree
     }
 
 
-    String8 OwningSnapshot::get_line_content(Arena::Arena* arena, Line line) const
+    String8 OwningSnapshot::get_line_content(Arena::Arena* arena, Line line) const
+    {
+        String8 result = str8_empty;
+        if (line == Line::IndexBeginning)
+            return result;
+        result = Tree::assemble_line(arena, &buffers, meta, root, line);
+        return result;
+    }
+    
+    String8 OwningSnapshot::get_range(Arena::Arena* arena, CharOffset offset, Length count) const
+    {
+        return Tree::get_range(arena, &buffers, meta, root, offset, count);
+    }
+
+    Length OwningSnapshot::copy_range(CharOffset offset, Length count, char* dst) const
+    {
+        return Tree::copy_range(&buffers, meta, root, offset, count, dst);
+    }
+
+#if FRED_CODE_POINT_SUMMARY
+    CodePointCount OwningSnapshot::offset_to_codepoint(CharOffset offset) const
+    {
+        return Tree::offset_to_codepoint(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::codepoint_to_offset(CodePointCount codepoint) const
+    {
+        return Tree::codepoint_to_offset(&buffers, meta, root, codepoint);
+    }
+
+    CodePointCount OwningSnapshot::codepoint_column(CharOffset offset) const
+    {
+        return Tree::codepoint_column(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::codepoint_column_offset(Line line, CodePointCount column) const
+    {
+        return Tree::codepoint_column_offset(&buffers, meta, root, line, column);
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Position OwningSnapshot::offset_to_utf16_position(CharOffset offset) const
+    {
+        return Tree::offset_to_utf16_position(&buffers, root, offset);
+    }
+
+    CharOffset OwningSnapshot::utf16_position_to_offset(Utf16Position position) const
+    {
+        return Tree::utf16_position_to_offset(&buffers, meta, root, position);
+    }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+    CharOffset OwningSnapshot::match_bracket(CharOffset offset, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::match_bracket(&buffers, meta, root, offset, ignored, ignored_count);
+    }
+
+    CharOffset OwningSnapshot::enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::enclosing_bracket(&buffers, meta, root, offset, pair, ignored, ignored_count);
+    }
+#endif // FRED_BRACKET_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    uint64_t OwningSnapshot::hash_range(CharOffset offset, Length count) const
+    {
+        return Tree::hash_range(&buffers, meta, root, offset, count);
+    }
+
+    uint64_t OwningSnapshot::hash_line(Line line) const
     {
-        String8 result = str8_empty;
-        if (line == Line::IndexBeginning)
-            return result;
-        result = Tree::assemble_line(arena, &buffers, meta, root, line);
-        return result;
+        return Tree::hash_line(&buffers, meta, root, line);
     }
-    
+#endif // FRED_HASH_SUMMARY
+
     Line OwningSnapshot::line_at(CharOffset offset) const
     {
         if (is_empty())
@@ -2363,6 +5531,16 @@ namespace RatchetPieceTree
         return range;
     }
 
+    String8 OwningSnapshot::get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice_content(arena, &buffers, meta, root, line, first_column, max_columns);
+    }
+
+    LineRange OwningSnapshot::get_line_range_slice(Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice(&buffers, root, line, first_column, max_columns);
+    }
+
     BufferCollection OwningSnapshot::buffer_collection_no_ref() const
     {
         return buffers;
@@ -2377,14 +5555,14 @@ namespace RatchetPieceTree
     }
 
     ReferenceSnapshot::ReferenceSnapshot(const Tree* tree):
-        root{ tree->root.dup() },
+        root{ (tree->settle_typing(), tree->root.dup()) },
         meta{ tree->meta },
-        buffers{ take_buffer_ref(&tree->buffers) } { }
+        buffers{ pin_buffers(&tree->buffers) } { }
 
     ReferenceSnapshot::ReferenceSnapshot(const Tree* tree, const StorageTree& dt):
         root{ dt.dup() },
         meta{ tree->meta },
-        buffers{ take_buffer_ref(&tree->buffers) }
+        buffers{ pin_buffers(&tree->buffers) }
     {
         // Compute the buffer meta for 'dt'.
         compute_buffer_meta(&meta, dt);
@@ -2393,7 +5571,7 @@ namespace RatchetPieceTree
     ReferenceSnapshot::ReferenceSnapshot(const ReferenceSnapshot& other):
         root{ other.root.dup() },
         meta{ other.meta },
-        buffers{ take_buffer_ref(&other.buffers) }
+        buffers{ pin_buffers(&other.buffers) }
     {
     }
 
@@ -2401,7 +5579,9 @@ namespace RatchetPieceTree
     {
         root = other.root.dup();
         meta = other.meta;
-        buffers = take_buffer_ref(&other.buffers);
+        BufferCollection old_buffers = buffers;
+        buffers = pin_buffers(&other.buffers);
+        unpin_buffers(&old_buffers);
         return *this;
     }
 
@@ -2409,7 +5589,7 @@ namespace RatchetPieceTree
     {
         // Reset the root since releasing the buffer below could cause the underlying nodes to be destroyed as well.
         root = StorageTree{};
-        dec_buffer_ref(&buffers);
+        unpin_buffers(&buffers);
     }
 
     String8 ReferenceSnapshot::get_line_content(Arena::Arena* arena, Line line) const
@@ -2467,6 +5647,7 @@ namespace RatchetPieceTree
 
     IncompleteCRLF Tree::get_line_content_crlf(Arena::Arena* arena, String8* buf, Line line) const
     {
+        settle_typing();
         *buf = str8_empty;
         if (line == Line::IndexBeginning)
             return IncompleteCRLF::No;
@@ -2477,7 +5658,103 @@ namespace RatchetPieceTree
         line_start<&Tree::accumulate_value>(&line_offset, &buffers, root, line);
         return trim_crlf(arena, buf, this, line_offset);
     }
-    
+
+    IncompleteCRLF OwningSnapshot::get_line_content_crlf(Arena::Arena* arena, String8* buf, Line line) const
+    {
+        // Reset the buffer.
+        *buf = str8_empty;
+        if (line == Line::IndexBeginning)
+            return IncompleteCRLF::No;
+        if (root.is_empty())
+            return IncompleteCRLF::No;
+        // Trying this new logic for now.
+        CharOffset line_offset{ };
+        Tree::line_start<&Tree::accumulate_value>(&line_offset, &buffers, root, line);
+        return trim_crlf(arena, buf, this, line_offset);
+    }
+
+    IncompleteCRLF ReferenceSnapshot::get_line_content_crlf(Arena::Arena* arena, String8* buf, Line line) const
+    {
+        // Reset the buffer.
+        *buf = str8_empty;
+        if (line == Line::IndexBeginning)
+            return IncompleteCRLF::No;
+        if (root.is_empty())
+            return IncompleteCRLF::No;
+        // Trying this new logic for now.
+        CharOffset line_offset{ };
+        Tree::line_start<&Tree::accumulate_value>(&line_offset, &buffers, root, line);
+        return trim_crlf(arena, buf, this, line_offset);
+    }
+
+    String8 ReferenceSnapshot::get_range(Arena::Arena* arena, CharOffset offset, Length count) const
+    {
+        return Tree::get_range(arena, &buffers, meta, root, offset, count);
+    }
+
+    Length ReferenceSnapshot::copy_range(CharOffset offset, Length count, char* dst) const
+    {
+        return Tree::copy_range(&buffers, meta, root, offset, count, dst);
+    }
+
+#if FRED_CODE_POINT_SUMMARY
+    CodePointCount ReferenceSnapshot::offset_to_codepoint(CharOffset offset) const
+    {
+        return Tree::offset_to_codepoint(&buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::codepoint_to_offset(CodePointCount codepoint) const
+    {
+        return Tree::codepoint_to_offset(&buffers, meta, root, codepoint);
+    }
+
+    CodePointCount ReferenceSnapshot::codepoint_column(CharOffset offset) const
+    {
+        return Tree::codepoint_column(&buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::codepoint_column_offset(Line line, CodePointCount column) const
+    {
+        return Tree::codepoint_column_offset(&buffers, meta, root, line, column);
+    }
+#endif // FRED_CODE_POINT_SUMMARY
+
+#if FRED_UTF16_SUMMARY
+    Utf16Position ReferenceSnapshot::offset_to_utf16_position(CharOffset offset) const
+    {
+        return Tree::offset_to_utf16_position(&buffers, root, offset);
+    }
+
+    CharOffset ReferenceSnapshot::utf16_position_to_offset(Utf16Position position) const
+    {
+        return Tree::utf16_position_to_offset(&buffers, meta, root, position);
+    }
+#endif // FRED_UTF16_SUMMARY
+
+#if FRED_BRACKET_SUMMARY
+    CharOffset ReferenceSnapshot::match_bracket(CharOffset offset, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::match_bracket(&buffers, meta, root, offset, ignored, ignored_count);
+    }
+
+    CharOffset ReferenceSnapshot::enclosing_bracket(CharOffset offset, uint64_t pair, const CharRange* ignored, uint64_t ignored_count) const
+    {
+        return Tree::enclosing_bracket(&buffers, meta, root, offset, pair, ignored, ignored_count);
+    }
+#endif // FRED_BRACKET_SUMMARY
+
+#if FRED_HASH_SUMMARY
+    uint64_t ReferenceSnapshot::hash_range(CharOffset offset, Length count) const
+    {
+        return Tree::hash_range(&buffers, meta, root, offset, count);
+    }
+
+    uint64_t ReferenceSnapshot::hash_line(Line line) const
+    {
+        return Tree::hash_line(&buffers, meta, root, line);
+    }
+#endif // FRED_HASH_SUMMARY
+
     Line ReferenceSnapshot::line_at(CharOffset offset) const
     {
         if (is_empty())
@@ -2509,9 +5786,20 @@ namespace RatchetPieceTree
         return range;
     }
 
+    String8 ReferenceSnapshot::get_line_slice(Arena::Arena* arena, Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice_content(arena, &buffers, meta, root, line, first_column, max_columns);
+    }
+
+    LineRange ReferenceSnapshot::get_line_range_slice(Line line, Column first_column, Length max_columns) const
+    {
+        return Tree::line_slice(&buffers, root, line, first_column, max_columns);
+    }
+
     TreeWalker::TreeWalker(Arena::Arena* arena, const Tree* tree, CharOffset offset):
         buffers{ &tree->buffers },
-        root{ tree->root.dup() },
+        compactions{ tree->buffers.compactions },
+        root{ (tree->settle_typing(), tree->root.dup()) },
         meta{ tree->meta },
         stack{ nullptr },
         stackCount{ 1 },
@@ -2523,6 +5811,7 @@ namespace RatchetPieceTree
 
     TreeWalker::TreeWalker(Arena::Arena* arena, const OwningSnapshot* snap, CharOffset offset):
         buffers{ &snap->buffers },
+        compactions{ snap->buffers.compactions },
         root{ snap->root.dup() },
         meta{ snap->meta },
         stack{ nullptr },
@@ -2535,6 +5824,7 @@ namespace RatchetPieceTree
 
     TreeWalker::TreeWalker(Arena::Arena* arena, const ReferenceSnapshot* snap, CharOffset offset):
         buffers{ &snap->buffers },
+        compactions{ snap->buffers.compactions },
         root{ snap->root.dup() },
         meta{ snap->meta },
         stack{ nullptr },
@@ -2548,6 +5838,7 @@ namespace RatchetPieceTree
 
     TreeWalker::TreeWalker(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, CharOffset offset):
         buffers{ buffers },
+        compactions{ buffers->compactions },
         root{ root.dup() },
         meta{ meta },
         total_offset{ offset }
@@ -2581,6 +5872,30 @@ namespace RatchetPieceTree
         return result;
     }
 
+    String8View TreeWalker::next_chunk()
+    {
+        if (exhausted())
+            return { };
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // Catchall.
+            if (first_ptr == last_ptr)
+                return next_chunk();
+        }
+        String8View chunk{ .str = first_ptr, .size = static_cast<uint64_t>(last_ptr - first_ptr) };
+        total_offset = total_offset + Length{ chunk.size };
+        first_ptr = last_ptr;
+        populate_ptrs();
+        return chunk;
+    }
+
+    String8View TreeWalker::chunk_at(CharOffset offset)
+    {
+        seek(offset);
+        return next_chunk();
+    }
+
     char TreeWalker::current() const
     {
         if (exhausted())
@@ -2611,6 +5926,7 @@ namespace RatchetPieceTree
 
     void TreeWalker::seek(CharOffset offset)
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         stackCount = 0;
         if(!root.root_ptr())return;
         stack[stackCount++] = { root.root_ptr() };
@@ -2679,6 +5995,7 @@ namespace RatchetPieceTree
 
     void TreeWalker::populate_ptrs()
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         if (exhausted())
             return;
         while (stack[stackCount-1].node->childCount == stack[stackCount-1].index)
@@ -2693,6 +6010,11 @@ namespace RatchetPieceTree
             StorageTree::InternalNodePtr in = to_internal_node(stack[stackCount-1].node);
             StorageTree::NodeVector children = (&in->children[0]);
             size_t childIndex = stack[stackCount-1].index++;
+            // Siblings are visited in order, so the next one can be loaded while this subtree is walked.
+            if (childIndex + 1 < in->childCount)
+            {
+                FRED_PREFETCH(children[childIndex + 1]);
+            }
             stack[stackCount++] = {children[childIndex], 0};
         }
         algo_mark(stack[stackCount-1].node, Traverse);
@@ -2700,6 +6022,10 @@ namespace RatchetPieceTree
         NodeData* leafs = (&ln->children[0]);
         
         auto& piece = leafs[stack[stackCount-1].index++].piece;
+        if (stack[stackCount-1].index < ln->childCount)
+        {
+            prefetch_piece(buffers, leafs[stack[stackCount-1].index].piece);
+        }
         auto* buffer = buffers->buffer_at(piece.index);
         auto first_offset = buffers->buffer_offset(piece.index, piece.first);
         auto last_offset = buffers->buffer_offset(piece.index, piece.last);
@@ -2715,7 +6041,8 @@ namespace RatchetPieceTree
 
     ReverseTreeWalker::ReverseTreeWalker(Arena::Arena* arena, const Tree* tree, CharOffset offset):
         buffers{ &tree->buffers },
-        root{ tree->root.dup() },
+        compactions{ tree->buffers.compactions },
+        root{ (tree->settle_typing(), tree->root.dup()) },
         meta{ tree->meta },
         stack{ nullptr },
         stackCount{ 1 },
@@ -2727,6 +6054,7 @@ namespace RatchetPieceTree
 
     ReverseTreeWalker::ReverseTreeWalker(Arena::Arena* arena, const OwningSnapshot* snap, CharOffset offset):
         buffers{ &snap->buffers },
+        compactions{ snap->buffers.compactions },
         root{ snap->root.dup() },
         meta{ snap->meta },
         stack{ nullptr },
@@ -2739,6 +6067,7 @@ namespace RatchetPieceTree
 
     ReverseTreeWalker::ReverseTreeWalker(Arena::Arena* arena, const ReferenceSnapshot* snap, CharOffset offset):
         buffers{ &snap->buffers },
+        compactions{ snap->buffers.compactions },
         root{ snap->root.dup() },
         meta{ snap->meta },
         stack{ nullptr },
@@ -2774,6 +6103,31 @@ namespace RatchetPieceTree
         return result;
     }
 
+    String8View ReverseTreeWalker::next_chunk()
+    {
+        if (exhausted())
+            return { };
+        if (first_ptr == last_ptr)
+        {
+            populate_ptrs();
+            // Catchall.
+            if (first_ptr == last_ptr)
+                return next_chunk();
+        }
+        // Recall that 'last_ptr' is the start of the piece for the reverse walker.
+        String8View chunk{ .str = last_ptr, .size = static_cast<uint64_t>(first_ptr - last_ptr) };
+        total_offset = retract(total_offset, chunk.size);
+        first_ptr = last_ptr;
+        populate_ptrs();
+        return chunk;
+    }
+
+    String8View ReverseTreeWalker::chunk_at(CharOffset offset)
+    {
+        seek(offset);
+        return next_chunk();
+    }
+
     char ReverseTreeWalker::current() const
     {
         //    populate_ptrs();
@@ -2809,6 +6163,7 @@ namespace RatchetPieceTree
 
     void ReverseTreeWalker::populate_ptrs()
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         if (exhausted())
             return;
         while (stack[stackCount-1].node->childCount == stack[stackCount-1].index)
@@ -2847,6 +6202,7 @@ namespace RatchetPieceTree
 
     void ReverseTreeWalker::seek(CharOffset offset)
     {
+        assert(compactions == buffers->compactions and "walkers must not be used across a compaction");
         stackCount = 0;
         if(!root.root_ptr())return;
         stack[stackCount++] = { root.root_ptr() };
@@ -2905,6 +6261,369 @@ namespace RatchetPieceTree
         }
         
     }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const Tree* tree, StripCRLF strip, Line line):
+        LineWalker{ arena, &tree->buffers, tree->meta, (tree->settle_typing(), tree->root), strip, line } { }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const OwningSnapshot* snap, StripCRLF strip, Line line):
+        LineWalker{ arena, &snap->buffers, snap->meta, snap->root, strip, line } { }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const ReferenceSnapshot* snap, StripCRLF strip, Line line):
+        LineWalker{ arena, &snap->buffers, snap->meta, snap->root, strip, line } { }
+
+    LineWalker::LineWalker(Arena::Arena* arena, const BufferCollection* buffers, const BufferMeta& meta, const StorageTree& root, StripCRLF strip, Line line):
+        arena{ arena },
+        walker{ arena, buffers, meta, root, line_offset(buffers, root, line) },
+        strip{ strip },
+        next_line{ line == Line::IndexBeginning ? Line::Beginning : line }
+    {
+        // Past the last line there is nothing to produce.
+        if (rep(next_line) > rep(meta.lf_count) + 1)
+        {
+            done = true;
+        }
+    }
+
+    CharOffset LineWalker::line_offset(const BufferCollection* buffers, const StorageTree& root, Line line)
+    {
+        CharOffset offset{ };
+        if (rep(line) > rep(Line::Beginning) and not root.is_empty())
+        {
+            Tree::line_start<&Tree::accumulate_value>(&offset, buffers, root, line);
+        }
+        return offset;
+    }
+
+    void LineWalker::push_slice(String8View slice)
+    {
+        if (slice.size == 0)
+            return;
+        if (slice_count == slice_capacity)
+        {
+            auto new_capacity = slice_capacity == 0 ? 16 : slice_capacity * 2;
+            String8View* new_slices = Arena::push_array_no_zero<String8View>(arena, new_capacity);
+            if (slice_count != 0)
+            {
+                memcpy(new_slices, slices, slice_count * sizeof(String8View));
+            }
+            slices = new_slices;
+            slice_capacity = new_capacity;
+        }
+        slices[slice_count++] = slice;
+    }
+
+    LineSlices LineWalker::next_slices()
+    {
+        slice_count = 0;
+        LineSlices result{ .slices = slices, .count = 0, .length = Length{ }, .incomplete_crlf = IncompleteCRLF::No };
+        if (done)
+            return result;
+        bool found_lf = false;
+        while (true)
+        {
+            if (chunk.size == 0)
+            {
+                chunk = walker.next_chunk();
+                // End of the buffer terminates the final line.
+                if (chunk.size == 0)
+                {
+                    done = true;
+                    break;
+                }
+            }
+            auto* lf = static_cast<const char*>(memchr(chunk.str, '\n', chunk.size));
+            if (lf != nullptr)
+            {
+                auto amount = static_cast<uint64_t>(lf - chunk.str);
+                push_slice({ .str = chunk.str, .size = amount });
+                chunk.str += amount + 1;
+                chunk.size -= amount + 1;
+                found_lf = true;
+                break;
+            }
+            push_slice(chunk);
+            chunk = { };
+        }
+        next_line = extend(next_line);
+        if (strip == StripCRLF::Yes)
+        {
+            bool had_cr = slice_count != 0 and slices[slice_count - 1].str[slices[slice_count - 1].size - 1] == '\r';
+            if (had_cr)
+            {
+                --slices[slice_count - 1].size;
+                if (slices[slice_count - 1].size == 0)
+                {
+                    --slice_count;
+                }
+            }
+            else if (found_lf)
+            {
+                result.incomplete_crlf = IncompleteCRLF::Yes;
+            }
+        }
+        uint64_t length = 0;
+        for EachIndex(i, slice_count)
+        {
+            length += slices[i].size;
+        }
+        result.slices = slices;
+        result.count = slice_count;
+        result.length = Length{ length };
+        return result;
+    }
+
+    String8View LineWalker::next()
+    {
+        LineSlices line = next_slices();
+        if (line.count == 0)
+            return { .str = "", .size = 0 };
+        if (line.count == 1)
+            return line.slices[0];
+        if (line_capacity < rep(line.length))
+        {
+            line_capacity = rep(line.length) < line_capacity * 2 ? line_capacity * 2 : rep(line.length);
+            line_buf = Arena::push_array_no_zero<char>(arena, line_capacity);
+        }
+        char* out = line_buf;
+        for EachIndex(i, line.count)
+        {
+            memcpy(out, line.slices[i].str, line.slices[i].size);
+            out += line.slices[i].size;
+        }
+        return { .str = line_buf, .size = rep(line.length) };
+    }
+
+    TextCursor::TextCursor(const Tree* tree, CharOffset offset):
+        tree{ tree }
+    {
+        sync();
+        locate(offset);
+    }
+
+    char TextCursor::current()
+    {
+        sync();
+        if (rep(cursor_offset) >= rep(total_length))
+            return '\0';
+        return piece_ptr[rep(cursor_offset) - rep(piece_first)];
+    }
+
+    Line TextCursor::line()
+    {
+        sync();
+        if (piece == nullptr)
+            return Line::Beginning;
+        auto remainder = distance(piece_first, cursor_offset);
+        auto pos = Tree::buffer_position(&tree->buffers, *piece, remainder);
+        auto lf_count = rep(piece_lf_first) + rep(retract(pos.line, rep(piece->first.line)));
+        return Line{ lf_count + 1 };
+    }
+
+    Column TextCursor::column()
+    {
+        sync();
+        if (piece == nullptr)
+            return Column{ };
+        auto remainder = distance(piece_first, cursor_offset);
+        auto pos = Tree::buffer_position(&tree->buffers, *piece, remainder);
+        // If the line begins inside of this piece, the buffer column is the column.
+        if (pos.line != piece->first.line)
+            return pos.column;
+        auto offset = cursor_offset;
+        auto first = line_start(line());
+        locate(offset);
+        return Column{ rep(distance(first, offset)) };
+    }
+
+    void TextCursor::seek(CharOffset offset)
+    {
+        sync();
+        locate(offset);
+    }
+
+    void TextCursor::advance(Length count)
+    {
+        sync();
+        auto target = rep(cursor_offset) + rep(count);
+        // Stay within the current piece if possible.
+        if (piece != nullptr and target < rep(piece_first) + rep(piece->length))
+        {
+            cursor_offset = CharOffset{ target };
+            return;
+        }
+        locate(CharOffset{ target });
+    }
+
+    void TextCursor::retreat(Length count)
+    {
+        sync();
+        auto target = rep(cursor_offset) > rep(count) ? rep(cursor_offset) - rep(count) : 0;
+        if (piece != nullptr and target >= rep(piece_first))
+        {
+            cursor_offset = CharOffset{ target };
+            return;
+        }
+        locate(CharOffset{ target });
+    }
+
+    void TextCursor::seek_line(Line line, Column column)
+    {
+        sync();
+        auto last_line = Line{ rep(total_lf_count) + 1 };
+        if (line == Line::IndexBeginning)
+            line = Line::Beginning;
+        if (rep(line) > rep(last_line))
+            line = last_line;
+        auto first = line_start(line);
+        // Clamp the column to the line content.
+        CharOffset last = CharOffset{ rep(total_length) };
+        if (line != last_line)
+        {
+            last = retract(line_start(extend(line)));
+        }
+        auto target = first + Length{ rep(column) };
+        if (rep(target) > rep(last))
+            target = last;
+        locate(target);
+    }
+
+    void TextCursor::advance_lines(Length count)
+    {
+        auto col = column();
+        seek_line(Line{ rep(line()) + rep(count) }, col);
+    }
+
+    void TextCursor::retreat_lines(Length count)
+    {
+        auto col = column();
+        auto current_line = rep(line());
+        auto target = current_line > rep(count) ? current_line - rep(count) : rep(Line::Beginning);
+        seek_line(Line{ target }, col);
+    }
+
+    CharOffset TextCursor::offset_at(Line line, Column column)
+    {
+        seek_line(line, column);
+        return cursor_offset;
+    }
+
+    void TextCursor::sync()
+    {
+        tree->settle_typing();
+        if (root.root_ptr() == tree->root.root_ptr())
+            return;
+        root = tree->root.dup();
+        total_length = root.length();
+        total_lf_count = root.lf_count();
+        depth = 0;
+        piece = nullptr;
+        piece_ptr = nullptr;
+        locate(cursor_offset);
+    }
+
+    void TextCursor::push_entry(const PathEntry& entry)
+    {
+        assert(depth < max_cursor_depth);
+        path[depth++] = entry;
+    }
+
+    void TextCursor::locate(CharOffset offset)
+    {
+        if (rep(offset) > rep(total_length))
+            offset = CharOffset{ rep(total_length) };
+        cursor_offset = offset;
+        if (total_length == Length{ })
+        {
+            depth = 0;
+            piece = nullptr;
+            piece_ptr = nullptr;
+            return;
+        }
+        // The end of the buffer is the end of the last piece.
+        auto probe = rep(offset) < rep(total_length) ? rep(offset) : rep(total_length) - 1;
+        // Climb until the subtree covers the target.
+        while (depth != 0
+               and (probe < rep(path[depth - 1].first)
+                    or probe >= rep(path[depth - 1].first) + rep(path[depth - 1].node->subTreeLength())))
+        {
+            --depth;
+        }
+        if (depth == 0)
+        {
+            push_entry({ .node = root.root_ptr(), .first = CharOffset{ }, .lf_first = LFCount{ } });
+        }
+        while (true)
+        {
+            const PathEntry& entry = path[depth - 1];
+            StorageTree::NodePtr node = entry.node;
+            auto rel = probe - rep(entry.first);
+            size_t i = 0;
+            while (i < node->childCount - 1 and rel >= rep(node->offsets[i]))
+            {
+                ++i;
+            }
+            auto child_first = entry.first + (i == 0 ? Length{ } : node->offsets[i - 1]);
+            auto child_lf_first = LFCount{ rep(entry.lf_first) + (i == 0 ? 0 : rep(node->lineFeeds[i - 1])) };
+            if (not node->isLeaf())
+            {
+                StorageTree::InternalNodePtr in = to_internal_node(node);
+                push_entry({ .node = in->children[i], .first = child_first, .lf_first = child_lf_first });
+                continue;
+            }
+            StorageTree::LeafNodePtr ln = to_leaf_node(node);
+            piece = &ln->children[i].piece;
+            auto* buffer = tree->buffers.buffer_at(piece->index);
+            piece_ptr = buffer->buffer.str + rep(tree->buffers.buffer_offset(piece->index, piece->first));
+            piece_first = child_first;
+            piece_lf_first = child_lf_first;
+            return;
+        }
+    }
+
+    CharOffset TextCursor::line_start(Line line)
+    {
+        // The start of line N follows the (N - 1)th LF.
+        auto lf = rep(line) - 1;
+        if (lf == 0 or total_length == Length{ })
+            return CharOffset{ };
+        while (depth != 0
+               and (lf <= rep(path[depth - 1].lf_first)
+                    or lf > rep(path[depth - 1].lf_first) + rep(path[depth - 1].node->subTreeLineFeeds())))
+        {
+            --depth;
+        }
+        if (depth == 0)
+        {
+            push_entry({ .node = root.root_ptr(), .first = CharOffset{ }, .lf_first = LFCount{ } });
+        }
+        while (true)
+        {
+            const PathEntry& entry = path[depth - 1];
+            StorageTree::NodePtr node = entry.node;
+            auto rel = lf - rep(entry.lf_first);
+            size_t i = 0;
+            while (i < node->childCount - 1 and rel > rep(node->lineFeeds[i]))
+            {
+                ++i;
+            }
+            auto child_first = entry.first + (i == 0 ? Length{ } : node->offsets[i - 1]);
+            auto child_lf_first = LFCount{ rep(entry.lf_first) + (i == 0 ? 0 : rep(node->lineFeeds[i - 1])) };
+            if (not node->isLeaf())
+            {
+                StorageTree::InternalNodePtr in = to_internal_node(node);
+                push_entry({ .node = in->children[i], .first = child_first, .lf_first = child_lf_first });
+                continue;
+            }
+            // The line begins inside of this piece (or immediately after it).
+            StorageTree::LeafNodePtr ln = to_leaf_node(node);
+            const Piece& lf_piece = ln->children[i].piece;
+            auto line_index = rep(lf_piece.first.line) + (lf - rep(child_lf_first));
+            auto* starts = tree->buffers.buffer_at(lf_piece.index)->line_starts.starts;
+            auto piece_offset = tree->buffers.buffer_offset(lf_piece.index, lf_piece.first);
+            return child_first + distance(piece_offset, CharOffset{ rep(starts[line_index]) });
+        }
+    }
+
 }
 
 
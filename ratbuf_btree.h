@@ -2,9 +2,11 @@
 
 #include <vector>
 #include <array>
+#include <type_traits>
 
 
 #include "macros.h"
+#include "piece-rewrite.h"
 #include "types.h"
 
 
@@ -43,6 +45,8 @@ namespace RatchetPieceTree
     using Editor::Column;
     struct NodeData;
     enum class LFCount : size_t { };
+    enum class CodePointCount : size_t { };
+    enum class Utf16Count : size_t { };
 
     struct BufferCursor
     {
@@ -54,6 +58,249 @@ namespace RatchetPieceTree
         bool operator==(const BufferCursor&) const = default;
     };
 
+    struct Piece;
+    struct BufferCollection;
+
+    // Piece summaries.  A summary is a monoid over the text of the tree: 'identity()' summarizes no text and must equal
+    // a value-initialized summary, 'combine(left, right)' summarizes 'left' followed by 'right' and
+    // 'of(buffers, piece)' summarizes the text of one piece.  Pieces cache their summary and the tree keeps the
+    // summary of every subtree as nodes are copied, so the summary of any prefix is a single descent (see 'seek').
+
+    // The number of code points, i.e. bytes which do not continue a UTF-8 sequence.
+    struct CodePointSummary
+    {
+        CodePointCount codepoints = { };
+
+        static CodePointSummary identity()
+        {
+            return { };
+        }
+
+        static CodePointSummary combine(const CodePointSummary& left, const CodePointSummary& right)
+        {
+            return { CodePointCount{ rep(left.codepoints) + rep(right.codepoints) } };
+        }
+
+        static CodePointSummary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // The number of UTF-16 code units.  Four byte UTF-8 sequences are a surrogate pair.
+    struct Utf16Summary
+    {
+        Utf16Count utf16_units = { };
+
+        static Utf16Summary identity()
+        {
+            return { };
+        }
+
+        static Utf16Summary combine(const Utf16Summary& left, const Utf16Summary& right)
+        {
+            return { Utf16Count{ rep(left.utf16_units) + rep(right.utf16_units) } };
+        }
+
+        static Utf16Summary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // Line lengths (in bytes, excluding the LF) at the edges of a span of text and the longest line lying entirely
+    // inside it.  A span without a LF has 'leading' and 'trailing' equal to its length.
+    struct LineExtent
+    {
+        Length leading = { };
+        Length trailing = { };
+        Length longest = { };
+        bool has_lf = false;
+
+        static LineExtent identity()
+        {
+            return { };
+        }
+
+        static LineExtent combine(const LineExtent& left, const LineExtent& right);
+        static LineExtent of(const BufferCollection* buffers, const Piece& piece);
+
+        // The longest line of the span, including the partial ones at its edges.
+        Length longest_line() const
+        {
+            auto edge = rep(leading) > rep(trailing) ? leading : trailing;
+            return rep(longest) > rep(edge) ? longest : edge;
+        }
+    };
+
+    // Bracket pairs tracked by 'BracketSummary'.  The opening and closing characters of a pair must differ.
+    constexpr size_t max_bracket_pairs = 4;
+
+    struct BracketPair
+    {
+        char open;
+        char close;
+    };
+
+    struct BracketPairs
+    {
+        BracketPair pairs[max_bracket_pairs];
+        uint64_t count;
+    };
+
+    // The nesting of one bracket pair over a span of text: 'delta' is the net change in depth and 'min' the lowest
+    // depth reached at any point of the span relative to its start (so never above 0).
+    struct BracketDepth
+    {
+        int32_t delta = 0;
+        int32_t min = 0;
+
+        static BracketDepth combine(const BracketDepth& left, const BracketDepth& right)
+        {
+            auto right_min = left.delta + right.min;
+            return { left.delta + right.delta, left.min < right_min ? left.min : right_min };
+        }
+    };
+
+    // Nesting of every bracket pair in the collection's 'bracket_pairs'.  Finding a matching bracket descends to the
+    // first span whose 'min' reaches the target depth instead of scanning the text in between.
+    struct BracketSummary
+    {
+        BracketDepth depths[max_bracket_pairs] = { };
+
+        static BracketSummary identity()
+        {
+            return { };
+        }
+
+        static BracketSummary combine(const BracketSummary& left, const BracketSummary& right)
+        {
+            BracketSummary result;
+            for (size_t i = 0; i < max_bracket_pairs; ++i)
+            {
+                result.depths[i] = BracketDepth::combine(left.depths[i], right.depths[i]);
+            }
+            return result;
+        }
+
+        static BracketSummary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // A polynomial rolling hash of the bytes, modulo 2^61 - 1.  'power_minus_one' is the base raised to the length of
+    // the text, minus one so that the empty text is the zero value.
+    struct HashSummary
+    {
+        uint64_t hash = 0;
+        uint64_t power_minus_one = 0;
+
+        static HashSummary identity()
+        {
+            return { };
+        }
+
+        static HashSummary combine(const HashSummary& left, const HashSummary& right);
+        static HashSummary of(const BufferCollection* buffers, const Piece& piece);
+    };
+
+    // Soft-wrapped rows at 'width' bytes per row, where an empty line still takes a row.  'head' is the text before
+    // the first LF and 'tail' the text after the last one (both the whole span without a LF), and 'rows' counts the
+    // rows of the complete lines between them.  Pieces summarized without a wrap index, and spans mixing widths, are
+    // 'stale', so a root summarized for another width is detected and rebuilt.
+    struct WrapSummary
+    {
+        static constexpr uint64_t stale = ~uint64_t{ 0 };
+
+        uint64_t width = 0;
+        Length head = { };
+        Length tail = { };
+        uint64_t rows = 0;
+        bool spans_lf = false;
+
+        static WrapSummary identity()
+        {
+            return { };
+        }
+
+        static WrapSummary combine(const WrapSummary& left, const WrapSummary& right);
+        static WrapSummary of(const BufferCollection* buffers, const Piece& piece);
+
+        static uint64_t line_rows(Length length, uint64_t width)
+        {
+            return rep(length) == 0 ? 1 : (rep(length) + width - 1) / width;
+        }
+
+        // The rows of every line ended by a LF of the span.
+        uint64_t complete_rows() const
+        {
+            return spans_lf ? rows + line_rows(head, width) : 0;
+        }
+    };
+
+    // Several summaries maintained together.  Each one is a base, so its members are reachable directly.
+    template <typename... Summaries>
+    struct SummaryList : Summaries...
+    {
+        static SummaryList identity()
+        {
+            return { Summaries::identity()... };
+        }
+
+        static SummaryList combine(const SummaryList& left, const SummaryList& right)
+        {
+            return { Summaries::combine(left, right)... };
+        }
+
+        static SummaryList of(const BufferCollection* buffers, const Piece& piece)
+        {
+            return { Summaries::of(buffers, piece)... };
+        }
+    };
+
+    // A summary the tree keeps when 'enabled'.
+    template <bool enabled, typename Summary>
+    struct SummaryOption { };
+
+    // The list of the summaries enabled among 'Options', in their order.
+    template <typename List, typename... Options>
+    struct SelectSummaries
+    {
+        using type = List;
+    };
+
+    template <typename... Chosen, bool enabled, typename Summary, typename... Options>
+    struct SelectSummaries<SummaryList<Chosen...>, SummaryOption<enabled, Summary>, Options...>
+    {
+        using type = typename SelectSummaries<std::conditional_t<enabled, SummaryList<Chosen..., Summary>, SummaryList<Chosen...>>, Options...>::type;
+    };
+
+    // The summaries kept by the tree, as selected in macros.h.  Length and line feeds are not part of it: every node
+    // keeps them in dedicated counters since all descents use them.  An empty list takes no space in pieces or nodes.
+    using TreeSummary = SelectSummaries<SummaryList<>,
+                                        SummaryOption<FRED_CODE_POINT_SUMMARY, CodePointSummary>,
+                                        SummaryOption<FRED_UTF16_SUMMARY, Utf16Summary>,
+                                        SummaryOption<FRED_LINE_EXTENT_SUMMARY, LineExtent>,
+                                        SummaryOption<FRED_BRACKET_SUMMARY, BracketSummary>,
+                                        SummaryOption<FRED_HASH_SUMMARY, HashSummary>,
+                                        SummaryOption<FRED_WRAP_SUMMARY, WrapSummary>>::type;
+
+    // Selects no summary: a seek projected onto it reads only the lengths and line feeds kept beside the summaries.
+    struct NoSummary
+    {
+        static NoSummary identity()
+        {
+            return { };
+        }
+
+        static NoSummary combine(const NoSummary&, const NoSummary&)
+        {
+            return { };
+        }
+    };
+
+    // The part of a tree summary a seek combines: one of its summaries, the whole list or none.
+    template <typename Part>
+    decltype(auto) project(const TreeSummary& summary)
+    {
+        if constexpr (std::is_base_of_v<Part, TreeSummary>)
+            return static_cast<const Part&>(summary);
+        else
+            return Part::identity();
+    }
+
     struct Piece
     {
         BufferIndex index = { }; // Index into a buffer in RatchetPieceTree.  This could be an immutable buffer or the mutable buffer.
@@ -61,6 +308,7 @@ namespace RatchetPieceTree
         BufferCursor last = { };
         Length length = { };
         LFCount newline_count = { };
+        FRED_NO_UNIQUE_ADDRESS TreeSummary summary = { };
     };
 
     using Offset = RatchetPieceTree::CharOffset;
@@ -92,6 +340,35 @@ namespace RatchetPieceTree
         NodeType type;
     };
 
+    // Prefix summaries of a node's children: entry 'i' summarizes children [0, i].  Takes no space for an empty
+    // summary.
+    template <typename Summary, size_t MaxChildren, bool Empty = std::is_empty_v<Summary>>
+    struct SummaryArray
+    {
+        std::array<Summary, MaxChildren> entries;
+
+        const Summary& get(size_t i) const
+        {
+            return entries[i];
+        }
+
+        void set(size_t i, const Summary& summary)
+        {
+            entries[i] = summary;
+        }
+    };
+
+    template <typename Summary, size_t MaxChildren>
+    struct SummaryArray<Summary, MaxChildren, true>
+    {
+        Summary get(size_t) const
+        {
+            return { };
+        }
+
+        void set(size_t, const Summary&) { }
+    };
+
     template <size_t MaxChildren>
     struct BNodeCountedGeneric
     {
@@ -100,6 +377,7 @@ namespace RatchetPieceTree
         NodeType type;
         std::array<Length, MaxChildren> offsets;
         std::array<LFCount, MaxChildren> lineFeeds;
+        FRED_NO_UNIQUE_ADDRESS SummaryArray<TreeSummary, MaxChildren> summaries;
         size_t childCount;
         
         Length subTreeLength() const
@@ -111,6 +389,11 @@ namespace RatchetPieceTree
         {
             return lineFeeds[childCount-1];
         }
+
+        TreeSummary subTreeSummary() const
+        {
+            return summaries.get(childCount-1);
+        }
         bool isLeaf ()const{
             return type == NodeType::LEAF;
         }
@@ -124,6 +407,7 @@ namespace RatchetPieceTree
         NodeType type;
         std::array<Length, MaxChildren> offsets;
         std::array<LFCount, MaxChildren> lineFeeds;
+        FRED_NO_UNIQUE_ADDRESS SummaryArray<TreeSummary, MaxChildren> summaries;
         size_t childCount;
         
         BNodeCountedGeneric<MaxChildren> *children[MaxChildren];
@@ -138,6 +422,11 @@ namespace RatchetPieceTree
         {
             return lineFeeds[childCount-1];
         }
+
+        TreeSummary subTreeSummary() const
+        {
+            return summaries.get(childCount-1);
+        }
         
     };
     
@@ -149,6 +438,7 @@ namespace RatchetPieceTree
         NodeType type;
         std::array<Length, MaxChildren> offsets;
         std::array<LFCount, MaxChildren> lineFeeds;
+        FRED_NO_UNIQUE_ADDRESS SummaryArray<TreeSummary, MaxChildren> summaries;
         size_t childCount;
         
         std::array<NodeData, MaxChildren> children;
@@ -162,6 +452,11 @@ namespace RatchetPieceTree
         {
             return lineFeeds[childCount-1];
         }
+
+        TreeSummary subTreeSummary() const
+        {
+            return summaries.get(childCount-1);
+        }
     };
 
 
@@ -192,6 +487,8 @@ namespace RatchetPieceTree
     BNodeCountedGeneric<MaxChildren>* to_node(BNodeCountedInternal<MaxChildren>* n);
 
     struct BufferCollection;
+    enum class LineStart : size_t;
+    using PieceRewrite = Editor::PieceRewrite<Piece, LineStart>;
 
     template <size_t MaxChildren>
     class B_Tree
@@ -224,6 +521,10 @@ namespace RatchetPieceTree
         {
             return root_node?root_node->subTreeLineFeeds():LFCount{0};
         }
+        TreeSummary summary() const
+        {
+            return root_node?root_node->subTreeSummary():TreeSummary::identity();
+        }
 
         // Helpers.
         bool operator==(const B_Tree&) const = default;
@@ -233,6 +534,19 @@ namespace RatchetPieceTree
         static B_Tree construct_from(BTreeBlock* blk, NodeData* leafNodes, size_t leafCount);
         B_Tree insert(BufferCollection* blk, const NodeData& x, Offset at) const;
         B_Tree remove(BufferCollection* blk, Offset at, Length len) const;
+        // Replaces the piece holding 'at' by 'x', copying only the path down to it.  'x' must keep the piece's start.
+        B_Tree replace(BufferCollection* blk, const NodeData& x, Offset at) const;
+        // Replaces the piece holding 'at' by 'count' pieces, at most three, copying only the path down to it.  Returns
+        // an empty tree, having built nothing, when the leaf holding it has no room for them.
+        B_Tree splice(BufferCollection* blk, const NodeData* pieces, size_t count, Offset at) const;
+        // Splits the text at 'at' into the trees before and after it, cutting the piece holding it in two.  Only the
+        // path down to 'at' is copied; every node off it is shared with this tree.
+        void split(BufferCollection* blk, Offset at, B_Tree* before, B_Tree* after) const;
+        // The text of 'left' followed by that of 'right'.  The lower tree joins the edge of the higher one at its own
+        // height, so only the nodes along that edge are copied.
+        static B_Tree concat(BTreeBlock* blk, const B_Tree& left, const B_Tree& right);
+        // Copies the tree with 'rewrite' applied to every piece, sharing the subtrees it leaves alone.
+        B_Tree rewrite_pieces(BTreeBlock* blk, PieceRewrite* rewrite) const;
 
         // Duplication.
         B_Tree<MaxChildren> dup() const;
@@ -256,6 +570,19 @@ namespace RatchetPieceTree
         TreeManipResult remove_from(Arena::Arena *arena, BufferCollection* blk, NodePtr a, NodePtr b, NodePtr c, Length at, Length len) const;
         TreeManipResult remove_from_leafs(Arena::Arena *arena, BufferCollection* blk, LeafNodePtr a, LeafNodePtr b, LeafNodePtr c, Length at, Length len) const;
         
+        static NodePtr replace_in(BTreeBlock* blk, NodePtr node, const NodeData* pieces, size_t count, Length at);
+        static NodePtr rewrite_node(BTreeBlock* blk, NodePtr node, PieceRewrite* rewrite);
+
+        static void split_node(BufferCollection* blk, NodePtr node, uint32_t depth, Length at, B_Tree* before, B_Tree* after);
+        // Children [begin, end) of an internal node at 'depth' as a tree of their own.
+        static B_Tree child_range(BTreeBlock* blk, InternalNodePtr node, uint32_t depth, size_t begin, size_t end);
+        // The joins write the one or two nodes replacing the edge node they descend into 'out', already taken.
+        static size_t join_right(BTreeBlock* blk, NodePtr left, uint32_t left_depth, NodePtr right, uint32_t right_depth, NodeVector out);
+        static size_t join_left(BTreeBlock* blk, NodePtr left, uint32_t left_depth, NodePtr right, uint32_t right_depth, NodeVector out);
+        static size_t merge_nodes(BTreeBlock* blk, NodePtr left, NodePtr right, NodeVector out);
+        // 'children' must be pre-taken
+        static size_t pack_internal(BTreeBlock* blk, NodeVector children, size_t count, NodeVector out);
+
         static NodePtr construct_leaf(BTreeBlock* blk, const NodeData* data, size_t begin, size_t end) ;
         // NodeVectors must be pre-taken
         static NodePtr construct_internal(BTreeBlock* blk, NodeVector data, size_t begin, size_t end);
@@ -265,6 +592,80 @@ namespace RatchetPieceTree
 
     };
 
+    // The summary of the text before some position, projected onto 'Part'.
+    template <typename Part>
+    struct PrefixOf
+    {
+        Length length = { };
+        LFCount lf_count = { };
+        FRED_NO_UNIQUE_ADDRESS Part summary = { };
+    };
+
+    template <typename Part>
+    struct SeekResultOf
+    {
+        // The piece whose inclusion makes the predicate true, or null if no prefix does.
+        const NodeData* node = nullptr;
+        // Everything before 'node', or the whole tree when 'node' is null.
+        PrefixOf<Part> prefix;
+    };
+
+    using PrefixSummary = PrefixOf<TreeSummary>;
+    using SeekResult = SeekResultOf<TreeSummary>;
+
+    // Finds the first piece whose inclusion makes 'pred' true.  'pred' is given summaries of prefixes ending at piece
+    // boundaries and must be monotone: once it holds for a prefix, it holds for every longer one.  Only the 'Part' of
+    // the summaries the predicate and the caller read is combined, so a seek by length with 'NoSummary' costs what a
+    // binary search of the offsets does.
+    template <typename Part = TreeSummary, size_t MaxChildren, typename Pred>
+    SeekResultOf<Part> seek(const B_Tree<MaxChildren>& root, Pred pred)
+    {
+        SeekResultOf<Part> result;
+        const BNodeCountedGeneric<MaxChildren>* node = root.root_ptr();
+        while (node != nullptr)
+        {
+            // The prefix arrays summarize everything up to the end of each child.
+            auto through = [&](size_t i) -> PrefixOf<Part>
+            {
+                return { .length = result.prefix.length + node->offsets[i],
+                            .lf_count = LFCount{ rep(result.prefix.lf_count) + rep(node->lineFeeds[i]) },
+                            .summary = Part::combine(result.prefix.summary, project<Part>(node->summaries.get(i))) };
+            };
+            // The prefixes grow with the child, so the first child satisfying 'pred' is binary searched.
+            size_t i = 0;
+            size_t count = node->childCount;
+            while (count != 0)
+            {
+                auto half = count / 2;
+                if (pred(through(i + half)))
+                {
+                    count = half;
+                }
+                else
+                {
+                    i += half + 1;
+                    count -= half + 1;
+                }
+            }
+            if (i == node->childCount)
+            {
+                result.prefix = through(i - 1);
+                return result;
+            }
+            if (i > 0)
+            {
+                result.prefix = through(i - 1);
+            }
+            if (node->isLeaf())
+            {
+                result.node = &reinterpret_cast<const BNodeCountedLeaf<MaxChildren>*>(node)->children[i];
+                return result;
+            }
+            node = reinterpret_cast<const BNodeCountedInternal<MaxChildren>*>(node)->children[i];
+        }
+        return result;
+    }
+
 #ifdef LOG_ALGORITHM
     enum class MarkReason : size_t { None, Traverse, Collect, Made, Skip };
     struct decrefer
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "arena.h"
+#include "enum-utils.h"
+#include "fred-strings.h"
+#include "macros.h"
+#include "types.h"
+
+namespace Editor
+{
+    // Text typed around one cursor that is not in the tree yet.  It stands for the document range starting at 'first'
+    // and is kept as a gap buffer: 'text' holds the bytes before the gap in [0, gap_first) and those after it in
+    // [gap_last, capacity), so an edit at the gap is a copy and moving the gap is a memmove of the bytes it passes.
+    // Indexes count from 'first'.
+    struct TypingCache
+    {
+        // A few lines of typing; longer text goes straight into the tree.
+        static constexpr uint64_t default_capacity = 256;
+
+        char* text;
+        uint64_t gap_first;
+        uint64_t gap_last;
+        uint64_t capacity;
+        uint64_t lf_count;
+        CharOffset first;
+        bool enabled;
+
+        void reserve(Arena::Arena* arena)
+        {
+            if (text != nullptr)
+                return;
+            text = Arena::push_array_no_zero<char>(arena, default_capacity);
+            capacity = default_capacity;
+            gap_last = capacity;
+        }
+
+        uint64_t length() const
+        {
+            return gap_first + (capacity - gap_last);
+        }
+
+        uint64_t room() const
+        {
+            return gap_last - gap_first;
+        }
+
+        // Whether [offset, offset + count) lies within the typed text.
+        bool holds(CharOffset offset, Length count) const
+        {
+            return offset >= first and rep(offset) + rep(count) <= rep(first) + length();
+        }
+
+        char at(uint64_t index) const
+        {
+            if (index < gap_first)
+                return text[index];
+            return text[gap_last + (index - gap_first)];
+        }
+
+        void insert(uint64_t index, String8 txt)
+        {
+            move_gap(index);
+            memcpy(text + gap_first, txt.str, txt.size);
+            gap_first += txt.size;
+            lf_count += count_line_feeds(txt.str, txt.size);
+        }
+
+        void remove(uint64_t index, uint64_t count)
+        {
+            move_gap(index + count);
+            lf_count -= count_line_feeds(text + index, count);
+            gap_first = index;
+        }
+
+        // Closes the gap and empties the cache, so that reads see the tree alone while it takes the text.  The text
+        // stays in place until the next insertion.
+        String8 take()
+        {
+            auto size = length();
+            move_gap(size);
+            gap_first = 0;
+            gap_last = capacity;
+            lf_count = 0;
+            return String8{ .str = text, .size = size };
+        }
+
+    private:
+        void move_gap(uint64_t index)
+        {
+            if (index < gap_first)
+            {
+                auto moved = gap_first - index;
+                memmove(text + gap_last - moved, text + index, moved);
+                gap_first = index;
+                gap_last -= moved;
+            }
+            else if (index > gap_first)
+            {
+                auto moved = index - gap_first;
+                memmove(text + gap_first, text + gap_last, moved);
+                gap_first = index;
+                gap_last += moved;
+            }
+        }
+
+        static uint64_t count_line_feeds(const char* p, uint64_t count)
+        {
+            uint64_t result = 0;
+            for EachIndex(i, count)
+            {
+                result += p[i] == '\n';
+            }
+            return result;
+        }
+    };
+} // namespace Editor